@@ -26,11 +26,18 @@
 #define FLAGS_CLOCKRT 0x02
 #define FUTEX_BITSET_MATCH_ANY 0xffffffff
 
-struct futex {
-    struct spinlock lock; // uncessary, using p->lock is ok
-    struct Queue waiting_queue;
+// private : (mm, uaddr)
+// shared : (physical page, offset in it | FUT_OFF_SHARED), the same for every proc mapping the page
+#define FUT_OFF_SHARED 1
+struct futex_key {
+    uint64 ptr;
+    uint64 offset;
 };
 
+static inline int futex_match(struct futex_key *key1, struct futex_key *key2) {
+    return key1->ptr == key2->ptr && key1->offset == key2->offset;
+}
+
 struct robust_list {
     struct robust_list *next;
 };
@@ -60,11 +67,12 @@ struct robust_list_head {
     struct robust_list *list_op_pending;
 };
 
-struct futex *get_futex(uint64 uaddr, int assert);
-void futex_init(struct futex *fp, char *name);
-int futex_wait(uint64 uaddr, uint val, struct timespec *ts);
-int futex_wakeup(uint64 uaddr, int nr_wake);
-int futex_requeue(uint64 uaddr1, int nr_wake, uint64 uaddr2, int nr_requeue);
+void futex_hash_init(void);
+// private : FUTEX_PRIVATE_FLAG was set, the futex isn't shared with other procs
+int futex_wait(uint64 uaddr, int private, uint val, struct timespec *ts);
+int futex_wake(uint64 uaddr, int private, int nr_wake);
+// cmpval : NULL for FUTEX_REQUEUE, val3 for FUTEX_CMP_REQUEUE
+int futex_requeue(uint64 uaddr1, int private, int nr_wake, uint64 uaddr2, int nr_requeue, uint32 *cmpval);
 
 int do_futex(uint64 uaddr, int op, uint32 val, struct timespec *ts, uint64 uaddr2, uint32 val2, uint32 val3);
 
@@ -52,6 +52,21 @@ static inline int atomic_sub_return(atomic_t *v, int i) {
     return __sync_fetch_and_sub(&v->counter, i);
 }
 
+// 不等于 u 时增加 a, 返回旧值 (等于 u 则未修改)
+static inline int atomic_add_unless(atomic_t *v, int a, int u) {
+    int c = atomic_read(v);
+    while (c != u) {
+        int old = __sync_val_compare_and_swap(&v->counter, c, c + a);
+        if (old == c)
+            break;
+        c = old;
+    }
+    return c;
+}
+
+// 非零时自增, 返回旧值 (0 则未自增)
+#define atomic_inc_not_zero(v) atomic_add_unless((v), 1, 0)
+
 // ==========================bit ops================================
 #define __WORDSIZE 64
 #define BITS_PER_LONG __WORDSIZE
@@ -20,4 +20,6 @@ void sema_wait(sem *S);
 
 void sema_signal(sem *S);
 
+int sema_trywait(sem *S);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include "common.h"
+#include "atomic/spinlock.h"
+#include "atomic/ops.h"
+
+// sequence lock, similar to seqlock_t of Linux
+// writers serialize on the spinlock and make the sequence odd while they work,
+// readers take no lock, they retry if the sequence moved under them
+// readers must only touch memory that stays allocated (e.g. a static pool)
+
+typedef struct {
+    struct spinlock lock;
+    uint sequence;
+} seqlock_t;
+
+static inline void seqlock_init(seqlock_t *sl, char *name) {
+    initlock(&sl->lock, name);
+    sl->sequence = 0;
+}
+
+static inline uint read_seqbegin(const seqlock_t *sl) {
+    uint seq;
+    while ((seq = READ_ONCE(sl->sequence)) & 1) {
+        // a writer is in the middle of an update
+    }
+    __sync_synchronize();
+    return seq;
+}
+
+// 1 : the data read since read_seqbegin() may be torn, read again
+static inline int read_seqretry(const seqlock_t *sl, uint start) {
+    __sync_synchronize();
+    return READ_ONCE(sl->sequence) != start;
+}
+
+static inline void write_seqlock(seqlock_t *sl) {
+    acquire(&sl->lock);
+    WRITE_ONCE(sl->sequence, sl->sequence + 1);
+    __sync_synchronize();
+}
+
+static inline void write_sequnlock(seqlock_t *sl) {
+    __sync_synchronize();
+    WRITE_ONCE(sl->sequence, sl->sequence + 1);
+    release(&sl->lock);
+}
+
+#endif // __SEQLOCK_H__
@@ -28,6 +28,7 @@ typedef struct spinlock spinlock_t;
 void wrap_acquire(char *file, int line, struct spinlock *lock);
 void wrap_release(char *file, int line, struct spinlock *lock);
 
+int tryacquire(struct spinlock *);
 int holding(struct spinlock *);
 void initlock(struct spinlock *, char *);
 void push_off(void);
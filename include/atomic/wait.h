@@ -0,0 +1,33 @@
+#ifndef __WAIT_H__
+#define __WAIT_H__
+
+#include "common.h"
+#include "atomic/spinlock.h"
+#include "lib/list.h"
+
+// wait queue with callbacks, similar to wait_queue_head of Linux
+// the owner of an event (pipe, socket, console ...) calls wake_up_poll(),
+// every entry decides by itself what to do: wake a poller, queue an epoll item ...
+
+struct wait_queue_entry;
+// key : the poll events that happened, 0 for any
+typedef int (*wait_queue_func_t)(struct wait_queue_entry *wait, uint key);
+
+struct wait_queue_entry {
+    wait_queue_func_t func; // called with the lock of the queue held
+    void *private;
+    struct list_head entry;
+};
+
+struct wait_queue_head {
+    struct spinlock lock;
+    struct list_head head;
+};
+
+void init_waitqueue_head(struct wait_queue_head *wq, char *name);
+void add_wait_queue(struct wait_queue_head *wq, struct wait_queue_entry *wait);
+// the callback is not running (nor will it be) once it returns
+void remove_wait_queue(struct wait_queue_head *wq, struct wait_queue_entry *wait);
+void wake_up_poll(struct wait_queue_head *wq, uint key);
+
+#endif // __WAIT_H__
@@ -20,7 +20,8 @@ typedef enum { FD_NONE,
                FD_PIPE,
                FD_INODE,
                FD_DEVICE,
-               FD_SOCKET } type_t;
+               FD_SOCKET,
+               FD_EPOLL } type_t;
 
 typedef unsigned int uint;
 typedef unsigned short ushort;
@@ -1,8 +1,14 @@
 #ifndef __CONCOLE_H__
 #define __CONCOLE_H__
 
+#include "common.h"
+
 void consoleintr(int);
 void consputc(int);
 int consoleready();
 
+struct file;
+struct poll_table_struct;
+uint console_poll(struct file *f, struct poll_table_struct *pt);
+
 #endif // __CONCOLE_H__
\ No newline at end of file
@@ -4,14 +4,12 @@
 struct buffer_head;
 struct bio;
 struct bio_vec;
+struct request;
 
-// #define BLOCK_SEL BLOCK_OLD
-#define BLOCK_SEL BLOCK_NEW
-#define BLOCK_OLD 0 // buffer header
-#define BLOCK_NEW 1 // bio
-
-// b is a pointer to struct bio_vec
-void disk_rw(void *b, int write, int type);
+// start the I/O of rq without sleeping, blk_end_request(rq) is called once it is done
+// the driver may complete it before returning
+// return -1 if the device is busy, the block layer retries once a request completes
+int disk_submit(struct request *rq);
 void disk_intr();
 void disk_init();
 void dma_intr(int irq);
@@ -42,3 +42,5 @@
 #define EPIPE 32  /* Broken pipe */
 #define EDOM 33   /* Math argument out of domain of func */
 #define ERANGE 34 /* Math result not representable */
+#define ELOOP 40  /* Too many symbolic links encountered */
+#define ETIMEDOUT 110 /* Connection timed out */
@@ -5,6 +5,7 @@
 #include "lib/list.h"
 #include "atomic/ops.h"
 #include "atomic/semaphore.h"
+#include "atomic/spinlock.h"
 #include "fs/vfs/fs_macro.h"
 #include "lib/list.h"
 
@@ -17,7 +18,11 @@ struct buffer_head {
     struct semaphore sem_disk_done;
     uint blockno;
     atomic_t refcnt;
-    list_head_t lru; // LRU cache list
+    list_head_t lru;  // LRU list of unused buffers
+    list_head_t hash; // hash bucket of (dev, blockno)
+    list_head_t dirty_list; // bcache.dirty, oldest first
+    uint64 dirtied_when;
+    int writeback; // being written by a flusher, don't evict it
     uchar data[BSIZE];
     int valid; // has data been read from disk?
     int dirty; // dirty
@@ -25,21 +30,103 @@ struct buffer_head {
     uint dev;
 };
 
+/*
+    buffer cache
+
+    bucket[hash(dev, blockno)] --> bh --> bh --> ...   (per-bucket lock)
+
+    lru: bh with refcnt 0, most recently used at the head  (bcache.lock)
+
+    buffers are allocated on demand until max_buf, then the clean one
+    at the tail of lru is evicted. lock order: bucket lock, then bcache.lock
+
+    dirty: bh written by bwrite(), oldest first  (bcache.lock)
+
+    brelse() doesn't write the buffer, pdflush does once it is older than
+    BDIRTY_EXPIRE_MS, or once more than BDIRTY_RATIO % of the cache is dirty.
+    a flusher copies a batch of them out under their locks, then writes
+    the runs of adjacent blocks as one bio. bsync() is the barrier.
+*/
+#define BCACHE_NBUCKET 61 // prime
+#define BCACHE_HASH(dev, blockno) ((((uint64)(dev) << 20) ^ (blockno)) % BCACHE_NBUCKET)
+
+#define BDIRTY_EXPIRE_MS 3000
+#define BDIRTY_RATIO 10  // percent of max_buf
+#define BFLUSH_BATCH 64  // buffers written back at a time
+
+#define BIO_MAX_SEGS 32 // pages of a scatter-gather bio_vec
+#define BLK_MAX_SEGS 64 // data segments of a merged request
+
+// deadline of a queued request
+#define READ_EXPIRE_MS 50
+#define WRITE_EXPIRE_MS 500
+
 // similar to bio of Linux
 struct bio {
     uint bi_bdev;                // device no
     uint64 bi_rw;                // read or write
     struct list_head list_entry; // entry
+
+    // completion
+    atomic_t bi_remaining;              // bio_vecs in flight
+    void (*bi_end_io)(struct bio *bio); // called once all bio_vecs are done, maybe in interrupt context
+    void *bi_private;
 };
 
 // different from Linux
 struct bio_vec {
-    struct semaphore sem_disk_done;
     struct list_head list;
     uint blockno_start;
     uint block_len;
-    uchar *data;
-    int disk;
+    uchar *data;     // contiguous buffer, if pages is NULL
+    uint64 *pages;   // scatter-gather: the buffer spans these pages,
+    uint offset;     // starting at offset of pages[0]
+    struct bio *bio; // owner
+    struct bio_vec *bi_next; // in the same request
+};
+
+/*
+    block request queue, one per device
+
+    submit_bio --> bio_vec --(merge front/back)--> [ request ] ... sorted by block, and in FIFO order
+                                                         |
+    blk_run_queue <-- unplug / completion         deadline elevator
+          |
+          +--> disk_submit(request) --> driver --> blk_end_request
+
+    a request is a run of contiguous blocks, made of one or more bio_vecs.
+    the elevator serves the expired request first (reads before writes), otherwise
+    it scans in ascending block order from the last one dispatched.
+    requests on the same blocks are dispatched in the order they were queued
+    (e.g. a read never goes ahead of a queued write of its block), a bio_vec is
+    never merged across them.
+    the plug is per thread: while the submitter is plugged, its requests are
+    only queued (and merged), others dispatch them when they run the queue.
+*/
+struct request {
+    struct list_head queuelist; // sort list
+    struct list_head fifo;      // fifo list of its direction
+    struct request_queue *q;
+    int rw;
+    uint blockno_start;
+    uint block_len;
+    int nr_segs;
+    uint64 deadline;
+    uint64 seq;               // order of arrival in the queue
+    struct bio_vec *vec_head; // chained by bi_next
+    struct bio_vec *vec_tail;
+};
+
+struct request_queue {
+    struct spinlock lock;
+    struct list_head sort_list;
+    struct list_head fifo_list[2]; // DISK_READ, DISK_WRITE
+    int nr_queued;
+    struct request *requeue; // the device was busy, dispatch it first
+    uint head_pos;           // block behind the last dispatched request
+    uint64 seq;              // of the next request
+    int dispatching;
+    int rerun;
 };
 // start : 2
 // len : 4
@@ -50,10 +137,25 @@ void binit(void);
 struct buffer_head *bread(uint, uint);
 void brelse(struct buffer_head *);
 void bwrite(struct buffer_head *);
+void bwback(struct buffer_head *b);
+void bcache_writeback(uint64 all);
+void bsync(void);
 // bio
 void disk_rw_bio(struct buffer_head *b, int rw);
 void init_bio(struct bio *bio_p, struct bio_vec *vec_p, struct buffer_head *b, int rw);
 void submit_bio(struct bio *bio, int free);
+void submit_bio_async(struct bio *bio);
+void bio_free_vecs(struct bio *bio);
+void bio_vec_map_pages(struct bio_vec *vec, uint64 *pages, uint offset);
+int bio_vec_nr_segs(struct bio_vec *vec);
+uint bio_vec_seg(struct bio_vec *vec, int i, uint64 *addr);
+// request queue
+void blk_init(void);
+struct request_queue *bdev_get_queue(uint dev);
+void blk_start_plug(struct request_queue *q);
+void blk_finish_plug(struct request_queue *q);
+void blk_run_queue(struct request_queue *q);
+void blk_end_request(struct request *rq);
 void bio_print(struct bio *bio);
 
 #endif // __BIO_H__
\ No newline at end of file
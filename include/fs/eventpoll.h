@@ -0,0 +1,78 @@
+#ifndef __EVENTPOLL_H__
+#define __EVENTPOLL_H__
+
+#include "common.h"
+#include "lib/riscv.h"
+#include "fs/fcntl.h"
+#include "atomic/spinlock.h"
+#include "atomic/semaphore.h"
+#include "atomic/wait.h"
+#include "lib/list.h"
+#include "lib/rbtree.h"
+#include "lib/poll.h"
+
+#define EPOLLIN 0x001
+#define EPOLLPRI 0x002
+#define EPOLLOUT 0x004
+#define EPOLLERR 0x008
+#define EPOLLHUP 0x010
+#define EPOLLRDNORM 0x040
+#define EPOLLRDBAND 0x080
+#define EPOLLWRNORM 0x100
+#define EPOLLWRBAND 0x200
+#define EPOLLMSG 0x400
+#define EPOLLRDHUP 0x2000
+#define EPOLLEXCLUSIVE (1U << 28)
+#define EPOLLWAKEUP (1U << 29)
+#define EPOLLONESHOT (1U << 30)
+#define EPOLLET (1U << 31)
+
+// the bits that are not events
+#define EP_PRIVATE_BITS (EPOLLWAKEUP | EPOLLONESHOT | EPOLLET | EPOLLEXCLUSIVE)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLL_CLOEXEC O_CLOEXEC
+
+// not packed on riscv
+struct epoll_event {
+    uint32 events;
+    uint64 data;
+};
+
+// events returned by one epoll_pwait
+#define EP_MAX_BATCH (PGSIZE / sizeof(struct epoll_event))
+
+struct eventpoll {
+    struct semaphore mtx;     // ctl and the transfer of events
+    struct spinlock lock;     // rdllist and the ready state of the items, taken by the callbacks
+    struct list_head rdllist; // the items that may have events
+    struct rb_root rbr;       // all the items, by (file, fd)
+    struct wait_queue_head wq; // epoll_pwait, and poll on the epoll fd
+};
+
+// a file in an epoll set
+struct epitem {
+    struct rb_node rbn;         // in ep->rbr
+    struct list_head rdllink;   // in ep->rdllist, when ready
+    int ready;                  // on rdllist or being transferred
+    int rewake;                 // an event came while it was transferred
+    struct list_head fllink;    // in file->f_ep_links
+    struct file *file;
+    int fd;
+    struct eventpoll *ep;
+    struct epoll_event event;
+    struct wait_queue_entry wait;      // on the wait queue of the file
+    struct wait_queue_head *whead;
+};
+
+void eventpoll_init(void);
+uint ep_eventpoll_poll(struct file *f, poll_table *pt);
+// the last reference of f is going away
+void eventpoll_release(struct file *f);
+// the epoll fd is closed
+void ep_free(struct eventpoll *ep);
+
+#endif // __EVENTPOLL_H__
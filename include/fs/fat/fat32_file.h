@@ -17,7 +17,11 @@ int fat32_filestat(struct file *, uint64 addr);
 // 4. write the file
 ssize_t fat32_filewrite(struct file *, uint64, int n);
 
-// 5. current working directory
+// 5. the ready events of the file
+struct poll_table_struct;
+uint fat32_filepoll(struct file *f, struct poll_table_struct *pt);
+
+// 6. current working directory
 void fat32_getcwd(char *buf);
 void get_absolute_path(struct inode *ip, char *kbuf);
 size_t fat32_getdents(struct inode *dp, char *buf, uint32 off, size_t len);
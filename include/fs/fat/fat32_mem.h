@@ -135,10 +135,23 @@ void fat32_inode_unlock_put(struct inode *ip);
 
 // dup a existed fat32 inode
 struct inode *fat32_inode_dup(struct inode *ip);
+struct inode *fat32_inode_tryget(struct inode *ip, struct inode *dp, const char *name);
+struct inode *fat32_inode_grab(struct inode *ip);
 
 // find a existed or new fat32 inode
 struct inode *fat32_inode_get(uint dev, struct inode *dp, const char *name, uint parentoff);
 
+// in-core inodes are hashed by their fcb : (dev, parent, offset in parent)
+#define INODE_NBUCKET 127 // prime
+#define INODE_HASH(dev, dp, off) (((((uint64)(dp) >> 4) << 12) ^ ((uint64)(dev) << 24) ^ (off)) % INODE_NBUCKET)
+#define INODE_SHRINK_BATCH 16
+
+// free at most nr unused clean inodes, return the number freed
+int fat32_inode_shrink(int nr);
+
+// start the thread that truncates and frees the unlinked inodes
+void itruncd_init(void);
+
 // load inode from disk
 int fat32_inode_load_from_disk(struct inode *ip);
 
@@ -279,7 +292,6 @@ void fat32_i_mapping_writeback(struct inode *ip);
 void fat32_i_mapping_destroy(struct inode *ip);
 
 // ignore it, a rough process
-void alloc_fail(void);
 
 void shutdown_writeback(void);
 // ======================= abandon， may be ============================
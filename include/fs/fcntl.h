@@ -70,6 +70,8 @@
 #define F_SETFL 4    /* set file->f_flags */
 #define FD_CLOEXEC 1 /* actually anything with low bit set goes */
 #define F_DUPFD_CLOEXEC 1030
+#define F_SETPIPE_SZ 1031 /* set the capacity of a pipe */
+#define F_GETPIPE_SZ 1032 /* get the capacity of a pipe */
 
 // faccess
 #define F_OK 0           /* test existance */
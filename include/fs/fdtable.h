@@ -6,19 +6,39 @@
 #include "atomic/ops.h"
 
 struct file;
-struct fd {
-    struct file *file;
-    uint flags;
-};
 
-typedef fd fd_t;
-// descriptor table
+#define NOFILE_WORDS ((NOFILE + 63) / 64)
+
+// descriptor table, similar to files_struct of Linux
+// shared by the threads of a proc, and by the procs cloned with CLONE_FILES
 struct fdtable {
     atomic_t ref;
     struct spinlock lock;
-    fd_t ofile[NOFILE];
-    uint max_fds; // max fd
-    uint cur_fd;  // current fd
+    struct file *ofile[NOFILE];
+    uint64 open_fds[NOFILE_WORDS]; // bit fd is set iff ofile[fd] != NULL
+    int max_fds;                   // fd < max_fds (RLIMIT_NOFILE)
+    int next_fd;                   // no free fd below it
 };
 
-#endif // __FDTABLE_H__
\ No newline at end of file
+struct fdtable *fdt_alloc(void);
+// for fork : a new table with the same files
+struct fdtable *fdt_dup(struct fdtable *old);
+// the last put closes the files
+void fdt_put(struct fdtable *fdt);
+
+static inline struct fdtable *fdt_get(struct fdtable *fdt) {
+    atomic_inc_return(&fdt->ref);
+    return fdt;
+}
+
+// the lowest free fd >= start takes f, -1 if none
+int fdt_install(struct fdtable *fdt, struct file *f, int start);
+// fd takes f, the file it had is returned (to be closed by the caller)
+struct file *fdt_replace(struct fdtable *fdt, int fd, struct file *f);
+// fd is free again, its file is returned (to be closed by the caller)
+struct file *fdt_remove(struct fdtable *fdt, int fd);
+// the file of fd with a reference of the caller (generic_fileclose() drops it), NULL if none
+struct file *fdt_fget(struct fdtable *fdt, int fd);
+void fdt_set_max(struct fdtable *fdt, uint64 max_fds);
+
+#endif // __FDTABLE_H__
@@ -25,10 +25,7 @@ typedef struct {
     uint64 fds_bits[FD_SETSIZE / 8 / sizeof(long)];
 } fd_set;
 
-int do_select(int nfds, fd_set_bits *fds, uint64 timeout);
-
-int core_sys_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, uint64 timeout);
-
-long do_pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timespec *tsp, const sigset_t *sigmask, size_t sigsetsize);
+// deadline : ns (0 : none), timed_out : don't wait at all
+int do_select(int nfds, fd_set_bits *fds, uint64 deadline, int timed_out);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,17 @@
+#ifndef __SPLICE_H__
+#define __SPLICE_H__
+#include "common.h"
+
+struct file;
+
+// flags of splice, tee and vmsplice
+#define SPLICE_F_MOVE 0x01     /* move pages instead of copying, always the case */
+#define SPLICE_F_NONBLOCK 0x02 /* don't block on the pipe */
+#define SPLICE_F_MORE 0x04     /* more data will be coming */
+#define SPLICE_F_GIFT 0x08     /* pages passed in are a gift */
+
+#define SPLICE_BATCH 16 // page cache pages looked up at a time
+
+ssize_t do_splice_direct(struct file *in, off_t *off, struct file *out, size_t len);
+
+#endif // __SPLICE_H__
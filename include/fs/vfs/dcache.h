@@ -0,0 +1,37 @@
+#ifndef __VFS_DCACHE_H__
+#define __VFS_DCACHE_H__
+
+#include "common.h"
+#include "param.h"
+#include "lib/list.h"
+
+// global cache of (directory, name) -> inode, similar to the dcache of Linux
+// a negative entry (d_inode == NULL) remembers that the name is not in the directory
+// lookups take no sleeping lock, the changes of a directory happen with its i_sem held
+
+#define NDHASH 512
+// longer names are not cached
+#define DNAME_INLINE_LEN 48
+
+struct dentry {
+    struct list_head d_hash; // in a bucket of the cache
+    struct list_head d_lru;  // free entries at the head, recently added at the tail
+    struct inode *d_parent;  // NULL if free
+    struct inode *d_inode;   // NULL for a negative entry
+    uint64 d_hashval;
+    int d_referenced; // hit since the last eviction pass
+    char d_name[DNAME_INLINE_LEN];
+};
+
+void dcache_init(void);
+// 1 : found, *ipp holds a new reference, -1 : known to be absent, 0 : unknown
+int d_lookup(struct inode *dp, const char *name, struct inode **ipp);
+// ip == NULL : name is not in dp, caller holds dp->i_sem
+void d_add(struct inode *dp, const char *name, struct inode *ip);
+// name was created or removed in dp, caller holds dp->i_sem
+void d_drop(struct inode *dp, const char *name);
+// dp is going away, forget its names and the names leading to it
+// no lookup uses dp after it returns
+void d_prune(struct inode *dp);
+
+#endif // __VFS_DCACHE_H__
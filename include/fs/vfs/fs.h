@@ -5,6 +5,7 @@
 #include "param.h"
 #include "atomic/spinlock.h"
 #include "atomic/semaphore.h"
+#include "atomic/ops.h"
 #include "fs/stat.h"
 #include "fs/fcntl.h"
 #include "fs/fat/fat32_mem.h"
@@ -14,13 +15,18 @@
 #include "fs/mpage.h"
 
 struct kstat;
-extern struct ftable _ftable;
+struct kmem_cache;
+extern struct kmem_cache *file_cachep;
 
 struct socket;
+struct eventpoll;
+struct inode_bucket;
+struct poll_table_struct;
 union file_type {
-    struct pipe *f_pipe;   // FD_PIPE
-    struct inode *f_inode; // FDINODE and FD_DEVICE
-    struct socket *f_sock; // FD_SOCKET
+    struct pipe *f_pipe;     // FD_PIPE
+    struct inode *f_inode;   // FDINODE and FD_DEVICE
+    struct socket *f_sock;   // FD_SOCKET
+    struct eventpoll *f_ep;  // FD_EPOLL
 };
 
 typedef enum {
@@ -67,7 +73,7 @@ struct file {
     off_t f_pos;
 
     ushort f_flags;
-    ushort f_count;
+    atomic_t f_count;
     short f_major;
 
     void *private_data; // for shared memory
@@ -78,11 +84,8 @@ struct file {
     // unsigned long f_version;
 
     int is_shm_file; // for shared memory
-};
 
-struct ftable {
-    struct spinlock lock;
-    struct file file[NFILE];
+    struct list_head f_ep_links; // the epoll items watching it, under epmutex
 };
 
 // #define NAME_MAX 10
@@ -166,7 +169,9 @@ struct inode {
     struct address_space *i_mapping; // used for page cache
     spinlock_t tree_lock;            /* and lock protecting radix tree */
 
-    struct list_head list; // to speed up inode_get
+    struct list_head list;              // in i_bucket, empty once unhashed
+    struct list_head i_lru;             // unused : on the lru or the trunc list of the inode table
+    struct inode_bucket *i_bucket;      // its lock protects ref
 
     int dirty_in_parent; // need to update ??
     int create_cnt;      // for inode parent
@@ -205,6 +210,7 @@ struct file_operations {
     long (*ioctl)(struct file *self, unsigned int cmd, unsigned long arg);
     // size_t (*readdir)(struct file *self, char *buf, size_t len);
     size_t (*readdir)(struct inode *dp, char *buf, uint32 off, size_t len);
+    uint (*poll)(struct file *self, struct poll_table_struct *pt);
 };
 
 struct inode_operations {
@@ -4,12 +4,12 @@
 #include "common.h"
 #include "atomic/spinlock.h"
 #include "atomic/semaphore.h"
+#include "atomic/wait.h"
+#include "lib/riscv.h"
 #include "lib/sbuf.h"
 
 struct file;
 
-#define PIPESIZE 512
-
 // struct pipe {
 //     struct sbuf buffer;
 //     int readopen;  // read fd is still open
@@ -21,29 +21,66 @@ struct file;
 // int pipe_write(struct pipe *pi, int user_dst, uint64 addr, int n);
 // int pipe_read(struct pipe *pi, int user_dst, uint64 addr, int n);
 
+// a ring of page buffers, a buffer is a page the pipe holds a reference to
+// pipe_write fills anonymous pages, splice puts page cache pages in it
+// the number of slots is a power of two, so head and tail can wrap
+#define PIPE_DEF_PAGES 16   // 64KB, as Linux
+#define PIPE_MAX_PAGES 256  // 1MB, the limit of F_SETPIPE_SZ
+#define PIPE_BUF 4096       // writes up to PIPE_BUF bytes are atomic
+
+#define PIPE_BUF_FLAG_CAN_MERGE 0x1 // an anonymous page of the pipe, pipe_write may append to it
+
+struct pipe_buffer {
+    uint64 page; // pa of the page
+    uint offset;
+    uint len;
+    int flags;
+};
+
 struct pipe {
     struct spinlock lock;
-    char data[PIPESIZE];
-    uint nread;    // number of bytes read
-    uint nwrite;   // number of bytes written
-    int readopen;  // read fd is still open
-    int writeopen; // write fd is still open
+    struct pipe_buffer *bufs;
+    uint npages;     // the number of slots in bufs
+    uint head;       // the next slot to fill
+    uint tail;       // the oldest slot in use
+    uint64 tmp_page; // a free anonymous page kept for the next write
+    int readopen;    // read fd is still open
+    int writeopen;   // write fd is still open
 
+    int r_waiting; // readers in sema_wait(&read_sem)
+    int w_waiting; // writers in sema_wait(&write_sem)
     struct semaphore read_sem;
     struct semaphore write_sem;
+    struct wait_queue_head wait; // poll, select and epoll of both ends
 };
 
-#define PIPE_FULL(pi) (pi->nwrite == pi->nread + PIPESIZE)
-#define PIPE_EMPTY(pi) (pi->nread == pi->nwrite)
+#define PIPE_SIZE(pi) ((pi)->npages * PGSIZE)
+#define PIPE_SLOTS_USED(pi) ((pi)->head - (pi)->tail)
+#define PIPE_FULL(pi) (PIPE_SLOTS_USED(pi) >= (pi)->npages)
+#define PIPE_EMPTY(pi) ((pi)->head == (pi)->tail)
+#define pipe_buf_at(pi, slot) (&(pi)->bufs[(slot) & ((pi)->npages - 1)])
 
 #define pipereadable(p) (p->readopen)
 #define pipewriteable(p) (p->writeopen)
 
 int pipe_empty(struct pipe *p);
 int pipe_full(struct pipe *p);
+struct pipe *pipe_create(void);
+void pipe_destroy(struct pipe *pi);
 int pipe_alloc(struct file **f0, struct file **f1);
 void pipe_close(struct pipe *pi, int writable);
 int pipe_read(struct pipe *pi, int user_dst, uint64 addr, int n);
 int pipe_write(struct pipe *pi, int user_dst, uint64 addr, int n);
+int pipe_get_size(struct pipe *pi);
+int pipe_set_size(struct pipe *pi, int size);
+struct poll_table_struct;
+uint pipe_poll(struct file *f, struct poll_table_struct *pt);
+
+// for splice, with pi->lock held
+void pipe_wait_readable(struct pipe *pi);
+void pipe_wait_writable(struct pipe *pi);
+void pipe_wake_readers(struct pipe *pi);
+void pipe_wake_writers(struct pipe *pi);
+void pipe_buf_release(struct pipe *pi, struct pipe_buffer *buf);
 
 #endif // __PIPE_H__
\ No newline at end of file
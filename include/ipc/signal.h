@@ -215,6 +215,7 @@ void signal_info_init(sig_t sig, siginfo_t *info, int opt);
 int signal_send(siginfo_t *info, struct tcb *t);
 void sigpending_init(struct sigpending *sig);
 int signal_handle(struct tcb *t);
+int signal_pending(struct tcb *t);
 int do_handle(struct tcb *t, int sig_no, struct sigaction *sig_act);
 void signal_DFL(struct tcb *t, sig_t signo);
 int do_sigaction(int sig, struct sigaction *act, struct sigaction *oact);
@@ -4,6 +4,7 @@
 #include "lib/riscv.h"
 #include "atomic/spinlock.h"
 #include "atomic/semaphore.h"
+#include "atomic/wait.h"
 #include "lib/sbuf.h"
 
 #define BUFSIZE PGSIZE
@@ -26,7 +27,7 @@ struct socket {
     struct semaphore do_accept;
     int has_map;
     int used;
-    // wait_queue_head_t	wait;
+    struct wait_queue_head wait; // poll, select and epoll
 };
 
 struct socket_operations {
@@ -35,6 +36,8 @@ struct socket_operations {
 };
 
 void free_socket(struct socket *sock);
+struct poll_table_struct;
+uint socket_poll(struct file *f, struct poll_table_struct *pt);
 
 /* Types of sockets.  */
 enum __socket_type {
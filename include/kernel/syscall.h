@@ -3,6 +3,7 @@
 #include "common.h"
 
 struct file;
+struct tcb;
 // syscall.c
 uint64 argraw(int);
 int argint(int, int *);
@@ -10,6 +11,8 @@ void argulong(int, unsigned long *);
 int arguint(int n, uint *ip);
 int arglong(int, long *);
 int argfd(int n, int *pfd, struct file **pf);
+void argfd_put(struct tcb *t);
+void argfd_put_atomic(struct tcb *t);
 int argstr(int, char *, int);
 int argaddr(int, uint64 *);
 int arglist(uint64 argv[], int s, int n); // do not use
@@ -171,6 +171,16 @@ static inline void list_splice(struct list_head *list, struct list_head *head) {
         __list_splice(list, head);
 }
 
+/**
+ * list_splice_tail - join two lists, each list being a queue
+ * @list: the new list to add.
+ * @head: the place to add it in the first list.
+ */
+static inline void list_splice_tail(struct list_head *list, struct list_head *head) {
+    if (!list_empty(list))
+        __list_splice(list, head->prev);
+}
+
 // mycode : join two lists given first pointer of head
 static inline void list_join_given_first(struct list_head *first_new, struct list_head *first_old) {
     if (first_new != NULL && first_old != NULL) {
@@ -2,6 +2,13 @@
 #define __POLL_H__
 
 #include "common.h"
+#include "atomic/spinlock.h"
+#include "atomic/wait.h"
+#include "lib/queue.h"
+#include "ipc/signal.h"
+
+struct file;
+struct tcb;
 /*
  * How many longwords for "nr" bits?
  */
@@ -43,20 +50,16 @@ static inline void zero_fd_set(uint64 nr, uint64 *fdset) {
 #define POLLPRI 0x002 /* There is urgent data to read.  */
 #define POLLOUT 0x004 /* Writing now will not block.  */
 
-#if defined __USE_XOPEN || defined __USE_XOPEN2K8
 /* These values are defined in XPG4.2.  */
 #define POLLRDNORM 0x040 /* Normal data may be read.  */
 #define POLLRDBAND 0x080 /* Priority data may be read.  */
 #define POLLWRNORM 0x100 /* Writing now will not block.  */
 #define POLLWRBAND 0x200 /* Priority data may be written.  */
-#endif
 
-#ifdef __USE_GNU
 /* These are extensions for Linux.  */
 #define POLLMSG 0x400
 #define POLLREMOVE 0x1000
 #define POLLRDHUP 0x2000
-#endif
 
 /* Event types always implicitly polled for.  These bits need not be set in
    `events', but they will appear in `revents' to indicate the status of
@@ -71,4 +74,55 @@ struct pollfd {
     short revents; /* returned events */
 };
 
+
+// the poll operation of a file : poll_wait() the wait queues of the events, then return the ready ones
+// qproc is NULL when the caller only wants the mask (a second pass, epoll_wait ...)
+struct poll_table_struct;
+typedef void (*poll_queue_proc)(struct file *, struct wait_queue_head *, struct poll_table_struct *);
+
+typedef struct poll_table_struct {
+    poll_queue_proc qproc;
+    uint key; // the events the caller waits for
+} poll_table;
+
+static inline void poll_wait(struct file *filp, struct wait_queue_head *wq, poll_table *p) {
+    if (p && p->qproc && wq)
+        p->qproc(filp, wq, p);
+}
+
+// select and poll : an entry for every wait queue of every file polled
+struct poll_wqueues;
+struct poll_table_entry {
+    struct file *filp; // a reference, the wait queue lives as long as it
+    uint key;
+    struct wait_queue_entry wait;
+    struct wait_queue_head *wait_address;
+};
+
+struct poll_table_page {
+    struct poll_table_page *next;
+    struct poll_table_entry *entry; // the next free one
+    struct poll_table_entry entries[];
+};
+
+struct poll_wqueues {
+    poll_table pt;
+    struct poll_table_page *table;
+    struct tcb *polling_task;
+    struct spinlock lock;
+    int triggered;           // woken since the last poll_schedule_timeout()
+    int error;
+    Queue_t waiting;         // the wait channel of polling_task
+    int inline_index;
+    struct poll_table_entry inline_entries[N_INLINE_POLL_ENTRIES];
+};
+
+void poll_initwait(struct poll_wqueues *pwq);
+void poll_freewait(struct poll_wqueues *pwq);
+int poll_schedule_timeout(struct poll_wqueues *pwq, uint64 deadline);
+uint vfs_poll(struct file *f, poll_table *pt);
+// the signal mask at user address usigmask while waiting (0 : unchanged)
+int poll_set_sigmask(uint64 usigmask, sigset_t *saved);
+void poll_restore_sigmask(uint64 usigmask, sigset_t *saved);
+
 #endif
\ No newline at end of file
@@ -8,6 +8,7 @@
 #define SHUTDOWN_EXT 0x08L
 #define TIMER_EXT 0x54494D45L
 #define HSM_EXT 0x48534DL
+#define IPI_EXT 0x735049L
 
 #define SBI_SUCCESS 0
 
@@ -45,6 +46,11 @@ static inline struct sbiret sbi_legacy_set_timer(uint64 stime_value) {
     return SBI_CALL_1(LEGACY_SET_TIMER, 0, stime_value);
 }
 
+// raise a supervisor software interrupt on the harts of hart_mask (from hart_mask_base)
+static inline int sbi_send_ipi(uint64 hart_mask, uint64 hart_mask_base) {
+    return SBI_CALL_2(IPI_EXT, 0, hart_mask, hart_mask_base).error;
+}
+
 static inline struct sbiret sbi_shutdown() {
     return SBI_CALL_0(SHUTDOWN_EXT, 0);
 }
@@ -8,15 +8,34 @@
 #include "lib/riscv.h"
 #include "memory/memlayout.h"
 
-// #define SET_TIMER() sbi_legacy_set_timer(*(uint64 *)CLINT_MTIME + CLINT_INTERVAL)
-#define SET_TIMER() sbi_legacy_set_timer(rdtime() + CLINT_INTERVAL)
+// the hart that runs clockintr(), it keeps ticking even when it is idle
+#if defined(SIFIVE_U) || defined(SIFIVE_B)
+#define TIMEKEEPER_HART 1 // bugs: can't be 0 when based on sifive_u
+#else
+#define TIMEKEEPER_HART 0 // QEMU : cpuid is 0
+#endif
 #define TIME_OUT(timer_cur) (TIME2NS(rdtime()) > ((timer_cur)->expires_end))
 
+// timer wheel : a jiffy is 2^20 ns (about 1ms), 4 levels of 64 slots cover 2^24 jiffies (about 4.9 hours)
+#define TIMER_JIFFY_SHIFT 20
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_DEPTH 4
+#define WHEEL_MAX_DELTA ((1UL << (WHEEL_BITS * WHEEL_DEPTH)) - 1)
+
 typedef void (*timer_expire)(void *); // uint64
 
-struct timer_entry {
+// per-CPU timer base, a timer stays on the base of the hart that armed it
+struct timer_base {
     struct spinlock lock;
-    struct list_head entry;
+    uint64 clk;                        // the next jiffy to run
+    uint64 next_tick;                  // rdtime of the next scheduler tick, -1 if stopped
+    uint64 programmed;                 // rdtime the SBI timer of the hart is set to
+    int nr_timers;
+    struct timer_list *running;        // the callback in progress
+    uint64 pending[WHEEL_DEPTH];       // bitmap of non-empty slots
+    struct list_head vectors[WHEEL_DEPTH][WHEEL_SIZE];
 };
 
 struct timer_list {
@@ -29,12 +48,17 @@ struct timer_list {
     int cycle;                // for every clock interrupt
     int over;                 // for pselect
     uint64 interval;          // for setitimer
+    uint64 jiffy;             // the jiffy it fires at
+    struct timer_base *base;  // NULL if it has never been armed
 };
 
-void timer_entry_init(struct timer_entry *t_entry, char *name);
+void init_timer(struct timer_list *timer);
 void add_timer_atomic(struct timer_list *timer, uint64 expires, timer_expire function, void *data);
 void delete_timer_atomic(struct timer_list *timer);
-void timer_list_decrease_atomic(struct timer_entry *head);
+void delete_timer_sync(struct timer_list *timer);
+void timer_start_tick(void);
+void timer_stop_tick(void);
+int timer_interrupt(void);
 void clockintr();
 
-#endif
\ No newline at end of file
+#endif
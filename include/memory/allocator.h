@@ -10,8 +10,10 @@
 void *kalloc(void);
 
 void kfree(void *);
+void kfree_cold(void *);
 void *kzalloc(size_t size);
 void *kmalloc(size_t size);
+void *kalloc_contig(uint64 cnt);
 void share_page(uint64 pa);
 
 /* get available memory size */
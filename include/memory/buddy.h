@@ -29,11 +29,21 @@
 
 #define NPAGES (((PHYSTOP)-START_MEM) / (PGSIZE))
 #define PAGES_PER_CPU (NPAGES / NCPU)
+
+/* watermarks of free pages for zone balancing */
+#define POOL_LOW_WMARK (PAGES_PER_CPU / 32)
+#define POOL_HIGH_WMARK (PAGES_PER_CPU / 8)
 extern struct page *pagemeta_start;
 
+struct kmem_cache;
+
 // page status
 #define PG_locked 0x01
 #define PG_dirty 0x02
+#define PG_slab 0x03 // page is owned by a kmem_cache
+#define PG_lru 0x04        // page is on one of the page cache LRU lists
+#define PG_active 0x05     // page is on the active list
+#define PG_referenced 0x06 // page has been accessed since the last scan
 
 // chage the refcnt of page (atomic)
 #define page_cache_get(page) (atomic_inc_return(&page->refcnt))
@@ -43,17 +53,29 @@ struct page {
     // use for buddy system
     int allocated;
     int order;
+    // free page: buddy/pcp list, slab page: slab list, page cache page: LRU list
     struct list_head list;
 
     // use for copy-on-write
     struct spinlock lock;
     atomic_t refcnt;
+    // objects in use (slab page only)
+    int inuse;
 
     // for i-mapping
     uint64 flags;
-    struct address_space *mapping;
-    // pagecache index
-    uint64 index;
+    union {
+        struct {
+            struct address_space *mapping;
+            // pagecache index
+            uint64 index;
+        };
+        // for slab allocator
+        struct {
+            struct kmem_cache *slab_cache;
+            void *freelist; // first free object of this slab
+        };
+    };
 };
 
 struct free_list {
@@ -74,11 +96,38 @@ struct phys_mem_pool {
 
     /* The free list of different free-memory-chunk orders. */
     struct free_list freelists[BUDDY_MAX_ORDER + 1];
+    uint64 nr_free; // pages in freelists
+
+    /* Blocks borrowed from other pools, still owned (and merged) by their own pool. */
+    struct free_list borrowed[BUDDY_MAX_ORDER + 1];
+    uint64 nr_borrowed;
 };
 extern struct phys_mem_pool mempools[NCPU];
 
+/*
+ * per-CPU cache of order-0 pages in front of the buddy pools.
+ * used by its own hart, the lock is only contended when an allocation
+ * about to fail drains the lists of all harts.
+ * refill PCP_BATCH pages when it runs empty,
+ * drain PCP_BATCH cold pages back once it grows beyond PCP_HIGH.
+ */
+#define PCP_HIGH 96
+#define PCP_BATCH 32
+struct per_cpu_pages {
+    struct spinlock lock;
+    int count;
+    int high;
+    int batch;
+    struct list_head list; // hot pages at the head, cold pages at the tail
+};
+extern struct per_cpu_pages pcps[NCPU];
+
 void buddy_free_pages(struct phys_mem_pool *pool, struct page *page);
 struct page *buddy_get_pages(struct phys_mem_pool *pool, uint64 order);
+int buddy_get_pages_bulk(struct phys_mem_pool *pool, int count, struct list_head *list);
+void buddy_free_pages_bulk(struct list_head *list);
+int buddy_balance(int cur_id, uint64 order, int any);
+void buddy_return_borrowed(int cur_id);
 
 static inline void set_page_flags(struct page *page, uint64 flags) {
     set_bit(flags, &page->flags);
@@ -88,6 +137,10 @@ static inline void clear_page_flags(struct page *page, uint64 flags) {
     clear_bit(flags, &page->flags);
 }
 
+static inline int test_page_flags(struct page *page, uint64 flags) {
+    return test_bit(flags, &page->flags);
+}
+
 static inline uint64 page_to_pa(struct page *page) {
     return (page - pagemeta_start) * PGSIZE + START_MEM;
 }
@@ -96,4 +149,9 @@ static inline struct page *pa_to_page(uint64 pa) {
     return ((pa - START_MEM) / PGSIZE + pagemeta_start);
 }
 
+// the pool(cpu) who owns this page
+static inline int get_pages_cpu(struct page *page) {
+    return (page - pagemeta_start) / PAGES_PER_CPU;
+}
+
 #endif // __BUDDY_H__
\ No newline at end of file
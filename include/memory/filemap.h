@@ -16,4 +16,8 @@ uint64 max_sane_readahead(uint64 nr, uint64 read_ahead, uint64 tot_nr);
 ssize_t do_generic_file_read(struct address_space *mapping, int user_src, uint64 src, uint off, uint n);
 ssize_t do_generic_file_write(struct address_space *mapping, int user_src, uint64 src, uint off, uint n);
 
+// for mmap
+int filemap_get_pages(struct inode *ip, uint64 index, int cnt, int read, struct page **pages);
+int set_page_dirty(struct inode *ip, struct page *page);
+
 #endif
\ No newline at end of file
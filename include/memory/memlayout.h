@@ -30,10 +30,8 @@
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
+// the kernel stack of a thread comes with its tcb, in the direct mapping
 #define KSTACK_PAGE 4
-// map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p) + 1) * (KSTACK_PAGE + 1) * PGSIZE)
 
 #ifdef __DEBUG_LDSO__
 #define LDSO 0x00000000
@@ -2,8 +2,12 @@
 #define __MM_H__
 
 #include "common.h"
+#include "param.h"
 #include "lib/list.h"
 #include "atomic/semaphore.h"
+#include "atomic/ops.h"
+
+#define NTFRAME_WORDS ((NTFRAME + 63) / 64)
 
 typedef unsigned long vm_flags_t;
 #define VM_NORESERVE 0x00200000 /* should the VM suppress accounting */
@@ -18,9 +22,25 @@ struct mm_struct {
 
     struct semaphore mmap_sem;
     struct spinlock lock;
+
+    // procs using it, more than one after clone(CLONE_VM) without CLONE_THREAD (e.g. vfork)
+    atomic_t mm_users;
+    // trapframe slots taken by the threads using it (see THREAD_TRAPFRAME), protected by lock
+    uint64 tframe_map[NTFRAME_WORDS];
 };
 
 struct mm_struct *alloc_mm();
-void free_mm(struct mm_struct *mm, int thread_idx);
+// drop a reference, the last one frees the user memory and the page table
+void free_mm(struct mm_struct *mm);
+
+// the lowest free trapframe slot, -1 if all NTFRAME are taken
+// with mm->lock held
+int mm_alloc_tframe(struct mm_struct *mm);
+void mm_free_tframe(struct mm_struct *mm, int tidx);
+
+static inline struct mm_struct *mmget(struct mm_struct *mm) {
+    atomic_inc_return(&mm->mm_users);
+    return mm;
+}
 
 #endif // __MM_H__
\ No newline at end of file
@@ -2,10 +2,17 @@
 #define __PAGEFAULT_H__
 
 #include "common.h"
+
+struct mm_struct;
+
 #define INSTUCTION_PAGEFAULT 12
 #define LOAD_PAGEFAULT 13
 #define STORE_PAGEFAULT 15
 
+// pages mapped around a fault, the window of sequential faults grows up to it
+#define FAULT_AROUND_PAGES 16
+extern int fault_around_pages;
+
 #define PAGEFAULT(format, ...) printf("[PAGEFAULT]: " format "\n", ##__VA_ARGS__);
 #define CHECK_PERM(cause, vma) (((cause) == STORE_PAGEFAULT && (vma->perm & PERM_WRITE))  \
                                 || ((cause) == LOAD_PAGEFAULT && (vma->perm & PERM_READ)) \
@@ -16,5 +23,6 @@ int cow(pte_t *pte, int level, paddr_t pa, int flags);
 int is_a_cow_page(int flags);
 
 int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval);
+int populate_vma_range(struct mm_struct *mm, vaddr_t start, vaddr_t end);
 
 #endif // __PAGEFAULT_H__
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "common.h"
+#include "param.h"
+#include "lib/list.h"
+#include "atomic/spinlock.h"
+
+/*
+    kmem_cache: object cache for sub-page allocations
+
+    +-----------------+     +------+------+------+-----+
+    | per-CPU magazine| <-> | obj  | obj  | obj  | ... |  <- one buddy page (slab)
+    +-----------------+     +------+------+------+-----+
+             |
+    slabs_partial / slabs_full / slabs_free  (protected by cache->lock)
+
+    alloc/free first hit the magazine of the current hart with interrupts off,
+    only refill/flush a batch of objects take the cache lock.
+*/
+
+#define SLAB_MIN_SIZE 16         // smallest kmalloc size class
+#define SLAB_MAX_SIZE (PGSIZE / 2) // larger requests go to the buddy system directly
+#define KMALLOC_NCLASS 8         // 16, 32, ..., 2048
+#define SLAB_MAG_LIMIT 32        // objects per per-CPU magazine
+#define SLAB_MAG_BATCH 16        // objects moved per refill/flush
+#define SLAB_FREE_LIMIT 2        // empty slabs kept before giving pages back
+
+#define KMEM_CACHE_NAME_MAX 20
+
+struct kmem_magazine {
+    int avail;
+    void *objs[SLAB_MAG_LIMIT];
+};
+
+struct kmem_cache {
+    char name[KMEM_CACHE_NAME_MAX];
+    size_t size;     // object size (aligned)
+    uint num;        // objects per slab
+    struct spinlock lock;
+
+    struct list_head slabs_partial;
+    struct list_head slabs_full;
+    struct list_head slabs_free;
+    uint nr_free_slabs;
+
+    struct kmem_magazine mag[NCPU];
+};
+
+void kmem_cache_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align);
+void kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void *kmem_cache_zalloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_cache_shrink(struct kmem_cache *cache);
+
+// for kmalloc/kfree
+void *kmalloc_small(size_t size);
+int kfree_small(void *obj);
+
+#endif // __SLAB_H__
@@ -14,6 +14,10 @@
 #define MAP_PRIVATE 0x02
 #define MAP_FIXED 0x10     /* Interpret addr exactly.  */
 #define MAP_ANONYMOUS 0x20 /* Don't use a file.  */
+#define MAP_POPULATE 0x8000 /* Prefault the mapping.  */
+
+// madvise
+#define MADV_WILLNEED 3
 
 // return (void *)0xfffff...ff to indicate fail
 #define MAP_FAILED ((void *)-1)
@@ -51,6 +55,10 @@ struct vma {
     // int fd;
     uint64 offset;
     struct file *vm_file;
+
+    /* fault-around */
+    vaddr_t fault_next; // a fault here is a sequential one
+    int fault_window;   // pages mapped ahead on the last fault
 };
 
 extern struct vma vmas[NVMA];
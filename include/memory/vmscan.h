@@ -0,0 +1,55 @@
+#ifndef __VMSCAN_H__
+#define __VMSCAN_H__
+
+#include "common.h"
+#include "lib/list.h"
+#include "atomic/spinlock.h"
+#include "atomic/cond.h"
+#include "memory/buddy.h"
+#include "memory/allocator.h"
+
+/*
+    page cache LRU
+
+    new page --> [ inactive list ] --(accessed twice)--> [ active list ]
+                 head        tail <------(not referenced)------ tail
+
+    reclaim scans the inactive list from its tail, a page referenced since the
+    last scan gets a second chance, the others are evicted if they are clean,
+    not under writeback and not used by anyone but the page cache.
+    the inactive list is refilled from the tail of the active list.
+
+    kswapd is woken up once free pages drop below KSWAPD_LOW_PAGES,
+    and reclaims until KSWAPD_HIGH_PAGES are free again.
+    an allocation that fails reclaims SWAP_CLUSTER_MAX pages by itself.
+*/
+
+#define KSWAPD_LOW_PAGES PAGES_THRESHOLD
+#define KSWAPD_HIGH_PAGES (PAGES_THRESHOLD * 4)
+#define SWAP_CLUSTER_MAX 32 // pages isolated from the LRU at a time
+
+struct lru_lists {
+    struct spinlock lock;
+    struct list_head active;
+    struct list_head inactive;
+    uint64 nr_active;
+    uint64 nr_inactive;
+};
+
+struct kswapd_control {
+    struct spinlock lock;
+    struct cond wait;
+    struct tcb *who;
+    int sleeping;
+};
+
+void lru_init(void);
+void lru_cache_add(struct page *page);
+void lru_cache_del(struct page *page);
+void mark_page_accessed(struct page *page);
+uint64 shrink_page_cache(uint64 nr_to_reclaim);
+
+void kswapd_init(void);
+void wakeup_kswapd(void);
+
+#endif // __VMSCAN_H__
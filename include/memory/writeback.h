@@ -10,6 +10,7 @@
 int sync_inode(struct inode *ip);
 void wakeup_bdflush(void *nr_pages);
 void writeback_inodes(uint64 nr_to_write);
+void writeback_single_inode(struct inode *ip);
 void page_writeback_timer_init(void);
 
 #endif
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include "ipc/shm.h"
 #include "lib/resource.h"
 #include "lib/timer.h"
+#include "fs/fdtable.h"
 #include "lib/list.h"
 #include "common.h"
 #include "param.h"
@@ -47,10 +48,8 @@ struct proc {
     int killed;
     // memory management
     struct mm_struct *mm;
-    // open files table
-    struct file *ofile[NOFILE];
-    int max_ofile;
-    int cur_ofile;
+    // open files table, shared with CLONE_FILES
+    struct fdtable *files;
     // current directory
     struct inode *cwd;
     // proc state queue
@@ -63,8 +62,8 @@ struct proc {
     struct thread_group *tg;
     // for clone
     pid_t ctid;
-    // thread lock
-    struct semaphore tlock;
+    // the parent of vfork sleeps on it until we exec or exit
+    struct semaphore *vfork_done;
     // ipc name space
     struct ipc_namespace *ipc_ns;
     // system V shared memory
@@ -110,8 +109,9 @@ struct proc *find_get_pid(pid_t pid);
 void proc_init(void);
 void init_ret(void);
 struct proc *proc_current(void);
-struct proc *alloc_proc(void);
-struct proc *create_proc();
+struct proc *alloc_proc(struct mm_struct *mm);
+struct proc *create_proc(struct mm_struct *mm);
+void vfork_release(struct proc *p);
 void free_proc(struct proc *p);
 void proc_setkilled(struct proc *p);
 int proc_killed(struct proc *p);
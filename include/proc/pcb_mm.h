@@ -5,10 +5,9 @@
 
 struct tcb;
 struct mm_struct;
-void tcb_mapstacks(pagetable_t);
 pagetable_t proc_pagetable();
 int thread_trapframe(struct tcb *t, int still);
-void proc_freepagetable(struct mm_struct *mm, int maxoffset);
+void proc_freepagetable(struct mm_struct *mm);
 int growheap(int);
 
 #endif
\ No newline at end of file
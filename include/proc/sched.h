@@ -7,6 +7,74 @@
 struct proc;
 struct tcb;
 
+/*
+    per-hart run queue
+
+    wakeup --select_task_rq--> run_queues[hart] --> thread_scheduler() of that hart
+                                      ^
+                                      | steal (idle) / pull (imbalanced)
+                                      |
+                               the other harts
+
+    a thread goes back to the hart it ran on last time (cache hot), unless the
+    waker's hart is less loaded (wake affine). a hart whose queue runs empty
+    steals from the busiest one, and every SCHED_BALANCE_INTERVAL picks it
+    pulls from the busiest one if that has SCHED_IMBALANCE more threads.
+    a thread is only moved to another hart by running it there,
+    so rq_cpu changes under t->lock only. vruntime is relative to the
+    min_vruntime of the run queue of rq_cpu, it is carried over when rq_cpu changes.
+
+    in a run queue, real-time threads (SCHED_FIFO/SCHED_RR) run before the fair ones
+    rt_list   : by rt_priority, FIFO among the same priority
+    cfs_tasks : by vruntime, the time it has run weighted by nice, the leftmost runs
+
+    the timer tick only preempts a thread if the one to run next is more entitled:
+    a higher rt_priority, the end of a SCHED_RR time slice, or a smaller vruntime.
+    a woken thread gets at most SCHED_WAKEUP_BONUS_MS of vruntime credit.
+
+    idle: a hart with nothing to run or steal marks itself idle, stops its
+    tick (except TIMEKEEPER_HART) and waits in wfi. rq_enqueue() sends an IPI
+    to the hart of the run queue if it is idle, otherwise to another idle
+    hart, which can steal the thread.
+*/
+#define SCHED_BALANCE_INTERVAL 16
+#define SCHED_IMBALANCE 2
+
+// policy
+#define SCHED_NORMAL 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+#define SCHED_BATCH 3
+#define SCHED_IDLE 5
+#define rt_policy(policy) ((policy) == SCHED_FIFO || (policy) == SCHED_RR)
+
+#define MIN_RT_PRIO 1
+#define MAX_RT_PRIO 99
+#define MIN_NICE -20
+#define MAX_NICE 19
+#define NICE_0_LOAD 1024
+#define SCHED_RR_TIMESLICE 1 // ticks
+#define SCHED_WAKEUP_BONUS_MS 10
+
+// setpriority
+#define PRIO_PROCESS 0
+#define PRIO_PGRP 1
+#define PRIO_USER 2
+
+struct sched_param {
+    int sched_priority;
+};
+
+struct run_queue {
+    struct spinlock lock;
+    struct list_head rt_list; // linked by state_list
+    struct rb_root cfs_tasks; // linked by run_node
+    uint64 min_vruntime;      // never goes back
+    int nr_running;
+    int rt_nr_running;
+    int idle; // the hart waits in wfi, read and written without the lock
+};
+
 void PCB_Q_ALL_INIT(void);
 void PCB_Q_changeState(struct proc *, enum procstate);
 
@@ -17,6 +85,11 @@ void thread_wakeup_atomic(void *t);
 void thread_wakeup(struct tcb *t);
 void thread_yield(void);
 
+void sched_fork(struct tcb *t);
+int sched_setattr(struct tcb *t, int policy, int rt_priority, int nice);
+int sched_dequeue(struct tcb *t);
+int sched_tick(void);
+
 int thread_sched(void);
 void thread_scheduler(void) __attribute__((noreturn));
 
@@ -8,14 +8,14 @@
 #include "atomic/spinlock.h"
 #include "atomic/ops.h"
 #include "ipc/signal.h"
+#include "atomic/futex.h"
 #include "lib/riscv.h"
 #include "lib/queue.h"
 #include "lib/timer.h"
 #include "lib/list.h"
+#include "lib/rbtree.h"
 #include "common.h"
 
-#define NTCB ((NPROC) * (NTCB_PER_PROC))
-
 // thread state
 enum thread_state { TCB_UNUSED,
                     TCB_USED,
@@ -35,8 +35,6 @@ struct thread_group {
     spinlock_t lock;
     // thread group id, equals to pid
     tid_t tgid;
-    // thread index within the group, start from 0
-    int thread_idx;
     // count of threads, start from 1
     atomic_t thread_cnt;
     // for list
@@ -53,11 +51,13 @@ struct tcb {
     char name[20];
     // the state of thread
     thread_state_t state;
+    // thread_reclaim() drops the first one, a lookup in tid_map takes one (see find_get_tid)
+    atomic_t ref;
     // the proc pointer it belongs to
     struct proc *p;
     // thread id, global
     tid_t tid;
-    // offset, local
+    // trapframe slot in p->mm, local
     int tidx;
     // thread : killed ?
     int killed;
@@ -82,12 +82,34 @@ struct tcb {
     struct list_head wait_list;
     // waiting queue entry
     struct Queue *wait_chan_entry;
+    // the futex it waits on, if wait_chan_entry is a futex bucket
+    struct futex_key futex_key;
     /* CLONE_CHILD_SETTID: */
     uint64 set_child_tid;
     /* CLONE_CHILD_CLEARTID: */
     uint64 clear_child_tid;
     // used for nanosleep and futex
     uint64 time_out;
+    // armed by thread_sched() while it sleeps with a time_out
+    struct timer_list sleep_timer;
+    // run queue it is on (if runnable), hart it ran on last time (-1 : never)
+    int rq_cpu;
+    int last_cpu;
+    int on_rq;
+    // scheduling class
+    int policy;               // SCHED_NORMAL, SCHED_FIFO, ...
+    int rt_priority;          // 1 ~ 99 for SCHED_FIFO and SCHED_RR
+    int nice;                 // -20 ~ 19 for the others
+    uint64 vruntime;          // weighted by nice, key of cfs_tasks
+    uint64 exec_start;        // rdtime() when it got the hart
+    uint64 sum_exec_runtime;
+    int time_slice;           // ticks left (SCHED_RR)
+    struct rb_node run_node;  // in cfs_tasks
+    // nesting of blk_start_plug(), the requests it queues wait for the last blk_finish_plug()
+    int plug_depth;
+    // files argfd() took a reference on, dropped when the syscall returns (see argfd_put)
+    struct file *fd_pinned[NPINFD];
+    int nr_pinned;
 };
 
 // =============================== tid management =========================
@@ -107,6 +129,7 @@ void tginit(struct thread_group *tg);
 void thread_forkret(void);
 int do_sleep_ns(struct tcb *t, struct timespec ts);
 void free_thread(struct tcb *t);
+void thread_reclaim(struct tcb *t);
 int thread_killed(struct tcb *t);
 void thread_setkilled(struct tcb *t);
 
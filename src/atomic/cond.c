@@ -7,10 +7,9 @@
 #include "debug.h"
 
 extern struct proc proc[NPROC];
-extern struct tcb thread[NTCB];
 
 extern Queue_t unused_p_q, used_p_q, zombie_p_q;
-extern Queue_t unused_t_q, runnable_t_q, sleeping_t_q;
+extern Queue_t unused_t_q, sleeping_t_q;
 
 // init
 void cond_init(struct cond *cond, char *name) {
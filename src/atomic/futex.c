@@ -1,196 +1,240 @@
 #include "atomic/futex.h"
 #include "atomic/spinlock.h"
 #include "proc/sched.h"
+#include "proc/pcb_life.h"
+#include "proc/tcb_life.h"
+#include "memory/vma.h"
+#include "memory/vm.h"
+#include "memory/pagefault.h"
 #include "lib/list.h"
 #include "lib/queue.h"
 #include "common.h"
 #include "debug.h"
-#include "lib/hash.h"
-#include "common.h"
+#include "errno.h"
 
-extern struct hash_table futex_map;
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
 
-void futex_init(struct futex *fp, char *name) {
-    initlock(&fp->lock, name);
-    Queue_init(&fp->waiting_queue, name, TCB_WAIT_QUEUE);
-}
+// a waiter sleeps on the queue of the bucket its key hashes to, linked through
+// its tcb (wait_list, futex_key), the lock of the queue is the lock of the bucket
+// lock order : t->lock, then the bucket, as the timer and signals waking t up do
+// so the wakers, holding the bucket, only try t->lock and back off if it is taken
+static Queue_t futex_queues[FUTEX_HASH_SIZE];
 
-// it is promised to be atomic
-struct futex *get_futex(uint64 uaddr, int assert) {
-    struct hash_node *node;
-
-    node = hash_lookup(&futex_map, (void *)uaddr, NULL, 1, 0); // release it, not holding lock
-    if (node) {
-        // find it
-        return (struct futex *)(node->value);
-    } else {
-        if (assert == 1) {
-            return NULL;
-        }
-        // create it
-        struct futex *fp = (struct futex *)kzalloc(sizeof(struct futex));
-        if (fp == NULL) {
-            printf("mm : %d\n", get_free_mem());
-        panic("get_futex : no free space\n");
-        }
-        futex_init(fp, "futex");
-        hash_insert(&futex_map, (void *)uaddr, (void *)fp, 0); // not holding lock
-        return fp;
+void futex_hash_init(void) {
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        Queue_init(&futex_queues[i], "futex_bucket", TCB_WAIT_QUEUE);
     }
+    Info("futex hash init [ok]\n");
 }
 
-// remember to release its memory
-void futex_free(uint64 uaddr) {
-    hash_delete(&futex_map, (void *)uaddr, 0, 1); // not holding lock, release lock
-    // printfGreen("mm ++: %d\n", get_free_mem());
+static inline Queue_t *hash_futex(struct futex_key *key) {
+    uint64 h = ((key->ptr >> 4) ^ key->offset) * 0x9E3779B97F4A7C15UL;
+    return &futex_queues[h >> (64 - FUTEX_HASH_BITS)];
 }
 
-int futex_wait(uint64 uaddr, uint val, struct timespec *ts) {
-    uint u_val;
-    struct proc *p = proc_current();
+// a private futex needs no lookup
+// a shared one in a MAP_SHARED mapping is keyed by the page, other procs may map it elsewhere,
+// any other page is only seen through this mm, (mm, uaddr) then, so it matches a private waiter
+static int get_futex_key(uint64 uaddr, int private, struct futex_key *key) {
+    struct mm_struct *mm = proc_current()->mm;
+    struct vma *vma;
+    paddr_t pa;
 
-    acquire(&p->lock);
-    if (copyin(p->mm->pagetable, (char *)&u_val, uaddr, sizeof(uint)) < 0) {
-        release(&p->lock);
-        return -1;
+    if (uaddr % sizeof(uint32) != 0) {
+        return -EINVAL;
     }
-
-    if (u_val == val) {
-        struct futex *fp = get_futex(uaddr, 0); // without assert
-        struct tcb *t = thread_current();
-
-        acquire(&t->lock);
-        TCB_Q_changeState(t, TCB_SLEEPING);
-        Queue_push_back(&fp->waiting_queue, t);
-
-        release(&p->lock);
-        if (ts != NULL) {
-            t->time_out = TIMESEPC2NS((*ts));
+    if (!private && (vma = find_vma_for_va(mm, uaddr)) != NULL && (vma->perm & PERM_SHARED)) {
+        if ((pa = getphyaddr(mm->pagetable, uaddr)) == 0) {
+            if (pagefault(LOAD_PAGEFAULT, mm->pagetable, uaddr) < 0 || (pa = getphyaddr(mm->pagetable, uaddr)) == 0) {
+                return -EFAULT;
+            }
         }
-        t->wait_chan_entry = &fp->waiting_queue; // !!!!!
+        key->ptr = PGROUNDDOWN(pa);
+        key->offset = (pa & (PGSIZE - 1)) | FUT_OFF_SHARED;
+        return 0;
+    }
+    key->ptr = (uint64)mm;
+    key->offset = uaddr;
+    return 0;
+}
 
+// with the bucket lock and t->lock held
+static void futex_wake_one(Queue_t *hb, struct tcb *t) {
+    ASSERT(t->state == TCB_SLEEPING && t->wait_chan_entry == hb);
+    Queue_remove((void *)t, hb->type);
+    t->wait_chan_entry = NULL;
+    TCB_Q_changeState(t, TCB_RUNNABLE);
 #ifdef __DEBUG_FUTEX__
-        printfYELLOW("futex wait sleep, fp : %x, tid : %d, timeout : %d ns (%d s), uaddr %x\n", fp, t->tid, t->time_out, t->time_out / 1000 / 1000 / 1000, uaddr);
+    printfGreen("tid : %d futex wakeup tid : %d\n", thread_current()->tid, t->tid);
 #endif
-        int ret = thread_sched();
-        release(&t->lock);
+}
 
-#ifdef __DEBUG_FUTEX__
-        if (ts != NULL) {
-            if (ret)
-                printfMAGENTA("futex wait wakeup, tid : %d, after time out wakeup, uaddr %x\n", t->tid, uaddr);
-            else
-                printfBlue("futex wait wakeup, tid : %d, before time out wakeup, uaddr %x\n", t->tid, uaddr);
-        }
-#endif
-        if (ts != NULL)
-            return ret ? -1 : 0;
-        else
-            return 0;
-    } else {
-        release(&p->lock);
-        return 0;
+// lock both buckets, in address order
+static void double_lock_hb(Queue_t *hb1, Queue_t *hb2) {
+    if (hb1 > hb2) {
+        Queue_t *tmp = hb1;
+        hb1 = hb2;
+        hb2 = tmp;
+    }
+    acquire(&hb1->lock);
+    if (hb1 != hb2) {
+        acquire(&hb2->lock);
     }
 }
 
-int futex_wakeup(uint64 uaddr, int nr_wake) {
-    struct proc *p = proc_current();
-    acquire(&p->lock);
-
-    // ========atomic=========
-    struct futex *fp = get_futex(uaddr, 1); // with assert
-    if (fp == NULL) {
-        release(&p->lock);
-        return 0;
+static void double_unlock_hb(Queue_t *hb1, Queue_t *hb2) {
+    if (hb1 != hb2) {
+        release(&hb2->lock);
     }
+    release(&hb1->lock);
+}
 
-    struct tcb *t = NULL;
-    int ret = 0;
+int futex_wait(uint64 uaddr, int private, uint val, struct timespec *ts) {
+    struct tcb *t = thread_current();
+    struct futex_key key;
+    Queue_t *hb;
+    uint u_val;
+    int ret;
 
-    while (!Queue_isempty(&fp->waiting_queue) && ret < nr_wake) {
-        t = (struct tcb *)Queue_provide_atomic(&fp->waiting_queue, 1); // remove it
+    if ((ret = get_futex_key(uaddr, private, &key)) < 0) {
+        return ret;
+    }
+    hb = hash_futex(&key);
 
-        if (t == NULL)
-            panic("futex wakeup : no waiting queue");
-        if (t->state != TCB_SLEEPING) {
-            printf("%s\n", fp->waiting_queue.name);
-            printf("%s\n", t->state);
-            panic("futex wakeup : this thread is not sleeping");
-        }
-        acquire(&t->lock);
-        ASSERT(t->wait_chan_entry != NULL);
-        t->wait_chan_entry = NULL;
-        TCB_Q_changeState(t, TCB_RUNNABLE);
-#ifdef __DEBUG_FUTEX__
-        printfGreen("tid : %d futex wakeup tid : %d, uaddr : %x\n", thread_current()->tid, t->tid, uaddr);
-#endif
+    acquire(&t->lock);
+    acquire(&hb->lock);
+    // read under the bucket lock : a waker that changed the value before waking can't be missed
+    if (copyin(proc_current()->mm->pagetable, (char *)&u_val, uaddr, sizeof(uint)) < 0) {
+        release(&hb->lock);
         release(&t->lock);
-        ret++;
+        return -EFAULT;
     }
+    if (u_val != val) {
+        release(&hb->lock);
+        release(&t->lock);
+        return -EAGAIN;
+    }
+
+    TCB_Q_changeState(t, TCB_SLEEPING);
+    t->futex_key = key;
+    Queue_push_back(hb, (void *)t);
+    t->wait_chan_entry = hb; // !!!!!
+    release(&hb->lock);
 
-    if (Queue_isempty_atomic(&fp->waiting_queue)) {
+    if (ts != NULL) {
+        t->time_out = TIMESEPC2NS((*ts));
+    }
 #ifdef __DEBUG_FUTEX__
-        printf("wakeup futex free, fp : %x, uaddr : %x\n", fp, uaddr);
+    printfYELLOW("futex wait sleep, tid : %d, timeout : %d ns, uaddr %x\n", t->tid, t->time_out, uaddr);
 #endif
-        futex_free(uaddr); // !!! avoid memory leak
-    }
+    ret = thread_sched();
+    release(&t->lock);
 
-    // ==========atomic==========
-    release(&p->lock);
-    return ret;
+    if (ts != NULL && ret) {
+        return -ETIMEDOUT;
+    }
+    return 0;
 }
 
-// 唤醒最多nr_wake个在uaddr1队列上等待的线程，其余的线程阻塞在uaddr2的队列
-int futex_requeue(uint64 uaddr1, int nr_wake, uint64 uaddr2, int nr_requeue) {
-    futex_wakeup(uaddr1, nr_wake);
-    // int nr_wake1 = futex_wakeup(uaddr1, nr_wake);
-    // #ifdef __DEBUG_FUTEX__
-    // printfRed("futex_requeue : has wakeup %d threads in uaddr1 : %x\n", nr_wake1, uaddr1); // debug
-    // #endif
-
-    struct proc *p = proc_current();
+int futex_wake(uint64 uaddr, int private, int nr_wake) {
+    struct futex_key key;
+    struct tcb *t, *t_tmp;
+    Queue_t *hb;
+    int ret, busy;
 
-    acquire(&p->lock);
-    // ==========atomic=========
-    struct futex *fp_old = get_futex(uaddr1, 1); // with assert
-    if (fp_old == NULL) {
-        release(&p->lock);
-        return 0;
+    if ((ret = get_futex_key(uaddr, private, &key)) < 0) {
+        return ret;
     }
+    hb = hash_futex(&key);
+
+    ret = 0;
+    do {
+        busy = 0;
+        acquire(&hb->lock);
+        list_for_each_entry_safe(t, t_tmp, &hb->list, wait_list) {
+            if (ret >= nr_wake) {
+                break;
+            }
+            if (!futex_match(&t->futex_key, &key)) {
+                continue;
+            }
+            if (!tryacquire(&t->lock)) {
+                // still on its way to sleep, or being woken up by someone else
+                busy = 1;
+                break;
+            }
+            futex_wake_one(hb, t);
+            release(&t->lock);
+            ret++;
+        }
+        release(&hb->lock);
+    } while (busy);
+
+    return ret;
+}
+
+// wake up nr_wake waiters of uaddr1, move up to nr_requeue of the others to uaddr2 without waking them
+// return the number of them woken up or moved
+int futex_requeue(uint64 uaddr1, int private, int nr_wake, uint64 uaddr2, int nr_requeue, uint32 *cmpval) {
+    struct futex_key key1, key2;
+    struct tcb *t, *t_tmp;
+    Queue_t *hb1, *hb2;
+    int ret, woken, requeued, busy;
+    uint u_val;
 
-    struct futex *fp_new = get_futex(uaddr2, 0); // without assert
-    if (fp_new == NULL) {
-        panic("not tested\n");
+    if ((ret = get_futex_key(uaddr1, private, &key1)) < 0 || (ret = get_futex_key(uaddr2, private, &key2)) < 0) {
+        return ret;
     }
-    struct tcb *t = NULL;
-    int ret = 0;
-
-    while (!Queue_isempty_atomic(&fp_old->waiting_queue) && ret < nr_requeue) {
-        t = (struct tcb *)Queue_provide_atomic(&fp_old->waiting_queue, 1); // remove it
-        if (t == NULL)
-            panic("futex requeue : no waiting queue") ;
-        if (t->state != TCB_SLEEPING) {
-            printf("%s\n", fp_old->waiting_queue.name);
-            printf("%s\n", t->state);
-            panic("futex requeue : this thread is not sleeping");
+    hb1 = hash_futex(&key1);
+    hb2 = hash_futex(&key2);
+
+    woken = requeued = 0;
+    do {
+        busy = 0;
+        double_lock_hb(hb1, hb2);
+        if (cmpval != NULL && woken + requeued == 0) {
+            if (copyin(proc_current()->mm->pagetable, (char *)&u_val, uaddr1, sizeof(uint)) < 0) {
+                double_unlock_hb(hb1, hb2);
+                return -EFAULT;
+            }
+            if (u_val != *cmpval) {
+                double_unlock_hb(hb1, hb2);
+                return -EAGAIN;
+            }
         }
-        Queue_push_back_atomic(&fp_new->waiting_queue, (void *)t); // move the rest of threads to new queue
-        ret++;
+        list_for_each_entry_safe(t, t_tmp, &hb1->list, wait_list) {
+            if (woken >= nr_wake && requeued >= nr_requeue) {
+                break;
+            }
+            if (!futex_match(&t->futex_key, &key1)) {
+                continue;
+            }
+            if (!tryacquire(&t->lock)) {
+                busy = 1;
+                break;
+            }
+            if (woken < nr_wake) {
+                futex_wake_one(hb1, t);
+                woken++;
+            } else {
+                // the timer and signals find the new bucket through wait_chan_entry
+                if (hb1 != hb2) {
+                    Queue_remove((void *)t, hb1->type);
+                    Queue_push_back(hb2, (void *)t);
+                    t->wait_chan_entry = hb2;
+                }
+                t->futex_key = key2;
+                requeued++;
 #ifdef __DEBUG_FUTEX__
-        printfGreen("tid : %d futex requeue tid : %d from uaddr1 : %x to uaddr2 : %x\n", thread_current()->tid, t->tid, uaddr1, uaddr2);
+                printfGreen("tid : %d futex requeue tid : %d from uaddr1 : %x to uaddr2 : %x\n", thread_current()->tid, t->tid, uaddr1, uaddr2);
 #endif
-    }
-    if (Queue_isempty_atomic(&fp_old->waiting_queue)) {
-#ifdef __DEBUG_FUTEX__
-        printf("requeue futex free, fp : %x, uaddr : %x\n", fp_old, uaddr1);
-#endif
-        futex_free(uaddr1); // !!! avoid memory leak
-    }
-
-    // ========atomic========
-    release(&p->lock);
+            }
+            release(&t->lock);
+        }
+        double_unlock_hb(hb1, hb2);
+    } while (busy);
 
-    return ret;
+    return woken + requeued;
 }
 
 // #ifdef __DEBUG_FUTEX__
@@ -203,19 +247,24 @@ int futex_requeue(uint64 uaddr1, int nr_wake, uint64 uaddr2, int nr_requeue) {
 int do_futex(uint64 uaddr, int op, uint32 val, struct timespec *ts,
              uint64 uaddr2, uint32 val2, uint32 val3) {
     int cmd = op & FUTEX_CMD_MASK;
+    int private = op & FUTEX_PRIVATE_FLAG;
 
     int ret = -1;
     switch (cmd) {
     case FUTEX_WAIT:
-        ret = futex_wait(uaddr, val, ts);
+        ret = futex_wait(uaddr, private, val, ts);
         break;
 
     case FUTEX_WAKE:
-        ret = futex_wakeup(uaddr, val);
+        ret = futex_wake(uaddr, private, val);
         break;
 
     case FUTEX_REQUEUE:
-        ret = futex_requeue(uaddr, val, uaddr2, val2); // must use val2 as a limit of requeue
+        ret = futex_requeue(uaddr, private, val, uaddr2, val2, NULL); // must use val2 as a limit of requeue
+        break;
+
+    case FUTEX_CMP_REQUEUE:
+        ret = futex_requeue(uaddr, private, val, uaddr2, val2, &val3);
         break;
 
     default:
@@ -227,4 +276,4 @@ int do_futex(uint64 uaddr, int op, uint32 val, struct timespec *ts,
     //         printfMAGENTA("futex, futex_cmd : %s, retval %d\n",futex_cmd[cmd], ret);
     // #endif
     return ret;
-}
\ No newline at end of file
+}
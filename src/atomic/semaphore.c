@@ -29,4 +29,16 @@ void sema_signal(sem *S) {
         cond_signal(&S->sem_cond);
     }
     release(&S->sem_lock);
-}
\ No newline at end of file
+}
+
+// return 1 if S is acquired, never sleep
+int sema_trywait(sem *S) {
+    int ret = 0;
+    acquire(&S->sem_lock);
+    if (S->value > 0) {
+        S->value--;
+        ret = 1;
+    }
+    release(&S->sem_lock);
+    return ret;
+}
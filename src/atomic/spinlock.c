@@ -139,6 +139,22 @@ void _acquire(struct spinlock *lk) {
     lk->cpu = t_mycpu();
 }
 
+// Take the lock only if it is free, 1 if we got it.
+int tryacquire(struct spinlock *lk) {
+    push_off();
+    if (holding(lk)) {
+        printf("%s\n", lk->name);
+        panic("tryacquire");
+    }
+    if (__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+        pop_off();
+        return 0;
+    }
+    __sync_synchronize();
+    lk->cpu = t_mycpu();
+    return 1;
+}
+
 // Release the lock.
 // void _release(struct spinlock *lk) {
 //     if (!holding(lk)) {
@@ -0,0 +1,32 @@
+#include "atomic/wait.h"
+
+void init_waitqueue_head(struct wait_queue_head *wq, char *name) {
+    initlock(&wq->lock, name);
+    INIT_LIST_HEAD(&wq->head);
+}
+
+void add_wait_queue(struct wait_queue_head *wq, struct wait_queue_entry *wait) {
+    acquire(&wq->lock);
+    list_add_tail(&wait->entry, &wq->head);
+    release(&wq->lock);
+}
+
+void remove_wait_queue(struct wait_queue_head *wq, struct wait_queue_entry *wait) {
+    acquire(&wq->lock);
+    list_del_reinit(&wait->entry);
+    release(&wq->lock);
+}
+
+void wake_up_poll(struct wait_queue_head *wq, uint key) {
+    struct wait_queue_entry *wait, *tmp;
+
+    // most of the time nobody polls; a poller adds itself before it checks the state
+    // under the lock the caller changed it with, so it can't be missed
+    if (list_empty(&wq->head))
+        return;
+    acquire(&wq->lock);
+    list_for_each_entry_safe(wait, tmp, &wq->head, entry) {
+        wait->func(wait, key);
+    }
+    release(&wq->lock);
+}
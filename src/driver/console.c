@@ -23,6 +23,8 @@
 #include "ipc/signal.h"
 #include "atomic/cond.h"
 #include "atomic/semaphore.h"
+#include "atomic/wait.h"
+#include "lib/poll.h"
 #include "kernel/trap.h"
 #include "fs/stat.h"
 #include "debug.h"
@@ -71,6 +73,7 @@ struct console {
 
     struct semaphore sem_r;
     struct semaphore sem_w;
+    struct wait_queue_head wait; // poll, select and epoll
 } cons;
 
 //
@@ -169,6 +172,7 @@ void consoleintr(char c) {
             cons.buf[cons.e++ % INPUT_BUF_SIZE] = c;
             cons.w = cons.e;
             sema_signal(&cons.sem_r);
+            wake_up_poll(&cons.wait, POLLIN | POLLRDNORM);
         }
         release(&cons.lock);
         return;
@@ -207,6 +211,7 @@ void consoleintr(char c) {
                 // has arrived.
                 cons.w = cons.e;
                 sema_signal(&cons.sem_r);
+                wake_up_poll(&cons.wait, POLLIN | POLLRDNORM);
             }
         }
         break;
@@ -218,6 +223,7 @@ void consoleintr(char c) {
 void consoleinit(void) {
     initlock(&cons.lock, "cons");
     sema_init(&cons.sem_r, 0, "cons_sema_r");
+    init_waitqueue_head(&cons.wait, "cons_wait");
     cons.e = cons.w = cons.r = 0;
 
     uartinit();
@@ -234,4 +240,16 @@ int consoleready() {
     int ready = cons.w - cons.r;
     release(&cons.lock);
     return ready;
-}
\ No newline at end of file
+}
+
+// a whole line (or any byte, not in cooked mode) can be read, writes never block
+uint console_poll(struct file *f, poll_table *pt) {
+    uint mask = POLLOUT | POLLWRNORM;
+
+    poll_wait(f, &cons.wait, pt);
+    acquire(&cons.lock);
+    if (cons.w != cons.r)
+        mask |= POLLIN | POLLRDNORM;
+    release(&cons.lock);
+    return mask;
+}
@@ -5,68 +5,216 @@
 #include "fs/bio.h"
 #include "lib/list.h"
 #include "memory/allocator.h"
+#include "memory/slab.h"
+#include "memory/buddy.h"
+#include "atomic/cond.h"
+#include "proc/pdflush.h"
+#include "proc/tcb_life.h"
 #include "driver/disk.h"
 #include "debug.h"
 
 // int hit;
 // int total; // debug
 
-struct {
+struct bcache_bucket {
     struct spinlock lock;
-    struct buffer_head buf[NBUF];
     list_head_t head;
+};
+
+struct {
+    struct spinlock lock; // protects lru, nr_buf
+    list_head_t lru;
+    struct cond wait; // all buffers are in use
+    int nr_buf;
+    int max_buf;
+    list_head_t dirty;
+    int nr_dirty;     // on dirty
+    int nr_writeback; // taken off dirty by a flusher
+    int flush_pending;
+    struct bcache_bucket bucket[BCACHE_NBUCKET];
 } bcache;
 
+static struct kmem_cache *bh_cache;
+
+// the only disk
+static struct request_queue disk_queue;
+static struct kmem_cache *request_cache;
+
+static struct buffer_head *bh_alloc(void) {
+    struct buffer_head *b;
+    if ((b = (struct buffer_head *)kmem_cache_alloc(bh_cache)) == NULL) {
+        return NULL;
+    }
+    sema_init(&b->sem_lock, 1, "buffer");
+    sema_init(&b->sem_disk_done, 0, "buffer_disk_done");
+    INIT_LIST_HEAD(&b->lru);
+    INIT_LIST_HEAD(&b->hash);
+    INIT_LIST_HEAD(&b->dirty_list);
+    atomic_set(&b->refcnt, 0);
+    b->valid = 0;
+    b->dirty = 0;
+    b->writeback = 0;
+    return b;
+}
+
 void binit(void) {
     struct buffer_head *b;
 
+    if ((bh_cache = kmem_cache_create("buffer_head", sizeof(struct buffer_head), sizeof(void *))) == NULL) {
+        panic("binit : no free memory\n");
+    }
     initlock(&bcache.lock, "bcache");
+    cond_init(&bcache.wait, "bcache_wait");
+    INIT_LIST_HEAD(&bcache.lru);
+    INIT_LIST_HEAD(&bcache.dirty);
+    bcache.nr_dirty = 0;
+    bcache.nr_writeback = 0;
+    bcache.flush_pending = 0;
+    for (int i = 0; i < BCACHE_NBUCKET; i++) {
+        initlock(&bcache.bucket[i].lock, "bcache");
+        INIT_LIST_HEAD(&bcache.bucket[i].head);
+    }
+    // no more than 1/64 of the memory
+    bcache.max_buf = MIN(NBUF_MAX, NPAGES * PGSIZE / 64 / sizeof(struct buffer_head));
+    bcache.max_buf = MAX(bcache.max_buf, NBUF);
 
-    INIT_LIST_HEAD(&bcache.head);
-    for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-        sema_init(&b->sem_lock, 1, "buffer");
-        sema_init(&b->sem_disk_done, 0, "buffer_disk_done");
-        list_add(&b->lru, &bcache.head);
+    // buffers not bound to any block yet
+    for (bcache.nr_buf = 0; bcache.nr_buf < NBUF; bcache.nr_buf++) {
+        if ((b = bh_alloc()) == NULL) {
+            panic("binit : no free memory\n");
+        }
+        b->dev = -1;
+        list_add(&b->lru, &bcache.lru);
     }
     Info("========= Information of block buffer cache ==========\n");
-    Info("number of block buffer cache : %d\n", NBUF);
+    Info("number of block buffer cache : %d, at most %d\n", NBUF, bcache.max_buf);
     Info("block buffer cache init [ok]\n");
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
-static struct buffer_head *bget(uint dev, uint blockno) {
+// caller holds the lock of bucket
+static struct buffer_head *bcache_lookup(struct bcache_bucket *bucket, uint dev, uint blockno) {
     struct buffer_head *b;
-
-    acquire(&bcache.lock);
-    // total++;// debug
-
-    // Is the block already cached?
-    list_for_each_entry(b, &bcache.head, lru) {
+    list_for_each_entry(b, &bucket->head, hash) {
         if (b->dev == dev && b->blockno == blockno) {
-            atomic_inc_return(&b->refcnt);
-            release(&bcache.lock);
-            sema_wait(&b->sem_lock);
-            // printfRed("hit : %d/%d\n",++hit, total);// debug
             return b;
         }
     }
+    return NULL;
+}
+
+static int bflush(uint64 cutoff, int nowait);
+
+// take a buffer off lru, it will be a new block
+// grow the cache if it is not full, otherwise evict the least recently used clean buffer
+// write back dirty buffers if there are none, wait if all of them are in use
+static struct buffer_head *bcache_get_free(void) {
+    struct buffer_head *b;
 
-    // Not cached.
-    // Recycle the least recently used (LRU) unused buffer.
-    list_for_each_entry_reverse(b, &bcache.head, lru) {
-        if (atomic_read(&b->refcnt) == 0) {
-            b->dev = dev;
-            b->blockno = blockno;
-            b->valid = 0;
-            atomic_set(&b->refcnt, 1);
+    acquire(&bcache.lock);
+    while (1) {
+        if (bcache.nr_buf < bcache.max_buf) {
+            bcache.nr_buf++;
+            release(&bcache.lock);
+            if ((b = bh_alloc()) != NULL) {
+                b->dev = -1;
+                return b;
+            }
+            // out of memory, fall back to eviction
+            acquire(&bcache.lock);
+            bcache.nr_buf--;
+            bcache.max_buf = bcache.nr_buf;
+        }
+        list_for_each_entry_reverse(b, &bcache.lru, lru) {
+            if (!b->dirty && !b->writeback) {
+                list_del_reinit(&b->lru);
+                release(&bcache.lock);
+                return b;
+            }
+        }
+        if (bcache.nr_dirty > 0) {
             release(&bcache.lock);
+            // the caller may hold some of them locked
+            int nr_written = bflush(-1, 1);
+            acquire(&bcache.lock);
+            if (nr_written > 0) {
+                continue;
+            }
+        }
+        cond_wait(&bcache.wait, &bcache.lock);
+    }
+}
+
+// unhash victim (taken off lru), return 0 if someone got it meanwhile
+static int bcache_unhash(struct buffer_head *b) {
+    if (b->dev == -1) {
+        return 1;
+    }
+    struct bcache_bucket *bucket = &bcache.bucket[BCACHE_HASH(b->dev, b->blockno)];
+    acquire(&bucket->lock);
+    acquire(&bcache.lock);
+    int busy = (atomic_read(&b->refcnt) != 0 || !list_empty(&b->lru));
+    release(&bcache.lock);
+    if (busy) {
+        // used (and maybe released onto lru again) meanwhile, it stays cached
+        release(&bucket->lock);
+        return 0;
+    }
+    list_del_reinit(&b->hash);
+    b->dev = -1;
+    release(&bucket->lock);
+    return 1;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+static struct buffer_head *bget(uint dev, uint blockno) {
+    struct bcache_bucket *bucket = &bcache.bucket[BCACHE_HASH(dev, blockno)];
+    struct buffer_head *b;
+    struct buffer_head *victim = NULL;
+
+    while (1) {
+        acquire(&bucket->lock);
+        // Is the block already cached?
+        if ((b = bcache_lookup(bucket, dev, blockno)) != NULL) {
+            if (atomic_inc_return(&b->refcnt) == 0) {
+                // it was unused (returns the old value)
+                acquire(&bcache.lock);
+                list_del_reinit(&b->lru);
+                release(&bcache.lock);
+            }
+            release(&bucket->lock);
+            if (victim != NULL) {
+                // lost the race for the block, victim is unbound now
+                acquire(&bcache.lock);
+                list_add_tail(&victim->lru, &bcache.lru);
+                release(&bcache.lock);
+            }
             sema_wait(&b->sem_lock);
             return b;
         }
+        if (victim != NULL) {
+            break;
+        }
+        release(&bucket->lock);
+
+        // Not cached.
+        do {
+            victim = bcache_get_free();
+        } while (!bcache_unhash(victim));
+        // look again, someone may have read it meanwhile
     }
-    panic("bget: no buffers");
+
+    b = victim;
+    b->dev = dev;
+    b->blockno = blockno;
+    b->valid = 0;
+    b->dirty = 0;
+    atomic_set(&b->refcnt, 1);
+    list_add(&b->hash, &bucket->head);
+    release(&bucket->lock);
+    sema_wait(&b->sem_lock);
+    return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -83,35 +231,229 @@ struct buffer_head *bread(uint dev, uint blockno) {
     return b;
 }
 
-// Write b's contents to disk.  Must be locked.
+// Mark b dirty, it is written back later.  Must be locked.
 void bwrite(struct buffer_head *b) {
-    b->dirty = 1;
+    acquire(&bcache.lock);
+    if (!b->dirty) {
+        b->dirty = 1;
+        b->dirtied_when = rdtime();
+        list_add_tail(&b->dirty_list, &bcache.dirty);
+        bcache.nr_dirty++;
+    }
+    release(&bcache.lock);
 }
 
-// buffer write back
+// buffer write back, now.  Must be locked.
 void bwback(struct buffer_head *b) {
-    if (b->dirty == 1) {
-        disk_rw_bio(b, DISK_WRITE);
-        b->dirty = 0;
+    acquire(&bcache.lock);
+    if (!b->dirty) {
+        release(&bcache.lock);
+        return;
     }
+    b->dirty = 0;
+    if (!list_empty(&b->dirty_list)) {
+        // otherwise a flusher has taken it, and skips it as it is clean
+        list_del_reinit(&b->dirty_list);
+        bcache.nr_dirty--;
+    }
+    release(&bcache.lock);
+    disk_rw_bio(b, DISK_WRITE);
 }
 
+static void bflush_background(uint64 unused);
+
 // Release a locked buffer.
 // Move to the head of the most-recently-used list.
 void brelse(struct buffer_head *b) {
-    if (b->dirty == 1) {
-        disk_rw_bio(b, DISK_WRITE);
-        b->dirty = 0;
-    }
+    struct bcache_bucket *bucket = &bcache.bucket[BCACHE_HASH(b->dev, b->blockno)];
+    int kick = 0;
     sema_signal(&b->sem_lock);
 
+    acquire(&bucket->lock);
+    acquire(&bcache.lock);
+    if (atomic_dec_return(&b->refcnt) == 1) {
+        // the last user
+        list_add(&b->lru, &bcache.lru);
+        cond_signal(&bcache.wait);
+    }
+    if (bcache.nr_dirty * 100 > bcache.max_buf * BDIRTY_RATIO && !bcache.flush_pending) {
+        bcache.flush_pending = kick = 1;
+    }
+    release(&bcache.lock);
+    release(&bucket->lock);
+
+    // too many dirty buffers, don't wait for the timer
+    if (kick && pdflush_operation(bflush_background, 0) < 0) {
+        acquire(&bcache.lock);
+        bcache.flush_pending = 0;
+        release(&bcache.lock);
+    }
+}
+
+// sort by (dev, blockno), the batch is small
+static void bh_sort(struct buffer_head **batch, int n) {
+    for (int i = 1; i < n; i++) {
+        struct buffer_head *b = batch[i];
+        int j = i - 1;
+        for (; j >= 0 && (batch[j]->dev > b->dev || (batch[j]->dev == b->dev && batch[j]->blockno > b->blockno)); j--) {
+            batch[j + 1] = batch[j];
+        }
+        batch[j + 1] = b;
+    }
+}
+
+// write batch[0, n) out of data, a bio_vec for every run of adjacent blocks
+// the buffers are sorted, and bio_vecs of a device go in one bio
+static void bflush_write(struct buffer_head **batch, uchar *data, int n) {
+    struct bio bio;
+    struct bio_vec *vec = NULL;
+
+    for (int i = 0; i < n; i++) {
+        struct buffer_head *b = batch[i];
+        if (i == 0 || b->dev != batch[i - 1]->dev) {
+            if (i != 0) {
+                submit_bio(&bio, 1);
+            }
+            INIT_LIST_HEAD(&bio.list_entry);
+            bio.bi_rw = DISK_WRITE;
+            bio.bi_bdev = b->dev;
+            vec = NULL;
+        }
+        if (vec != NULL && vec->blockno_start + vec->block_len == b->blockno) {
+            vec->block_len++;
+            continue;
+        }
+        if ((vec = (struct bio_vec *)kzalloc(sizeof(struct bio_vec))) == NULL) {
+            panic("bflush_write : no free memory\n");
+        }
+        vec->blockno_start = b->blockno;
+        vec->block_len = 1;
+        vec->data = data + i * BSIZE;
+        vec->pages = NULL;
+        list_add_tail(&vec->list, &bio.list_entry);
+    }
+    submit_bio(&bio, 1);
+}
+
+// write back at most BFLUSH_BATCH dirty buffers dirtied no later than cutoff
+// nowait : skip the locked ones, the caller may hold some of them
+// return the number of buffers cleaned (written, or found clean)
+static int bflush(uint64 cutoff, int nowait) {
+    struct buffer_head *batch[BFLUSH_BATCH];
+    struct buffer_head *b = NULL;
+    struct buffer_head *b_tmp = NULL;
+    uchar *data;
+    int n = 0;
+    int m = 0;
+    int nr_skipped = 0;
+
     acquire(&bcache.lock);
-    atomic_dec_return(&b->refcnt);
-    if (atomic_read(&b->refcnt) == 0) {
-        list_del(&b->lru);
-        list_add(&b->lru, &bcache.head);
+    list_for_each_entry_safe(b, b_tmp, &bcache.dirty, dirty_list) {
+        if (n == BFLUSH_BATCH || b->dirtied_when > cutoff) {
+            break;
+        }
+        list_del_reinit(&b->dirty_list);
+        bcache.nr_dirty--;
+        b->writeback = 1;
+        bcache.nr_writeback++;
+        batch[n++] = b;
+    }
+    release(&bcache.lock);
+    if (n == 0) {
+        return 0;
+    }
+    if ((data = (uchar *)kmalloc(n * BSIZE)) == NULL) {
+        panic("bflush : no free memory\n");
+    }
+    bh_sort(batch, n);
+
+    // copy them out, and they are clean from now on
+    for (int i = 0; i < n; i++) {
+        b = batch[i];
+        int locked = 1;
+        if (nowait) {
+            locked = sema_trywait(&b->sem_lock);
+        } else {
+            sema_wait(&b->sem_lock);
+        }
+        acquire(&bcache.lock);
+        if (locked && b->dirty) {
+            memmove(data + m * BSIZE, b->data, BSIZE);
+            b->dirty = 0;
+            batch[m++] = b;
+        } else {
+            if (!locked) {
+                // dirty still, try it next time
+                list_add(&b->dirty_list, &bcache.dirty);
+                bcache.nr_dirty++;
+                nr_skipped++;
+            }
+            b->writeback = 0;
+            bcache.nr_writeback--;
+        }
+        release(&bcache.lock);
+        if (locked) {
+            sema_signal(&b->sem_lock);
+        }
+    }
+
+    if (m > 0) {
+        bflush_write(batch, data, m);
+    }
+    kfree(data);
+
+    // they can be evicted now
+    acquire(&bcache.lock);
+    for (int i = 0; i < m; i++) {
+        batch[i]->writeback = 0;
+    }
+    bcache.nr_writeback -= m;
+    cond_broadcast(&bcache.wait);
+    release(&bcache.lock);
+    return n - nr_skipped;
+}
+
+// write back the expired buffers, and more until the dirty ones are below BDIRTY_RATIO
+// all : write back all of them dirtied so far
+void bcache_writeback(uint64 all) {
+    uint64 expire = BDIRTY_EXPIRE_MS * (FREQUENCY / 1000);
+    uint64 now = rdtime();
+    uint64 cutoff = now;
+
+    if (!all) {
+        cutoff = (now > expire ? now - expire : 0);
+    }
+    while (bflush(cutoff, 0) > 0)
+        ;
+    if (all) {
+        return;
     }
+    while (1) {
+        acquire(&bcache.lock);
+        int over = (bcache.nr_dirty * 100 > bcache.max_buf * BDIRTY_RATIO);
+        release(&bcache.lock);
+        if (!over || bflush(-1, 0) == 0) {
+            break;
+        }
+    }
+}
 
+// pdflush work, kicked by brelse
+static void bflush_background(uint64 unused) {
+    bcache_writeback(0);
+    acquire(&bcache.lock);
+    bcache.flush_pending = 0;
+    release(&bcache.lock);
+}
+
+// barrier : all buffers dirtied before it are on the disk once it returns
+void bsync(void) {
+    bcache_writeback(1);
+    // wait for the other flushers
+    acquire(&bcache.lock);
+    while (bcache.nr_writeback > 0) {
+        cond_wait(&bcache.wait, &bcache.lock);
+    }
     release(&bcache.lock);
 }
 
@@ -132,31 +474,370 @@ void init_bio(struct bio *bio_p, struct bio_vec *vec_p, struct buffer_head *b, i
     bio_p->bi_bdev = b->dev;
 
     // bio_vec
-    sema_init(&vec_p->sem_disk_done, 0, "bio_disk_done"); // vec_p ！！！
     INIT_LIST_HEAD(&vec_p->list);
     vec_p->blockno_start = b->blockno;
     vec_p->block_len = 1;
     vec_p->data = b->data;
-    vec_p->disk = b->disk;
+    vec_p->pages = NULL;
+    vec_p->offset = 0;
 
     // join bio_vec to bio (don't forget it)
     list_add_tail(&vec_p->list, &bio_p->list_entry);
     // bug like this : list_add_tail(&bio_p->list_entr, &vec_p->list);
 }
 
-// read or write
-// free bio_vec, if necessary
-void submit_bio(struct bio *bio, int free) {
+void blk_init(void) {
+    struct request_queue *q = &disk_queue;
+
+    if ((request_cache = kmem_cache_create("blk_request", sizeof(struct request), sizeof(void *))) == NULL) {
+        panic("blk_init : no free memory\n");
+    }
+    initlock(&q->lock, "disk_queue");
+    INIT_LIST_HEAD(&q->sort_list);
+    INIT_LIST_HEAD(&q->fifo_list[DISK_READ]);
+    INIT_LIST_HEAD(&q->fifo_list[DISK_WRITE]);
+    q->nr_queued = 0;
+    q->requeue = NULL;
+    q->head_pos = 0;
+    q->seq = 0;
+    q->dispatching = 0;
+    q->rerun = 0;
+    Info("block request queue init [ok]\n");
+}
+
+struct request_queue *bdev_get_queue(uint dev) {
+    return &disk_queue;
+}
+
+// the disk is done with vec
+static void bio_vec_endio(struct bio_vec *vec) {
+    struct bio *bio = vec->bio;
+    // the last one, bi_end_io may free the bio
+    if (atomic_dec_return(&bio->bi_remaining) == 1) {
+        bio->bi_end_io(bio);
+    }
+}
+
+static inline int rq_overlap(struct request *rq, uint blockno_start, uint block_len) {
+    return rq->blockno_start < blockno_start + block_len && blockno_start < rq->blockno_start + rq->block_len;
+}
+
+// caller holds q->lock
+// merge vec into a queued request which it is contiguous with, return 1 if merged
+static int elv_merge(struct request_queue *q, struct bio_vec *vec, int rw) {
+    struct request *rq;
+    int nr_segs = bio_vec_nr_segs(vec);
+
+    // merged, it would take the place of an older request, maybe ahead of one on its blocks
+    list_for_each_entry(rq, &q->sort_list, queuelist) {
+        if (rq_overlap(rq, vec->blockno_start, vec->block_len)) {
+            return 0;
+        }
+    }
+    list_for_each_entry(rq, &q->sort_list, queuelist) {
+        if (rq->rw != rw || rq->nr_segs + nr_segs > BLK_MAX_SEGS) {
+            continue;
+        }
+        if (rq->blockno_start + rq->block_len == vec->blockno_start) {
+            // back merge
+            rq->vec_tail->bi_next = vec;
+            rq->vec_tail = vec;
+        } else if (vec->blockno_start + vec->block_len == rq->blockno_start) {
+            // front merge, still in order: nothing is queued between them
+            vec->bi_next = rq->vec_head;
+            rq->vec_head = vec;
+            rq->blockno_start = vec->blockno_start;
+        } else {
+            continue;
+        }
+        rq->block_len += vec->block_len;
+        rq->nr_segs += nr_segs;
+        return 1;
+    }
+    return 0;
+}
+
+// caller holds q->lock
+static void elv_add_request(struct request_queue *q, struct request *rq) {
+    struct request *pos;
+    list_for_each_entry(pos, &q->sort_list, queuelist) {
+        if (pos->blockno_start > rq->blockno_start) {
+            break;
+        }
+    }
+    // before pos, or at the tail
+    list_add_tail(&rq->queuelist, &pos->queuelist);
+    list_add_tail(&rq->fifo, &q->fifo_list[rq->rw]);
+    rq->seq = q->seq++;
+    q->nr_queued++;
+}
+
+// caller holds q->lock
+// deadline: an expired request first (reads before writes),
+// otherwise the next one in ascending block order, wrap around at the end
+static struct request *elv_next_request(struct request_queue *q) {
+    struct request *rq = NULL;
+    struct request *pos;
+    uint64 now = rdtime();
+
+    if (q->nr_queued == 0) {
+        return NULL;
+    }
+    for (int rw = DISK_READ; rw <= DISK_WRITE; rw++) {
+        if (!list_empty(&q->fifo_list[rw])) {
+            pos = list_first_entry(&q->fifo_list[rw], struct request, fifo);
+            if (now >= pos->deadline) {
+                rq = pos;
+                break;
+            }
+        }
+    }
+    if (rq == NULL) {
+        list_for_each_entry(pos, &q->sort_list, queuelist) {
+            if (pos->blockno_start >= q->head_pos) {
+                rq = pos;
+                break;
+            }
+        }
+    }
+    if (rq == NULL) {
+        rq = list_first_entry(&q->sort_list, struct request, queuelist);
+    }
+    // the oldest one on its blocks goes first
+    struct request *older;
+    do {
+        older = NULL;
+        list_for_each_entry(pos, &q->sort_list, queuelist) {
+            if (pos->seq < (older ? older : rq)->seq && rq_overlap(pos, rq->blockno_start, rq->block_len)) {
+                older = pos;
+            }
+        }
+        if (older != NULL) {
+            rq = older;
+        }
+    } while (older != NULL);
+
+    list_del(&rq->queuelist);
+    list_del(&rq->fifo);
+    q->nr_queued--;
+    q->head_pos = rq->blockno_start + rq->block_len;
+    return rq;
+}
+
+// queue vec, as a new request or merged into a queued one
+static void blk_queue_vec(struct request_queue *q, struct bio_vec *vec, int rw) {
+    struct request *rq;
+
+    // allocate it before taking the lock, the allocator may reclaim memory
+    if ((rq = (struct request *)kmem_cache_alloc(request_cache)) == NULL) {
+        panic("blk_queue_vec : no free memory\n");
+    }
+    vec->bi_next = NULL;
+
+    acquire(&q->lock);
+    if (elv_merge(q, vec, rw)) {
+        release(&q->lock);
+        kmem_cache_free(request_cache, rq);
+        return;
+    }
+    rq->q = q;
+    rq->rw = rw;
+    rq->blockno_start = vec->blockno_start;
+    rq->block_len = vec->block_len;
+    rq->nr_segs = bio_vec_nr_segs(vec);
+    rq->deadline = rdtime() + (rw == DISK_READ ? READ_EXPIRE_MS : WRITE_EXPIRE_MS) * (FREQUENCY / 1000);
+    rq->vec_head = vec;
+    rq->vec_tail = vec;
+    elv_add_request(q, rq);
+    release(&q->lock);
+}
+
+// dispatch requests to the disk, until the queue is empty or the disk is busy
+// it doesn't look at the plug, that is for the submitters
+void blk_run_queue(struct request_queue *q) {
+    struct request *rq;
+
+    acquire(&q->lock);
+    if (q->dispatching) {
+        // the dispatcher looks at the queue again before it leaves
+        q->rerun = 1;
+        release(&q->lock);
+        return;
+    }
+    q->dispatching = 1;
+    do {
+        q->rerun = 0;
+        while (1) {
+            if ((rq = q->requeue) != NULL) {
+                q->requeue = NULL;
+            } else if ((rq = elv_next_request(q)) == NULL) {
+                break;
+            }
+            release(&q->lock);
+            int busy = (disk_submit(rq) < 0);
+            acquire(&q->lock);
+            if (busy) {
+                // dispatched again once a request completes
+                q->requeue = rq;
+                break;
+            }
+        }
+    } while (q->rerun);
+    q->dispatching = 0;
+    release(&q->lock);
+}
+
+// the disk is done with rq, maybe in interrupt context
+void blk_end_request(struct request *rq) {
+    struct request_queue *q = rq->q;
+    struct bio_vec *vec = rq->vec_head;
+
+    while (vec != NULL) {
+        struct bio_vec *next = vec->bi_next;
+        bio_vec_endio(vec);
+        vec = next;
+    }
+    kmem_cache_free(request_cache, rq);
+    // the disk has room now
+    blk_run_queue(q);
+}
+
+// hold the requests the caller queues, so that the ones it submits later can be merged and sorted with them
+// the plug of a thread doesn't hold those of the others
+void blk_start_plug(struct request_queue *q) {
+    struct tcb *t = thread_current();
+    if (t != NULL) {
+        t->plug_depth++;
+    }
+}
+
+void blk_finish_plug(struct request_queue *q) {
+    struct tcb *t = thread_current();
+    if (t != NULL) {
+        ASSERT(t->plug_depth > 0);
+        if (--t->plug_depth > 0) {
+            return;
+        }
+    }
+    blk_run_queue(q);
+}
+
+// queue all bio_vecs of the bio, and return before the I/O completes
+// bio->bi_end_io is called once all of them are done
+void submit_bio_async(struct bio *bio) {
+    struct request_queue *q = bdev_get_queue(bio->bi_bdev);
+    struct bio_vec *vec_cur = NULL;
+    struct bio_vec *vec_tmp = NULL;
+    int n = 0;
+
+    list_for_each_entry(vec_cur, &bio->list_entry, list) {
+        vec_cur->bio = bio;
+        n++;
+    }
+    if (n == 0) {
+        bio->bi_end_io(bio);
+        return;
+    }
+    atomic_set(&bio->bi_remaining, n);
+    blk_start_plug(q);
+    // don't touch the bio after the last bio_vec is queued, it may be completed already
+    list_for_each_entry_safe(vec_cur, vec_tmp, &bio->list_entry, list) {
+        blk_queue_vec(q, vec_cur, bio->bi_rw);
+    }
+    blk_finish_plug(q);
+}
+
+void bio_free_vecs(struct bio *bio) {
     struct bio_vec *vec_cur = NULL;
     struct bio_vec *vec_tmp = NULL;
     list_for_each_entry_safe(vec_cur, vec_tmp, &bio->list_entry, list) {
-        // virtio_disk_rw((void *)vec_cur, bio->bi_rw, BLOCK_SEL);
-        disk_rw((void *)vec_cur, bio->bi_rw, BLOCK_SEL);
-        if (free) {
-            kfree(vec_cur);
-            // printfGreen("submit_bio, mm ++: %d pages\n", get_free_mem() / PGSIZE);
+        list_del(&vec_cur->list);
+        kfree(vec_cur);
+        // printfGreen("submit_bio, mm ++: %d pages\n", get_free_mem() / PGSIZE);
+    }
+}
+
+static void bio_end_sync(struct bio *bio) {
+    sema_signal((struct semaphore *)bio->bi_private);
+}
+
+// read or write, and wait for it
+// free bio_vec, if necessary
+void submit_bio(struct bio *bio, int free) {
+    struct request_queue *q = bdev_get_queue(bio->bi_bdev);
+    struct semaphore done;
+
+    sema_init(&done, 0, "bio_done");
+    bio->bi_end_io = bio_end_sync;
+    bio->bi_private = &done;
+    submit_bio_async(bio);
+    // the caller may be plugged itself, don't wait for its plug
+    blk_run_queue(q);
+    sema_wait(&done);
+
+    if (free) {
+        bio_free_vecs(bio);
+    }
+}
+
+// point vec at its data, which starts at offset of pages[0]
+// the pages contiguous in memory are a single buffer, otherwise vec is a scatter-gather one,
+// and the part beyond BIO_MAX_SEGS pages is split into a new bio_vec right behind it
+void bio_vec_map_pages(struct bio_vec *vec, uint64 *pages, uint offset) {
+    uint64 len = (uint64)vec->block_len * BSIZE;
+    int nr = (offset + len + PGSIZE - 1) / PGSIZE;
+    int contig = 1;
+
+    for (int i = 1; i < nr; i++) {
+        if (pages[i] != pages[0] + i * PGSIZE) {
+            contig = 0;
+            break;
+        }
+    }
+    if (contig) {
+        vec->data = (uchar *)(pages[0] + offset);
+        vec->pages = NULL;
+        vec->offset = 0;
+        return;
+    }
+
+    if (nr > BIO_MAX_SEGS) {
+        uint head = (BIO_MAX_SEGS * PGSIZE - offset) / BSIZE;
+        struct bio_vec *tail;
+        if ((tail = (struct bio_vec *)kzalloc(sizeof(struct bio_vec))) == NULL) {
+            panic("bio_vec_map_pages : no free memory\n");
         }
+        INIT_LIST_HEAD(&tail->list);
+        tail->blockno_start = vec->blockno_start + head;
+        tail->block_len = vec->block_len - head;
+        vec->block_len = head;
+        list_add(&tail->list, &vec->list);
+    }
+    vec->data = NULL;
+    vec->pages = pages;
+    vec->offset = offset;
+}
+
+// the number of data segments of vec
+int bio_vec_nr_segs(struct bio_vec *vec) {
+    if (vec->pages == NULL) {
+        return 1;
+    }
+    return (vec->offset + (uint64)vec->block_len * BSIZE + PGSIZE - 1) / PGSIZE;
+}
+
+// the i-th data segment of vec, return its length
+uint bio_vec_seg(struct bio_vec *vec, int i, uint64 *addr) {
+    uint64 len = (uint64)vec->block_len * BSIZE;
+    if (vec->pages == NULL) {
+        ASSERT(i == 0);
+        *addr = (uint64)vec->data;
+        return len;
     }
+    uint64 start = (i == 0 ? vec->offset : 0);
+    uint64 done = (i == 0 ? 0 : i * PGSIZE - vec->offset);
+    *addr = vec->pages[i] + start;
+    return MIN(PGSIZE - start, len - done);
 }
 
 // debug
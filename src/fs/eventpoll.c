@@ -0,0 +1,439 @@
+#include "common.h"
+#include "errno.h"
+#include "kernel/syscall.h"
+#include "kernel/trap.h"
+#include "memory/allocator.h"
+#include "proc/pcb_life.h"
+#include "proc/tcb_life.h"
+#include "fs/vfs/fs.h"
+#include "fs/vfs/ops.h"
+#include "fs/eventpoll.h"
+#include "lib/poll.h"
+#include "debug.h"
+
+// epoll : every item sits on the wait queue of its file, ep_poll_callback() puts it
+// on the ready list, so epoll_pwait only looks at the files that had events
+//
+// locks : epmutex -> ep->mtx -> the wait queue of a file -> ep->lock
+// epmutex serializes the changes of the sets (and f_ep_links), ep->mtx the transfer of events
+
+#define EP_MAX_NESTS 4 // epoll in epoll in ...
+
+extern int fdalloc(struct file *f);
+
+static struct semaphore epmutex;
+
+void eventpoll_init(void) {
+    sema_init(&epmutex, 1, "epmutex");
+}
+
+static int ep_cmp(struct file *file, int fd, struct epitem *epi) {
+    if (file != epi->file)
+        return file < epi->file ? -1 : 1;
+    return fd - epi->fd;
+}
+
+static struct epitem *ep_find(struct eventpoll *ep, struct file *file, int fd) {
+    struct rb_node *rbp = ep->rbr.rb_node;
+
+    while (rbp) {
+        struct epitem *epi = rb_entry(rbp, struct epitem, rbn);
+        int cmp = ep_cmp(file, fd, epi);
+
+        if (cmp == 0)
+            return epi;
+        rbp = cmp < 0 ? rbp->rb_left : rbp->rb_right;
+    }
+    return NULL;
+}
+
+static void ep_rbtree_insert(struct eventpoll *ep, struct epitem *epi) {
+    struct rb_node **link = &ep->rbr.rb_node, *parent = NULL;
+
+    while (*link) {
+        parent = *link;
+        if (ep_cmp(epi->file, epi->fd, rb_entry(parent, struct epitem, rbn)) < 0)
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+    rb_link_node(&epi->rbn, parent, link);
+    rb_insert_color(&epi->rbn, &ep->rbr);
+}
+
+// with ep->lock held, return 1 if it went on the ready list
+static int ep_item_ready(struct eventpoll *ep, struct epitem *epi) {
+    if (epi->ready) {
+        // on the ready list already, or being transferred : look at it again afterwards
+        epi->rewake = 1;
+        return 0;
+    }
+    epi->ready = 1;
+    list_add_tail(&epi->rdllink, &ep->rdllist);
+    return 1;
+}
+
+// the file of epi had an event, called with its wait queue locked
+static int ep_poll_callback(struct wait_queue_entry *wait, uint key) {
+    struct epitem *epi = wait->private;
+    struct eventpoll *ep = epi->ep;
+    int woken;
+
+    acquire(&ep->lock);
+    // disabled by EPOLLONESHOT, or not an event it waits for
+    if (!(epi->event.events & ~EP_PRIVATE_BITS) || (key && !(key & epi->event.events))) {
+        release(&ep->lock);
+        return 0;
+    }
+    woken = ep_item_ready(ep, epi);
+    release(&ep->lock);
+    if (woken)
+        wake_up_poll(&ep->wq, POLLIN | POLLRDNORM);
+    return 1;
+}
+
+struct ep_pqueue {
+    poll_table pt;
+    struct epitem *epi;
+};
+
+// the files here have a single wait queue
+static void ep_ptable_queue_proc(struct file *file, struct wait_queue_head *whead, poll_table *pt) {
+    struct epitem *epi = container_of(pt, struct ep_pqueue, pt)->epi;
+
+    if (epi->whead)
+        return;
+    epi->wait.func = ep_poll_callback;
+    epi->wait.private = epi;
+    epi->whead = whead;
+    add_wait_queue(whead, &epi->wait);
+}
+
+static void ep_queue_if_ready(struct eventpoll *ep, struct epitem *epi, uint revents) {
+    int woken;
+
+    if (!revents)
+        return;
+    acquire(&ep->lock);
+    woken = ep_item_ready(ep, epi);
+    release(&ep->lock);
+    if (woken)
+        wake_up_poll(&ep->wq, POLLIN | POLLRDNORM);
+}
+
+// with epmutex and ep->mtx held
+static int ep_insert(struct eventpoll *ep, struct epoll_event *event, struct file *file, int fd) {
+    struct ep_pqueue epq;
+    struct epitem *epi;
+    uint revents;
+
+    if ((epi = (struct epitem *)kzalloc(sizeof(struct epitem))) == NULL)
+        return -ENOMEM;
+    INIT_LIST_HEAD(&epi->rdllink);
+    INIT_LIST_HEAD(&epi->fllink);
+    INIT_LIST_HEAD(&epi->wait.entry);
+    epi->ep = ep;
+    epi->file = file;
+    epi->fd = fd;
+    epi->event = *event;
+    ep_rbtree_insert(ep, epi);
+    list_add_tail(&epi->fllink, &file->f_ep_links);
+
+    epq.epi = epi;
+    epq.pt.qproc = ep_ptable_queue_proc;
+    epq.pt.key = event->events;
+    revents = vfs_poll(file, &epq.pt) & event->events;
+    ep_queue_if_ready(ep, epi, revents);
+    return 0;
+}
+
+// with epmutex and ep->mtx held
+static int ep_modify(struct eventpoll *ep, struct epitem *epi, struct epoll_event *event) {
+    acquire(&ep->lock);
+    epi->event = *event;
+    release(&ep->lock);
+    ep_queue_if_ready(ep, epi, vfs_poll(epi->file, NULL) & event->events);
+    return 0;
+}
+
+// with epmutex and ep->mtx held
+static void ep_remove(struct eventpoll *ep, struct epitem *epi) {
+    // no callback runs on it after this
+    if (epi->whead)
+        remove_wait_queue(epi->whead, &epi->wait);
+    list_del_reinit(&epi->fllink);
+    acquire(&ep->lock);
+    if (epi->ready)
+        list_del_reinit(&epi->rdllink);
+    release(&ep->lock);
+    rb_erase(&epi->rbn, &ep->rbr);
+    kfree(epi);
+}
+
+// with ep->mtx held : the events of the ready items into kevents
+// level triggered items go back on the ready list, they are checked again next time
+static int ep_send_events(struct eventpoll *ep, struct epoll_event *kevents, int maxevents) {
+    struct list_head txlist;
+    struct epitem *epi, *tmp;
+    int n = 0;
+
+    INIT_LIST_HEAD(&txlist);
+    acquire(&ep->lock);
+    list_splice(&ep->rdllist, &txlist);
+    INIT_LIST_HEAD(&ep->rdllist);
+    release(&ep->lock);
+
+    // the files are polled without ep->lock, the callbacks only set rewake meanwhile
+    list_for_each_entry_safe(epi, tmp, &txlist, rdllink) {
+        uint revents;
+        int requeue = 0;
+
+        if (n >= maxevents)
+            break;
+        revents = vfs_poll(epi->file, NULL) & epi->event.events;
+
+        acquire(&ep->lock);
+        list_del_reinit(&epi->rdllink);
+        if (revents) {
+            kevents[n].events = revents;
+            kevents[n].data = epi->event.data;
+            n++;
+            if (epi->event.events & EPOLLONESHOT)
+                epi->event.events &= EP_PRIVATE_BITS;
+            else if (!(epi->event.events & EPOLLET))
+                requeue = 1;
+        }
+        if (requeue || epi->rewake)
+            list_add_tail(&epi->rdllink, &ep->rdllist);
+        else
+            epi->ready = 0;
+        epi->rewake = 0;
+        release(&ep->lock);
+    }
+
+    // what didn't fit stays ready, in front
+    acquire(&ep->lock);
+    list_splice(&txlist, &ep->rdllist);
+    release(&ep->lock);
+    return n;
+}
+
+uint ep_eventpoll_poll(struct file *f, poll_table *pt) {
+    struct eventpoll *ep = f->f_tp.f_ep;
+    uint mask = 0;
+
+    poll_wait(f, &ep->wq, pt);
+    acquire(&ep->lock);
+    if (!list_empty(&ep->rdllist))
+        mask = POLLIN | POLLRDNORM;
+    release(&ep->lock);
+    return mask;
+}
+
+void eventpoll_release(struct file *f) {
+    struct epitem *epi;
+    struct eventpoll *ep;
+
+    sema_wait(&epmutex);
+    while (!list_empty(&f->f_ep_links)) {
+        epi = list_first_entry(&f->f_ep_links, struct epitem, fllink);
+        ep = epi->ep;
+        sema_wait(&ep->mtx);
+        ep_remove(ep, epi);
+        sema_signal(&ep->mtx);
+    }
+    sema_signal(&epmutex);
+}
+
+void ep_free(struct eventpoll *ep) {
+    struct rb_node *rbp;
+
+    sema_wait(&epmutex);
+    sema_wait(&ep->mtx);
+    while ((rbp = rb_first(&ep->rbr)) != NULL) {
+        ep_remove(ep, rb_entry(rbp, struct epitem, rbn));
+    }
+    sema_signal(&ep->mtx);
+    sema_signal(&epmutex);
+    kfree(ep);
+}
+
+// with epmutex held, return 1 if ep can be reached from the set of to
+static int ep_loop_check(struct eventpoll *ep, struct eventpoll *to, int depth) {
+    struct rb_node *rbp;
+
+    if (depth > EP_MAX_NESTS)
+        return 1;
+    for (rbp = rb_first(&to->rbr); rbp; rbp = rb_next(rbp)) {
+        struct epitem *epi = rb_entry(rbp, struct epitem, rbn);
+
+        if (epi->file->f_type != FD_EPOLL)
+            continue;
+        if (epi->file->f_tp.f_ep == ep || ep_loop_check(ep, epi->file->f_tp.f_ep, depth + 1))
+            return 1;
+    }
+    return 0;
+}
+
+// int epoll_create1(int flags);
+// close-on-exec is not supported by the fd table, EPOLL_CLOEXEC is accepted and ignored
+uint64 sys_epoll_create1(void) {
+    struct eventpoll *ep;
+    struct file *f;
+    int flags, fd;
+
+    argint(0, &flags);
+    if (flags & ~EPOLL_CLOEXEC)
+        return -EINVAL;
+
+    if ((ep = (struct eventpoll *)kzalloc(sizeof(struct eventpoll))) == NULL)
+        return -ENOMEM;
+    sema_init(&ep->mtx, 1, "ep_mtx");
+    initlock(&ep->lock, "ep_lock");
+    INIT_LIST_HEAD(&ep->rdllist);
+    ep->rbr = RB_ROOT;
+    init_waitqueue_head(&ep->wq, "ep_wq");
+
+    if ((f = filealloc(proc_current()->cwd->fs_type)) == 0) {
+        kfree(ep);
+        return -ENFILE;
+    }
+    f->f_type = FD_EPOLL;
+    f->f_flags = O_RDWR;
+    f->f_tp.f_ep = ep;
+    if ((fd = fdalloc(f)) < 0) {
+        generic_fileclose(f);
+        return -EMFILE;
+    }
+    return fd;
+}
+
+// int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+uint64 sys_epoll_ctl(void) {
+    struct file *ef, *tf;
+    struct eventpoll *ep;
+    struct epitem *epi;
+    struct epoll_event event;
+    uint64 uevent;
+    int op, fd, error;
+
+    if (argfd(0, 0, &ef) < 0)
+        return -EBADF;
+    argint(1, &op);
+    if (argfd(2, &fd, &tf) < 0)
+        return -EBADF;
+    argaddr(3, &uevent);
+
+    if (op != EPOLL_CTL_DEL && copyin(proc_current()->mm->pagetable, (char *)&event, uevent, sizeof(event)) < 0)
+        return -EFAULT;
+    if (ef->f_type != FD_EPOLL || ef == tf)
+        return -EINVAL;
+    // regular files and directories are always ready
+    if (tf->f_type == FD_INODE)
+        return -EPERM;
+    ep = ef->f_tp.f_ep;
+
+    sema_wait(&epmutex);
+    if (op == EPOLL_CTL_ADD && tf->f_type == FD_EPOLL && ep_loop_check(ep, tf->f_tp.f_ep, 0)) {
+        sema_signal(&epmutex);
+        return -ELOOP;
+    }
+    sema_wait(&ep->mtx);
+    epi = ep_find(ep, tf, fd);
+    error = -EINVAL;
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        if (epi) {
+            error = -EEXIST;
+            break;
+        }
+        event.events |= EPOLLERR | EPOLLHUP;
+        error = ep_insert(ep, &event, tf, fd);
+        break;
+    case EPOLL_CTL_DEL:
+        if (!epi) {
+            error = -ENOENT;
+            break;
+        }
+        ep_remove(ep, epi);
+        error = 0;
+        break;
+    case EPOLL_CTL_MOD:
+        if (!epi) {
+            error = -ENOENT;
+            break;
+        }
+        event.events |= EPOLLERR | EPOLLHUP;
+        error = ep_modify(ep, epi, &event);
+        break;
+    }
+    sema_signal(&ep->mtx);
+    sema_signal(&epmutex);
+    return error;
+}
+
+// int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask);
+// timeout : ms, -1 waits forever
+uint64 sys_epoll_pwait(void) {
+    struct poll_wqueues table;
+    struct file *f;
+    struct eventpoll *ep;
+    struct epoll_event *kevents;
+    uint64 uevents, usigmask, deadline = 0;
+    int maxevents, timeout, timed_out = 0, n, r;
+    sigset_t saved;
+
+    if (argfd(0, 0, &f) < 0)
+        return -EBADF;
+    argaddr(1, &uevents);
+    argint(2, &maxevents);
+    argint(3, &timeout);
+    argaddr(4, &usigmask);
+
+    if (maxevents <= 0 || f->f_type != FD_EPOLL)
+        return -EINVAL;
+    ep = f->f_tp.f_ep;
+    maxevents = MIN(maxevents, EP_MAX_BATCH);
+    if (timeout == 0)
+        timed_out = 1;
+    else if (timeout > 0)
+        deadline = TIME2NS(rdtime()) + timeout * 1000000UL;
+
+    if ((kevents = (struct epoll_event *)kmalloc(maxevents * sizeof(struct epoll_event))) == NULL)
+        return -ENOMEM;
+    if ((n = poll_set_sigmask(usigmask, &saved)) < 0) {
+        kfree(kevents);
+        return n;
+    }
+
+    poll_initwait(&table);
+    for (;;) {
+        sema_wait(&ep->mtx);
+        n = ep_send_events(ep, kevents, maxevents);
+        sema_signal(&ep->mtx);
+        if (n || timed_out)
+            break;
+        if (table.pt.qproc) {
+            // on ep->wq now, look once more before sleeping
+            poll_wait(f, &ep->wq, &table.pt);
+            table.pt.qproc = NULL;
+            continue;
+        }
+        if (table.error) {
+            n = table.error;
+            break;
+        }
+        if ((r = poll_schedule_timeout(&table, deadline)) < 0) {
+            n = r;
+            break;
+        }
+        timed_out = (r == 0);
+    }
+    poll_freewait(&table);
+    poll_restore_sigmask(usigmask, &saved);
+
+    if (n > 0 && copyout(proc_current()->mm->pagetable, uevents, (char *)kevents, n * sizeof(struct epoll_event)) < 0)
+        n = -EFAULT;
+    kfree(kevents);
+    return n;
+}
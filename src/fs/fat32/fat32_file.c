@@ -15,6 +15,11 @@
 #include "fs/fat/fat32_stack.h"
 #include "fs/fat/fat32_file.h"
 #include "memory/allocator.h"
+#include "memory/slab.h"
+#include "driver/console.h"
+#include "fs/eventpoll.h"
+#include "ipc/socket.h"
+#include "lib/poll.h"
 
 extern uint64 socket_write(struct socket *sock, vaddr_t addr, int len);
 extern uint64 socket_read(struct socket *sock, vaddr_t addr, int len);
@@ -24,18 +29,18 @@ int pid_debug_2 = 11;
 // #define _O_READ              (~O_WRONLY)
 // #define _O_WRITE             (O_WRONLY | O_RDWR | O_CREATE |)
 void fileinit(void) {
-    initlock(&_ftable.lock, "_ftable");
+    if ((file_cachep = kmem_cache_create("file", sizeof(struct file), sizeof(void *))) == NULL) {
+        panic("fileinit: no file cache");
+    }
+    eventpoll_init();
 }
 
 // Increment ref count for file f.
 // 语义：将 f 指向的 file 文件的引用次数自增，并返回该指针
-// 实现：给 _ftable 加锁后，f->f_count++
+// 实现：原子地 f->f_count++
 struct file *fat32_filedup(struct file *f) {
-    acquire(&_ftable.lock);
-    if (f->f_count < 1)
+    if (atomic_inc_return(&f->f_count) < 1)
         panic("filedup");
-    f->f_count++;
-    release(&_ftable.lock);
     return f;
 }
 
@@ -79,7 +84,7 @@ ssize_t fat32_fileread(struct file *f, uint64 addr, int n) {
 #ifdef __DEBUG_PIPE__
         pipe_r_cnt += 1;
         if(pipe_r_cnt % 1000==0)
-        printfGreen("read pipe : pid : %d, read %d chars -> pipe file (%d) starting from %d\n", proc_current()->pid, r, f->f_tp.f_pipe, f->f_tp.f_pipe->nread - r);
+        printfGreen("read pipe : pid : %d, read %d chars -> pipe file (%d) at slot %d\n", proc_current()->pid, r, f->f_tp.f_pipe, f->f_tp.f_pipe->tail);
 #endif
     } else if (f->f_type == FD_DEVICE) {
         if (f->f_major < 0 || f->f_major >= NDEV || !devsw[f->f_major].read)
@@ -109,6 +114,8 @@ ssize_t fat32_fileread(struct file *f, uint64 addr, int n) {
 #endif
     } else if (f->f_type == FD_SOCKET) {
         r = socket_read(f->f_tp.f_sock, addr, n);
+    } else if (f->f_type == FD_EPOLL) {
+        return -1;
     } else {
         panic("fileread");
     }
@@ -134,7 +141,7 @@ ssize_t fat32_filewrite(struct file *f, uint64 addr, int n) {
 #ifdef __DEBUG_PIPE__
         pipe_w_cnt += 1;
         if(pipe_w_cnt % 1000==0)
-        printfYELLOW("write pipe: pid : %d, write %d chars -> pipe file (%d) starting from %d\n", proc_current()->pid, ret, f->f_tp.f_pipe, f->f_tp.f_pipe->nwrite - ret);
+        printfYELLOW("write pipe: pid : %d, write %d chars -> pipe file (%d) at slot %d\n", proc_current()->pid, ret, f->f_tp.f_pipe, f->f_tp.f_pipe->head);
 #endif
     } else if (f->f_type == FD_DEVICE) {
         // special for dev_cpu_dma_latency?
@@ -193,6 +200,8 @@ ssize_t fat32_filewrite(struct file *f, uint64 addr, int n) {
 #endif
     } else if (f->f_type == FD_SOCKET) {
         ret = socket_write(f->f_tp.f_sock, addr, n);
+    } else if (f->f_type == FD_EPOLL) {
+        return -1;
     } else {
         // panic("filewrite");
         if (!f->is_shm_file) {
@@ -203,6 +212,27 @@ ssize_t fat32_filewrite(struct file *f, uint64 addr, int n) {
     return ret;
 }
 
+// the events of file f that are ready now, and the wait queues of them for pt
+// regular files and the other devices never block
+uint fat32_filepoll(struct file *f, poll_table *pt) {
+    switch (f->f_type) {
+    case FD_PIPE:
+        return pipe_poll(f, pt);
+    case FD_SOCKET:
+        return socket_poll(f, pt);
+    case FD_EPOLL:
+        return ep_eventpoll_poll(f, pt);
+    case FD_DEVICE:
+        if (f->f_major == CONSOLE)
+            return console_poll(f, pt);
+        return DEFAULT_POLLMASK;
+    case FD_INODE:
+        return DEFAULT_POLLMASK;
+    default:
+        return POLLERR;
+    }
+}
+
 // 查询 ip 指向的 inode 文件的绝对路径
 // 不做参数检查
 // buf 最后以 / 结尾
@@ -7,6 +7,7 @@
 #include "fs/stat.h"
 #include "fs/vfs/fs.h"
 #include "fs/vfs/ops.h"
+#include "fs/vfs/dcache.h"
 #include "fs/fat/fat32_stack.h"
 #include "fs/fat/fat32_mem.h"
 #include "fs/fat/fat32_disk.h"
@@ -18,8 +19,13 @@
 #include "memory/filemap.h"
 #include "lib/radix-tree.h"
 #include "memory/writeback.h"
+#include "memory/vmscan.h"
 #include "lib/list.h"
 #include "atomic/semaphore.h"
+#include "atomic/cond.h"
+#include "memory/slab.h"
+#include "memory/buddy.h"
+#include "proc/tcb_life.h"
 
 // debug
 // int cache_cnt;
@@ -28,38 +34,122 @@
 
 extern struct file_operations fat32_fop;
 extern struct inode_operations fat32_iop;
+extern struct proc *initproc;
 
 struct _superblock fat32_sb;
 
+struct inode_bucket {
+    struct spinlock lock; // the chain, and ref of the inodes hashed here
+    struct list_head head;
+};
+
+// lock order : fat32_sb.dirty_lock -> bucket -> inode_table.lock
 struct inode_table_t {
-    spinlock_t lock;
-    // struct semaphore lock;
-    struct list_head entry;           // free list
-    struct inode inode_entry[NINODE]; // array
+    spinlock_t lock;         // lru, trunc and the counters
+    struct list_head lru;    // unused inodes, the least recently used at the tail
+    struct list_head trunc;  // unused inodes that are not hashed any more, for itruncd
+    struct cond trunc_cond;
+    struct semaphore reclaim; // only one of itruncd and the shrinkers frees inodes at a time
+    int nr_inode;
+    int nr_unused;           // on lru
+    int max_inode;           // shrink the lru beyond this
+    struct inode_bucket bucket[INODE_NBUCKET];
 } inode_table;
 
+static struct kmem_cache *inode_cachep;
+
 // init the global inode table
 void inode_table_init() {
-    INIT_LIST_HEAD(&inode_table.entry);
-    struct inode *entry;
+    if ((inode_cachep = kmem_cache_create("inode", sizeof(struct inode), sizeof(void *))) == NULL) {
+        panic("inode_table_init : no free memory\n");
+    }
     initlock(&inode_table.lock, "inode_table"); // !!!!
-    // sema_init(&inode_table.lock, 1, "inode_table_lock");
-    for (entry = inode_table.inode_entry; entry < &inode_table.inode_entry[NINODE]; entry++) {
-        memset(entry, 0, sizeof(struct inode));
-        sema_init(&entry->i_sem, 1, "inode_entry_sem");
-        sema_init(&entry->i_read_lock, 1, "read_lock");
-        // sema_init(&entry->i_writeback_lock, 1, "i_writeback_lock");
-        initlock(&entry->i_lock, "inode_entry_lock");
-        initlock(&entry->tree_lock, "inode_radix_tree_lock");
-        INIT_LIST_HEAD(&entry->dirty_list);
-        INIT_LIST_HEAD(&entry->list); // !!! to speed up inode_get
-        list_add_tail(&entry->list, &inode_table.entry);
+    INIT_LIST_HEAD(&inode_table.lru);
+    INIT_LIST_HEAD(&inode_table.trunc);
+    cond_init(&inode_table.trunc_cond, "itrunc_cond");
+    sema_init(&inode_table.reclaim, 1, "inode_reclaim");
+    inode_table.nr_inode = 0;
+    inode_table.nr_unused = 0;
+    // no more than 1/64 of the memory
+    inode_table.max_inode = MAX(NINODE, NPAGES * PGSIZE / 64 / sizeof(struct inode));
+    for (int i = 0; i < INODE_NBUCKET; i++) {
+        initlock(&inode_table.bucket[i].lock, "inode_bucket");
+        INIT_LIST_HEAD(&inode_table.bucket[i].head);
     }
     Info("========= Information of inode table ==========\n");
-    Info("number of inode : %d\n", NINODE);
+    Info("number of cached inode : at most %d unused\n", inode_table.max_inode);
     Info("inode table init [ok]\n");
 }
 
+// a new in-core inode, shrink the unused ones first if there are too many
+static struct inode *inode_new(void) {
+    struct inode *ip;
+
+    if (READ_ONCE(inode_table.nr_inode) >= inode_table.max_inode) {
+        fat32_inode_shrink(INODE_SHRINK_BATCH);
+    }
+    if ((ip = (struct inode *)kmem_cache_zalloc(inode_cachep)) == NULL) {
+        // out of memory, the unused inodes hold page cache
+        fat32_inode_shrink(READ_ONCE(inode_table.nr_unused));
+        if ((ip = (struct inode *)kmem_cache_zalloc(inode_cachep)) == NULL) {
+            return NULL;
+        }
+    }
+    sema_init(&ip->i_sem, 1, "inode_entry_sem");
+    sema_init(&ip->i_read_lock, 1, "read_lock");
+    initlock(&ip->i_lock, "inode_entry_lock");
+    initlock(&ip->tree_lock, "inode_radix_tree_lock");
+    INIT_LIST_HEAD(&ip->dirty_list);
+    INIT_LIST_HEAD(&ip->list);
+    INIT_LIST_HEAD(&ip->i_lru);
+
+    acquire(&inode_table.lock);
+    inode_table.nr_inode++;
+    release(&inode_table.lock);
+    return ip;
+}
+
+// ip is unhashed, unused and on no list, caller holds inode_table.reclaim
+static void inode_destroy(struct inode *ip) {
+    struct inode *parent = ip->parent;
+
+    // no lookup of the dcache uses ip after this
+    d_prune(ip);
+    fat32_i_mapping_destroy(ip);
+    fat32_inode_hash_destroy(ip);
+    fat32_free_index_table(ip);
+    kmem_cache_free(inode_cachep, ip);
+
+    acquire(&inode_table.lock);
+    inode_table.nr_inode--;
+    release(&inode_table.lock);
+
+    // a child holds its parent in memory
+    if (parent != NULL && parent != ip) {
+        fat32_inode_put(parent);
+    }
+}
+
+// caller holds ip->i_bucket->lock
+static void inode_ref_locked(struct inode *ip) {
+    if (ip->ref++ == 0 && !list_empty(&ip->i_lru)) {
+        acquire(&inode_table.lock);
+        if (!list_empty(&ip->list)) {
+            // the lru holds hashed inodes only
+            inode_table.nr_unused--;
+        }
+        list_del_reinit(&ip->i_lru);
+        release(&inode_table.lock);
+    }
+}
+
+// the fcb of ip is gone, nobody finds ip any more
+static void inode_unhash(struct inode *ip) {
+    acquire(&ip->i_bucket->lock);
+    list_del_reinit(&ip->list);
+    release(&ip->i_bucket->lock);
+}
+
 // caller must pass a valid pointer !
 static uint8 __inode_update_to_fatdev(struct inode *ip) {
     uint8 DIR_Dev;
@@ -100,7 +190,11 @@ struct inode *fat32_root_inode_init(struct _superblock *sb) {
     // root_ip->i_mode = IMODE_NONE;
     // set root inode num to 0 (this is no longer used)
     root_ip->i_ino = ROOT_INO; // offset in parent << 32 | cluster_start!!!
-    root_ip->ref = 0;
+    // never freed, not hashed
+    root_ip->ref = 1;
+    root_ip->i_bucket = &inode_table.bucket[0];
+    INIT_LIST_HEAD(&root_ip->list);
+    INIT_LIST_HEAD(&root_ip->i_lru);
     root_ip->valid = 1;
     // file size
     root_ip->i_mount = root_ip;
@@ -547,106 +641,120 @@ ssize_t fat32_inode_write(struct inode *ip, int user_src, uint64 src, uint off,
 
 // duplicate
 struct inode *fat32_inode_dup(struct inode *ip) {
-    // sema_wait(&inode_table.lock);
-    acquire(&inode_table.lock);
-    ip->ref++;
-    // sema_signal(&inode_table.lock);
-    release(&inode_table.lock);
+    acquire(&ip->i_bucket->lock);
+    inode_ref_locked(ip);
+    release(&ip->i_bucket->lock);
     return ip;
 }
-// TODO():等待合并
-// get a inode , move it from disk to memory
-struct inode *fat32_inode_get(uint dev, struct inode *dp, const char *name, uint parentoff) {
-    // int get_cnt = 0;// debug
-    struct inode *ip = NULL, *empty = NULL;
-    acquire(&inode_table.lock);
-    // sema_wait(&inode_table.lock);
-
-    // Is the fat32 inode already in the table?
-    empty = 0;
-    // ===== using array =====
-    for (ip = inode_table.inode_entry; ip < &inode_table.inode_entry[NINODE]; ip++) {
-        // get_cnt++;
-        if (ip->ref > 0 && ip->i_nlink == 0) {
-            fat32_inode_lock(ip);
-            release(&inode_table.lock);
-            // sema_signal(&inode_table.lock);
-            fat32_inode_trunc(ip);
-            fat32_inode_unlock(ip);
-            acquire(&inode_table.lock);
-            ip->ref = 0;
-        }
-        if (ip->ref > 0 && ip->i_dev == dev && ip->parent == dp && ip->fat32_i.parent_off == parentoff && ip->i_nlink != 0 && !strcmp(ip->fat32_i.fname, name)) {
+
+// duplicate ip unless it is on its way to inode_destroy (unused and unhashed), NULL then
+// for reclaim, which finds ip through its page cache, see isolate_inactive
+struct inode *fat32_inode_grab(struct inode *ip) {
+    struct inode_bucket *bucket = ip->i_bucket;
+    acquire(&bucket->lock);
+    if (ip->ref > 0 || !list_empty(&ip->list)) {
+        inode_ref_locked(ip);
+        release(&bucket->lock);
+        return ip;
+    }
+    release(&bucket->lock);
+    return NULL;
+}
+
+// duplicate ip if it still is name in dp, NULL otherwise
+// for the dcache, which may hand out an inode that was unlinked since
+// (but not freed, see inode_destroy)
+struct inode *fat32_inode_tryget(struct inode *ip, struct inode *dp, const char *name) {
+    struct inode_bucket *bucket = ip->i_bucket;
+    acquire(&bucket->lock);
+    if (!list_empty(&ip->list) && ip->i_nlink != 0 && ip->parent == dp && !strcmp(ip->fat32_i.fname, name)) {
+        inode_ref_locked(ip);
+        release(&bucket->lock);
+        return ip;
+    }
+    release(&bucket->lock);
+    return NULL;
+}
+
+// caller holds the lock of bucket
+static struct inode *inode_lookup(struct inode_bucket *bucket, uint dev, struct inode *dp, const char *name, uint parentoff) {
+    struct inode *ip;
+    list_for_each_entry(ip, &bucket->head, list) {
+        if (ip->i_dev == dev && ip->parent == dp && ip->fat32_i.parent_off == parentoff && ip->i_nlink != 0 && !strcmp(ip->fat32_i.fname, name)) {
             // bug : i_nlink!!
-            ip->ref++;
-            release(&inode_table.lock);
-            // sema_signal(&inode_table.lock);
-            // printfMAGENTA("inode get, hit : %d\n", get_cnt);// debug
             return ip;
         }
-        // bug !!!
-        if (!list_empty(&ip->dirty_list)) {
-            continue;
-        }
-        if (empty == 0 && ip->ref == 0) // Remember empty slot.
-            empty = ip;
     }
-    // ===== using list =====
-    // struct inode* ip_cur = NULL;
-    // struct inode* ip_tmp = NULL;
-    // list_for_each_entry_safe(ip_cur, ip_tmp, &inode_table.entry, list) {
-
-    //     list_del_reinit(&ip_cur->list);
-    // }
-    // printfBlue("inode get, not hit : %d\n", get_cnt);// debug
-    // Recycle an fat32 entry.
-    if (empty == 0) {
-        printf("mm : %d\n", get_free_mem());
-        panic("fat32_inode_get: no space");
-    }
-
-    // init the inode pointer
-    ip = empty;
-    ip->i_sb = &fat32_sb;
-    ip->i_dev = dev;
-    // ip->i_ino = inum;
-    ip->ref = 1;
-    ip->valid = 0;
-    ip->fat32_i.parent_off = parentoff; // very important!!!
-    ip->i_op = get_inodeops[FAT32]();
-    ip->fs_type = FAT32;
-
-    // hash table
-    ip->i_hash = NULL;
-
-    // speed up dirlookup using hint
-    ip->off_hint = 0;
+    return NULL;
+}
 
-    if (!list_empty(&ip->dirty_list)) {
-        panic("fat32_inode_get : get dirty inode\n");
-    }
-    // ASSERT(list_empty(&ip->dirty_list));
+// get a inode , move it from disk to memory
+// caller holds a reference of dp, the new inode takes its own
+struct inode *fat32_inode_get(uint dev, struct inode *dp, const char *name, uint parentoff) {
+    struct inode_bucket *bucket = &inode_table.bucket[INODE_HASH(dev, dp, parentoff)];
+    struct inode *ip = NULL, *new = NULL;
+
+    while (1) {
+        acquire(&bucket->lock);
+        // Is the fat32 inode already in the table?
+        if ((ip = inode_lookup(bucket, dev, dp, name, parentoff)) != NULL) {
+            inode_ref_locked(ip);
+            release(&bucket->lock);
+            if (new != NULL) {
+                // lost the race, nobody knows new
+                sema_wait(&inode_table.reclaim);
+                inode_destroy(new);
+                sema_signal(&inode_table.reclaim);
+            }
+            return ip;
+        }
+        if (new != NULL) {
+            break;
+        }
+        release(&bucket->lock);
 
-    // i_mapping set NULL (bug!!)
-    ip->i_mapping = NULL;
+        if ((new = inode_new()) == NULL) {
+            printf("mm : %d\n", get_free_mem());
+            panic("fat32_inode_get: no space");
+        }
+        // init the inode pointer
+        ip = new;
+        ip->i_sb = &fat32_sb;
+        ip->i_dev = dev;
+        // ip->i_ino = inum;
+        ip->ref = 1;
+        ip->valid = 0;
+        ip->fat32_i.parent_off = parentoff; // very important!!!
+        ip->i_op = get_inodeops[FAT32]();
+        ip->fs_type = FAT32;
+        ip->parent = fat32_inode_dup(dp);
+        ip->i_bucket = bucket;
+
+        // hash table
+        ip->i_hash = NULL;
+
+        // speed up dirlookup using hint
+        ip->off_hint = 0;
 
-    ip->i_nlink = 1;
+        // i_mapping set NULL (bug!!)
+        ip->i_mapping = NULL;
 
-    ip->dirty_in_parent = 0; // !!!
+        ip->i_nlink = 1;
 
-    // full name of file
-    safestrcpy(ip->fat32_i.fname, name, strlen(name));
+        ip->dirty_in_parent = 0; // !!!
 
-    // for inode create
-    ip->create_cnt = 0;
-    ip->create_first = 0;
+        // full name of file
+        safestrcpy(ip->fat32_i.fname, name, strlen(name));
 
-    release(&inode_table.lock);
-    // sema_signal(&inode_table.lock);
+        // for inode create
+        ip->create_cnt = 0;
+        ip->create_first = 0;
+        // look again, someone may have got it meanwhile
+    }
 
-    // printfGreen("get new, filename : %s\n", ip->fat32_i.fname); // debug
-    // printfGreen("mm: %d pages\n", get_free_mem()/4096); 
-    return ip;
+    list_add(&new->list, &bucket->head);
+    release(&bucket->lock);
+    return new;
 }
 
 // 往 dp 中写入代表 ip 磁盘块信息的fcb
@@ -672,6 +780,8 @@ int fat32_fcb_copy(struct inode *dp, struct inode *ip) {
     ASSERT(nwrite == fcb_char_len);
 
     kfree(fcb_char);
+    // it may be a negative entry
+    d_drop(dp, ip->fat32_i.fname);
 
     return 0;
 }
@@ -869,35 +979,133 @@ void fat32_inode_unlock(struct inode *ip) {
 //     }
 // }
 
+// drop a reference, the last one caches ip on the lru,
+// or leaves it to itruncd if it is unlinked or renamed away
 void fat32_inode_put(struct inode *ip) {
-    // int put_parent = 0;
-    // int unlock_parent = 0;
+    struct inode_bucket *bucket = ip->i_bucket;
+
+    acquire(&bucket->lock);
+    if (ip->ref < 1) {
+        release(&bucket->lock);
+        Warn("fat32_inode_put : %s, ref %d", ip->fat32_i.fname, ip->ref);
+        return;
+    }
+    if (--ip->ref > 0 || ip == fat32_sb.root) {
+        release(&bucket->lock);
+        return;
+    }
     acquire(&inode_table.lock);
-    if (ip->valid && ip->i_nlink == 0) {
-        // sema_wait(&ip->i_writeback_lock);
-        // destory hash table
-        fat32_inode_hash_destroy(ip);
-
-        // write back dirty pages of inode
-        fat32_i_mapping_writeback(ip);
-        // list_del_reinit(&ip->dirty_list);// !!!
-
-        // destory i_mapping
-        fat32_i_mapping_destroy(ip);
-        // sema_signal(&ip->i_writeback_lock);
-
-        // // truncate inode
-        // fat32_inode_lock(ip);
-        // release(&inode_table.lock);
-        // fat32_inode_trunc(ip);
-
-        // fat32_inode_unlock(ip);
-        // acquire(&inode_table.lock);
-        // ip->ref = 0;
-        // printfRed("unlink, filename : %s\n", ip->fat32_i.fname);// debug
-        // printfRed("mm: %d pages\n", get_free_mem()/4096);
+    if (!list_empty(&ip->list) && ip->i_nlink != 0) {
+        list_add(&ip->i_lru, &inode_table.lru);
+        inode_table.nr_unused++;
+    } else if (list_empty(&ip->i_lru)) {
+        list_del_reinit(&ip->list);
+        list_add_tail(&ip->i_lru, &inode_table.trunc);
+        cond_signal(&inode_table.trunc_cond);
     }
     release(&inode_table.lock);
+    release(&bucket->lock);
+}
+
+// ip came off the trunc list, free it (and its clusters if unlinked)
+// unless someone got it again, the last put queues it once more
+static void inode_evict(struct inode *ip) {
+    int busy;
+
+    if (ip->i_nlink != 0) {
+        // renamed away, an open file may have written it
+        writeback_single_inode(ip);
+    }
+    // the flushers take their reference under dirty_lock
+    acquire(&fat32_sb.dirty_lock);
+    acquire(&ip->i_bucket->lock);
+    busy = ip->ref != 0;
+    if (!busy) {
+        list_del_reinit(&ip->dirty_list);
+    }
+    release(&ip->i_bucket->lock);
+    release(&fat32_sb.dirty_lock);
+    if (busy) {
+        return;
+    }
+
+    // nobody can find ip now
+    sema_wait(&ip->i_sem);
+    fat32_inode_hash_destroy(ip);
+    if (ip->i_nlink == 0 && ip->valid) {
+        fat32_inode_trunc(ip);
+    }
+    sema_signal(&ip->i_sem);
+
+    sema_wait(&inode_table.reclaim);
+    inode_destroy(ip);
+    sema_signal(&inode_table.reclaim);
+}
+
+// truncation of unlinked files is deferred to here, out of unlink and close
+static void itruncd(void) {
+    struct inode *ip;
+
+    // similar to thread_forkret
+    release(&thread_current()->lock);
+
+    acquire(&inode_table.lock);
+    while (1) {
+        while (list_empty(&inode_table.trunc)) {
+            cond_wait(&inode_table.trunc_cond, &inode_table.lock);
+        }
+        ip = list_first_entry(&inode_table.trunc, struct inode, i_lru);
+        list_del_reinit(&ip->i_lru);
+        release(&inode_table.lock);
+
+        inode_evict(ip);
+
+        acquire(&inode_table.lock);
+    }
+}
+
+void itruncd_init(void) {
+    struct tcb *t = NULL;
+    create_thread(initproc, t, "itruncd", itruncd);
+}
+
+int fat32_inode_shrink(int nr) {
+    struct inode *ip;
+    int freed = 0, busy;
+
+    sema_wait(&inode_table.reclaim);
+    for (int scanned = 0; freed < nr; scanned++) {
+        acquire(&inode_table.lock);
+        if (list_empty(&inode_table.lru) || scanned >= inode_table.nr_unused) {
+            release(&inode_table.lock);
+            break;
+        }
+        ip = list_last_entry(&inode_table.lru, struct inode, i_lru);
+        // to the head, the next round looks at the others first
+        list_move(&ip->i_lru, &inode_table.lru);
+        release(&inode_table.lock);
+
+        // ip stays in memory, only the holders of reclaim free inodes
+        acquire(&fat32_sb.dirty_lock);
+        acquire(&ip->i_bucket->lock);
+        acquire(&inode_table.lock);
+        busy = ip->ref != 0 || list_empty(&ip->i_lru) || !list_empty(&ip->dirty_list) || ip->i_writeback;
+        if (!busy) {
+            list_del_reinit(&ip->i_lru);
+            inode_table.nr_unused--;
+            list_del_reinit(&ip->list);
+        }
+        release(&inode_table.lock);
+        release(&ip->i_bucket->lock);
+        release(&fat32_sb.dirty_lock);
+
+        if (!busy) {
+            inode_destroy(ip);
+            freed++;
+        }
+    }
+    sema_signal(&inode_table.reclaim);
+    return freed;
 }
 
 // unlock and put
@@ -1085,12 +1293,12 @@ struct inode *fat32_inode_dirlookup(struct inode *dp, const char *name, uint *po
     if (ip_search != NULL) {
         // printfBlue("hit, %d/%d\n", ++hit_cnt, dirlookup_cnt);
         return ip_search;
-    } else {
-        if (off_hit != 0) {
-            // printfBlue("hit, %d/%d, off_hit, %d\n", ++hit_cnt, dirlookup_cnt, off_hit);
-        }
-        return 0;
     }
+    if (off_hit != 0) {
+        // the entries before the hint were not searched, a miss must be sure (the dcache keeps it)
+        ip_search = fat32_inode_dirlookup_with_hint(dp, name, poff);
+    }
+    return ip_search;
 }
 
 // dirlookup optimization (dirlookup with hint)
@@ -1132,7 +1340,7 @@ struct inode *fat32_inode_create(struct inode *dp, const char *name, uint16 type
 
     // haven't exited
     if ((ip = fat32_inode_alloc(dp, name, type)) == 0) {
-        fat32_inode_unlock_put(dp);
+        fat32_inode_unlock(dp);
         return 0;
     }
 
@@ -1206,6 +1414,7 @@ struct inode *fat32_inode_alloc(struct inode *dp, const char *name, uint16 type)
     ip_new = fat32_inode_get(dp->i_dev, dp, name, off);
     ip_new->parent = dp;
     dp->off_hint = off + 1; // don't use off, but the next one
+    d_add(dp, name, ip_new);
 
 #ifdef __DEBUG_INODE__
     printfRed("inode alloc : pid %d, filename : %s, off : %d (%x)\n", proc_current()->pid, ip_new->fat32_i.fname, off, off);
@@ -1460,6 +1669,13 @@ int fat32_fcb_delete(struct inode *dp, struct inode *ip) {
     ASSERT(tot == (long_dir_len + 1) * sizeof(dirent_l_t));
 
     hash_delete(dp->i_hash, (void *)ip->fat32_i.fname, 0, 1); // not holding lock, release it
+    d_add(dp, ip->fat32_i.fname, NULL);
+    // unlinked or renamed, a new file may take this fcb
+    inode_unhash(ip);
+    ip->dirty_in_parent = 0;
+    if (S_ISDIR(ip->i_mode)) {
+        d_prune(ip);
+    }
     return 0;
 }
 
@@ -1587,7 +1803,6 @@ int fat32_get_block(struct inode *ip, struct bio *bio_p, uint off, uint n, int a
             }
             // printfMAGENTA("fat32_get_block: bio_vec alloc, mm-- : %d pages\n", get_free_mem() / 4096);
 
-            sema_init(&vec_cur->sem_disk_done, 0, "bio_disk_done"); // !!! don't forget it
             INIT_LIST_HEAD(&vec_cur->list);                         // !!! don't forget it
             list_add_tail(&vec_cur->list, &bio_p->list_entry);
             // bug like this :  list_add_tail(&bio_p->list_entry, &vec_cur->list);
@@ -1659,7 +1874,8 @@ void fat32_i_mapping_destroy(struct inode *ip) {
         return;
     }
     if (!radix_tree_is_indirect_ptr(node)) {
-        kfree((void *)page_to_pa((struct page *)node));
+        lru_cache_del((struct page *)node);
+        kfree_cold((void *)page_to_pa((struct page *)node));
     } else {
         node = radix_tree_indirect_to_ptr(node);
 #ifdef __DEBUG_PAGE_CACHE__
@@ -1697,18 +1913,11 @@ void fat32_i_mapping_init(struct inode *ip) {
 }
 
 void fat32_i_mapping_writeback(struct inode *ip) {
-    // atomic !!!
-    // sema_wait(&ip->i_sem); // !!!! bug , must acquire this lock
     if (!list_empty_atomic(&ip->dirty_list, &ip->i_lock)) {
-        // release(&inode_table.lock);
-
-
-        release(&inode_table.lock);
         int ret = sync_inode(ip);
-        acquire(&inode_table.lock);
 
         // remove inode from dity list
-        // acquire(&ip->i_sb->dirty_lock);
+        acquire(&ip->i_sb->dirty_lock);
         if (ret == 0) {
             list_del_reinit(&ip->dirty_list);
             ip->i_writeback = 0;
@@ -1716,9 +1925,8 @@ void fat32_i_mapping_writeback(struct inode *ip) {
             printfCYAN("file %s has written back\n", ip->fat32_i.fname);
 #endif
         }
-        // release(&ip->i_sb->dirty_lock);
+        release(&ip->i_sb->dirty_lock);
     }
-    // sema_signal(&ip->i_sem);
 }
 
 // do_general_travel
@@ -1943,82 +2151,53 @@ void fat32_find_same_name_cnt_handler(struct trav_control *tc) {
     }
 }
 
-void alloc_fail(void) {
-    printfGreen("mm: %d pages before alloc fail\n", get_free_mem()/4096);
-
-    acquire(&inode_table.lock);
-    struct inode *ip = NULL;
-
-    for (ip = inode_table.inode_entry; ip < &inode_table.inode_entry[NINODE]; ip++) {
-        if (ip->ref) {
-            // printfBlue("file name : %s recycle, ref : %d\n", ip->fat32_i.fname, ip->ref);
-
-            // release(&inode_table.lock);
-            // sema_wait(&ip->i_writeback_lock);
-            // ==== atomic ====
-            // write back dirty pages of inode
-            // fat32_i_mapping_writeback(ip);
-
-            // destory i_mapping
-            if (list_empty_atomic(&ip->dirty_list, &ip->i_lock)) {
-                fat32_i_mapping_destroy(ip);
-            }
-            // acquire(&inode_table.lock);
-
-            // destory hash table
-            fat32_inode_hash_destroy(ip);
-
-            // // free index table
-            // fat32_free_index_table(ip);
-
-            // sema_signal(&ip->i_writeback_lock);
-            // ==== atomic ====
-        }
-    }
-    if (list_empty_atomic(&fat32_sb.root->dirty_list, &fat32_sb.root->i_lock)) {
-        fat32_i_mapping_destroy(fat32_sb.root);
-    }
-    fat32_inode_hash_destroy(fat32_sb.root);
-    // // free index table
-    // fat32_free_index_table(ip);
-
-    printfGreen("mm: %d pages after alloc fail\n", get_free_mem()/4096);
-
-    release(&inode_table.lock);
-
-
-}
-
 void shutdown_writeback(void) {
     printfGreen("mm: %d pages before writeback\n", get_free_mem()/4096);
 
-    acquire(&inode_table.lock);
-    struct inode *ip = NULL;
+    struct inode *ip = NULL, *next = NULL;
 
-    for (ip = inode_table.inode_entry; ip < &inode_table.inode_entry[NINODE]; ip++) {
-        if (ip->ref) {
-            // printfBlue("file name : %s recycle, ref : %d\n", ip->fat32_i.fname, ip->ref);
+    // the unlinked files itruncd has not got to
+    acquire(&inode_table.lock);
+    while (!list_empty(&inode_table.trunc)) {
+        ip = list_first_entry(&inode_table.trunc, struct inode, i_lru);
+        list_del_reinit(&ip->i_lru);
+        release(&inode_table.lock);
+        inode_evict(ip);
+        acquire(&inode_table.lock);
+    }
+    release(&inode_table.lock);
 
-            // release(&inode_table.lock);
-            // sema_wait(&ip->i_writeback_lock);
-            // ==== atomic ====
+    for (int i = 0; i < INODE_NBUCKET; i++) {
+        struct inode_bucket *bucket = &inode_table.bucket[i];
+        acquire(&bucket->lock);
+        ip = list_empty(&bucket->head) ? NULL : list_first_entry(&bucket->head, struct inode, list);
+        if (ip != NULL) {
+            inode_ref_locked(ip);
+        }
+        release(&bucket->lock);
+        while (ip != NULL) {
             // write back dirty pages of inode
             fat32_i_mapping_writeback(ip);
 
             // destory i_mapping
-            // if (list_empty_atomic(&ip->dirty_list, &ip->i_lock)) {
             fat32_i_mapping_destroy(ip);
-            // }
-            // acquire(&inode_table.lock);
 
             // destory hash table
             fat32_inode_hash_destroy(ip);
 
-            // // free index table
+            // free index table
             fat32_free_index_table(ip);
 
-            // sema_signal(&ip->i_writeback_lock);
-            // ==== atomic ====
+            // hold the next one before letting go of ip
+            acquire(&bucket->lock);
+            next = NULL;
+            if (!list_empty(&ip->list) && ip->list.next != &bucket->head) {
+                next = list_next_entry(ip, list);
+                inode_ref_locked(next);
+            }
+            release(&bucket->lock);
+            fat32_inode_put(ip);
+            ip = next;
         }
     }
     // if (list_empty_atomic(&fat32_sb.root->dirty_list, &fat32_sb.root->i_lock)) {
@@ -2033,8 +2212,9 @@ void shutdown_writeback(void) {
     // fat32_free_index_table(ip);
 
     printfGreen("mm: %d pages after writeback\n", get_free_mem()/4096);
-    release(&inode_table.lock);
     fat32_fat_bitmap_writeback(ROOTDEV, &fat32_sb);
+    // the FAT only reaches the buffer cache above
+    bsync();
 
 }
 
@@ -0,0 +1,143 @@
+#include "common.h"
+#include "param.h"
+#include "memory/allocator.h"
+#include "fs/vfs/fs.h"
+#include "fs/vfs/ops.h"
+#include "fs/fdtable.h"
+#include "debug.h"
+
+// with fdt->lock held
+static inline void fd_set_open(struct fdtable *fdt, int fd, struct file *f) {
+    fdt->ofile[fd] = f;
+    fdt->open_fds[fd / 64] |= (1UL << (fd % 64));
+}
+
+// with fdt->lock held
+static inline void fd_clear_open(struct fdtable *fdt, int fd) {
+    fdt->ofile[fd] = NULL;
+    fdt->open_fds[fd / 64] &= ~(1UL << (fd % 64));
+    if (fd < fdt->next_fd) {
+        fdt->next_fd = fd;
+    }
+}
+
+// the lowest zero bit at or after start, NOFILE if none
+// with fdt->lock held
+static int find_next_zero_fd(struct fdtable *fdt, int start) {
+    for (int w = start / 64; w < NOFILE_WORDS; w++) {
+        uint64 free = ~fdt->open_fds[w];
+        if (w == start / 64) {
+            // the bits below start don't count
+            free &= ~((1UL << (start % 64)) - 1);
+        }
+        if (free != 0) {
+            return MIN(w * 64 + __builtin_ctzl(free), NOFILE);
+        }
+    }
+    return NOFILE;
+}
+
+struct fdtable *fdt_alloc(void) {
+    struct fdtable *fdt;
+    if ((fdt = (struct fdtable *)kzalloc(sizeof(struct fdtable))) == NULL) {
+        Warn("fdt_alloc: no free memory");
+        return NULL;
+    }
+    atomic_set(&fdt->ref, 1);
+    initlock(&fdt->lock, "fdtable");
+    fdt->max_fds = NOFILE;
+    fdt->next_fd = 0;
+    return fdt;
+}
+
+// only the open fds are visited
+struct fdtable *fdt_dup(struct fdtable *old) {
+    struct fdtable *fdt;
+    if ((fdt = fdt_alloc()) == NULL) {
+        return NULL;
+    }
+    acquire(&old->lock);
+    for (int w = 0; w < NOFILE_WORDS; w++) {
+        uint64 bits = old->open_fds[w];
+        while (bits != 0) {
+            int fd = w * 64 + __builtin_ctzl(bits);
+            bits &= bits - 1;
+            struct file *f = old->ofile[fd];
+            fd_set_open(fdt, fd, f->f_op->dup(f));
+        }
+    }
+    fdt->max_fds = old->max_fds;
+    fdt->next_fd = old->next_fd;
+    release(&old->lock);
+    return fdt;
+}
+
+void fdt_put(struct fdtable *fdt) {
+    // atomic_dec_return returns the old value
+    if (atomic_dec_return(&fdt->ref) > 1) {
+        return;
+    }
+    // nobody else sees fdt, no lock
+    for (int w = 0; w < NOFILE_WORDS; w++) {
+        uint64 bits = fdt->open_fds[w];
+        while (bits != 0) {
+            int fd = w * 64 + __builtin_ctzl(bits);
+            bits &= bits - 1;
+            generic_fileclose(fdt->ofile[fd]);
+        }
+    }
+    kfree(fdt);
+}
+
+int fdt_install(struct fdtable *fdt, struct file *f, int start) {
+    int fd;
+    acquire(&fdt->lock);
+    fd = find_next_zero_fd(fdt, MAX(start, fdt->next_fd));
+    if (fd >= fdt->max_fds) {
+        release(&fdt->lock);
+        return -1;
+    }
+    fd_set_open(fdt, fd, f);
+    if (start <= fdt->next_fd) {
+        fdt->next_fd = fd + 1;
+    }
+    release(&fdt->lock);
+    return fd;
+}
+
+struct file *fdt_replace(struct fdtable *fdt, int fd, struct file *f) {
+    struct file *old;
+    acquire(&fdt->lock);
+    old = fdt->ofile[fd];
+    fd_set_open(fdt, fd, f);
+    release(&fdt->lock);
+    return old;
+}
+
+struct file *fdt_remove(struct fdtable *fdt, int fd) {
+    struct file *f;
+    acquire(&fdt->lock);
+    if ((f = fdt->ofile[fd]) != NULL) {
+        fd_clear_open(fdt, fd);
+    }
+    release(&fdt->lock);
+    return f;
+}
+
+struct file *fdt_fget(struct fdtable *fdt, int fd) {
+    struct file *f;
+    acquire(&fdt->lock);
+    // taken under fdt->lock, a close by another thread sharing fdt puts the table's reference
+    // only after fdt_remove(), a count of 0 means its last close is under way already
+    if ((f = fdt->ofile[fd]) != NULL && atomic_inc_not_zero(&f->f_count) == 0) {
+        f = NULL;
+    }
+    release(&fdt->lock);
+    return f;
+}
+
+void fdt_set_max(struct fdtable *fdt, uint64 max_fds) {
+    acquire(&fdt->lock);
+    fdt->max_fds = MIN(max_fds, (uint64)NOFILE);
+    release(&fdt->lock);
+}
@@ -5,6 +5,7 @@
 #include "fs/vfs/fs.h"
 #include "debug.h"
 #include "fs/mpage.h"
+#include "fs/fat/fat32_mem.h"
 
 extern struct _superblock fat32_sb;
 
@@ -28,13 +29,42 @@ int sync_inode(struct inode *ip) {
     return 0;
 }
 
+// write back ip now if it is dirty, for fsync
+void writeback_single_inode(struct inode *ip) {
+    acquire(&fat32_sb.dirty_lock);
+    if (list_empty(&ip->dirty_list)) {
+        release(&fat32_sb.dirty_lock);
+        return;
+    }
+    release(&fat32_sb.dirty_lock);
+
+    sema_wait(&ip->i_sem);
+    int ret = sync_inode(ip);
+    sema_signal(&ip->i_sem);
+
+    acquire(&fat32_sb.dirty_lock);
+    if (ret == 0) {
+        list_del_reinit(&ip->dirty_list);
+        ip->i_writeback = 0;
+    }
+    release(&fat32_sb.dirty_lock);
+}
+
 void writeback_inodes(uint64 nr_to_write) {
     // nr_to_write is not important
     struct inode *ip_cur = NULL;
-    struct inode *ip_tmp = NULL;
+    struct list_head work;
 
+    // a private list, the inodes dirtied meanwhile wait for the next round
+    INIT_LIST_HEAD(&work);
     acquire(&fat32_sb.dirty_lock);
-    list_for_each_entry_safe(ip_cur, ip_tmp, &fat32_sb.s_dirty, dirty_list) {
+    list_splice(&fat32_sb.s_dirty, &work);
+    INIT_LIST_HEAD(&fat32_sb.s_dirty);
+    while (!list_empty(&work)) {
+        ip_cur = list_first_entry(&work, struct inode, dirty_list);
+        list_move_tail(&ip_cur->dirty_list, &fat32_sb.s_dirty);
+        // the last put of ip_cur waits for dirty_lock before freeing it
+        fat32_inode_dup(ip_cur);
         release(&fat32_sb.dirty_lock);
 
         sema_wait(&ip_cur->i_sem);// important ??? maybe
@@ -46,6 +76,9 @@ void writeback_inodes(uint64 nr_to_write) {
             list_del_reinit(&ip_cur->dirty_list);
             ip_cur->i_writeback = 0;
         }
+        release(&fat32_sb.dirty_lock);
+        fat32_inode_put(ip_cur);
+        acquire(&fat32_sb.dirty_lock);
     }
     release(&fat32_sb.dirty_lock);
 }
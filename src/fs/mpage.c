@@ -13,7 +13,8 @@
 
 // index : page index
 // cnt : page count
-void block_full_pages(struct inode *ip, struct bio *bio_p, uint64 src, uint64 index, uint64 cnt, int alloc) {
+// the data of page index + i is at pas[i], the pages need not be contiguous in memory
+void block_full_pages(struct inode *ip, struct bio *bio_p, uint64 *pas, uint64 index, uint64 cnt, int alloc) {
     // fill the bio using fat32_get_block
     uint32 off = index * PGSIZE;
     uint32 n = cnt * PGSIZE;
@@ -24,73 +25,60 @@ void block_full_pages(struct inode *ip, struct bio *bio_p, uint64 src, uint64 in
     if (alloc == 1) // it is ok, if only read
         ASSERT(blocks_n * bsize == n);
 
-    // copy bio_vec into dst
+    // point bio_vec at its pages (a bio_vec split by bio_vec_map_pages is the next one)
+    uint64 pos = 0;
     struct bio_vec *vec_cur = NULL;
     list_for_each_entry(vec_cur, &bio_p->list_entry, list) {
-        vec_cur->data = (uchar *)src;
-        src += vec_cur->block_len * bsize;
+        bio_vec_map_pages(vec_cur, pas + pos / PGSIZE, PGMASK(pos));
+        pos += vec_cur->block_len * bsize;
     }
 }
 
-// read/write more than one page
-void fat32_rw_pages(struct inode *ip, uint64 src, uint64 index, int rw, uint64 cnt, int alloc) {
-    struct bio bio_cur;
-
-    // init bio
-    INIT_LIST_HEAD(&bio_cur.list_entry);
-    bio_cur.bi_rw = rw;
-    bio_cur.bi_bdev = ip->i_dev;
-
-    // fill bio with bio_vec
-    // block_full_pages(ip, &bio_cur, page_list, index, cnt, alloc);
-    block_full_pages(ip, &bio_cur, src, index, cnt, alloc);
+// read/write more than one page using page batch
+// every run of consecutive indexes is mapped to its blocks, then the whole batch
+// goes to the disk as one bio, so that all of it is in flight at once
+void fat32_rw_pages_batch(struct inode *ip, struct Page_entry *p_entry, int rw, int alloc) {
+    struct bio bio_all;
+    struct bio bio_run;
+    struct Page_item *p_cur = NULL;
+    uint64 *pas;
+    uint64 *idx;
+    int n = 0;
 
-    // submit bio
-    if (!list_empty(&bio_cur.list_entry)) {
-        submit_bio(&bio_cur, 1); // free bio_vec of bio
+    if (p_entry->n_pages == 0) {
+        return;
+    }
+    if ((pas = (uint64 *)kmalloc(2 * p_entry->n_pages * sizeof(uint64))) == NULL) {
+        panic("fat32_rw_pages_batch : no enough memory\n");
+    }
+    idx = pas + p_entry->n_pages;
+    list_for_each_entry(p_cur, &p_entry->entry, list) {
+        pas[n] = p_cur->pa;
+        idx[n] = p_cur->index;
+        n++;
     }
-}
 
-// read/write more than one page using page batch
-void fat32_rw_pages_batch(struct inode *ip, struct Page_entry *p_entry, int rw, int alloc) {
-    struct Page_item *p_cur_out = NULL;
-    int batch_size = 1;
-
-    // out : we don't use list_for_each_entry_safe in order to change p_cur_out in inner
-    list_for_each_entry(p_cur_out, &p_entry->entry, list) {
-        struct Page_item *p_cur_in = NULL;
-        struct Page_item *p_nxt_in = NULL;
-
-        struct Page_item *p_tmp_head_in = p_cur_out; // !!!
-        batch_size = 1;
-        // inner :
-        list_for_each_entry_safe_condition(p_cur_in, p_nxt_in, &p_tmp_head_in->list, list,
-                                           &p_cur_in->list != &p_entry->entry) {
-            if (PAGE_ADJACENT(p_cur_out, p_cur_in)) {
-                p_cur_out = p_cur_in; // !!!!!!!!!
-                batch_size++;
-                // struct page *page_cur = pa_to_page(p_cur_in->pa);
-                // page_cache_put(page_cur);
-                // release(&page_cur->lock);
-            } else {
-                break;
-            }
-        }
+    INIT_LIST_HEAD(&bio_all.list_entry);
+    bio_all.bi_rw = rw;
+    bio_all.bi_bdev = ip->i_dev;
+
+    int start, end;
+    for (start = 0; start < n; start = end) {
+        for (end = start + 1; end < n && idx[end - 1] + 1 == idx[end]; end++)
+            ;
 #ifdef __DEBUG_PAGE_CACHE__
-        // if(batch_size > 1) {
-        //     if(rw == DISK_READ)
-        //         printfCYAN("read : batchsize : %d, index from %d to %d\n", batch_size, p_tmp_head_in->index, p_tmp_head_in->index + batch_size - 1);
-        //     else
-        //         printfBlue("write : batchsize : %d, index from %d to %d\n", batch_size, p_tmp_head_in->index, p_tmp_head_in->index + batch_size - 1);
-        // }
+        // printfCYAN("%s : batchsize : %d, index from %d to %d\n", rw == DISK_READ ? "read" : "write", end - start, idx[start], idx[end - 1]);
 #endif
-        // release(&pa_to_page(p_tmp_head_in->pa)->lock); // !!! maybe the lock protecting page is not needed ??
-        fat32_rw_pages(ip, p_tmp_head_in->pa, p_tmp_head_in->index, rw, batch_size, alloc); // don't write batch_size as batch_size * PGSIZE
+        INIT_LIST_HEAD(&bio_run.list_entry);
+        block_full_pages(ip, &bio_run, pas + start, idx[start], end - start, alloc); // don't write cnt as cnt * PGSIZE
+        list_splice_tail(&bio_run.list_entry, &bio_all.list_entry);
     }
 
-    // must remember to free page list
-    page_list_free(p_entry);
-    // printfGreen("page_list_free, mm ++: %d pages\n", get_free_mem() / PGSIZE);
+    // submit bio
+    if (!list_empty(&bio_all.list_entry)) {
+        submit_bio(&bio_all, 1); // free bio_vec of bio
+    }
+    kfree(pas);
 }
 
 void page_list_free(struct Page_entry *p_entry) {
@@ -130,11 +118,12 @@ uint64 mpage_readpages(struct inode *ip, uint64 index, uint64 cnt, int read_from
                 end_idx++;
             }
 
-            // allocpages:
-            if ((pa = (uint64)kzalloc(PGSIZE * (end_idx - start_idx))) == 0) {
+            // allocpages: contiguous for batched I/O, but each page can be evicted on its own
+            if ((pa = (uint64)kalloc_contig(end_idx - start_idx)) == 0) {
                 printfRed("end_idx : %d, start_idx : %d\n", end_idx, start_idx);
                 panic("mpage_readpages, pa, : no enough memory\n");
             }
+            memset((void *)pa, 0, PGSIZE * (end_idx - start_idx));
             // printfMAGENTA("mpage_readpages: page alloc, mm-- : %d pages\n", get_free_mem() / 4096);
 
             if (first_pa == 0) {
@@ -187,6 +176,8 @@ uint64 mpage_readpages(struct inode *ip, uint64 index, uint64 cnt, int read_from
         // read pages using page list
         fat32_rw_pages_batch(ip, &p_entry, DISK_READ, alloc);
 
+    // must remember to free page list
+    page_list_free(&p_entry);
     return first_pa;
 }
 
@@ -212,14 +203,37 @@ void mpage_writepage(struct inode *ip, int alloc) {
 
     int ret = radix_tree_general_gang_lookup_elements(&(mapping->page_tree), &p_entry, page_list_add,
                                                       0, maxitems_invald, PAGECACHE_TAG_DIRTY);
-    ASSERT(ret > 0);
+    if (ret == 0) {
+        // nothing dirty, it has been written back already
+        release(&ip->tree_lock);
+        return;
+    }
     if (mapping->page_tree.height == 0 && ret != 1) {
         panic("mpage_writepage : error\n");
     }
+
+    // the pages are clean once they are on the disk, a write during the I/O dirties them again
+    // reclaim must not evict them before that
+    struct Page_item *p_item = NULL;
+    list_for_each_entry(p_item, &p_entry.entry, list) {
+        radix_tree_tag_clear(&mapping->page_tree, p_item->index, PAGECACHE_TAG_DIRTY);
+        radix_tree_tag_set(&mapping->page_tree, p_item->index, PAGECACHE_TAG_WRITEBACK);
+    }
     release(&ip->tree_lock);
 
     // write pages using page list
     fat32_rw_pages_batch(ip, &p_entry, DISK_WRITE, alloc);
+
+    acquire(&ip->tree_lock);
+    if (ip->i_mapping == mapping) {
+        list_for_each_entry(p_item, &p_entry.entry, list) {
+            radix_tree_tag_clear(&mapping->page_tree, p_item->index, PAGECACHE_TAG_WRITEBACK);
+        }
+    }
+    release(&ip->tree_lock);
+
+    // must remember to free page list
+    page_list_free(&p_entry);
 }
 
 // add page item into page list
@@ -1,25 +1,213 @@
 #include "common.h"
 #include "kernel/syscall.h"
+#include "kernel/trap.h"
 #include "fs/select.h"
+#include "fs/vfs/fs.h"
+#include "fs/vfs/ops.h"
 #include "ipc/signal.h"
 #include "proc/tcb_life.h"
 #include "proc/pcb_life.h"
+#include "proc/sched.h"
 #include "lib/poll.h"
 #include "errno.h"
 #include "memory/allocator.h"
 #include "debug.h"
-#include "ipc/pipe.h"
-#include "proc/pcb_life.h"
-#include "driver/console.h"
 
-extern struct cond cond_ticks;
+// select, poll and epoll sleep on the wait queues of the files (see atomic/wait.h):
+// the first pass over the files adds an entry to every wait queue,
+// an event of any of them wakes the poller up to check all the files again
+
+uint vfs_poll(struct file *f, poll_table *pt) {
+    if (f->f_op->poll == NULL)
+        return DEFAULT_POLLMASK;
+    return f->f_op->poll(f, pt);
+}
+
+static int pollwake(struct wait_queue_entry *wait, uint key) {
+    struct poll_table_entry *entry = container_of(wait, struct poll_table_entry, wait);
+    struct poll_wqueues *pwq = wait->private;
+    struct tcb *t = pwq->polling_task;
+
+    if (key && !(key & entry->key))
+        return 0;
+    acquire(&pwq->lock);
+    pwq->triggered = 1;
+    release(&pwq->lock);
+
+    // the poller may not be asleep yet, then it sees triggered
+    acquire(&t->lock);
+    if (t->wait_chan_entry == &pwq->waiting)
+        thread_wakeup(t);
+    release(&t->lock);
+    return 1;
+}
+
+static struct poll_table_entry *poll_get_entry(struct poll_wqueues *pwq) {
+    struct poll_table_page *table = pwq->table;
+
+    if (pwq->inline_index < N_INLINE_POLL_ENTRIES)
+        return pwq->inline_entries + pwq->inline_index++;
+
+    if (!table || (char *)(table->entry + 1) > (char *)table + PGSIZE) {
+        struct poll_table_page *new_table;
+
+        if ((new_table = (struct poll_table_page *)kmalloc(PGSIZE)) == NULL) {
+            pwq->error = -ENOMEM;
+            return NULL;
+        }
+        new_table->entry = new_table->entries;
+        new_table->next = table;
+        pwq->table = new_table;
+        table = new_table;
+    }
+    return table->entry++;
+}
+
+// the qproc of select and poll : hold the file, so its wait queue stays until poll_freewait()
+static void __pollwait(struct file *filp, struct wait_queue_head *wq, poll_table *p) {
+    struct poll_wqueues *pwq = container_of(p, struct poll_wqueues, pt);
+    struct poll_table_entry *entry = poll_get_entry(pwq);
+
+    if (!entry)
+        return;
+    // the caller pinned filp (fdt_fget), the entry takes a reference of its own
+    entry->filp = filp->f_op->dup(filp);
+    entry->key = p->key;
+    entry->wait_address = wq;
+    entry->wait.func = pollwake;
+    entry->wait.private = pwq;
+    add_wait_queue(wq, &entry->wait);
+}
+
+void poll_initwait(struct poll_wqueues *pwq) {
+    pwq->pt.qproc = __pollwait;
+    pwq->pt.key = ~0U;
+    pwq->polling_task = thread_current();
+    initlock(&pwq->lock, "poll_wqueues");
+    pwq->triggered = 0;
+    pwq->error = 0;
+    pwq->table = NULL;
+    pwq->inline_index = 0;
+    Queue_init(&pwq->waiting, "poll_wait", TCB_WAIT_QUEUE);
+}
+
+static void free_poll_entry(struct poll_table_entry *entry) {
+    remove_wait_queue(entry->wait_address, &entry->wait);
+    generic_fileclose(entry->filp);
+}
+
+void poll_freewait(struct poll_wqueues *pwq) {
+    struct poll_table_page *p = pwq->table;
+
+    for (int i = 0; i < pwq->inline_index; i++)
+        free_poll_entry(pwq->inline_entries + i);
+    while (p) {
+        struct poll_table_entry *entry;
+        struct poll_table_page *old;
+
+        for (entry = p->entries; entry < p->entry; entry++)
+            free_poll_entry(entry);
+        old = p;
+        p = p->next;
+        kfree(old);
+    }
+}
+
+// sleep until pollwake(), a signal or the deadline (ns, 0 : no deadline)
+// return 0 once the deadline has passed, 1 to check the files again, -EINTR for a signal
+int poll_schedule_timeout(struct poll_wqueues *pwq, uint64 deadline) {
+    struct tcb *t = thread_current();
+    uint64 now;
+    int killed;
+
+    if (signal_pending(t))
+        return -EINTR;
+
+    acquire(&t->lock);
+    acquire(&pwq->lock);
+    if (pwq->triggered) {
+        pwq->triggered = 0;
+        release(&pwq->lock);
+        release(&t->lock);
+        return 1;
+    }
+    if (deadline) {
+        now = TIME2NS(rdtime());
+        if (now >= deadline) {
+            release(&pwq->lock);
+            release(&t->lock);
+            return 0;
+        }
+        t->time_out = deadline - now;
+    }
+    TCB_Q_changeState(t, TCB_SLEEPING);
+    Queue_push_back_atomic(&pwq->waiting, (void *)t);
+    t->wait_chan_entry = &pwq->waiting;
+    release(&pwq->lock);
+
+    thread_sched();
+    killed = t->killed;
+    release(&t->lock);
+    if (killed) {
+        // the caller unwinds through poll_freewait(), the way back to user space exits
+        return -EINTR;
+    }
+
+    acquire(&pwq->lock);
+    pwq->triggered = 0;
+    release(&pwq->lock);
+    if (deadline && TIME2NS(rdtime()) >= deadline)
+        return 0;
+    return 1;
+}
+
+// *ts is relative, NULL waits forever
+// return the deadline in ns (0 : none), *timed_out is set for a zero timeout
+static uint64 poll_deadline(struct timespec *ts, int *timed_out) {
+    uint64 ns;
+
+    *timed_out = 0;
+    if (ts == NULL)
+        return 0;
+    if ((ns = TIMESEPC2NS((*ts))) == 0) {
+        *timed_out = 1;
+        return 0;
+    }
+    return TIME2NS(rdtime()) + ns;
+}
+
+// pselect6 and ppoll : the signal mask while waiting, restored afterwards
+int poll_set_sigmask(uint64 usigmask, sigset_t *saved) {
+    struct tcb *t = thread_current();
+    sigset_t mask;
+
+    if (!usigmask)
+        return 0;
+    if (copyin(proc_current()->mm->pagetable, (char *)&mask, usigmask, sizeof(mask)) < 0)
+        return -EFAULT;
+    *saved = t->blocked;
+    // SIGKILL and SIGSTOP can't be blocked
+    mask.sig &= ~(sig_gen_mask(SIGKILL) | sig_gen_mask(SIGSTOP));
+    t->blocked = mask;
+    return 0;
+}
 
-int do_select(int nfds, fd_set_bits *fds, uint64 timeout) {
-    int retval;
+void poll_restore_sigmask(uint64 usigmask, sigset_t *saved) {
+    if (usigmask)
+        thread_current()->blocked = *saved;
+}
 
-    uint64 time_now = TIME2NS(rdtime());
+int do_select(int nfds, fd_set_bits *fds, uint64 deadline, int timed_out) {
+    struct poll_wqueues table;
     struct proc *p = proc_current();
-    retval = 0;
+    poll_table *wait;
+    int retval = 0, r;
+
+    poll_initwait(&table);
+    wait = &table.pt;
+    if (timed_out)
+        wait->qproc = NULL;
+
     for (;;) {
         uint64 *rinp, *routp, *rexp, *inp, *outp, *exp;
 
@@ -31,351 +219,194 @@ int do_select(int nfds, fd_set_bits *fds, uint64 timeout) {
         rexp = fds->res_ex;
 
         for (int i = 0; i < nfds; ++rinp, ++routp, ++rexp) {
-            uint64 in, out, ex;
-            uint64 bit = 1;
+            uint64 in, out, ex, all_bits, bit = 1;
             uint64 res_in = 0, res_out = 0, res_ex = 0;
-            struct file *file = NULL;
+            uint mask;
 
             in = *inp++;
             out = *outp++;
             ex = *exp++;
-            uint64 all_bits = in | out | ex;
-
+            all_bits = in | out | ex;
             if (all_bits == 0) {
                 i += __NFDBITS;
                 continue;
             }
-            for (int j = 0; j < __NFDBITS; ++j, ++i, bit <<= 1) {
-                // 			int fput_needed;
-                if (i >= nfds) {
-                    panic("i>=nfds : not tested\n");
-                    break;
-                }
+            for (int j = 0; j < __NFDBITS && i < nfds; ++j, ++i, bit <<= 1) {
+                struct file *file;
+
                 if (!(bit & all_bits))
                     continue;
-                file = p->ofile[i];
-                if (file) {
-                    switch (file->f_type) {
-                    case FD_INODE:
-                        break;
-                    case FD_PIPE: {
-                    }
-                    default:
-                        Warn("TYPE is %d", file->f_type);
-                        panic("this type not tested\n");
-                    }
-                    if (in & bit) {
-                        res_in |= bit;
-                        retval++;
-                    }
-                    if (out & bit) {
-                        res_out |= bit;
-                        retval++;
-                    }
-                    if (ex & bit) {
-                        res_ex |= bit;
-                        retval++;
-                    }
+                if ((file = fdt_fget(p->files, i)) == NULL) {
+                    retval = -EBADF;
+                    goto out;
+                }
+                wait->key = ((in & bit) ? POLLIN_SET : 0) | ((out & bit) ? POLLOUT_SET : 0) | ((ex & bit) ? POLLEX_SET : 0);
+                mask = vfs_poll(file, wait);
+                generic_fileclose(file);
+                if ((mask & POLLIN_SET) && (in & bit)) {
+                    res_in |= bit;
+                    retval++;
+                }
+                if ((mask & POLLOUT_SET) && (out & bit)) {
+                    res_out |= bit;
+                    retval++;
+                }
+                if ((mask & POLLEX_SET) && (ex & bit)) {
+                    res_ex |= bit;
+                    retval++;
                 }
             }
-            if (res_in)
-                *rinp = res_in;
-            if (res_out)
-                *routp = res_out;
-            if (res_ex)
-                *rexp = res_ex;
+            *rinp = res_in;
+            *routp = res_out;
+            *rexp = res_ex;
         }
-
-        // 	wait = NULL;
-        if (retval || (TIME2NS(rdtime()) > time_now + timeout)) {
-            // printf("ready\n");
-            // printfGreen("select , pid : %d exit\n", proc_current()->pid);// debug
+        // the wait queues are all there after the first pass
+        wait->qproc = NULL;
+        if (retval || timed_out)
+            break;
+        if (table.error) {
+            retval = table.error;
+            break;
+        }
+        if ((r = poll_schedule_timeout(&table, deadline)) < 0) {
+            retval = r;
             break;
-        } else {
-            // TODO : set a waiting queue
         }
+        timed_out = (r == 0);
     }
-
+out:
+    poll_freewait(&table);
     return retval;
 }
 
-int core_sys_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, uint64 timeout) {
-    fd_set_bits fds;
-    void *bits;
-    int ret;
-    // 	int ret, max_fds;
-    uint32 size;
-    // 	struct fdtable *fdt;
-    // 	/* Allocate small arguments on the stack to save memory and be faster */
-    long stack_fds[SELECT_STACK_ALLOC / sizeof(long)];
-
-    ret = -EINVAL;
-    if (nfds > NOFILE) {
-        panic("nfds > NOFILE, not tested\n");
-    }
-
-    // 	if (nfds < 0)
-    // 		goto out_nofds;
-
-    // 	/* max_fds can increase, so grab it once to avoid race */
-    // 	rcu_read_lock();
-    // 	fdt = files_fdtable(current->files);
-    // 	max_fds = fdt->max_fds;
-    // 	rcu_read_unlock();
-    // 	if (nfds > max_fds)
-    // 		nfds = max_fds;
-
-    /*
-     * We need 6 bitmaps (in/out/ex for both incoming and outgoing),
-     * since we used fdset we need to allocate memory in units of
-     * long-words.
-     */
-
-    size = FDS_BYTES(nfds);
-    bits = stack_fds;
-    if (size > sizeof(stack_fds) / 6) {
-        /* Not enough space in on-stack array; must use kmalloc */
-        ret = -ENOMEM;
-        bits = kmalloc(6 * size);
-        if (!bits)
-            panic("no memory\n");
-        // goto out_nofds;
-    }
-    fds.in = bits;
-    fds.out = bits + size;
-    fds.ex = bits + 2 * size;
-    fds.res_in = bits + 3 * size;
-    fds.res_out = bits + 4 * size;
-    fds.res_ex = bits + 5 * size;
-
-    // if ((ret = get_fd_set(nfds, readfds, fds.in)) || (ret = get_fd_set(nfds, writefds, fds.out)) || (ret = get_fd_set(nfds, exceptfds, fds.ex)))
-    // 	// goto out;
-    // 	panic("core_sys_select : get_fd_set error\n");
-    // copy_fd_set(nfds, fds.in, readfds);
-    // copy_fd_set(nfds, fds.out, writefds);
-    // copy_fd_set(nfds, fds.ex, exceptfds);
-    fds.in = (uint64 *)readfds;
-    fds.out = (uint64 *)writefds;
-    fds.ex = (uint64 *)exceptfds;
-    zero_fd_set(nfds, fds.res_in);
-    zero_fd_set(nfds, fds.res_out);
-    zero_fd_set(nfds, fds.res_ex);
-
-    ret = do_select(nfds, &fds, timeout);
-    if (ret < 0) {
-        panic("ret < 0, not tested\n");
-    }
-    // 	if (ret < 0)
-    // 		goto out;
-    // 	if (!ret) {
-    // 		ret = -ERESTARTNOHAND;
-    // 		if (signal_pending(current))
-    // 			goto out;
-    // 		ret = 0;
-    // 	}
-    // if (set_fd_set(nfds, readfds, fds.res_in) || set_fd_set(nfds, writefds, fds.res_out) || set_fd_set(nfds, exceptfds, fds.res_ex))
-    //     // ret = -EFAULT;
-    // 	panic("core_sys_select : set_fd_set error\n");
-    return ret;
-
-    // out:
-    // 	if (bits != stack_fds)
-    // 		kfree(bits);
-    // out_nofds:
-    // 	return ret;
-}
-
-int poll_select_copy_remaining(uint64 timeout, void *p, int timeval, int ret) {
-    // 	struct timespec rts;
-    // 	struct timeval rtv;
-
-    // 	if (!p)
-    // 		return ret;
-
-    // 	if (current->personality & STICKY_TIMEOUTS)
-    // 		goto sticky;
-
-    // 	/* No update for zero timeout */
-    // 	if (!end_time->tv_sec && !end_time->tv_nsec)
-    // 		return ret;
-
-    // 	ktime_get_ts(&rts);
-    // 	rts = timespec_sub(*end_time, rts);
-    // 	if (rts.tv_sec < 0)
-    // 		rts.tv_sec = rts.tv_nsec = 0;
-
-    // 	if (timeval) {
-    // 		rtv.tv_sec = rts.tv_sec;
-    // 		rtv.tv_usec = rts.tv_nsec / NSEC_PER_USEC;
-
-    // 		if (!copy_to_user(p, &rtv, sizeof(rtv)))
-    // 			return ret;
-
-    // 	} else if (!copy_to_user(p, &rts, sizeof(rts)))
-    // 		return ret;
-
-    // 	/*
-    // 	 * If an application puts its timeval in read-only memory, we
-    // 	 * don't want the Linux-specific update to the timeval to
-    // 	 * cause a fault after the select has completed
-    // 	 * successfully. However, because we're not updating the
-    // 	 * timeval, we can't restart the system call.
-    // 	 */
-
-    // sticky:
-    // 	if (ret == -ERESTARTNOHAND)
-    // 		ret = -EINTR;
-    // 	return ret;
-    return 0;
-}
-
-long do_pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timespec *tsp, const sigset_t *sigmask, size_t sigsetsize) {
-    int ret;
-
-    uint64 time_out = (tsp != NULL ? TIMESEPC2NS((*tsp)) : 0);
-
-    ret = core_sys_select(nfds, readfds, writefds, exceptfds, time_out);
-
-    // if ()
-
-    return ret;
-}
-
 // select, pselect, FD_CLR, FD_ISSET, FD_SET, FD_ZERO - synchronous I/O multiplexing
-// int pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct timespec *timeout, const sigset_t *sigmask);
+// int pselect6(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct timespec *timeout, const struct {const sigset_t *ss; size_t ss_len;} *sigmask);
 uint64 sys_pselect6(void) {
     int nfds;
-    uint64 readfds_addr, writefds_addr, exceptfds_addr, timeout_addr;
-    // uint64 sigmask_addr;
-    fd_set readfds, writefds, exceptfds;
+    uint64 readfds_addr, writefds_addr, exceptfds_addr, timeout_addr, sigmask_addr;
+    uint64 ufds[3], usigmask = 0, sigmask_arg[2];
+    fd_set sets[3], res[3];
+    fd_set_bits fds;
     struct timespec timeout;
-    // sigset_t sigmask;
+    sigset_t saved;
+    uint64 deadline;
+    int timed_out, ret;
+    uint size;
+    struct proc *p = proc_current();
+
     argint(0, &nfds);
     argaddr(1, &readfds_addr);
     argaddr(2, &writefds_addr);
     argaddr(3, &exceptfds_addr);
     argaddr(4, &timeout_addr);
-    // argaddr(5, &sigmask_addr);
-    struct proc *p = proc_current();
+    argaddr(5, &sigmask_addr);
 
-    if (readfds_addr && (copyin(p->mm->pagetable, (char *)&readfds, readfds_addr, sizeof(readfds))) < 0) return -1;
-    if (writefds_addr && (copyin(p->mm->pagetable, (char *)&writefds, writefds_addr, sizeof(writefds))) < 0) return -1;
-    if (exceptfds_addr && (copyin(p->mm->pagetable, (char *)&exceptfds, exceptfds_addr, sizeof(exceptfds)) < 0)) return -1;
+    if (nfds < 0)
+        return -EINVAL;
+    nfds = MIN(nfds, NOFILE);
+    size = FDS_BYTES(nfds);
+
+    ufds[0] = readfds_addr;
+    ufds[1] = writefds_addr;
+    ufds[2] = exceptfds_addr;
+    for (int k = 0; k < 3; k++) {
+        memset(&sets[k], 0, sizeof(fd_set));
+        memset(&res[k], 0, sizeof(fd_set));
+        if (ufds[k] && copyin(p->mm->pagetable, (char *)&sets[k], ufds[k], size) < 0)
+            return -EFAULT;
+    }
 
     if (timeout_addr) {
-        if (copyin(p->mm->pagetable, (char *)&timeout, timeout_addr, sizeof(timeout)) < 0) return -1;
-        // panic("timeout not tested\n");
+        if (copyin(p->mm->pagetable, (char *)&timeout, timeout_addr, sizeof(timeout)) < 0)
+            return -EFAULT;
     }
-    uint64 time_out = (timeout_addr != 0 ? TIMESEPC2NS(timeout) : 0);
-    // printfRed("time_out : %ld\n", time_out);
-
-    // size_t sigsetsize = 0;
-    // if (sigmask_addr) {
-    //     if (copyin(p->mm->pagetable, (char *)&sigmask, sigmask_addr, sizeof(sigmask)) < 0) return -1;
-    // }
-    // int ret = do_pselect(nfds, &readfds, &writefds, &exceptfds, timeout_addr ? &timeout : NULL, &sigmask, sigsetsize);
-
-    int ret = 0;
-
-    struct file *fp;
-    while (1) {
-        if (readfds_addr) {
-            for (int i = 0; i < nfds; i++) {
-                fp = p->ofile[i];
-                if (fp) {
-                    switch (fp->f_type) {
-                    case FD_INODE:
-                        break;
-                    case FD_PIPE: {
-                        if (!pipereadable(fp->f_tp.f_pipe) || pipe_empty(fp->f_tp.f_pipe)) {
-                            FD_CLR(i, &readfds);
-                            break;
-                        }
-                    }
-                    case FD_DEVICE:
-                    case FD_SOCKET: {
-                        ret++;
-                        break;
-                    }
-                    default:
-                        Warn("TYPE is %d", fp->f_type);
-                        panic("this type not tested\n");
-                    }
-                }
-            }
-        }
+    deadline = poll_deadline(timeout_addr ? &timeout : NULL, &timed_out);
+
+    if (sigmask_addr) {
+        if (copyin(p->mm->pagetable, (char *)sigmask_arg, sigmask_addr, sizeof(sigmask_arg)) < 0)
+            return -EFAULT;
+        usigmask = sigmask_arg[0];
+    }
+    if ((ret = poll_set_sigmask(usigmask, &saved)) < 0)
+        return ret;
+
+    fds.in = sets[0].fds_bits;
+    fds.out = sets[1].fds_bits;
+    fds.ex = sets[2].fds_bits;
+    fds.res_in = res[0].fds_bits;
+    fds.res_out = res[1].fds_bits;
+    fds.res_ex = res[2].fds_bits;
+    ret = do_select(nfds, &fds, deadline, timed_out);
+    poll_restore_sigmask(usigmask, &saved);
+    if (ret < 0)
+        return ret;
+
+    for (int k = 0; k < 3; k++) {
+        if (ufds[k] && copyout(p->mm->pagetable, ufds[k], (char *)&res[k], size) < 0)
+            return -EFAULT;
+    }
+    return ret;
+}
+
+static int do_poll(struct pollfd *pfds, int nfds, uint64 deadline, int timed_out) {
+    struct poll_wqueues table;
+    struct proc *p = proc_current();
+    poll_table *wait;
+    int count = 0, r;
+
+    poll_initwait(&table);
+    wait = &table.pt;
+    if (timed_out)
+        wait->qproc = NULL;
 
-        if (writefds_addr) {
-            for (int i = 0; i < nfds; i++) {
-                fp = p->ofile[i];
-                if (fp) {
-                    switch (fp->f_type) {
-                    case FD_INODE:
-                        break;
-                    case FD_PIPE: {
-                        if (!pipewriteable(fp->f_tp.f_pipe) || pipe_full(fp->f_tp.f_pipe)) {
-                            FD_CLR(i, &writefds);
-                            break;
-                        }
-                    }
-                    case FD_DEVICE:
-                    case FD_SOCKET: {
-                        ret++;
-                        break;
-                    }
-                    default:
-                        Warn("TYPE is %d", fp->f_type);
-                        panic("this type not tested\n");
-                    }
+    for (;;) {
+        for (int i = 0; i < nfds; i++) {
+            struct pollfd *pfd = &pfds[i];
+            uint mask = 0;
+
+            if (pfd->fd >= 0) {
+                struct file *file;
+                if (pfd->fd >= NOFILE || (file = fdt_fget(p->files, pfd->fd)) == NULL) {
+                    mask = POLLNVAL;
+                } else {
+                    // POLLERR and POLLHUP are always reported
+                    wait->key = pfd->events | POLLERR | POLLHUP;
+                    mask = vfs_poll(file, wait) & (pfd->events | POLLERR | POLLHUP);
+                    generic_fileclose(file);
                 }
+                if (mask)
+                    count++;
             }
+            pfd->revents = mask;
         }
-
-        if (exceptfds_addr) {
-            for (int i = 0; i < nfds; i++) {
-                FD_CLR(i, &exceptfds);
-            }
+        wait->qproc = NULL;
+        if (count || timed_out)
+            break;
+        if (table.error) {
+            count = table.error;
+            break;
         }
-
-        // timeout
-        // 	wait = NULL;
-        uint64 time_now = TIME2NS(rdtime());
-        if (ret || (TIME2NS(rdtime()) > time_now + time_out)) {
-            // printf("ready\n");
-            // printfGreen("select , pid : %d exit\n", proc_current()->pid);// debug
+        if ((r = poll_schedule_timeout(&table, deadline)) < 0) {
+            count = r;
             break;
-        } else {
-            // acquire(&cond_ticks.waiting_queue.lock);
-            // struct tcb* t = thread_current();
-            // t->time_out = time_out;
-            // cond_wait(&cond_ticks, &cond_ticks.waiting_queue.lock);
-            // release(&cond_ticks.waiting_queue.lock);
-            // break;
         }
+        timed_out = (r == 0);
     }
-
-    if (readfds_addr && (copyout(p->mm->pagetable, readfds_addr, (char *)&readfds, sizeof(readfds)) < 0)) return -1;
-    if (writefds_addr && (copyout(p->mm->pagetable, writefds_addr, (char *)&writefds, sizeof(writefds)) < 0)) return -1;
-    if (exceptfds_addr && (copyout(p->mm->pagetable, exceptfds_addr, (char *)&exceptfds, sizeof(exceptfds)) < 0)) return -1;
-
-    return ret;
-}
-
-
-#define TICK_GRANULARITY 10L // ms
-#define SEC2TICK(sec) ((sec)*1000 / TICK_GRANULARITY)
-#define MS2TICK(ms) ((ms) / TICK_GRANULARITY)
-#define US2TICK(us) ((us)*TICK_GRANULARITY / 1000)
-#define NS2TICK(ns) ((ns) / 1000 / 1000 / TICK_GRANULARITY)
-static inline uint64 ts2ticks(struct timespec *ts) {
-    return ts ? SEC2TICK(ts->ts_sec) + NS2TICK(ts->ts_nsec) : 0;
+    poll_freewait(&table);
+    return count;
 }
 
+// poll, ppoll - wait for some event on a file descriptor
+// int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *tmo_p, const sigset_t *sigmask);
 uint64 sys_ppoll(void) {
-    uint64 pfdaddr;
+    uint64 pfdaddr, tsaddr, sigmaskaddr;
     int nfds;
-    uint64 tsaddr;
-    uint64 sigmaskaddr;
+    long stack_pfds[POLL_STACK_ALLOC / sizeof(long)];
+    struct pollfd *pfds = (struct pollfd *)stack_pfds;
+    struct timespec ts;
+    sigset_t saved;
+    uint64 deadline;
+    int timed_out, ret;
     struct proc *p = proc_current();
 
     argaddr(0, &pfdaddr);
@@ -383,67 +414,28 @@ uint64 sys_ppoll(void) {
     argaddr(2, &tsaddr);
     argaddr(3, &sigmaskaddr);
 
-    ASSERT(nfds == 1);
-    // printf("ts addr is %#lx\n", tsaddr);
-
-    struct pollfd pfd;
-
-    if (copyin(p->mm->pagetable, (char *)&pfd, pfdaddr, sizeof(pfd)) < 0)
-        return -1;
-
-    ASSERT(pfd.events == POLLIN);
-    ASSERT(pfd.fd == 0);
-
-    struct file *f;
-    f = p->ofile[pfd.fd];
-
-    // TODO
-    // argfd(, pfd.fd, , f);
-
-    struct timespec ts;
-    if (tsaddr && copyin(p->mm->pagetable, (char *)&ts, tsaddr, sizeof(struct timespec)) < 0)
-        return -1;
-
-    // uint64 timeout = TIMESEPC2NS(ts);
-    uint64 timeout = tsaddr ? ts2ticks(&ts) : -1;
-
-    while (1) {
-        switch (f->f_type) {
-        case FD_DEVICE:
-            if (consoleready()) goto ret;
-            break;
-        case FD_PIPE:
-            return 1;
-        default:
-            panic("error");
-        }
-
-        if (timeout == -1) continue;
-
-        // uint64 time_now = TIME2NS(rdtime());
-        // if ((TIME2NS(rdtime()) > time_now + timeout)) {
-        //     // printf("ready\n");
-        //     // printfGreen("select , pid : %d exit\n", proc_current()->pid);// debug
-        //     break;
-        // }
-
-        if (timeout) {
-            // Log("hit");
-            extern struct cond cond_ticks;
-            acquire(&cond_ticks.waiting_queue.lock);
-            cond_wait(&cond_ticks, &cond_ticks.waiting_queue.lock);
-            release(&cond_ticks.waiting_queue.lock);
-            timeout--;
-        } else {
-            break;
-        }
+    if (nfds < 0 || nfds > NOFILE)
+        return -EINVAL;
+    if (nfds * sizeof(struct pollfd) > sizeof(stack_pfds)) {
+        if ((pfds = (struct pollfd *)kmalloc(nfds * sizeof(struct pollfd))) == NULL)
+            return -ENOMEM;
     }
-ret:
-    if (timeout == 0) return 0;
-
-    pfd.revents = pfd.events;
-    if (copyout(p->mm->pagetable, pfdaddr, (char *)&pfd, sizeof(pfd)) < 0)
-        return -1;
-
-    return 1;
-}
\ No newline at end of file
+    ret = -EFAULT;
+    if (copyin(p->mm->pagetable, (char *)pfds, pfdaddr, nfds * sizeof(struct pollfd)) < 0)
+        goto out;
+    if (tsaddr && copyin(p->mm->pagetable, (char *)&ts, tsaddr, sizeof(struct timespec)) < 0)
+        goto out;
+    deadline = poll_deadline(tsaddr ? &ts : NULL, &timed_out);
+
+    if ((ret = poll_set_sigmask(sigmaskaddr, &saved)) < 0)
+        goto out;
+    ret = do_poll(pfds, nfds, deadline, timed_out);
+    poll_restore_sigmask(sigmaskaddr, &saved);
+
+    if (ret >= 0 && copyout(p->mm->pagetable, pfdaddr, (char *)pfds, nfds * sizeof(struct pollfd)) < 0)
+        ret = -EFAULT;
+out:
+    if (pfds != (struct pollfd *)stack_pfds)
+        kfree(pfds);
+    return ret;
+}
@@ -0,0 +1,375 @@
+#include "common.h"
+#include "errno.h"
+#include "lib/riscv.h"
+#include "kernel/trap.h"
+#include "kernel/syscall.h"
+#include "memory/allocator.h"
+#include "memory/buddy.h"
+#include "memory/filemap.h"
+#include "fs/vfs/fs.h"
+#include "fs/fcntl.h"
+#include "fs/uio.h"
+#include "fs/splice.h"
+#include "fs/fat/fat32_mem.h"
+#include "ipc/pipe.h"
+#include "debug.h"
+
+// file -> pipe : the pipe takes references to the page cache pages, nothing is copied
+static ssize_t splice_file_to_pipe(struct file *in, off_t *off, struct pipe *pi, size_t len, int flags) {
+    struct inode *ip = in->f_tp.f_inode;
+    struct page *pages[SPLICE_BATCH];
+    struct pipe_buffer *buf;
+    ssize_t ret = 0;
+    int cnt, i;
+
+    while (len > 0) {
+        acquire(&pi->lock);
+        while (PIPE_FULL(pi) && pi->readopen) {
+            if (ret > 0 || (flags & SPLICE_F_NONBLOCK)) {
+                release(&pi->lock);
+                return ret ? ret : -EAGAIN;
+            }
+            pipe_wake_readers(pi);
+            pipe_wait_writable(pi);
+        }
+        if (!pi->readopen) {
+            release(&pi->lock);
+            return ret ? ret : -EPIPE;
+        }
+        cnt = MIN(pi->npages - PIPE_SLOTS_USED(pi), SPLICE_BATCH);
+        release(&pi->lock);
+
+        fat32_inode_lock(ip);
+        if (*off >= ip->i_size) {
+            fat32_inode_unlock(ip);
+            break;
+        }
+        len = MIN(len, ip->i_size - *off);
+        cnt = MIN(cnt, (PGMASK(*off) + len + PGSIZE - 1) / PGSIZE);
+        filemap_get_pages(ip, *off >> PGSHIFT, cnt, 1, pages);
+        fat32_inode_unlock(ip);
+
+        acquire(&pi->lock);
+        // someone else may have filled the pipe meanwhile
+        for (i = 0; i < cnt && pages[i] != NULL && !PIPE_FULL(pi); i++) {
+            buf = pipe_buf_at(pi, pi->head++);
+            buf->page = page_to_pa(pages[i]);
+            buf->offset = PGMASK(*off);
+            buf->len = MIN(PGSIZE - buf->offset, len);
+            buf->flags = 0;
+            *off += buf->len;
+            len -= buf->len;
+            ret += buf->len;
+        }
+        pipe_wake_readers(pi);
+        release(&pi->lock);
+
+        // the pages that didn't fit
+        int added = i;
+        for (; i < cnt; i++) {
+            if (pages[i])
+                kfree((void *)page_to_pa(pages[i]));
+        }
+        if (added == 0 && (cnt == 0 || pages[0] == NULL))
+            break;
+    }
+    return ret;
+}
+
+// pipe -> file : written from the pages of the pipe, the one copy is into the page cache
+static ssize_t splice_pipe_to_file(struct pipe *pi, struct file *out, off_t *off, size_t len, int flags) {
+    struct inode *ip = out->f_tp.f_inode;
+    struct pipe_buffer *buf, b;
+    ssize_t ret = 0, r;
+
+    acquire(&pi->lock);
+    while (len > 0) {
+        if (PIPE_EMPTY(pi)) {
+            if (!pi->writeopen || ret > 0)
+                break;
+            if (flags & SPLICE_F_NONBLOCK) {
+                ret = -EAGAIN;
+                break;
+            }
+            pipe_wait_readable(pi);
+            continue;
+        }
+        // take it out of the pipe, the file is written without pi->lock
+        buf = pipe_buf_at(pi, pi->tail);
+        b = *buf;
+        b.len = MIN(buf->len, len);
+        if (b.len == buf->len) {
+            pi->tail++;
+        } else {
+            // the rest stays in the pipe, take our own reference
+            share_page(b.page);
+            b.flags = 0;
+            buf->offset += b.len;
+            buf->len -= b.len;
+        }
+        pipe_wake_writers(pi);
+        release(&pi->lock);
+
+        fat32_inode_lock(ip);
+        r = fat32_inode_write(ip, 0, b.page + b.offset, *off, b.len);
+        fat32_inode_unlock(ip);
+
+        acquire(&pi->lock);
+        pipe_buf_release(pi, &b);
+        if (r != b.len) {
+            if (ret == 0)
+                ret = -EIO;
+            break;
+        }
+        *off += r;
+        ret += r;
+        len -= r;
+    }
+    release(&pi->lock);
+    return ret;
+}
+
+static void pipe_double_lock(struct pipe *a, struct pipe *b) {
+    if (a < b) {
+        acquire(&a->lock);
+        acquire(&b->lock);
+    } else {
+        acquire(&b->lock);
+        acquire(&a->lock);
+    }
+}
+
+// wait for something to read in ipi and room in opi, one at a time
+static int splice_pipe_prep(struct pipe *ipi, struct pipe *opi, int flags) {
+    int ret = 0;
+
+    acquire(&ipi->lock);
+    while (PIPE_EMPTY(ipi)) {
+        if (!ipi->writeopen) {
+            ret = 0;
+            goto out_in;
+        }
+        if (flags & SPLICE_F_NONBLOCK) {
+            ret = -EAGAIN;
+            goto out_in;
+        }
+        pipe_wait_readable(ipi);
+    }
+    ret = 1;
+out_in:
+    release(&ipi->lock);
+    if (ret <= 0)
+        return ret;
+
+    acquire(&opi->lock);
+    while (PIPE_FULL(opi) && opi->readopen) {
+        if (flags & SPLICE_F_NONBLOCK) {
+            release(&opi->lock);
+            return -EAGAIN;
+        }
+        pipe_wake_readers(opi);
+        pipe_wait_writable(opi);
+    }
+    ret = opi->readopen ? 1 : -EPIPE;
+    release(&opi->lock);
+    return ret;
+}
+
+// pipe -> pipe : the buffers move (or are duplicated for tee), no data is copied
+static ssize_t splice_pipe_to_pipe(struct pipe *ipi, struct pipe *opi, size_t len, int flags, int dup) {
+    struct pipe_buffer *ibuf, *obuf;
+    ssize_t ret;
+    uint n;
+
+    if (ipi == opi)
+        return -EINVAL;
+    do {
+        if ((ret = splice_pipe_prep(ipi, opi, flags)) <= 0)
+            return ret;
+        ret = 0;
+
+        pipe_double_lock(ipi, opi);
+        for (uint i = 0; len > 0 && i < PIPE_SLOTS_USED(ipi) && !PIPE_FULL(opi);) {
+            ibuf = pipe_buf_at(ipi, ipi->tail + i);
+            obuf = pipe_buf_at(opi, opi->head++);
+            n = MIN(ibuf->len, len);
+            *obuf = *ibuf;
+            obuf->len = n;
+            if (dup) {
+                // both pipes see the page now, nobody appends to it
+                share_page(ibuf->page);
+                obuf->flags &= ~PIPE_BUF_FLAG_CAN_MERGE;
+                i++;
+            } else if (n == ibuf->len) {
+                ipi->tail++;
+            } else {
+                share_page(ibuf->page);
+                obuf->flags &= ~PIPE_BUF_FLAG_CAN_MERGE;
+                ibuf->offset += n;
+                ibuf->len -= n;
+            }
+            len -= n;
+            ret += n;
+        }
+        if (!dup)
+            pipe_wake_writers(ipi);
+        pipe_wake_readers(opi);
+        release(&opi->lock);
+        release(&ipi->lock);
+    } while (ret == 0);
+    return ret;
+}
+
+// the offset of a file end: *uoff if it is given (f_pos is left alone), or f_pos
+static int splice_get_off(struct file *f, uint64 uoff, off_t *off) {
+    if (uoff)
+        return either_copyin(off, 1, uoff, sizeof(off_t));
+    *off = f->f_pos;
+    return 0;
+}
+
+static void splice_put_off(struct file *f, uint64 uoff, off_t off) {
+    if (uoff)
+        either_copyout(1, uoff, &off, sizeof(off_t));
+    else
+        f->f_pos = off;
+}
+
+// sendfile : in -> out through a private pipe, a pipe at a time
+// out is a pipe or a file
+ssize_t do_splice_direct(struct file *in, off_t *off, struct file *out, size_t len) {
+    struct pipe *pi;
+    ssize_t ret = 0, n, w;
+
+    if (in->f_type != FD_INODE)
+        return -EINVAL;
+    if (out->f_type == FD_PIPE)
+        return splice_file_to_pipe(in, off, out->f_tp.f_pipe, len, 0);
+    if (out->f_type != FD_INODE)
+        return -EINVAL;
+
+    if ((pi = pipe_create()) == 0)
+        return -ENOMEM;
+    while (len > 0) {
+        if ((n = splice_file_to_pipe(in, off, pi, len, SPLICE_F_NONBLOCK)) <= 0) {
+            if (ret == 0)
+                ret = n;
+            break;
+        }
+        w = splice_pipe_to_file(pi, out, &out->f_pos, n, SPLICE_F_NONBLOCK);
+        if (w > 0)
+            ret += w;
+        if (w != n) {
+            // what didn't get written is not consumed either
+            *off -= n - MAX(w, 0);
+            if (ret == 0)
+                ret = w;
+            break;
+        }
+        len -= n;
+    }
+    pipe_destroy(pi);
+    return ret;
+}
+
+// ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags);
+// one end is a pipe, the other a pipe or a regular file
+uint64 sys_splice(void) {
+    struct file *in, *out;
+    uint64 off_in, off_out;
+    size_t len;
+    int flags;
+    off_t off;
+    ssize_t ret;
+
+    if (argfd(0, 0, &in) < 0 || argfd(2, 0, &out) < 0)
+        return -EBADF;
+    argaddr(1, &off_in);
+    argaddr(3, &off_out);
+    arglong(4, (long *)&len);
+    argint(5, &flags);
+    if (!F_READABLE(in) || !F_WRITEABLE(out))
+        return -EBADF;
+    if (len == 0)
+        return 0;
+
+    if (in->f_type == FD_PIPE && out->f_type == FD_PIPE) {
+        if (off_in || off_out)
+            return -ESPIPE;
+        return splice_pipe_to_pipe(in->f_tp.f_pipe, out->f_tp.f_pipe, len, flags, 0);
+    }
+    if (in->f_type == FD_PIPE && out->f_type == FD_INODE) {
+        if (off_in)
+            return -ESPIPE;
+        if (splice_get_off(out, off_out, &off) < 0)
+            return -EFAULT;
+        if ((ret = splice_pipe_to_file(in->f_tp.f_pipe, out, &off, len, flags)) > 0)
+            splice_put_off(out, off_out, off);
+        return ret;
+    }
+    if (in->f_type == FD_INODE && out->f_type == FD_PIPE) {
+        if (off_out)
+            return -ESPIPE;
+        if (splice_get_off(in, off_in, &off) < 0)
+            return -EFAULT;
+        if ((ret = splice_file_to_pipe(in, &off, out->f_tp.f_pipe, len, flags)) > 0)
+            splice_put_off(in, off_in, off);
+        return ret;
+    }
+    return -EINVAL;
+}
+
+// ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+uint64 sys_tee(void) {
+    struct file *in, *out;
+    size_t len;
+    int flags;
+
+    if (argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+        return -EBADF;
+    arglong(2, (long *)&len);
+    argint(3, &flags);
+    if (in->f_type != FD_PIPE || out->f_type != FD_PIPE)
+        return -EINVAL;
+    if (!F_READABLE(in) || !F_WRITEABLE(out))
+        return -EBADF;
+    if (len == 0)
+        return 0;
+    return splice_pipe_to_pipe(in->f_tp.f_pipe, out->f_tp.f_pipe, len, flags, 1);
+}
+
+// ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr_segs, unsigned int flags);
+// user memory is copied into (or out of) the pipe, SPLICE_F_GIFT is not honoured
+uint64 sys_vmsplice(void) {
+    struct file *f;
+    uint64 uiov;
+    size_t nr_segs;
+    int flags;
+    struct iovec iov;
+    ssize_t ret = 0, n;
+
+    if (argfd(0, 0, &f) < 0)
+        return -EBADF;
+    argaddr(1, &uiov);
+    arglong(2, (long *)&nr_segs);
+    argint(3, &flags);
+    if (f->f_type != FD_PIPE)
+        return -EBADF;
+
+    for (size_t i = 0; i < nr_segs; i++) {
+        if (either_copyin(&iov, 1, uiov + i * sizeof(struct iovec), sizeof(struct iovec)) < 0)
+            return ret ? ret : -EFAULT;
+        if (iov.iov_len == 0)
+            continue;
+        if (F_WRITEABLE(f))
+            n = pipe_write(f->f_tp.f_pipe, 1, (uint64)iov.iov_base, iov.iov_len);
+        else
+            n = pipe_read(f->f_tp.f_pipe, 1, (uint64)iov.iov_base, iov.iov_len);
+        if (n < 0)
+            return ret ? ret : n;
+        ret += n;
+        if (n < iov.iov_len)
+            break;
+    }
+    return ret;
+}
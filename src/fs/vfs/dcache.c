@@ -0,0 +1,194 @@
+#include "common.h"
+#include "param.h"
+#include "debug.h"
+#include "atomic/seqlock.h"
+#include "atomic/spinlock.h"
+#include "kernel/cpu.h"
+#include "lib/list.h"
+#include "lib/hash.h"
+#include "fs/vfs/fs.h"
+#include "fs/vfs/dcache.h"
+#include "fs/fat/fat32_mem.h"
+
+// the entries never leave the pool, so a lookup racing with a writer
+// only reads stale data and the sequence makes it try again
+struct dcache_t {
+    seqlock_t seqlock;               // writers of the buckets, the lru and the entries
+    struct list_head hash[NDHASH];   // buckets
+    struct list_head lru;            // for eviction
+    struct dentry dentry[NDENTRY];   // pool
+} dcache;
+
+// odd while a lookup on that cpu may still hold a d_inode it read
+// d_prune() waits them out before the inode is freed
+static uint d_readers[NCPU];
+
+static inline uint64 d_hashname(struct inode *dp, const char *name) {
+    return hash_str((char *)name) ^ ((uint64)dp >> 4);
+}
+
+static inline struct list_head *d_bucket(uint64 hashval) {
+    return &dcache.hash[hashval % NDHASH];
+}
+
+void dcache_init(void) {
+    seqlock_init(&dcache.seqlock, "dcache");
+    for (int i = 0; i < NDHASH; i++) {
+        INIT_LIST_HEAD(&dcache.hash[i]);
+    }
+    INIT_LIST_HEAD(&dcache.lru);
+    for (struct dentry *d = dcache.dentry; d < dcache.dentry + NDENTRY; d++) {
+        memset(d, 0, sizeof(struct dentry));
+        INIT_LIST_HEAD(&d->d_hash);
+        list_add_tail(&d->d_lru, &dcache.lru);
+    }
+    Info("dcache init [ok]\n");
+}
+
+// not list_del(), a lookup may still be walking through d
+static void d_unhash(struct dentry *d) {
+    __list_del_entry(&d->d_hash);
+    INIT_LIST_HEAD(&d->d_hash);
+}
+
+// with the seqlock held
+static void d_free(struct dentry *d) {
+    d_unhash(d);
+    d->d_parent = NULL;
+    d->d_inode = NULL;
+    list_move(&d->d_lru, &dcache.lru);
+}
+
+// with the seqlock held
+static struct dentry *__d_find(struct inode *dp, const char *name, uint64 hashval) {
+    struct dentry *d;
+    list_for_each_entry(d, d_bucket(hashval), d_hash) {
+        if (d->d_parent == dp && d->d_hashval == hashval && !strncmp(d->d_name, name, DNAME_INLINE_LEN)) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// second chance : the entries hit since the last pass go to the tail once
+// with the seqlock held
+static struct dentry *d_evict(void) {
+    struct dentry *d;
+    for (int i = 0; i < NDENTRY; i++) {
+        d = list_first_entry(&dcache.lru, struct dentry, d_lru);
+        if (d->d_parent == NULL || !d->d_referenced) {
+            break;
+        }
+        d->d_referenced = 0;
+        list_move_tail(&d->d_lru, &dcache.lru);
+    }
+    d = list_first_entry(&dcache.lru, struct dentry, d_lru);
+    if (d->d_parent != NULL) {
+        d_unhash(d);
+    }
+    return d;
+}
+
+int d_lookup(struct inode *dp, const char *name, struct inode **ipp) {
+    struct list_head *head, *pos;
+    struct dentry *d, *found;
+    struct inode *ip = NULL;
+    uint64 hashval;
+    uint seq;
+    int ret;
+
+    if (strlen(name) >= DNAME_INLINE_LEN) {
+        return 0;
+    }
+    hashval = d_hashname(dp, name);
+    head = d_bucket(hashval);
+    push_off();
+    WRITE_ONCE(d_readers[cpuid()], d_readers[cpuid()] + 1);
+    __sync_synchronize();
+    do {
+        seq = read_seqbegin(&dcache.seqlock);
+        found = NULL;
+        // an entry moved to another bucket under us would never lead back to head
+        pos = READ_ONCE(head->next);
+        for (int steps = 0; pos != NULL && pos != head && steps < NDENTRY; steps++) {
+            d = list_entry(pos, struct dentry, d_hash);
+            if (d->d_parent == dp && d->d_hashval == hashval && !strncmp(d->d_name, name, DNAME_INLINE_LEN)) {
+                found = d;
+                ip = d->d_inode;
+                break;
+            }
+            pos = READ_ONCE(pos->next);
+        }
+    } while (read_seqretry(&dcache.seqlock, seq));
+
+    ret = 0;
+    if (found != NULL) {
+        found->d_referenced = 1;
+        // the inode may have been unlinked since, walk the directory then
+        if (ip == NULL) {
+            ret = -1;
+        } else if ((ip = fat32_inode_tryget(ip, dp, name)) != NULL) {
+            *ipp = ip;
+            ret = 1;
+        }
+    }
+    __sync_synchronize();
+    WRITE_ONCE(d_readers[cpuid()], d_readers[cpuid()] + 1);
+    pop_off();
+    return ret;
+}
+
+void d_add(struct inode *dp, const char *name, struct inode *ip) {
+    uint64 hashval;
+    struct dentry *d;
+
+    if (strlen(name) >= DNAME_INLINE_LEN) {
+        return;
+    }
+    hashval = d_hashname(dp, name);
+    write_seqlock(&dcache.seqlock);
+    if ((d = __d_find(dp, name, hashval)) == NULL) {
+        d = d_evict();
+        d->d_parent = dp;
+        d->d_hashval = hashval;
+        safestrcpy(d->d_name, name, DNAME_INLINE_LEN);
+        list_add(&d->d_hash, d_bucket(hashval));
+    }
+    d->d_inode = ip;
+    d->d_referenced = 0;
+    list_move_tail(&d->d_lru, &dcache.lru);
+    write_sequnlock(&dcache.seqlock);
+}
+
+void d_drop(struct inode *dp, const char *name) {
+    struct dentry *d;
+
+    if (strlen(name) >= DNAME_INLINE_LEN) {
+        return;
+    }
+    write_seqlock(&dcache.seqlock);
+    if ((d = __d_find(dp, name, d_hashname(dp, name))) != NULL) {
+        d_free(d);
+    }
+    write_sequnlock(&dcache.seqlock);
+}
+
+void d_prune(struct inode *dp) {
+    write_seqlock(&dcache.seqlock);
+    for (struct dentry *d = dcache.dentry; d < dcache.dentry + NDENTRY; d++) {
+        if (d->d_parent == dp || (d->d_parent != NULL && d->d_inode == dp)) {
+            d_free(d);
+        }
+    }
+    write_sequnlock(&dcache.seqlock);
+
+    // a lookup that read dp before the entries went away is still in flight
+    uint snap[NCPU];
+    for (int i = 0; i < NCPU; i++) {
+        snap[i] = READ_ONCE(d_readers[i]);
+    }
+    for (int i = 0; i < NCPU; i++) {
+        while ((snap[i] & 1) && READ_ONCE(d_readers[i]) == snap[i]) {
+        }
+    }
+}
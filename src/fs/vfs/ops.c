@@ -4,38 +4,38 @@
 #include "fs/fcntl.h"
 #include "fs/vfs/fs.h"
 #include "fs/vfs/ops.h"
+#include "fs/vfs/dcache.h"
+#include "memory/slab.h"
+#include "atomic/ops.h"
 #include "fs/fat/fat32_file.h"
 #include "fs/fat/fat32_mem.h"
 #include "fs/ext2/ext2_file.h"
 #include "ipc/socket.h"
+#include "fs/eventpoll.h"
 
 struct devsw devsw[NDEV];
-struct ftable _ftable;
+// the files come from the per-cpu magazines of the slab, and the table grows with memory
+struct kmem_cache *file_cachep;
 
 // == file layer ==
 struct file *filealloc(fs_t type) {
     // Allocate a file structure.
-    // 语义：从内存中的 _ftable 中寻找一个空闲的 file 项，并返回指向该 file 的指针
+    // 语义：从 file_cachep 中分配一个清零的 file 项，并返回指向该 file 的指针
     ASSERT(type == FAT32);
     if (type < 0) {
         // error: ilegal file system type
         return 0;
     }
     struct file *f;
-    acquire(&_ftable.lock);
-    for (f = _ftable.file; f < _ftable.file + NFILE; f++) {
-        if (f->f_count == 0) {
-            f->f_count = 1;
-            // ASSERT(proc_current()->cwd->fs_type == FAT32);
-            // f->f_op = get_fileops[proc_current()->cwd->fs_type]();
-            f->f_op = get_fileops[type]();
-
-            release(&_ftable.lock);
-            return f;
-        }
+    if ((f = (struct file *)kmem_cache_zalloc(file_cachep)) == 0) {
+        return 0;
     }
-    release(&_ftable.lock);
-    return 0;
+    atomic_set(&f->f_count, 1);
+    // ASSERT(proc_current()->cwd->fs_type == FAT32);
+    // f->f_op = get_fileops[proc_current()->cwd->fs_type]();
+    f->f_op = get_fileops[type]();
+    INIT_LIST_HEAD(&f->f_ep_links);
+    return f;
 }
 
 void generic_fileclose(struct file *f) {
@@ -45,17 +45,20 @@ void generic_fileclose(struct file *f) {
     // 否则，调用iput归还inode节点
     struct file ff;
 
-    acquire(&_ftable.lock);
-    if (f->f_count < 1)
+    // atomic_dec_return returns the old value
+    int ref = atomic_dec_return(&f->f_count);
+    if (ref < 1)
         panic("generic_fileclose");
-    if (--f->f_count > 0) {
-        release(&_ftable.lock);
+    if (ref > 1) {
         return;
     }
+    // the last reference is ours alone now, a dup racing with us can't revive f
+    if (!list_empty(&f->f_ep_links)) {
+        // take it out of the epoll sets first (that may sleep)
+        eventpoll_release(f);
+    }
     ff = *f;
-    f->f_count = 0;
-    f->f_type = FD_NONE;
-    release(&_ftable.lock);
+    kmem_cache_free(file_cachep, f);
 
     if (ff.f_type == FD_PIPE) {
         int wrable = F_WRITEABLE(&ff);
@@ -65,6 +68,8 @@ void generic_fileclose(struct file *f) {
         ff.f_tp.f_inode->i_op->iput(ff.f_tp.f_inode);
     } else if (ff.f_type == FD_SOCKET) {
         free_socket(ff.f_tp.f_sock);
+    } else if (ff.f_type == FD_EPOLL) {
+        ep_free(ff.f_tp.f_ep);
     }
 }
 
@@ -76,6 +81,7 @@ static inline const struct file_operations *get_fat32_fileops(void) {
         .write = fat32_filewrite,
         .fstat = fat32_filestat,
         .readdir = fat32_getdents,
+        .poll = fat32_filepoll,
     };
 
     return &fops_instance;
@@ -147,6 +153,23 @@ static struct inode *inode_namex(char *path, int nameeparent, char *name) {
     }
 
     while ((path = skepelem(path, name)) != 0) {
+        // a loaded directory and a cached name : no need to lock ip
+        if (READ_ONCE(ip->valid) && S_ISDIR(ip->i_mode)) {
+            if (nameeparent && *path == '\0') {
+                return ip;
+            }
+            if (name[0] != '.') {
+                int ret = d_lookup(ip, name, &next);
+                if (ret > 0) {
+                    ip->i_op->iput(ip);
+                    ip = next;
+                    continue;
+                } else if (ret < 0) {
+                    ip->i_op->iput(ip);
+                    return 0;
+                }
+            }
+        }
         // printf("path:%s name:%s\n",path,name);
         // printf("namex: ip : %s ",ip->fat32_i.fname);
         // printf("sem.value %d\n",ip->i_sem.value);
@@ -178,18 +201,17 @@ static struct inode *inode_namex(char *path, int nameeparent, char *name) {
             next = fat32_inode_dup(ip);
         } else {
             if ((next = fat32_inode_dirlookup(ip, name, 0)) == 0) {
+                d_add(ip, name, NULL);
                 fat32_inode_unlock_put(ip);
                 return 0;
             }
+            d_add(ip, name, next);
         }
 
         // printf("dirlook up ok!\n");
 
-        ip->i_op->iunlock(ip);
-        // printf("ip %s sem.value: %d  unlocked~\n",ip->fat32_i.fname, ip->i_sem.value);
-        // if (likely(*path != '\0')) {
-        //     ip->i_op->iput(ip);
-        // }
+        // next holds its parent in memory
+        ip->i_op->iunlock_put(ip);
         ip = next;
     }
     // printf("inode_namex got ip!\n");
@@ -6,14 +6,48 @@
 #include "proc/pcb_life.h"
 #include "kernel/trap.h"
 #include "memory/allocator.h"
+#include "memory/buddy.h"
 #include "atomic/cond.h"
 #include "ipc/signal.h"
 #include "fs/vfs/fs.h"
 #include "fs/vfs/ops.h"
 #include "lib/sbuf.h"
+#include "lib/poll.h"
 #include "debug.h"
 #include "errno.h"
 
+struct pipe *pipe_create(void) {
+    struct pipe *pi;
+
+    if ((pi = (struct pipe *)kzalloc(sizeof(struct pipe))) == 0)
+        return 0;
+    if ((pi->bufs = (struct pipe_buffer *)kzalloc(PIPE_DEF_PAGES * sizeof(struct pipe_buffer))) == 0) {
+        kfree((char *)pi);
+        return 0;
+    }
+    pi->npages = PIPE_DEF_PAGES;
+    pi->readopen = 1;
+    pi->writeopen = 1;
+    pi->head = 0;
+    pi->tail = 0;
+    initlock(&pi->lock, "pipe");
+
+    sema_init(&pi->read_sem, 0, "read_sem");
+    sema_init(&pi->write_sem, 0, "write_sem");
+    init_waitqueue_head(&pi->wait, "pipe_wait");
+    return pi;
+}
+
+void pipe_destroy(struct pipe *pi) {
+    for (; !PIPE_EMPTY(pi); pi->tail++) {
+        kfree((void *)pipe_buf_at(pi, pi->tail)->page);
+    }
+    if (pi->tmp_page)
+        kfree((void *)pi->tmp_page);
+    kfree((char *)pi->bufs);
+    kfree((char *)pi);
+}
+
 int pipe_alloc(struct file **f0, struct file **f1) {
     struct pipe *pi;
     fs_t type = proc_current()->cwd->fs_type;
@@ -21,16 +55,8 @@ int pipe_alloc(struct file **f0, struct file **f1) {
     *f0 = *f1 = 0;
     if ((*f0 = filealloc(type)) == 0 || (*f1 = filealloc(type)) == 0)
         goto bad;
-    if ((pi = (struct pipe *)kalloc()) == 0)
+    if ((pi = pipe_create()) == 0)
         goto bad;
-    pi->readopen = 1;
-    pi->writeopen = 1;
-    pi->nwrite = 0;
-    pi->nread = 0;
-    initlock(&pi->lock, "pipe");
-
-    sema_init(&pi->read_sem, 0, "read_sem");
-    sema_init(&pi->write_sem, 0, "write_sem");
 
     (*f0)->f_type = FD_PIPE;
     (*f0)->f_flags = O_RDONLY;
@@ -41,8 +67,6 @@ int pipe_alloc(struct file **f0, struct file **f1) {
     return 0;
 
 bad:
-    if (pi)
-        kfree((char *)pi);
     if (*f0)
         generic_fileclose(*f0);
     if (*f1)
@@ -50,25 +74,88 @@ bad:
     return -EMFILE;
 }
 
+// wake up all the waiters, they check the pipe again
+static void pipe_wake(struct semaphore *sem, int *waiting) {
+    for (; *waiting > 0; (*waiting)--) {
+        sema_signal(sem);
+    }
+}
+
+void pipe_wake_readers(struct pipe *pi) {
+    pipe_wake(&pi->read_sem, &pi->r_waiting);
+    wake_up_poll(&pi->wait, POLLIN | POLLRDNORM);
+}
+
+// only once a page is free, not for every byte read
+void pipe_wake_writers(struct pipe *pi) {
+    if (!PIPE_FULL(pi) || !pi->readopen) {
+        pipe_wake(&pi->write_sem, &pi->w_waiting);
+        wake_up_poll(&pi->wait, POLLOUT | POLLWRNORM);
+    }
+}
+
+// sleep until the pipe changes, the caller checks it again
+void pipe_wait_readable(struct pipe *pi) {
+    pi->r_waiting++;
+    release(&pi->lock);
+    sema_wait(&pi->read_sem);
+    acquire(&pi->lock);
+}
+
+void pipe_wait_writable(struct pipe *pi) {
+    pi->w_waiting++;
+    release(&pi->lock);
+    sema_wait(&pi->write_sem);
+    acquire(&pi->lock);
+}
+
+// drop the reference of the pipe, keep a page nobody else sees for the next write
+void pipe_buf_release(struct pipe *pi, struct pipe_buffer *buf) {
+    if ((buf->flags & PIPE_BUF_FLAG_CAN_MERGE) && pi->tmp_page == 0 && atomic_read(&pa_to_page(buf->page)->refcnt) == 1) {
+        pi->tmp_page = buf->page;
+    } else {
+        kfree((void *)buf->page);
+    }
+    buf->page = 0;
+}
+
+// the bytes pipe_write can take now: the room in the last page and the free slots
+static uint pipe_room(struct pipe *pi) {
+    uint room = (pi->npages - PIPE_SLOTS_USED(pi)) * PGSIZE;
+
+    if (!PIPE_EMPTY(pi)) {
+        struct pipe_buffer *last = pipe_buf_at(pi, pi->head - 1);
+        if (last->flags & PIPE_BUF_FLAG_CAN_MERGE)
+            room += PGSIZE - (last->offset + last->len);
+    }
+    return room;
+}
+
 void pipe_close(struct pipe *pi, int writable) {
     acquire(&pi->lock);
     if (writable) {
         pi->writeopen = 0;
-        sema_signal(&pi->read_sem);
+        pipe_wake_readers(pi);
+        wake_up_poll(&pi->wait, POLLHUP);
     } else {
         pi->readopen = 0;
-        sema_signal(&pi->write_sem);
+        pipe_wake_writers(pi);
+        wake_up_poll(&pi->wait, POLLERR);
     }
     if (pi->readopen == 0 && pi->writeopen == 0) {
         release(&pi->lock);
-        kfree((char *)pi);
+        pipe_destroy(pi);
     } else
         release(&pi->lock);
 }
 
+// readers are woken once when the writer stops (done or full), not for every page
 int pipe_write(struct pipe *pi, int user_dst, uint64 addr, int n) {
     int i = 0;
     struct proc *pr = proc_current();
+    struct pipe_buffer *buf;
+    uint64 page;
+    uint m;
 
     acquire(&pi->lock);
     while (i < n) {
@@ -76,27 +163,43 @@ int pipe_write(struct pipe *pi, int user_dst, uint64 addr, int n) {
             release(&pi->lock);
             return -1;
         }
-        if (PIPE_FULL(pi)) {
-            sema_signal(&pi->read_sem);
-            release(&pi->lock);
-            sema_wait(&pi->write_sem);
-            acquire(&pi->lock);
-        } else {
-            char ch;
-            if (either_copyin(&ch, user_dst, addr + i, 1) == -1)
+        // append to the last page
+        buf = PIPE_EMPTY(pi) ? NULL : pipe_buf_at(pi, pi->head - 1);
+        if (buf && (buf->flags & PIPE_BUF_FLAG_CAN_MERGE) && buf->offset + buf->len < PGSIZE
+            && (n > PIPE_BUF || i > 0 || pipe_room(pi) >= n)) {
+            m = MIN(PGSIZE - (buf->offset + buf->len), n - i);
+            if (either_copyin((void *)(buf->page + buf->offset + buf->len), user_dst, addr + i, m) == -1)
                 break;
-            pi->data[pi->nwrite++ % PIPESIZE] = ch;
-            i++;
-            // int write_idx = pi->nwrite % PIPESIZE;
-            // int read_idx = pi->nwrite % PIPESIZE;
-            // int cpy_len = PIPESIZE - (write_idx - read_idx);
-            // if (either_copyin(pi->data + write_idx, user_dst, addr + cpy_len, cpy_len) == -1)
-            //     break;
-            // pi->nwrite += cpy_len;
-            // i+= cpy_len;
+            buf->len += m;
+            i += m;
+            continue;
+        }
+        // a write of at most PIPE_BUF bytes is not interleaved with other writers
+        if (PIPE_FULL(pi) || (n <= PIPE_BUF && i == 0 && pipe_room(pi) < n)) {
+            pipe_wake_readers(pi);
+            pipe_wait_writable(pi);
+            continue;
         }
+        if ((page = pi->tmp_page) != 0) {
+            pi->tmp_page = 0;
+        } else if ((page = (uint64)kalloc()) == 0) {
+            if (i == 0)
+                i = -ENOMEM;
+            break;
+        }
+        m = MIN(PGSIZE, n - i);
+        if (either_copyin((void *)page, user_dst, addr + i, m) == -1) {
+            pi->tmp_page = page;
+            break;
+        }
+        buf = pipe_buf_at(pi, pi->head++);
+        buf->page = page;
+        buf->offset = 0;
+        buf->len = m;
+        buf->flags = PIPE_BUF_FLAG_CAN_MERGE;
+        i += m;
     }
-    sema_signal(&pi->read_sem);
+    pipe_wake_readers(pi);
     release(&pi->lock);
 
     return i;
@@ -105,7 +208,8 @@ int pipe_write(struct pipe *pi, int user_dst, uint64 addr, int n) {
 int pipe_read(struct pipe *pi, int user_dst, uint64 addr, int n) {
     int i;
     struct proc *pr = proc_current();
-    char ch;
+    struct pipe_buffer *buf;
+    uint m;
 
     acquire(&pi->lock);
     while (PIPE_EMPTY(pi) && pi->writeopen) {
@@ -113,23 +217,90 @@ int pipe_read(struct pipe *pi, int user_dst, uint64 addr, int n) {
             release(&pi->lock);
             return -1;
         }
-        release(&pi->lock);
-        sema_wait(&pi->read_sem);
-        acquire(&pi->lock);
+        pipe_wait_readable(pi);
     }
-    for (i = 0; i < n; i++) {
-        if (PIPE_EMPTY(pi))
+    for (i = 0; i < n && !PIPE_EMPTY(pi);) {
+        buf = pipe_buf_at(pi, pi->tail);
+        m = MIN(buf->len, n - i);
+        if (either_copyout(user_dst, addr + i, (void *)(buf->page + buf->offset), m) == -1)
             break;
-        ch = pi->data[pi->nread % PIPESIZE];
-        if (either_copyout(user_dst, addr + i, &ch, 1) == -1)
-            break;
-        ++pi->nread;
+        buf->offset += m;
+        buf->len -= m;
+        i += m;
+        if (buf->len == 0) {
+            pipe_buf_release(pi, buf);
+            pi->tail++;
+        }
     }
-    sema_signal(&pi->write_sem);
+    pipe_wake_writers(pi);
     release(&pi->lock);
     return i;
 }
 
+// the read end is readable with data or once the writers are gone (POLLHUP),
+// the write end is writable with a free slot, POLLERR once the readers are gone
+uint pipe_poll(struct file *f, poll_table *pt) {
+    struct pipe *pi = f->f_tp.f_pipe;
+    uint mask = 0;
+
+    poll_wait(f, &pi->wait, pt);
+    acquire(&pi->lock);
+    if (F_READABLE(f)) {
+        if (!PIPE_EMPTY(pi))
+            mask |= POLLIN | POLLRDNORM;
+        if (!pi->writeopen)
+            mask |= POLLHUP;
+    } else {
+        if (!PIPE_FULL(pi))
+            mask |= POLLOUT | POLLWRNORM;
+        if (!pi->readopen)
+            mask |= POLLERR;
+    }
+    release(&pi->lock);
+    return mask;
+}
+
+int pipe_get_size(struct pipe *pi) {
+    return PIPE_SIZE(pi);
+}
+
+// F_SETPIPE_SZ : size is rounded up to a power of two pages
+// the buffers move to the start of the new ring, the pages stay where they are
+int pipe_set_size(struct pipe *pi, int size) {
+    uint npages = 1;
+    struct pipe_buffer *bufs;
+    uint used;
+
+    if (size <= 0)
+        return -EINVAL;
+    while (npages < PIPE_MAX_PAGES && npages * PGSIZE < size)
+        npages <<= 1;
+    if (npages * PGSIZE < size)
+        return -EPERM;
+    if ((bufs = (struct pipe_buffer *)kzalloc(npages * sizeof(struct pipe_buffer))) == 0)
+        return -ENOMEM;
+
+    acquire(&pi->lock);
+    used = PIPE_SLOTS_USED(pi);
+    if (used > npages) {
+        release(&pi->lock);
+        kfree((char *)bufs);
+        return -EBUSY;
+    }
+    for (uint i = 0; i < used; i++) {
+        bufs[i] = *pipe_buf_at(pi, pi->tail + i);
+    }
+    kfree((char *)pi->bufs);
+    pi->bufs = bufs;
+    pi->npages = npages;
+    pi->tail = 0;
+    pi->head = used;
+    // a larger pipe may let writers go on
+    pipe_wake_writers(pi);
+    release(&pi->lock);
+    return PIPE_SIZE(pi);
+}
+
 // int pipe_alloc(struct file **f0, struct file **f1) {
 //     struct pipe *pi = 0;
 //     fs_t type = proc_current()->cwd->fs_type;
@@ -225,14 +396,14 @@ int pipe_read(struct pipe *pi, int user_dst, uint64 addr, int n) {
 // }
 int pipe_empty(struct pipe *p) {
     acquire(&p->lock);
-    int ret = (p->nread == p->nwrite);
+    int ret = PIPE_EMPTY(p);
     release(&p->lock);
     return ret;
 }
 
 int pipe_full(struct pipe *p) {
     acquire(&p->lock);
-    int ret = ((p->nread + PIPESIZE) == p->nwrite);
+    int ret = PIPE_FULL(p);
     release(&p->lock);
     return ret;
 }
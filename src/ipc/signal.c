@@ -103,6 +103,21 @@ void sigpending_init(struct sigpending *sig) {
     INIT_LIST_HEAD(&sig->list);
 }
 
+// is there a signal signal_handle() acts on? (a sleep returns -EINTR for it)
+int signal_pending(struct tcb *t) {
+    struct sigqueue *sig_cur;
+
+    if (t->sig_pending_cnt == 0)
+        return 0;
+    list_for_each_entry(sig_cur, &t->pending.list, list) {
+        int sig_no = sig_cur->info.si_signo;
+        if (sig_ignored(t, sig_no) || sig_action(t, sig_no).sa_handler == SIG_IGN)
+            continue;
+        return 1;
+    }
+    return 0;
+}
+
 // signal handlle
 int signal_handle(struct tcb *t) {
     if (t->sig_pending_cnt == 0)
@@ -8,6 +8,7 @@
 #include "fs/vfs/ops.h"
 #include "ipc/socket.h"
 #include "atomic/spinlock.h"
+#include "lib/poll.h"
 #include "syscall_gen/syscall_num.h"
 #include <stdarg.h>
 
@@ -192,8 +193,8 @@ uint64 sys_getsockname(void) {
     int sockfd;
     struct file *fp;
     struct socket *sock;
-    struct sockaddr_in *sa = (struct sockaddr_in *)getphyaddr(proc_current()->mm->pagetable, tp->a1);
-    paddr_t *addrlen = (paddr_t *)getphyaddr(proc_current()->mm->pagetable, tp->a2);
+    struct sockaddr_in sa;
+    uint32 addrlen = sizeof(struct sockaddr_in);
     // uint32 addrlen = tp->a2;
     if (argfd(0, &sockfd, &fp) < 0) {
         Warn("argfd failed");
@@ -201,9 +202,15 @@ uint64 sys_getsockname(void) {
     }
     sock = fp->f_tp.f_sock;
 
-    sa->sin_port = sock->src_port;
-    sa->sin_addr.s_addr = INADDR_ANY;
-    *addrlen = sizeof(struct sockaddr_in);
+    // copyout, the buffers may be on a copy-on-write stack
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = sock->src_port;
+    sa.sin_addr.s_addr = INADDR_ANY;
+    if (copyout(proc_current()->mm->pagetable, tp->a1, (char *)&sa, sizeof(sa)) < 0
+        || copyout(proc_current()->mm->pagetable, tp->a2, (char *)&addrlen, sizeof(addrlen)) < 0) {
+        return -1;
+    }
     return 0;
 }
 
@@ -253,6 +260,7 @@ uint64 sys_accept(void) {
 static void do_connect(struct socket *src_sock, struct socket *dst_sock) {
     list_add_tail(&src_sock->node, &dst_sock->pending);
     sema_signal(&dst_sock->do_accept);
+    wake_up_poll(&dst_sock->wait, POLLIN | POLLRDNORM);
     return;
 }
 
@@ -308,6 +316,7 @@ struct socket *alloc_socket() {
             memset(&socket_table[i], 0, sizeof(struct socket));
             socket_table[i].used = 1;
             INIT_LIST_HEAD(&socket_table[i].pending);
+            init_waitqueue_head(&socket_table[i].wait, "socket_wait");
             release(&socket_table_lock);
             return &socket_table[i];
         }
@@ -354,7 +363,7 @@ uint64 sys_socket(void) {
 
     fp->f_type = FD_SOCKET;
     fp->f_tp.f_sock = sock;
-    fp->f_count = 1;
+    atomic_set(&fp->f_count, 1);
     fp->f_flags |= (type & SOCK_CLOEXEC) ? FD_CLOEXEC : 0;
     fp->f_flags |= (type & SOCK_NONBLOCK) ? O_NONBLOCK : 0;
     info_socket(SYS_socket, fd, sock, type);
@@ -384,7 +393,7 @@ int create_sockfp(int type) {
 
     fp->f_type = FD_SOCKET;
     fp->f_tp.f_sock = sock;
-    fp->f_count = 1;
+    atomic_set(&fp->f_count, 1);
     // tmp for socketpair
     fp->f_flags |= O_RDWR;
     info_socket(SYS_socket, fd, sock, type);
@@ -422,6 +431,8 @@ uint64 socket_write(struct socket *sock, vaddr_t addr, int len) {
         }
         ret++;
     }
+    if (ret > 0)
+        wake_up_poll(&sock->wait, POLLIN | POLLRDNORM);
 
     return ret;
 }
@@ -447,9 +458,28 @@ uint64 socket_read(struct socket *sock, vaddr_t addr, int len) {
         }
         ret++;
     }
+    if (ret > 0)
+        wake_up_poll(&sock->wait, POLLOUT | POLLWRNORM);
 
     return ret;
 }
+
+// readable with data or a connection to accept, writable while the buffer has room
+uint socket_poll(struct file *f, poll_table *pt) {
+    struct socket *sock = f->f_tp.f_sock;
+    uint mask = 0;
+
+    poll_wait(f, &sock->wait, pt);
+    if (sock->do_accept.value > 0)
+        mask |= POLLIN | POLLRDNORM;
+    if (sock->sbuf.type != NONE) {
+        if (!sbuf_empty(&sock->sbuf))
+            mask |= POLLIN | POLLRDNORM;
+        if (!sbuf_full(&sock->sbuf))
+            mask |= POLLOUT | POLLWRNORM;
+    }
+    return mask;
+}
 //    ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
 //                   const struct sockaddr *dest_addr, socklen_t addrlen);
 uint64 sys_sendto(void) {
@@ -23,14 +23,21 @@ void binit(void);
 void fileinit(void);
 void vmas_init();
 void mm_init();
+void kmem_cache_init(void);
+void lru_init(void);
 void userinit(void);
 void proc_init();
 void inode_table_init(void);
+void dcache_init(void);
 void hash_tables_init(void);
+void futex_hash_init(void);
 void hartinit();
 void pdflush_init();
+void kswapd_init(void);
+void itruncd_init(void);
 void page_writeback_timer_init(void);
 void disk_init(void);
+void blk_init(void);
 void null_zero_dev_init();
 void dma_init(void);
 void init_socket_table();
@@ -77,6 +84,10 @@ void main(uint64 hartid) {
         
         //========== physical memory management ==========
         mm_init();
+        //========== slab allocator ==========
+        kmem_cache_init();
+        //========== page cache LRU ==========
+        lru_init();
         //========== VMA management ==========
         vmas_init();
 
@@ -103,17 +114,20 @@ void main(uint64 hartid) {
         binit();
         fileinit();
         inode_table_init();
+        dcache_init();
 
         //========== socket ==========
         init_socket_table();
 
         //========== global map ==========
         hash_tables_init();
+        futex_hash_init();
 
 
         Info("========= Block device ==========\n");
         //========== block device ============
         disk_init();
+        blk_init();
 
 #if defined(SIFIVE_U) || defined(SIFIVE_B)
         // DMA
@@ -129,7 +143,15 @@ void main(uint64 hartid) {
 #endif
 
         // pdflush kernel thread
-        // pdflush_init();
+        pdflush_init();
+        // periodic writeback by pdflush, on the timers of timer_init()
+        page_writeback_timer_init();
+
+        // kswapd kernel thread
+        kswapd_init();
+
+        // itruncd kernel thread
+        itruncd_init();
         __sync_synchronize();
 
         hart_start();
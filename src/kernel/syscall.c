@@ -235,6 +235,12 @@ static struct syscall_info info[] = {
     // int clock_gettime(clockid_t clk_id, struct timespec *tp);
     [SYS_clock_gettime] { "clock_gettime", 2, "dp" },
     [SYS_sendfile] { "sendfile", 4, "dddd" },
+    // ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags);
+    [SYS_splice] { "splice", 6, "dpdpdd" },
+    // ssize_t tee(int fd_in, int fd_out, size_t len, unsigned int flags);
+    [SYS_tee] { "tee", 4, "dddd" },
+    // ssize_t vmsplice(int fd, const struct iovec *iov, size_t nr_segs, unsigned int flags);
+    [SYS_vmsplice] { "vmsplice", 4, "dpdd" },
 
     // int socket(int domain, int type, int protocol);
     [SYS_socket] { "socket", 3, "ddd", 'd' },
@@ -303,6 +309,11 @@ static struct syscall_info info[] = {
     [SYS_sched_getscheduler] { "sched_getscheduler", 3, "ddp" },
     [SYS_sched_getparam] { "sched_getparam", 2, "dp" },
     [SYS_sched_setscheduler] { "sched_setscheduler", 3, "ddp" },
+    [SYS_sched_setparam] { "sched_setparam", 2, "dp" },
+    [SYS_sched_get_priority_max] { "sched_get_priority_max", 1, "d" },
+    [SYS_sched_get_priority_min] { "sched_get_priority_min", 1, "d" },
+    [SYS_setpriority] { "setpriority", 3, "ddd" },
+    [SYS_getpriority] { "getpriority", 2, "dd" },
     [SYS_clock_getres] { "clock_getres", 2, "dp" },
     [SYS_nanosleep] { "nanosleep", 2, "pp" },
     [SYS_futex] { "futex", 6, "pddppd" },
@@ -330,6 +341,12 @@ static struct syscall_info info[] = {
     //        int ppoll(struct pollfd *fds, nfds_t nfds,
     //    const struct timespec *tmo_p, const sigset_t *sigmask);
     [SYS_ppoll] { "ppoll", 4, "pdpp", },
+    // int epoll_create1(int flags);
+    [SYS_epoll_create1] { "epoll_create1", 1, "d", 'd' },
+    // int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+    [SYS_epoll_ctl] { "epoll_ctl", 4, "dddp", 'd' },
+    // int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask);
+    [SYS_epoll_pwait] { "epoll_pwait", 5, "dpddp", 'd' },
 };
 
 // static int syscall_filter[] = {
@@ -470,6 +487,7 @@ void syscall(void) {
         // int pages_before = atomic_read(&pages_cnt);
         // uint64 time_before = rdtime();
         t->trapframe->a0 = syscalls[num]();
+        argfd_put(t);
         // uint64 time_after = rdtime();
         // int pages_after = atomic_read(&pages_cnt);
         // syscall_mm[num] += (pages_after - pages_before);
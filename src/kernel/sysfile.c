@@ -25,36 +25,62 @@
 #include "fs/vfs/ops.h"
 #include "fs/stat.h"
 #include "fs/uio.h"
+#include "fs/splice.h"
 #include "kernel/syscall.h"
 #include "fs/ioctl.h"
+#include "fs/bio.h"
+#include "memory/writeback.h"
+#include "proc/pdflush.h"
 
-#define FILE2FD(f, proc) (((char *)(f) - (char *)(proc)->ofile) / sizeof(struct file))
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
-// 它是线程安全的
+// 它是线程安全的: the fdtable may be shared (threads, CLONE_FILES), so the file is
+// pinned until the syscall returns, a close by another thread can't free it under us
 int argfd(int n, int *pfd, struct file **pf) {
     int fd;
     struct file *f;
     struct proc *p = proc_current();
+    struct tcb *t = thread_current();
     argint(n, &fd);
     if (fd < 0 || fd >= NOFILE)
         return -1;
 
-    // in case another thread writes after the current thead reads
-    sema_wait(&p->tlock);
-    if ((f = proc_current()->ofile[fd]) == 0) {
-        sema_signal(&p->tlock);
+    if ((f = fdt_fget(p->files, fd)) == 0) {
         return -1;
-    } else {
-        if (pfd)
-            *pfd = fd;
-        if (pf)
-            *pf = f;
     }
-    sema_signal(&p->tlock);
+    ASSERT(t->nr_pinned < NPINFD);
+    t->fd_pinned[t->nr_pinned++] = f;
+    if (pfd)
+        *pfd = fd;
+    if (pf)
+        *pf = f;
     return 0;
 }
 
+// drop what argfd() pinned, syscall() does it when the syscall returns
+void argfd_put(struct tcb *t) {
+    while (t->nr_pinned > 0) {
+        generic_fileclose(t->fd_pinned[--t->nr_pinned]);
+    }
+}
+
+static void fileclose_deferred(uint64 f) {
+    generic_fileclose((struct file *)f);
+}
+
+// the same for a thread killed inside a syscall (see thread_reclaim), we can't sleep there,
+// so the last reference of a file goes to pdflush
+void argfd_put_atomic(struct tcb *t) {
+    while (t->nr_pinned > 0) {
+        struct file *f = t->fd_pinned[--t->nr_pinned];
+        if (atomic_add_unless(&f->f_count, -1, 1) != 1)
+            continue;
+        if (pdflush_operation(fileclose_deferred, (uint64)f) < 0) {
+            printf("argfd_put_atomic: no pdflush, leak a file\n");
+        }
+    }
+}
+
 static inline int __namecmp(const char *s, const char *t) {
     return strncmp(s, t, MAXPATH);
 }
@@ -63,20 +89,7 @@ static inline int __namecmp(const char *s, const char *t) {
 // Takes over file reference from caller on success.
 // 它是线程安全的
 int fdalloc(struct file *f) {
-    int fd;
-    struct proc *p = proc_current();
-
-    sema_wait(&p->tlock);
-    // for (fd = 0; fd < NOFILE; fd++) {
-    for (fd = 0; fd < p->max_ofile; fd++) {
-        if (p->ofile[fd] == 0) {
-            p->ofile[fd] = f;
-            sema_signal(&p->tlock);
-            return fd;
-        }
-    }
-    sema_signal(&p->tlock);
-    return -1;
+    return fdt_install(proc_current()->files, f, 0);
 }
 
 // return ip without ip->lock held
@@ -108,7 +121,7 @@ static struct inode *find_inode(char *path, int dirfd, char *name) {
         // path为相对于 dirfd目录的路径
         struct file *f;
         // acquire(&p->tlock);
-        if (dirfd < 0 || dirfd >= NOFILE || (f = p->ofile[dirfd]) == 0) {
+        if (dirfd < 0 || dirfd >= NOFILE || (f = fdt_fget(p->files, dirfd)) == 0) {
             // release(&p->tlock);
             // printf("about to leave find_inode!\n");
             return 0;
@@ -116,14 +129,13 @@ static struct inode *find_inode(char *path, int dirfd, char *name) {
         struct inode *oldcwd = p->cwd;
         p->cwd = f->f_tp.f_inode;
         ip = (!name) ? namei(path) : namei_parent(path, name);
+        p->cwd = oldcwd;
+        generic_fileclose(f);
         if (ip == 0) {
             // release(&p->tlock);
-
-            p->cwd = oldcwd;
             // printf("about to leave find_inode!\n");
             return 0;
         }
-        p->cwd = oldcwd;
         // release(&p->tlock);
     }
 
@@ -158,7 +170,7 @@ int assist_openat(struct inode *ip, int flags, int omode, struct file **fp) {
     f->f_tp.f_inode = ip;
     f->f_flags = flags; // TODO(): &
     f->f_mode = omode & 0777;
-    f->f_count = 1;
+    atomic_set(&f->f_count, 1);
 
     if (((flags & O_TRUNC) == O_TRUNC) && S_ISREG(ip->i_mode)) {
         ip->i_size = 0;
@@ -186,6 +198,8 @@ static struct inode *assist_icreate(char *path, int dirfd, uint16 type, short ma
     ASSERT(dp->i_op);
     // dp->i_op->ilock(dp); // no need to lock dp !
     ip = dp->i_op->icreate(dp, name, type, major, minor); // don't check, caller will do this
+    // ip holds its parent in memory
+    dp->i_op->iput(dp);
     return ip;
 }
 
@@ -286,60 +300,28 @@ static int do_faccess(struct inode *ip, int mode, int flags) {
 }
 
 // 如果offset不为NULL，则不会更新in_fd的pos,否则pos会更新，offset也会被赋值
+// the page cache pages of rf go through a pipe, not a kernel buffer of count bytes
 static uint64 do_sendfile(struct file *rf, struct file *wf, off_t __user *poff, size_t count) {
-    void *kbuf;
-    struct inode *rdip, *wrip;
     off_t offset;
-    ssize_t nread, nwritten;
-    // bug like this :
-    // kbuf = kmalloc(PGSIZE)
-    // printfBlue("count : %ldkbuf = kzalloc(count)B, %ldKB, %ldMB\n",count, count/1024, count/1024/1024);
-    if ((kbuf = kzalloc(count)) == 0) {
-        return -1;
-    }
+    ssize_t nwritten;
+
     if (poff) {
-        either_copyin(&offset, 1, (uint64)poff, sizeof(off_t));
+        if (either_copyin(&offset, 1, (uint64)poff, sizeof(off_t)) < 0) {
+            return -1;
+        }
     } else {
         offset = rf->f_pos;
     }
-    rdip = rf->f_tp.f_inode;
-    wrip = wf->f_tp.f_inode;
-    if ((nread = rdip->i_op->iread(rdip, 0, (uint64)kbuf, offset, count)) <= 0) {
-        goto bad;
-    }
-
-    if (wf->f_type == FD_PIPE) {
-        // if ((nwritten = pipewrite(wf->f_tp.f_pipe, 0, (uint64)kbuf, count)) < 0) {
-        //     goto bad;
-        // }
-        if ((nwritten = pipe_write(wf->f_tp.f_pipe, 0, (uint64)kbuf, count)) < 0) {
-            goto bad;
-        }
-    } else if (wf->f_type == FD_INODE) {
-        if ((nwritten = wrip->i_op->iwrite(wrip, 0, (uint64)kbuf, wf->f_pos, MIN(count, nread))) < 0) {
-            goto bad;
-        }
-    } else {
-        // unsupported file type
-        goto bad;
+    if ((nwritten = do_splice_direct(rf, &offset, wf, count)) < 0) {
+        return -1;
     }
 
-    offset += nread;
-
     if (poff) {
         either_copyout(1, (uint64)poff, &offset, sizeof(offset));
     } else {
-        rf->f_pos += nread;
-        wf->f_pos += nwritten;
+        rf->f_pos = offset;
     }
-    kfree(kbuf);
     return nwritten;
-
-bad:
-    if (kbuf) {
-        kfree(kbuf);
-    }
-    return -1;
 }
 
 static uint64 do_renameat2(struct inode *ip, int newdirfd, char *newpath, int flags) {
@@ -350,6 +332,8 @@ static uint64 do_renameat2(struct inode *ip, int newdirfd, char *newpath, int fl
     newip = find_inode(newpath, newdirfd, 0);
     if (unlikely(ip == newip)) {
         // 指向同一个文件
+        newip->i_op->iput(newip);
+        ip->i_op->iput(ip);
         return 0;
     }
 
@@ -371,6 +355,8 @@ static uint64 do_renameat2(struct inode *ip, int newdirfd, char *newpath, int fl
         } else {
             // 删除, 然后创建
             ASSERT(newip->parent->i_sem.value > 0);
+            // __unlink puts it
+            newip->parent->i_op->idup(newip->parent);
             newip->parent->i_op->ilock(newip->parent);
             // assist_unlink(newip);    // error! do not use this
             __unlink(newip->parent, newip);
@@ -387,6 +373,8 @@ static uint64 do_renameat2(struct inode *ip, int newdirfd, char *newpath, int fl
         } else {
             // 删除，然后创建
             ASSERT(newip->parent->i_sem.value > 0);
+            // __unlink puts it
+            newip->parent->i_op->idup(newip->parent);
             newip->parent->i_op->ilock(newip->parent);
             // assist_unlink(newip);    // error! do not use this
             __unlink(newip->parent, newip);
@@ -414,7 +402,7 @@ create:
 
     // 2. 删除原目录项entry（不删除文件数据）
     ASSERT(ip->parent->i_op);
-    parent = ip->parent;
+    parent = ip->parent->i_op->idup(ip->parent);
     ASSERT(parent->i_sem.value > 0);
     parent->i_op->ilock(parent);
     parent->i_op->ientrydelete(parent, ip);
@@ -446,25 +434,18 @@ static int assist_dupfd(struct file *f) {
 // 一定返回 newfd
 static int assist_setfd(struct file *f, int oldfd, int newfd) {
     struct proc *p = proc_current();
+    struct file *old;
     if (oldfd == newfd) {
         // do nothing
         return EINVAL;
         // return newfd;
     }
-    sema_wait(&p->tlock); // 可以修改为粒度小一些的锁;可以往_file结构里加锁，或者fdtable
-    if (p->ofile[newfd] == 0) {
-        // not used, great!
-        p->ofile[newfd] = f;
-        sema_signal(&p->tlock);
-    } else {
-        // close and reuse
-        // two steps must be atomic!
-        generic_fileclose(p->ofile[newfd]);
-        p->ofile[newfd] = f;
-        sema_signal(&p->tlock);
-    }
     // fat32_filedup(f);
     f->f_op->dup(f);
+    // reuse newfd atomically, close what it had afterwards
+    if ((old = fdt_replace(p->files, newfd, f)) != 0) {
+        generic_fileclose(old);
+    }
     return newfd;
 }
 
@@ -516,6 +497,20 @@ static uint64 do_fcntl(struct file *f, int cmd) {
         //     proc_current()->ofile[ret]->f_flags |= FD_CLOEXEC;
         // }
         break;
+
+    case F_SETPIPE_SZ:
+        if (f->f_type != FD_PIPE) {
+            ret = -EBADF;
+        } else if (argint(2, &arg) < 0) {
+            ret = -EINVAL;
+        } else {
+            ret = pipe_set_size(f->f_tp.f_pipe, arg);
+        }
+        break;
+
+    case F_GETPIPE_SZ:
+        ret = (f->f_type == FD_PIPE) ? pipe_get_size(f->f_tp.f_pipe) : -EBADF;
+        break;
     default:
         ret = 0;
         break;
@@ -707,10 +702,10 @@ uint64 sys_close(void) {
     int fd;
     struct file *f;
 
-    if (argfd(0, &fd, &f) < 0) {
+    argint(0, &fd);
+    if (fd < 0 || fd >= NOFILE || (f = fdt_remove(proc_current()->files, fd)) == 0) {
         return -1;
     }
-    proc_current()->ofile[fd] = 0;
 
 #ifdef __DEBUG_FS__
     printfCYAN("close : filename : %s, pid %d, fd = %d\n", f->f_tp.f_inode->fat32_i.fname, proc_current()->pid, fd);
@@ -807,21 +802,25 @@ uint64 sys_linkat(void) {
     ASSERT(flags == 0);
 
     char oldname[MAXPATH], newname[MAXPATH];
-    struct inode *oldip, *newdp;
+    struct inode *oldip, *newdp, *newip;
     if ((newdp = find_inode(newpath, newdirfd, newname)) == 0) {
         // 新路径的目录不存在
         return -1;
     }
     if ((oldip = find_inode(oldpath, olddirfd, oldname)) == 0) {
         // 旧文件的inode不存在
+        newdp->i_op->iput(newdp);
         return -1;
     }
+    oldip->i_op->iput(oldip);
 
     // if (fat32_inode_dirlookup(newdp, newname, 0) != 0)
-    if (newdp->i_op->idirlookup(newdp, newname, 0) != 0) {
+    newdp->i_op->ilock(newdp);
+    if ((newip = newdp->i_op->idirlookup(newdp, newname, 0)) != 0) {
         // 新文件已存在
-        return 0;
+        newip->i_op->iput(newip);
     }
+    newdp->i_op->iunlock_put(newdp);
 
     // unfinished ! but will not implement
     // FAT32 don't support hard link
@@ -861,6 +860,7 @@ uint64 sys_unlinkat(void) {
     // printf("unlinkat: %d :find inode ok!\n",hit);
     if (__namecmp(name, ".") == 0 || __namecmp(name, "..") == 0) {
         //  error: cannot unlink "." or "..".
+        dp->i_op->iput(dp);
         return -1;
     }
 
@@ -1122,6 +1122,7 @@ uint64 sys_chdir(void) {
     }
 
     ip->i_op->iunlock(ip);
+    p->cwd->i_op->iput(p->cwd);
     p->cwd = ip;
     return 0;
 }
@@ -1144,15 +1145,15 @@ uint64 sys_pipe2(void) {
     fd0 = -1;
     if ((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0) { // 给当前进程分配两个文件描述符，代指那两个管道文件
         if (fd0 >= 0)
-            p->ofile[fd0] = 0;
+            fdt_remove(p->files, fd0);
         generic_fileclose(rf);
         generic_fileclose(wf);
         return -EMFILE;
     }
     if (copyout(p->mm->pagetable, fdarray, (char *)&fd0, sizeof(fd0)) < 0
         || copyout(p->mm->pagetable, fdarray + sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0) {
-        p->ofile[fd0] = 0;
-        p->ofile[fd1] = 0;
+        fdt_remove(p->files, fd0);
+        fdt_remove(p->files, fd1);
         generic_fileclose(rf);
         generic_fileclose(wf);
         return -1;
@@ -1160,9 +1161,11 @@ uint64 sys_pipe2(void) {
     return 0;
 }
 
-// pseudo implement
+// pseudo implement, but the file system is on the disk once it returns
 uint64 sys_umount2(void) {
     // ASSERT(0);
+    writeback_inodes(0);
+    bsync();
     return 0;
 }
 
@@ -1374,7 +1377,9 @@ uint64 sys_faccessat(void) {
     if ((ip = find_inode(pathname, dirfd, 0)) == 0) {
         return -1;
     }
-    return do_faccess(ip, mode, flags);
+    int ret = do_faccess(ip, mode, flags);
+    ip->i_op->iput(ip);
+    return ret;
 }
 
 // 功能：copies  data  between  one  file descriptor and another
@@ -1549,6 +1554,7 @@ long do_utimes(int dfd, char *filename, struct timespec *times, int flags) {
             return -ENOTDIR;
         }
         error = utimes_common(ip, times);
+        ip->i_op->iput(ip);
     }
     // error = utimes_common(file->f_tp.f_inode, times);
     // 		fput(file);
@@ -1767,8 +1773,7 @@ uint64 sys_fstatat(void) {
     kbuf.st_ctim.ts_nsec = 0;
     kbuf.st_ctim.ts_sec = 0;
 
-    ip->i_op->iunlock(ip);
-    // ip->i_op->iunlock_put(ip);// not nesessary for test
+    ip->i_op->iunlock_put(ip);
 
     // printf("name : %s\n", ip->fat32_i.fname);// debug
     // print_stat(&kbuf);// debug
@@ -1834,12 +1839,23 @@ uint64 sys_pwrite64(void) {
 // synchronize cached writes to persistent storage
 // void sync(void);
 uint64 sys_sync(void) {
+    writeback_inodes(0);
+    bsync();
     return 0;
 }
 
 // synchronize a file's in-core state with storage device
 // int fsync(int fd);
 uint64 sys_fsync(void) {
+    struct file *f;
+    if (argfd(0, 0, &f) < 0) {
+        return -EBADF;
+    }
+    if (f->f_type == FD_INODE) {
+        writeback_single_inode(f->f_tp.f_inode);
+    }
+    // the FAT and directory entries it depends on
+    bsync();
     return 0;
 }
 
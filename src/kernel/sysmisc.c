@@ -17,6 +17,8 @@
 #include "ipc/signal.h"
 #include "memory/vm.h"
 #include "memory/allocator.h"
+#include "memory/vma.h"
+#include "memory/pagefault.h"
 #include "kernel/syscall.h"
 
 extern atomic_t ticks;
@@ -341,8 +343,7 @@ int do_prlimit(struct proc *p, uint32 resource, struct rlimit *new_rlim, struct
             *rlim = *new_rlim;
             switch (resource) {
             case RLIMIT_NOFILE:
-                p->max_ofile = new_rlim->rlim_max;
-                p->cur_ofile = new_rlim->rlim_cur;
+                fdt_set_max(p->files, new_rlim->rlim_max);
                 break;
             case RLIMIT_STACK:
                 // panic("stack not tested\n");
@@ -713,19 +714,20 @@ uint64 sys_clock_nanosleep(void) {
 uint64 sys_getrusage(void) {
     int who;
     uint64 usage;
-    paddr_t pa;
     struct proc *p = proc_current();
 
     argint(0, &who);
     argaddr(1, &usage);
 
-    pa = getphyaddr(proc_current()->mm->pagetable, usage);
+    // not through the physical address, usage may be on a copy-on-write stack
     switch (who) {
     case RUSAGE_SELF: {
         struct timeval utime = TIME2TIMEVAL(p->utime);
         struct timeval stime = TIME2TIMEVAL(p->stime);
-        memmove((void *)(&((struct rusage *)pa)->ru_utime), (const void *)&utime, sizeof(struct timeval));
-        memmove((void *)(&((struct rusage *)pa)->ru_stime), (const void *)&stime, sizeof(struct timeval));
+        if (copyout(p->mm->pagetable, (uint64) & ((struct rusage *)usage)->ru_utime, (char *)&utime, sizeof(struct timeval)) < 0
+            || copyout(p->mm->pagetable, (uint64) & ((struct rusage *)usage)->ru_stime, (char *)&stime, sizeof(struct timeval)) < 0) {
+            return -1;
+        }
         break;
     }
     default:
@@ -748,6 +750,22 @@ uint64 sys_readlinkat(void) {
 }
 //    int madvise(void *addr, size_t length, int advice);
 uint64 sys_madvise(void) {
+    vaddr_t addr;
+    size_t length;
+    int advice;
+    argaddr(0, &addr);
+    argulong(1, &length);
+    argint(2, &advice);
+
+    if (addr % PGSIZE != 0) {
+        return -EINVAL;
+    }
+    if (advice == MADV_WILLNEED) {
+        // prefault the range now, the other advices are only hints
+        if (populate_vma_range(proc_current()->mm, addr, addr + length) < 0) {
+            return -ENOMEM;
+        }
+    }
     return 0;
 }
 
@@ -17,6 +17,8 @@
 #include "kernel/syscall.h"
 #include "atomic/ops.h"
 #include "memory/binfmt.h"
+#include "proc/sched.h"
+#include "errno.h"
 
 #define ROOT_UID 0
 
@@ -474,6 +476,7 @@ uint64 sys_tkill() {
 
     // do_tkill
     do_tkill(t, signo);
+    release(&t->lock);
 
     return 0;
 }
@@ -492,15 +495,16 @@ uint64 sys_tgkill () {
     struct tcb *t;
     if ((t = find_get_tidx(tgid, tid)) == NULL)
         return -1;
-    // release(&t->lock);
 
     // empty signal
     if (signo == 0) {
+        release(&t->lock);
         return 0;
     }
 
     // do_tkill
     do_tkill(t, signo);
+    release(&t->lock);
 
     return 0;
 }
@@ -622,19 +626,189 @@ uint64 sys_setsid(void) {
 uint64 sys_gettid(void) {
     return proc_current()->pid;
 }
+// the thread that pid stands for, 0 is the caller
+// libc knows its threads by tid (clone, set_tid_address), getpid() gives the process
+// return it with t->lock held
+static struct tcb *sched_find_thread(int pid) {
+    struct proc *p;
+    struct tcb *t, *leader = NULL;
+    if (pid == 0) {
+        t = thread_current();
+        acquire(&t->lock);
+        return t;
+    }
+    if (pid < 0) {
+        return NULL;
+    }
+    if ((t = find_get_tid(pid)) != NULL) {
+        return t;
+    }
+    if ((p = find_get_pid(pid)) == NULL) {
+        return NULL;
+    }
+    // p stays, but free_proc() frees its thread group with p->lock held
+    acquire(&p->lock);
+    if (p->pid == pid && p->tg != NULL) {
+        acquire(&p->tg->lock);
+        // the leader may have exited before the others, only the threads on the list are alive
+        list_for_each_entry(t, &p->tg->threads, threads) {
+            if (t == p->tg->group_leader) {
+                acquire(&t->lock);
+                leader = t;
+                break;
+            }
+        }
+        release(&p->tg->lock);
+    }
+    release(&p->lock);
+    return leader;
+}
+
+// check policy and param, then apply them to the thread of pid
+static int do_sched_setscheduler(int pid, int policy, uint64 param_addr) {
+    struct sched_param param;
+    struct tcb *t;
+
+    if (param_addr == 0) {
+        return -EINVAL;
+    }
+    if (copyin(proc_current()->mm->pagetable, (char *)&param, param_addr, sizeof(param)) < 0) {
+        return -EFAULT;
+    }
+    if ((t = sched_find_thread(pid)) == NULL) {
+        return -ESRCH;
+    }
+    if (policy < 0) {
+        // sched_setparam
+        policy = t->policy;
+    }
+    if (rt_policy(policy)) {
+        if (param.sched_priority < MIN_RT_PRIO || param.sched_priority > MAX_RT_PRIO) {
+            release(&t->lock);
+            return -EINVAL;
+        }
+    } else if ((policy != SCHED_NORMAL && policy != SCHED_BATCH && policy != SCHED_IDLE) || param.sched_priority != 0) {
+        release(&t->lock);
+        return -EINVAL;
+    }
+    sched_setattr(t, policy, param.sched_priority, t->nice);
+    release(&t->lock);
+    return 0;
+}
+
+// int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param);
 uint64 sys_sched_setscheduler(void) {
+    int pid, policy;
+    uint64 param_addr;
+
+    argint(0, &pid);
+    argint(1, &policy);
+    argaddr(2, &param_addr);
+    if (policy < 0) {
+        return -EINVAL;
+    }
+    return do_sched_setscheduler(pid, policy, param_addr);
+}
+
+// int sched_setparam(pid_t pid, const struct sched_param *param);
+uint64 sys_sched_setparam(void) {
+    int pid;
+    uint64 param_addr;
+
+    argint(0, &pid);
+    argaddr(1, &param_addr);
+    return do_sched_setscheduler(pid, -1, param_addr);
+}
+
+// int sched_get_priority_max(int policy);
+uint64 sys_sched_get_priority_max(void) {
+    int policy;
+    argint(0, &policy);
+    return rt_policy(policy) ? MAX_RT_PRIO : 0;
+}
+
+// int sched_get_priority_min(int policy);
+uint64 sys_sched_get_priority_min(void) {
+    int policy;
+    argint(0, &policy);
+    return rt_policy(policy) ? MIN_RT_PRIO : 0;
+}
+
+// int setpriority(int which, id_t who, int prio);
+uint64 sys_setpriority(void) {
+    int which, who, prio;
+    struct tcb *t;
+
+    argint(0, &which);
+    argint(1, &who);
+    argint(2, &prio);
+    if (which != PRIO_PROCESS) {
+        return -EINVAL;
+    }
+    if ((t = sched_find_thread(who)) == NULL) {
+        return -ESRCH;
+    }
+    prio = MAX(MIN_NICE, MIN(prio, MAX_NICE));
+    sched_setattr(t, t->policy, t->rt_priority, prio);
+    release(&t->lock);
     return 0;
 }
+
+// int getpriority(int which, id_t who);
+// return 20 - nice, so that it is never negative
+uint64 sys_getpriority(void) {
+    int which, who;
+    struct tcb *t;
+
+    argint(0, &which);
+    argint(1, &who);
+    if (which != PRIO_PROCESS) {
+        return -EINVAL;
+    }
+    if ((t = sched_find_thread(who)) == NULL) {
+        return -ESRCH;
+    }
+    int nice = t->nice;
+    release(&t->lock);
+    return 20 - nice;
+}
 uint64 sys_sched_getaffinity(void) {
     return 0;
 }
 uint64 sys_sched_setaffinity(void) {
     return 0;
 }
+// int sched_getscheduler(pid_t pid);
 uint64 sys_sched_getscheduler(void) {
-    return 0;
+    int pid;
+    struct tcb *t;
+
+    argint(0, &pid);
+    if ((t = sched_find_thread(pid)) == NULL) {
+        return -ESRCH;
+    }
+    int policy = t->policy;
+    release(&t->lock);
+    return policy;
 }
+
+// int sched_getparam(pid_t pid, struct sched_param *param);
 uint64 sys_sched_getparam(void) {
+    int pid;
+    uint64 param_addr;
+    struct sched_param param;
+    struct tcb *t;
+
+    argint(0, &pid);
+    argaddr(1, &param_addr);
+    if ((t = sched_find_thread(pid)) == NULL) {
+        return -ESRCH;
+    }
+    param.sched_priority = rt_policy(t->policy) ? t->rt_priority : 0;
+    release(&t->lock);
+    if (copyout(proc_current()->mm->pagetable, param_addr, (char *)&param, sizeof(param)) < 0) {
+        return -EFAULT;
+    }
     return 0;
 }
 uint64 sys_membarrier(void) {
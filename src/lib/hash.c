@@ -1,6 +1,5 @@
 #include "memory/allocator.h"
 #include "atomic/spinlock.h"
-#include "atomic/futex.h"
 #include "lib/hash.h"
 #include "debug.h"
 
@@ -10,11 +9,7 @@ struct hash_table pid_map = {.lock = INIT_SPINLOCK(pid_hash_table),
                              .size = NPROC};
 struct hash_table tid_map = {.lock = INIT_SPINLOCK(tid_hash_table),
                              .type = TID_MAP,
-                             .size = NTCB};
-struct hash_table futex_map = {.lock = INIT_SPINLOCK(futex_hash_table),
-                               .type = FUTEX_MAP,
-                               .size = FUTEX_NUM};
-struct futex;
+                             .size = NPROC * 2};
 
 // find the table entry given the table，type and key
 struct hash_entry *hash_get_entry(struct hash_table *table, void *key, int holding) {
@@ -219,11 +214,9 @@ void hash_table_entry_init(struct hash_table *table) {
 void hash_tables_init() {
     hash_table_entry_init(&pid_map);
     hash_table_entry_init(&tid_map);
-    hash_table_entry_init(&futex_map);
     Info("========= Information of global hash table ==========\n");
     Info("pid_map size : %d B\n", MAP_SIZE(pid_map));
     Info("tid_map size : %d B\n", MAP_SIZE(tid_map));
-    Info("futex_map size : %d B\n", MAP_SIZE(futex_map));
     Info("hash table, size = %d\n", sizeof(struct hash_table));
     Info("hash node, size = %d\n", sizeof(struct hash_node));
     Info("global hash table init [ok]\n");
@@ -1,6 +1,7 @@
 #include "lib/radix-tree.h"
 #include "memory/allocator.h"
 #include "memory/buddy.h"
+#include "memory/vmscan.h"
 #include "atomic/ops.h"
 #include "debug.h"
 
@@ -618,7 +619,8 @@ void radix_tree_free_whole_tree(struct radix_tree_node *node, uint32 max_height,
                 struct page *page = (struct page *)(node->slots[i]);
                 if (page->allocated == 1) { // don't forget it
                     uint64 pa = page_to_pa(page);
-                    kfree((void *)pa); // must use page_to_pa
+                    lru_cache_del(page);
+                    kfree_cold((void *)pa); // must use page_to_pa
                                        // printfBlue("memory : %d PAGES\n", get_free_mem()/4096);
 #ifdef __DEBUG_PAGE_CACHE__
                     pa_prev = pa;
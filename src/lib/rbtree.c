@@ -0,0 +1,227 @@
+#include "lib/rbtree.h"
+
+// red-black tree, NULL leaves are black
+
+#define rb_is_red(n) ((n) != NULL && (n)->rb_color == RB_RED)
+#define rb_is_black(n) (!rb_is_red(n))
+
+// put new in the place of old under old's parent
+static void rb_replace_child(struct rb_node *old, struct rb_node *new, struct rb_node *parent, struct rb_root *root) {
+    if (parent == NULL) {
+        root->rb_node = new;
+    } else if (parent->rb_left == old) {
+        parent->rb_left = new;
+    } else {
+        parent->rb_right = new;
+    }
+}
+
+/*
+        x               y
+       / \             / \
+      a   y    -->    x   c
+         / \         / \
+        b   c       a   b
+*/
+static void rb_rotate_left(struct rb_node *x, struct rb_root *root) {
+    struct rb_node *y = x->rb_right;
+    x->rb_right = y->rb_left;
+    if (y->rb_left != NULL) {
+        y->rb_left->rb_parent = x;
+    }
+    y->rb_parent = x->rb_parent;
+    rb_replace_child(x, y, x->rb_parent, root);
+    y->rb_left = x;
+    x->rb_parent = y;
+}
+
+static void rb_rotate_right(struct rb_node *x, struct rb_root *root) {
+    struct rb_node *y = x->rb_left;
+    x->rb_left = y->rb_right;
+    if (y->rb_right != NULL) {
+        y->rb_right->rb_parent = x;
+    }
+    y->rb_parent = x->rb_parent;
+    rb_replace_child(x, y, x->rb_parent, root);
+    y->rb_right = x;
+    x->rb_parent = y;
+}
+
+// node has just been linked by rb_link_node
+void rb_insert_color(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *parent, *gparent, *uncle;
+
+    while (rb_is_red(parent = node->rb_parent)) {
+        // a red parent is never the root
+        gparent = parent->rb_parent;
+        if (parent == gparent->rb_left) {
+            uncle = gparent->rb_right;
+            if (rb_is_red(uncle)) {
+                uncle->rb_color = RB_BLACK;
+                parent->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_right) {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            rb_rotate_right(gparent, root);
+        } else {
+            uncle = gparent->rb_left;
+            if (rb_is_red(uncle)) {
+                uncle->rb_color = RB_BLACK;
+                parent->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_left) {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->rb_node->rb_color = RB_BLACK;
+}
+
+// node (maybe NULL) under parent has one black less than its sibling
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root) {
+    struct rb_node *sibling;
+
+    while (node != root->rb_node && rb_is_black(node)) {
+        if (node == parent->rb_left) {
+            sibling = parent->rb_right;
+            if (rb_is_red(sibling)) {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                rb_rotate_left(parent, root);
+                sibling = parent->rb_right;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_right)) {
+                sibling->rb_left->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                rb_rotate_right(sibling, root);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_right->rb_color = RB_BLACK;
+            rb_rotate_left(parent, root);
+        } else {
+            sibling = parent->rb_left;
+            if (rb_is_red(sibling)) {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                rb_rotate_right(parent, root);
+                sibling = parent->rb_left;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_left)) {
+                sibling->rb_right->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                rb_rotate_left(sibling, root);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_left->rb_color = RB_BLACK;
+            rb_rotate_right(parent, root);
+        }
+        node = root->rb_node;
+        break;
+    }
+    if (node != NULL) {
+        node->rb_color = RB_BLACK;
+    }
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *child, *parent;
+    int color;
+
+    if (node->rb_left != NULL && node->rb_right != NULL) {
+        // replace node by its successor, which has no left child
+        struct rb_node *succ = node->rb_right;
+        while (succ->rb_left != NULL) {
+            succ = succ->rb_left;
+        }
+        child = succ->rb_right;
+        color = succ->rb_color;
+        if (succ->rb_parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->rb_parent;
+            parent->rb_left = child;
+            if (child != NULL) {
+                child->rb_parent = parent;
+            }
+            succ->rb_right = node->rb_right;
+            node->rb_right->rb_parent = succ;
+        }
+        succ->rb_left = node->rb_left;
+        node->rb_left->rb_parent = succ;
+        succ->rb_parent = node->rb_parent;
+        succ->rb_color = node->rb_color;
+        rb_replace_child(node, succ, node->rb_parent, root);
+    } else {
+        child = (node->rb_left != NULL ? node->rb_left : node->rb_right);
+        parent = node->rb_parent;
+        color = node->rb_color;
+        if (child != NULL) {
+            child->rb_parent = parent;
+        }
+        rb_replace_child(node, child, parent, root);
+    }
+
+    if (color == RB_BLACK) {
+        rb_erase_color(child, parent, root);
+    }
+}
+
+struct rb_node *rb_first(const struct rb_root *root) {
+    struct rb_node *n = root->rb_node;
+    if (n == NULL) {
+        return NULL;
+    }
+    while (n->rb_left != NULL) {
+        n = n->rb_left;
+    }
+    return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node) {
+    struct rb_node *parent;
+
+    if (node->rb_right != NULL) {
+        node = node->rb_right;
+        while (node->rb_left != NULL) {
+            node = node->rb_left;
+        }
+        return (struct rb_node *)node;
+    }
+    // go up until we come from a left child
+    while ((parent = node->rb_parent) != NULL && node == parent->rb_right) {
+        node = parent;
+    }
+    return parent;
+}
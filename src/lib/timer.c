@@ -4,87 +4,335 @@
 #include "memory/memlayout.h"
 #include "atomic/cond.h"
 #include "atomic/ops.h"
+#include "kernel/cpu.h"
 #include "debug.h"
 
-struct timer_entry timer_head;
+#define NS_PER_CYCLE (1000000000 / FREQUENCY)
+
+struct timer_base timer_bases[NCPU];
 struct spinlock tickslock;
 struct cond cond_ticks;
 atomic_t ticks;
 
+static inline uint64 jiffies_now(void) {
+    return (rdtime() * NS_PER_CYCLE) >> TIMER_JIFFY_SHIFT;
+}
+
+// the first rdtime in the jiffy
+static inline uint64 jiffy_to_cycles(uint64 jiffy) {
+    return ((jiffy << TIMER_JIFFY_SHIFT) + NS_PER_CYCLE - 1) / NS_PER_CYCLE;
+}
+
+// x != 0
+static inline int lowest_bit(uint64 x) {
+    int n = 0;
+    if (!(x & 0xffffffffUL)) { n += 32; x >>= 32; }
+    if (!(x & 0xffffUL)) { n += 16; x >>= 16; }
+    if (!(x & 0xffUL)) { n += 8; x >>= 8; }
+    if (!(x & 0xfUL)) { n += 4; x >>= 4; }
+    if (!(x & 0x3UL)) { n += 2; x >>= 2; }
+    if (!(x & 0x1UL)) { n += 1; }
+    return n;
+}
+
 void timer_init() {
     atomic_set(&ticks, 0);
     cond_init(&cond_ticks, "cond_ticks");
-    timer_entry_init(&timer_head, "timer_entry");
+    for (int i = 0; i < NCPU; i++) {
+        struct timer_base *base = &timer_bases[i];
+        initlock(&base->lock, "timer_base");
+        base->clk = jiffies_now();
+        base->next_tick = -1UL;
+        base->programmed = -1UL;
+        base->nr_timers = 0;
+        base->running = NULL;
+        for (int lvl = 0; lvl < WHEEL_DEPTH; lvl++) {
+            base->pending[lvl] = 0;
+            for (int idx = 0; idx < WHEEL_SIZE; idx++) {
+                INIT_LIST_HEAD(&base->vectors[lvl][idx]);
+            }
+        }
+    }
     Info("timer init [ok]\n");
 }
 
-void timer_entry_init(struct timer_entry *t_entry, char *name) {
-    initlock(&t_entry->lock, name);
-    INIT_LIST_HEAD(&t_entry->entry);
+void init_timer(struct timer_list *timer) {
+    INIT_LIST_HEAD(&timer->list);
+    timer->expires = 0;
+    timer->expires_end = 0;
+    timer->base = NULL;
+}
+
+// the level is picked by how far away it is, level n slots are 64^n jiffies wide
+static void wheel_enqueue(struct timer_base *base, struct timer_list *timer) {
+    uint64 expires = timer->jiffy;
+    uint64 delta;
+    int lvl = 0, idx;
+
+    if ((int64)(expires - base->clk) < 0) {
+        // overdue, run it on the next pass
+        expires = base->clk;
+    }
+    delta = expires - base->clk;
+    if (delta > WHEEL_MAX_DELTA) {
+        // cascaded again when it gets there
+        expires = base->clk + WHEEL_MAX_DELTA;
+        delta = WHEEL_MAX_DELTA;
+    }
+    while (lvl < WHEEL_DEPTH - 1 && delta >= (1UL << (WHEEL_BITS * (lvl + 1)))) {
+        lvl++;
+    }
+    idx = (expires >> (WHEEL_BITS * lvl)) & WHEEL_MASK;
+    list_add_tail(&timer->list, &base->vectors[lvl][idx]);
+    // a cancel leaves the bit set, run_timers() clears it
+    base->pending[lvl] |= 1UL << idx;
+}
+
+// move the timers of a slot down a level
+static void wheel_cascade(struct timer_base *base, int lvl, int idx) {
+    struct list_head work;
+    struct timer_list *timer, *tmp;
+
+    INIT_LIST_HEAD(&work);
+    list_splice(&base->vectors[lvl][idx], &work);
+    INIT_LIST_HEAD(&base->vectors[lvl][idx]);
+    base->pending[lvl] &= ~(1UL << idx);
+    list_for_each_entry_safe(timer, tmp, &work, list) {
+        wheel_enqueue(base, timer);
+    }
+}
+
+// the jiffy at which something happens to the wheel: an expiry or a cascade, -1 if empty
+// an early estimate is fine, it just takes one more interrupt
+static uint64 timer_next_event(struct timer_base *base) {
+    uint64 next = -1UL;
+
+    if (base->nr_timers == 0) {
+        return next;
+    }
+    for (int lvl = 0; lvl < WHEEL_DEPTH; lvl++) {
+        uint64 bits = base->pending[lvl];
+        int shift = WHEEL_BITS * lvl;
+        int idx = (base->clk >> shift) & WHEEL_MASK;
+        uint64 rot, jiffy;
+        int d;
+
+        if (!bits) {
+            continue;
+        }
+        // bit 0 is the current slot
+        rot = idx ? (bits >> idx) | (bits << (WHEEL_SIZE - idx)) : bits;
+        if (lvl == 0) {
+            jiffy = base->clk + lowest_bit(rot);
+        } else {
+            // the current slot of an upper level was cascaded already, it is a lap away
+            d = (rot & ~1UL) ? lowest_bit(rot & ~1UL) : WHEEL_SIZE;
+            jiffy = ((base->clk >> shift) + d) << shift;
+        }
+        next = MIN(next, jiffy);
+    }
+    return next;
+}
+
+// program the SBI timer of this hart, with base->lock held
+static void timer_program(struct timer_base *base) {
+    uint64 next = base->next_tick;
+    uint64 jiffy = timer_next_event(base);
+
+    if (jiffy != -1UL) {
+        next = MIN(next, jiffy_to_cycles(jiffy));
+    }
+    base->programmed = next;
+    sbi_legacy_set_timer(next);
+}
+
+static struct timer_base *lock_timer_base(struct timer_list *timer) {
+    struct timer_base *base;
+
+    for (;;) {
+        base = READ_ONCE(timer->base);
+        if (base == NULL) {
+            return NULL;
+        }
+        acquire(&base->lock);
+        // add_timer_atomic() may have moved it to another hart
+        if (base == timer->base) {
+            return base;
+        }
+        release(&base->lock);
+    }
+}
+
+static void detach_timer(struct timer_base *base, struct timer_list *timer) {
+    if (!list_empty(&timer->list)) {
+        list_del_reinit(&timer->list);
+        base->nr_timers--;
+    }
 }
 
 // expires : ns!!!
+// the timer goes to the wheel of this hart, re-arming a pending timer moves it
 void add_timer_atomic(struct timer_list *timer, uint64 expires, timer_expire function, void *data) {
+    struct timer_base *base;
+
+    delete_timer_atomic(timer);
+
+    push_off();
+    base = &timer_bases[cpuid()];
+    acquire(&base->lock);
     timer->data = data;
     timer->expires_end = expires + TIME2NS(rdtime());
     timer->expires = expires;
     timer->function = function;
-    // bug!!!
-    if (!list_empty(&timer->list)) {
+    timer->jiffy = ((rdtime() * NS_PER_CYCLE + expires) >> TIMER_JIFFY_SHIFT) + 1;
+    timer->base = base;
+    wheel_enqueue(base, timer);
+    base->nr_timers++;
+    if (jiffy_to_cycles(timer->jiffy) < base->programmed) {
+        timer_program(base);
+    }
+    release(&base->lock);
+    pop_off();
+}
+
+void delete_timer_atomic(struct timer_list *timer) {
+    struct timer_base *base = lock_timer_base(timer);
+
+    if (base == NULL) {
         return;
     }
+    detach_timer(base, timer);
+    release(&base->lock);
+}
+
+// also wait for its callback to return, don't hold a lock the callback takes
+void delete_timer_sync(struct timer_list *timer) {
+    struct timer_base *base;
 
-    acquire(&timer_head.lock);
-    list_add_tail(&timer->list, &timer_head.entry);
-    release(&timer_head.lock);
+    for (;;) {
+        base = lock_timer_base(timer);
+        if (base == NULL) {
+            return;
+        }
+        detach_timer(base, timer);
+        if (base->running != timer) {
+            release(&base->lock);
+            return;
+        }
+        release(&base->lock);
+    }
 }
 
-void delete_timer_atomic(struct timer_list *timer) {
-    acquire(&timer_head.lock);
-    list_del_reinit(&timer->list);
-    release(&timer_head.lock);
-}
-
-void timer_list_decrease_atomic(struct timer_entry *head) {
-    struct timer_list *timer_cur;
-    struct timer_list *timer_tmp;
-
-    acquire(&head->lock);
-    list_for_each_entry_safe(timer_cur, timer_tmp, &head->entry, list) {
-        // special for pselect6
-        // if (timer_cur->cycle == -1) {
-        //     // wakeup every clock interrupt, don't care expire
-        //     timer_cur->over = TIME_OUT(timer_cur);
-        //     timer_cur->function(timer_cur->data);
-        //     list_del_reinit(&timer_cur->list);
-        //     continue;
-        // }
-        // uint64 time_now_ns = TIME2NS(rdtime());
-        // if (time_now_ns > timer_cur->expires_end) {
-        if (TIME_OUT(timer_cur)) {
-            timer_cur->function(timer_cur->data);
-            if (timer_cur->count == -1) {
-                // if(timer_cur->interval)
-                if (timer_cur->interval == -1)
-                    // special for pdflush
-                    timer_cur->expires_end = timer_cur->expires + TIME2NS(rdtime());
-                else
-                    // special for setitimer
-                    timer_cur->expires_end = timer_cur->interval + TIME2NS(rdtime());
+// run the expired timers of this hart, the callbacks run without base->lock
+static void run_timers(struct timer_base *base) {
+    uint64 now = jiffies_now();
+    struct list_head work;
+    struct timer_list *timer;
+    timer_expire function;
+    void *data;
+
+    acquire(&base->lock);
+    while ((int64)(now - base->clk) >= 0) {
+        if (base->nr_timers == 0) {
+            base->clk = now + 1;
+            break;
+        }
+        int idx = base->clk & WHEEL_MASK;
+        if (idx == 0) {
+            for (int lvl = 1; lvl < WHEEL_DEPTH; lvl++) {
+                int i = (base->clk >> (WHEEL_BITS * lvl)) & WHEEL_MASK;
+                wheel_cascade(base, lvl, i);
+                if (i) {
+                    break;
+                }
+            }
+        }
+        uint64 bits = base->pending[0] >> idx;
+        if (!(bits & 1)) {
+            // skip the empty slots, but stop at the next lap to cascade
+            base->clk = MIN(base->clk + (bits ? lowest_bit(bits) : WHEEL_SIZE - idx), now + 1);
+            continue;
+        }
+
+        INIT_LIST_HEAD(&work);
+        list_splice(&base->vectors[0][idx], &work);
+        INIT_LIST_HEAD(&base->vectors[0][idx]);
+        base->pending[0] &= ~(1UL << idx);
+        base->clk++;
+
+        while (!list_empty(&work)) {
+            timer = list_first_entry(&work, struct timer_list, list);
+            detach_timer(base, timer);
+            function = timer->function;
+            data = timer->data;
+            if (timer->count == -1) {
+                // special for pdflush : interval == -1, re-arm with expires
+                // special for setitimer : re-arm with interval
+                uint64 period = timer->interval == -1 ? timer->expires : timer->interval;
+                timer->expires_end = period + TIME2NS(rdtime());
+                timer->jiffy = ((rdtime() * NS_PER_CYCLE + period) >> TIMER_JIFFY_SHIFT) + 1;
+                wheel_enqueue(base, timer);
+                base->nr_timers++;
             } else {
-                list_del_reinit(&timer_cur->list);
-                timer_cur->expires_end = 0;
-                timer_cur->expires = 0;
+                timer->expires_end = 0;
+                timer->expires = 0;
             }
+            // the timer may be gone once we let go of the lock (e.g. on the stack of thread_sched)
+            base->running = timer;
+            release(&base->lock);
+            function(data);
+            acquire(&base->lock);
+            base->running = NULL;
+        }
+    }
+    release(&base->lock);
+}
+
+// the SBI timer fired : a tick, a timer deadline, or both
+// return 1 if it was a tick
+int timer_interrupt(void) {
+    struct timer_base *base = &timer_bases[cpuid()];
+    int tick = 0;
+
+    if (rdtime() >= base->next_tick) {
+        base->next_tick = rdtime() + CLINT_INTERVAL;
+        tick = 1;
+        if (cpuid() == TIMEKEEPER_HART) {
+            clockintr();
         }
     }
-    release(&head->lock);
+    run_timers(base);
+
+    acquire(&base->lock);
+    timer_program(base);
+    release(&base->lock);
+    return tick;
+}
+
+void timer_start_tick(void) {
+    push_off();
+    struct timer_base *base = &timer_bases[cpuid()];
+    acquire(&base->lock);
+    base->next_tick = rdtime() + CLINT_INTERVAL;
+    timer_program(base);
+    release(&base->lock);
+    pop_off();
+}
+
+// no tick until timer_start_tick(), the timers of this hart still fire
+void timer_stop_tick(void) {
+    push_off();
+    struct timer_base *base = &timer_bases[cpuid()];
+    acquire(&base->lock);
+    base->next_tick = -1UL;
+    timer_program(base);
+    release(&base->lock);
+    pop_off();
 }
 
 void clockintr() {
 // static int ctr = 0;
 // printf("hit, clockintr %d, %d\n",++ctr, CLINT_INTERVAL);
     atomic_inc_return(&ticks);       // 或许可以不用原子操作
-    timer_list_decrease_atomic(&timer_head);
     cond_signal(&cond_ticks);
-}
\ No newline at end of file
+}
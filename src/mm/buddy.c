@@ -7,7 +7,6 @@
 #include "atomic/ops.h"
 
 extern atomic_t pages_cnt;
-extern atomic_t recycling;
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
@@ -15,7 +14,8 @@ uint64 npages;
 
 struct phys_mem_pool mempools[NCPU];
 static struct page *merge_page(struct phys_mem_pool *pool, struct page *page);
-static struct page *split_page(struct phys_mem_pool *pool, uint64 order, struct page *page);
+static struct page *split_page(struct phys_mem_pool *owner, uint64 order, struct page *page, struct free_list *freelists);
+void pcp_init(void);
 void init_buddy(struct phys_mem_pool *pool, struct page *start_page, uint64 start_addr, uint64 page_num);
 
 // uint64 get_free_mem();// debug
@@ -49,7 +49,6 @@ void mm_init() {
     Info("pagemeta_start: %x\n", pagemeta_start);
     Info("NPAGES: %d\n", NPAGES);
     atomic_set(&pages_cnt, NPAGES);
-    atomic_set(&recycling, 0);
     Info("PAGES PER CPU: %d\n", PAGES_PER_CPU);
     for (int i = 0; i < NCPU; i++) {
         init_buddy(&mempools[i],
@@ -58,6 +57,7 @@ void mm_init() {
                    PAGES_PER_CPU);
     }
     Info("buddy system init [ok]\n");
+    pcp_init();
 }
 
 static int cur = 0;
@@ -86,7 +86,11 @@ void init_buddy(struct phys_mem_pool *pool, struct page *start_page, uint64 star
     for (int order = 0; order <= BUDDY_MAX_ORDER; ++order) {
         INIT_LIST_HEAD(&pool->freelists[order].lists);
         pool->freelists[order].num = 0;
+        INIT_LIST_HEAD(&pool->borrowed[order].lists);
+        pool->borrowed[order].num = 0;
     }
+    pool->nr_free = 0;
+    pool->nr_borrowed = 0;
 
     /* Clear the page_metadata area. */
     memset(pool->page_metadata, 0, page_num * sizeof(struct page));
@@ -118,58 +122,99 @@ void init_buddy(struct phys_mem_pool *pool, struct page *start_page, uint64 star
     return;
 }
 
-struct page *buddy_get_pages(struct phys_mem_pool *pool, uint64 order) {
-    // kalloc() will call push_off, so use pop_off here to prevent long time interrupt off
-    pop_off();
-    // printf("memory %d PAGES, %d Bytes\n", get_free_mem()/4096, get_free_mem());
-    ASSERT(order <= BUDDY_MAX_ORDER);
-    struct page *page = NULL;
+// take a free block whose order >= order,
+// the smallest one by default, the largest one if largest is set
+static struct page *freelists_take(struct free_list *freelists, uint64 order, int largest) {
     struct list_head *lists;
-
-    acquire(&pool->lock);
-    for (int i = order; i <= BUDDY_MAX_ORDER; i++) {
-        lists = &pool->freelists[i].lists;
+    for (int k = 0; k <= BUDDY_MAX_ORDER - order; k++) {
+        int i = largest ? BUDDY_MAX_ORDER - k : order + k;
+        lists = &freelists[i].lists;
         if (!list_empty(lists)) {
-            page = list_first_entry(lists, struct page, list);
+            struct page *page = list_first_entry(lists, struct page, list);
             list_del(&page->list);
-            pool->freelists[page->order].num--;
-            break;
+            freelists[i].num--;
+            return page;
         }
     }
+    return NULL;
+}
 
-    if (page == NULL) {
+// caller holds pool->lock
+static struct page *__buddy_get_pages(struct phys_mem_pool *pool, uint64 order) {
+    ASSERT(order <= BUDDY_MAX_ORDER);
+    struct page *page = NULL;
+
+    if ((page = freelists_take(pool->freelists, order, 0)) != NULL) {
+        if (page->order > order) {
+            page = split_page(pool, order, page, pool->freelists);
+        }
+        pool->nr_free -= (1 << order);
+    } else if ((page = freelists_take(pool->borrowed, order, 0)) != NULL) {
+        // a block borrowed from other pool, split it in the owner's view
+        if (page->order > order) {
+            page = split_page(&mempools[get_pages_cpu(page)], order, page, pool->borrowed);
+        }
+        pool->nr_borrowed -= (1 << order);
+    } else {
         // Log("there is no 2^%d mem!", order);
-        release(&pool->lock);
         return NULL;
     }
 
-    if (page->order > order) {
-        page = split_page(pool, order, page);
-    }
     page->allocated = 1;
     ASSERT(page->order == order);
+    return page;
+}
+
+struct page *buddy_get_pages(struct phys_mem_pool *pool, uint64 order) {
+    // printf("memory %d PAGES, %d Bytes\n", get_free_mem()/4096, get_free_mem());
+    struct page *page;
+
+    acquire(&pool->lock);
+    page = __buddy_get_pages(pool, order);
     release(&pool->lock);
     return page;
 }
 
-static struct page *split_page(struct phys_mem_pool *pool, uint64 order, struct page *page) {
+// take at most count order-0 pages with one lock round trip, append them to list
+// return the number of pages we got
+int buddy_get_pages_bulk(struct phys_mem_pool *pool, int count, struct list_head *list) {
+    struct page *page;
+    int n;
+
+    acquire(&pool->lock);
+    for (n = 0; n < count; n++) {
+        if ((page = __buddy_get_pages(pool, 0)) == NULL) {
+            break;
+        }
+        list_add_tail(&page->list, list);
+    }
+    release(&pool->lock);
+    return n;
+}
+
+// split the block down to order, the upper halves go to freelists
+// owner: the pool who owns the block, buddies are computed in its view
+static struct page *split_page(struct phys_mem_pool *owner, uint64 order, struct page *page, struct free_list *freelists) {
     ASSERT(page->order > order);
 
     while (page->order > order) {
         page->order--;
-        struct page *buddy = get_buddy(pool, page);
+        struct page *buddy = get_buddy(owner, page);
         ASSERT(buddy->allocated == 0);
         buddy->order = page->order;
+        // a borrowed block is still allocated for its owner, so the owner never merges it
+        buddy->allocated = (freelists != owner->freelists);
 
-        list_add(&buddy->list, &pool->freelists[buddy->order].lists);
-        pool->freelists[buddy->order].num++;
+        list_add(&buddy->list, &freelists[buddy->order].lists);
+        freelists[buddy->order].num++;
     }
     return page;
 }
 
-void buddy_free_pages(struct phys_mem_pool *pool, struct page *page) {
-    acquire(&pool->lock);
+// caller holds pool->lock
+static void __buddy_free_pages(struct phys_mem_pool *pool, struct page *page) {
     page->allocated = 0;
+    pool->nr_free += (1 << page->order);
 
     if (page->order < BUDDY_MAX_ORDER) {
         page = merge_page(pool, page);
@@ -178,9 +223,32 @@ void buddy_free_pages(struct phys_mem_pool *pool, struct page *page) {
     struct list_head *list = &pool->freelists[page->order].lists;
     list_add(&page->list, list);
     pool->freelists[page->order].num++;
+}
+
+void buddy_free_pages(struct phys_mem_pool *pool, struct page *page) {
+    acquire(&pool->lock);
+    __buddy_free_pages(pool, page);
     release(&pool->lock);
 }
 
+// give back a list of pages, each page returns to the pool who owns it,
+// one lock round trip per pool
+void buddy_free_pages_bulk(struct list_head *list) {
+    struct page *page, *tmp;
+    for (int id = 0; id < NCPU && !list_empty(list); id++) {
+        struct phys_mem_pool *pool = &mempools[id];
+        acquire(&pool->lock);
+        list_for_each_entry_safe(page, tmp, list, list) {
+            if (get_pages_cpu(page) == id) {
+                list_del(&page->list);
+                __buddy_free_pages(pool, page);
+            }
+        }
+        release(&pool->lock);
+    }
+    ASSERT(list_empty(list));
+}
+
 static struct page *merge_page(struct phys_mem_pool *pool, struct page *page) {
     if (page->order == BUDDY_MAX_ORDER) {
         return page;
@@ -213,16 +281,105 @@ static struct page *merge_page(struct phys_mem_pool *pool, struct page *page) {
     }
 }
 
+/*
+ * Zone balancing.
+ * A pool whose free pages fall below POOL_LOW_WMARK borrows the largest free
+ * block of the richest pool in one lock round trip. The borrowed block is
+ * handed out by the borrower, but every page still goes back (and merges)
+ * in its owner pool once freed. Idle borrowed blocks are given back as soon
+ * as the borrower rises above POOL_HIGH_WMARK again.
+ */
+static int richest_pool(int cur_id, uint64 min_free) {
+    int victim = -1;
+    uint64 max = min_free;
+    for (int i = 0; i < NCPU; i++) {
+        // racy read, only a hint
+        uint64 nr_free = READ_ONCE(mempools[i].nr_free);
+        if (i != cur_id && nr_free >= max) {
+            max = nr_free;
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+// borrow a free block (order >= order) from other pool into pool cur_id
+// only rich pools are asked, unless any is set
+// return 0 on success, -1 if no pool can lend it
+int buddy_balance(int cur_id, uint64 order, int any) {
+    struct phys_mem_pool *pool = &mempools[cur_id];
+    struct page *page = NULL;
+
+    // prefer a rich pool and take its largest block at once
+    int victim = richest_pool(cur_id, POOL_HIGH_WMARK);
+    if (victim >= 0) {
+        acquire(&mempools[victim].lock);
+        if ((page = freelists_take(mempools[victim].freelists, order, 1)) != NULL) {
+            mempools[victim].nr_free -= (1 << page->order);
+            // allocated in the eyes of the owner
+            page->allocated = 1;
+        }
+        release(&mempools[victim].lock);
+    }
+
+    // last resort: any pool which has a block that is large enough
+    for (int i = 0; any && page == NULL && i < NCPU; i++) {
+        if (i == cur_id) {
+            continue;
+        }
+        acquire(&mempools[i].lock);
+        if ((page = freelists_take(mempools[i].freelists, order, 0)) != NULL) {
+            mempools[i].nr_free -= (1 << page->order);
+            page->allocated = 1;
+        }
+        release(&mempools[i].lock);
+    }
+
+    if (page == NULL) {
+        return -1;
+    }
+
+    acquire(&pool->lock);
+    list_add(&page->list, &pool->borrowed[page->order].lists);
+    pool->borrowed[page->order].num++;
+    pool->nr_borrowed += (1 << page->order);
+    release(&pool->lock);
+    return 0;
+}
+
+// give idle borrowed blocks back to their owners once pool cur_id is rich again
+void buddy_return_borrowed(int cur_id) {
+    struct phys_mem_pool *pool = &mempools[cur_id];
+    struct list_head blocks;
+    INIT_LIST_HEAD(&blocks);
+
+    if (READ_ONCE(pool->nr_borrowed) == 0 || READ_ONCE(pool->nr_free) < POOL_HIGH_WMARK) {
+        return;
+    }
+
+    acquire(&pool->lock);
+    for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        struct page *page, *tmp;
+        list_for_each_entry_safe(page, tmp, &pool->borrowed[i].lists, list) {
+            list_move(&page->list, &blocks);
+        }
+        pool->borrowed[i].num = 0;
+    }
+    pool->nr_borrowed = 0;
+    release(&pool->lock);
+
+    buddy_free_pages_bulk(&blocks);
+}
+
 uint64 get_free_mem() {
     uint64 memsize = 0;
     for (int cpu = 0; cpu < NCPU; cpu++) {
         struct phys_mem_pool *pool = &mempools[cpu];
         acquire(&pool->lock);
-        for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
-            // Log("%d order chunks num: %d", i, pool->freelists[i].num);
-            memsize += pool->freelists[i].num * PGSIZE * (1 << i);
-        }
+        memsize += (pool->nr_free + pool->nr_borrowed) * PGSIZE;
         release(&pool->lock);
+        // pages cached in per-CPU lists are free as well
+        memsize += READ_ONCE(pcps[cpu].count) * PGSIZE;
     }
     return memsize;
 }
\ No newline at end of file
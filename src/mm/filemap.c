@@ -3,6 +3,7 @@
 #include "atomic/spinlock.h"
 #include "memory/buddy.h"
 #include "memory/allocator.h"
+#include "memory/vmscan.h"
 #include "fs/mpage.h"
 #include "atomic/ops.h"
 #include "debug.h"
@@ -19,6 +20,7 @@ int add_to_page_cache_atomic(struct page *page, struct address_space *mapping, u
         // if(mapping->host->fat32_i.fname[0]=='b')
         // printfRed("index : %x\n", index);
         mapping->nrpages++;
+        lru_cache_add(page);
     } else {
         panic("add_to_page_cache : error\n");
     }
@@ -54,6 +56,75 @@ struct page *find_get_page_atomic(struct address_space *mapping, uint64 index, i
     return page;
 }
 
+// get cnt pages of ip from index for mmap, read the missing ones from disk if read is set
+// a page beyond EOF (or missing and not read) is NULL in pages
+// each page is returned with an extra reference for the caller, so reclaim leaves it alone
+// return the number of pages got
+int filemap_get_pages(struct inode *ip, uint64 index, int cnt, int read, struct page **pages) {
+    uint32 isize = ip->i_size;
+    int got = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        pages[i] = NULL;
+    }
+    if (isize == 0) {
+        return 0;
+    }
+    uint64 end_index = (isize - 1) >> PGSHIFT;
+
+    if (ip->i_mapping == NULL) {
+        fat32_i_mapping_init(ip);
+    }
+    struct address_space *mapping = ip->i_mapping;
+
+    sema_wait(&ip->i_read_lock);
+    for (int i = 0; i < cnt && index + i <= end_index; i++) {
+        struct page *page = find_get_page_atomic(mapping, index + i, 0); // not acquire the lock of page
+        if (page == NULL) {
+            if (!read) {
+                continue;
+            }
+            // read the rest of the window at once, cached pages in it are skipped
+            mpage_readpages(ip, index + i, MIN(cnt - i, end_index - (index + i) + 1), 1, 0);
+            page = find_get_page_atomic(mapping, index + i, 0);
+            ASSERT(page != NULL);
+        } else {
+            mark_page_accessed(page);
+        }
+
+        // the user sees the whole page, clear the garbage of the last cluster beyond EOF
+        if (index + i == end_index && PGMASK(isize) != 0) {
+            memset((void *)(page_to_pa(page) + PGMASK(isize)), 0, PGSIZE - PGMASK(isize));
+        }
+        share_page(page_to_pa(page));
+        pages[i] = page;
+        got++;
+    }
+    sema_signal(&ip->i_read_lock);
+    return got;
+}
+
+// the page is written through a shared mapping
+// return -1 if it is not a page cache page of ip (any more)
+int set_page_dirty(struct inode *ip, struct page *page) {
+    acquire(&ip->tree_lock);
+    struct address_space *mapping = ip->i_mapping;
+    if (mapping == NULL || page->mapping != mapping || radix_tree_lookup_node(&mapping->page_tree, page->index) != page) {
+        release(&ip->tree_lock);
+        return -1;
+    }
+    radix_tree_tag_set(&mapping->page_tree, page->index, PAGECACHE_TAG_DIRTY);
+    release(&ip->tree_lock);
+
+    // add it into dirty list, similar to fat32_inode_write
+    acquire(&ip->i_sb->dirty_lock);
+    if (list_empty(&ip->dirty_list)) {
+        list_add_tail(&ip->dirty_list, &ip->i_sb->s_dirty);
+    }
+    release(&ip->i_sb->dirty_lock);
+    return 0;
+}
+
 // read ahead
 uint64 max_sane_readahead(uint64 nr, uint64 read_ahead, uint64 tot_nr) {
     return MIN(MIN(PGROUNDUP(nr) / PGSIZE + read_ahead, DIV_ROUND_UP(FREE_RATE(READ_AHEAD_RATE), PGSIZE)), PGROUNDUP(tot_nr) / PGSIZE);
@@ -144,6 +215,7 @@ ssize_t do_generic_file_read(struct address_space *mapping, int user_dst, uint64
                         ip->fat32_i.fname, off, n, index, offset, mapping->read_ahead_cnt, mapping->read_ahead_end);
 #endif
             pa = page_to_pa(page);
+            mark_page_accessed(page);
             // read_hit_cnt ++;// debug
             // printf("read hit : %d/%d\n",read_hit_cnt, read_cnt);// debug
 
@@ -264,6 +336,7 @@ ssize_t do_generic_file_write(struct address_space *mapping, int user_src, uint6
                        ip->fat32_i.fname, off, n, index, offset);
 #endif
             pa = page_to_pa(page);
+            mark_page_accessed(page);
             // write_hit_cnt++;
             // printf("write hit : %d/%d\n", write_hit_cnt, write_cnt);// debug     
         }
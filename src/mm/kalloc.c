@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// requests no larger than SLAB_MAX_SIZE are served by the slab caches.
 
 #include "common.h"
 #include "param.h"
@@ -9,37 +10,88 @@
 #include "lib/riscv.h"
 #include "memory/allocator.h"
 #include "memory/buddy.h"
+#include "memory/slab.h"
+#include "memory/vmscan.h"
 #include "debug.h"
 #include "kernel/cpu.h"
 #include "atomic/ops.h"
 
 extern char end[];
-extern void alloc_fail();
 
 atomic_t pages_cnt;
-atomic_t recycling;
 
-static inline int get_pages_cpu(struct page *page) {
-    return (page - pagemeta_start) / PAGES_PER_CPU;
+struct per_cpu_pages pcps[NCPU];
+
+void pcp_init(void) {
+    for (int i = 0; i < NCPU; i++) {
+        initlock(&pcps[i].lock, "pcp");
+        pcps[i].count = 0;
+        pcps[i].high = PCP_HIGH;
+        pcps[i].batch = PCP_BATCH;
+        INIT_LIST_HEAD(&pcps[i].list);
+    }
+    Info("per-CPU page lists init [ok]\n");
 }
 
-struct page *steal_mem(int cur_id, uint64 order) {
+// interrupts must be off
+static struct page *pcp_alloc_page(int id) {
+    struct per_cpu_pages *pcp = &pcps[id];
     struct page *page = NULL;
-    for (int i = 0; i < NCPU; i++) {
-        if (i == cur_id) {
-            continue;
-        }
-        // TODO
-        push_off();
-        page = buddy_get_pages(&mempools[i], order);
-        if (page != NULL) {
-            return page;
-        }
+
+    acquire(&pcp->lock);
+    if (pcp->count == 0) {
+        pcp->count += buddy_get_pages_bulk(&mempools[id], pcp->batch, &pcp->list);
+    }
+    if (pcp->count > 0) {
+        page = list_first_entry(&pcp->list, struct page, list);
+        list_del(&page->list);
+        pcp->count--;
     }
-    ASSERT(page == NULL);
+    release(&pcp->lock);
     return page;
 }
 
+// with pcp->lock held
+static void pcp_drain(struct per_cpu_pages *pcp, int count) {
+    struct list_head drain;
+    INIT_LIST_HEAD(&drain);
+
+    // the coldest pages live at the tail
+    for (; count > 0 && pcp->count > 0; count--) {
+        struct page *page = list_last_entry(&pcp->list, struct page, list);
+        list_move(&page->list, &drain);
+        pcp->count--;
+    }
+    buddy_free_pages_bulk(&drain);
+    buddy_return_borrowed(pcp - pcps);
+}
+
+// interrupts must be off
+static void pcp_free_page(int id, struct page *page, int cold) {
+    struct per_cpu_pages *pcp = &pcps[id];
+    acquire(&pcp->lock);
+    if (cold) {
+        list_add_tail(&page->list, &pcp->list);
+    } else {
+        list_add(&page->list, &pcp->list);
+    }
+    pcp->count++;
+    if (pcp->count > pcp->high) {
+        pcp_drain(pcp, pcp->batch);
+    }
+    release(&pcp->lock);
+}
+
+// give the pages cached by every hart back to the pools, before an allocation fails
+static void drain_all_pages(void) {
+    for (int i = 0; i < NCPU; i++) {
+        struct per_cpu_pages *pcp = &pcps[i];
+        acquire(&pcp->lock);
+        pcp_drain(pcp, pcp->count);
+        release(&pcp->lock);
+    }
+}
+
 uint64 size_to_page_order(uint64 size) {
     uint64 order;
     uint64 page_num;
@@ -61,76 +113,76 @@ uint64 size_to_page_order(uint64 size) {
     return order;
 }
 
-void *kmalloc(size_t size) {
-    uint64 order;
-    if (size <= PGSIZE) {
-        order = 0;
-    } else {
-        order = size_to_page_order(size);
-    }
+// take a free block from the pool of current hart, borrow one if the pool is drained
+static struct page *get_free_pages(uint64 order) {
+    struct page *page = NULL;
 
     push_off();
     int id = cpuid();
     ASSERT(id >= 0 && id < NCPU);
-    struct page *page = buddy_get_pages(&mempools[id], order);
+    if (order == 0) {
+        page = pcp_alloc_page(id);
+    }
+    pop_off();
+
+    if (page == NULL && order != 0) {
+        page = buddy_get_pages(&mempools[id], order);
+    }
+    if (page == NULL) {
+        // our pool is drained, borrow a large block from other pool at once
+        if (buddy_balance(id, order, 1) < 0) {
+            return NULL;
+        }
+        return buddy_get_pages(&mempools[id], order);
+    } else if (READ_ONCE(mempools[id].nr_free) + READ_ONCE(mempools[id].nr_borrowed) < POOL_LOW_WMARK) {
+        // refill from a rich pool before we run out
+        buddy_balance(id, 0, 0);
+    }
+    return page;
+}
 
+static struct page *alloc_pages(uint64 order) {
+    struct page *page = get_free_pages(order);
     if (page == NULL) {
-        page = steal_mem(id, order);
-        if (page == NULL) {
-            return 0;
+        // kswapd can't keep up, reclaim clean page cache by ourselves and retry
+        shrink_page_cache(MAX(1UL << order, SWAP_CLUSTER_MAX));
+        if ((page = get_free_pages(order)) == NULL) {
+            // the free pages may sit on the lists of other harts
+            drain_all_pages();
+            if ((page = get_free_pages(order)) == NULL) {
+                return NULL;
+            }
         }
     }
 
-    // acquire(&page->lock);
-    // ASSERT(page->count == 0);
     ASSERT(atomic_read(&page->refcnt) == 0);
     atomic_set(&page->refcnt, 1);
-    // page->count = 1;
-    // release(&page->lock);
-    void *page_ret = (void *)page_to_pa(page);
-    // if (page_ret != NULL) {
+    // not a page cache page (yet), cow() relies on it
+    page->mapping = NULL;
     atomic_sub_return(&pages_cnt, 1 << page->order);
-    // if (atomic_read(&pages_cnt) < PAGES_THRESHOLD) {
-    //     alloc_fail();
-    // }
-    if (!atomic_read(&recycling) && atomic_read(&pages_cnt) < PAGES_THRESHOLD) {
-        atomic_inc_return(&recycling);
-        alloc_fail();
-        atomic_dec_return(&recycling);
-    }
-    // if(atomic_read(&pages_cnt) < 10000) {
-    //     printf("ready\n");
-    // }
-    // int cnt = 1<< page->order;
-
-    // if(cnt == 4) {
-    //     printfBlue("ready\n");
-    // }
-    // if(cnt == 1) {
-    //     printfRed("prepare\n");
-    // }
-    // if(cnt == 2) {
-    //     printf("page cnt : 2\n");
-    // }
-    // if(cnt == 4096) {
-    //     printf("page cnt : 4096\n");
-    // }
-    // if(cnt == 8) {
-    //     printf("page cnt : 4096\n");
-    // }
-    // if(cnt == 16) {
-    //     printf("page cnt : 16\n");
-    // }
-    // if(cnt == 64) {
-    //     printf("page cnt : 64\n");
-    // }
-    // if(cnt == 4096) {
-    //     printf("alloc, page cnt : 4096\n");
-    // }
-    
-    // if (cnt > 2)
-    //     printfRed("kmalloc, page alloc : %d pages \n", cnt);
-    return page_ret;
+    if (atomic_read(&pages_cnt) < KSWAPD_LOW_PAGES) {
+        wakeup_kswapd();
+    }
+    return page;
+}
+
+void *kmalloc(size_t size) {
+    uint64 order;
+    // sub-page objects come from the slab caches
+    if (size <= SLAB_MAX_SIZE) {
+        return kmalloc_small(size);
+    }
+    if (size <= PGSIZE) {
+        order = 0;
+    } else {
+        order = size_to_page_order(size);
+    }
+
+    struct page *page = alloc_pages(order);
+    if (page == NULL) {
+        return 0;
+    }
+    return (void *)page_to_pa(page);
 }
 
 void *kzalloc(size_t size) {
@@ -148,89 +200,76 @@ void *kzalloc(size_t size) {
 
 /* compatible with the old kalloc call, use kmalloc instead */
 void *kalloc(void) {
-    int order = 0;
-
-    push_off();
-    int id = cpuid();
-    // printf("%d\n", NCPU);
-    ASSERT(id >= 0 && id < NCPU);
-    struct page *page = buddy_get_pages(&mempools[id], order);
-
+    struct page *page = alloc_pages(0);
     if (page == NULL) {
-        page = steal_mem(id, order);
-        if (page == NULL) {
-            return 0;
-        }
+        return 0;
     }
-
-    // acquire(&page->lock);
-    ASSERT(atomic_read(&page->refcnt) == 0);
-    atomic_set(&page->refcnt, 1);
-    // ASSERT(page->count == 0);
-    // page->count = 1;
-    // release(&page->lock);
-    void *page_ret = (void *)page_to_pa(page);
-    // if (page_ret != NULL) {
-    atomic_sub_return(&pages_cnt, 1 << page->order);
-    // }
-
-    if (!atomic_read(&recycling) && atomic_read(&pages_cnt) < PAGES_THRESHOLD) {
-        atomic_inc_return(&recycling);
-        alloc_fail();
-        atomic_dec_return(&recycling);
-    }
-
-    // int cnt = 1<< page->order;
-    // if(cnt == 4) {
-    //     printfBlue("ready\n");
-    // }
-    // if(cnt == 2) {
-    //     printf("page cnt : 2\n");
-    // }
-    // if(cnt == 1) {
-    //     printfRed("prepare\n");
-    // }
-    // if(cnt == 16) {
-    //     printf("page cnt : 16\n");
-    // }
-    // if (cnt > 2)
-    //     printfRed("kalloc, page alloc : %d pages \n", cnt);
-    return page_ret;
+    return (void *)page_to_pa(page);
 }
 
-void kfree(void *pa) {
-    struct page *page = pa_to_page((uint64)pa);
+static void free_pages(struct page *page, int cold) {
     acquire(&page->lock);
-    // ASSERT(page->count >= 1);
-    // ASSERT(atomic_read(&page->refcnt) >= 1);
     if (atomic_read(&page->refcnt) < 1) {
         panic("kfree : page ref error\n");
     }
 
-    // page->count--;
     atomic_dec_return(&page->refcnt);
     if (atomic_read(&page->refcnt) >= 1) {
         release(&page->lock);
         return;
     }
-    // ASSERT(page->count == 0);
     ASSERT(atomic_read(&page->refcnt) == 0);
     release(&page->lock);
 
     ASSERT(page->allocated == 1);
-    int id = get_pages_cpu(page);
-    ASSERT(id >= 0 && id < NCPU);
-
-    // if (page != NULL) {
     atomic_add_return(&pages_cnt, 1 << page->order);
-    // }
-
-    // int cnt = 1<< page->order;
-    // if(cnt == 4096) {
-    //     printfBlue("free, page cnt : 4096\n");
-    // }
-    
-    buddy_free_pages(&mempools[id], page);
+
+    if (page->order == 0) {
+        // single page goes to the list of the freeing cpu, not the owner
+        push_off();
+        pcp_free_page(cpuid(), page, cold);
+        pop_off();
+    } else {
+        int id = get_pages_cpu(page);
+        ASSERT(id >= 0 && id < NCPU);
+        buddy_free_pages(&mempools[id], page);
+        buddy_return_borrowed(id);
+    }
+}
+
+void kfree(void *pa) {
+    if (kfree_small(pa)) {
+        return;
+    }
+    free_pages(pa_to_page((uint64)pa), 0);
+}
+
+// allocate cnt physically contiguous pages, each of them is freed on its own
+// (e.g. a read-ahead window of the page cache, evicted page by page later)
+void *kalloc_contig(uint64 cnt) {
+    uint64 order = size_to_page_order(cnt * PGSIZE);
+    struct page *page = alloc_pages(order);
+    if (page == NULL) {
+        return 0;
+    }
+
+    // split the block into order-0 pages
+    for (uint64 i = 1; i < (1UL << order); i++) {
+        page[i].order = 0;
+        page[i].allocated = 1;
+        atomic_set(&page[i].refcnt, 1);
+    }
+    page->order = 0;
+    // give back the tail we don't need
+    for (uint64 i = cnt; i < (1UL << order); i++) {
+        free_pages(page + i, 0);
+    }
+    return (void *)page_to_pa(page);
+}
+
+/* the page is not likely to be touched again soon (e.g. evicted page cache) */
+void kfree_cold(void *pa) {
+    free_pages(pa_to_page((uint64)pa), 1);
 }
 
 void share_page(uint64 pa) {
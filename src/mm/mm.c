@@ -23,6 +23,8 @@ struct mm_struct *alloc_mm() {
     // spin lock
     initlock(&mm->lock, "mm_lock");
 
+    atomic_set(&mm->mm_users, 1);
+
     // an empty user page table.
     mm->pagetable = proc_pagetable();
     if (mm->pagetable == 0) {
@@ -35,15 +37,37 @@ bad:
     return NULL;
 }
 
-/* TODO: optimize interface argument */
-void free_mm(struct mm_struct *mm, int thread_cnt) {
+int mm_alloc_tframe(struct mm_struct *mm) {
+    for (int w = 0; w < NTFRAME_WORDS; w++) {
+        uint64 free = ~mm->tframe_map[w];
+        if (free != 0) {
+            int tidx = w * 64 + __builtin_ctzl(free);
+            if (tidx >= NTFRAME) {
+                break;
+            }
+            mm->tframe_map[w] |= (1UL << (tidx % 64));
+            return tidx;
+        }
+    }
+    return -1;
+}
+
+void mm_free_tframe(struct mm_struct *mm, int tidx) {
+    mm->tframe_map[tidx / 64] &= ~(1UL << (tidx % 64));
+}
+
+void free_mm(struct mm_struct *mm) {
     if (mm == NULL) {
         Warn("no need to free mm");
         return;
     }
+    if (atomic_dec_return(&mm->mm_users) > 1) {
+        // still used by another proc
+        return;
+    }
 
     if (mm->pagetable)
-        proc_freepagetable(mm, thread_cnt);
+        proc_freepagetable(mm);
 
     mm->pagetable = 0;
     mm->brk = 0;
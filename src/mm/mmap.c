@@ -10,6 +10,7 @@
 #include "kernel/syscall.h"
 #include "atomic/spinlock.h"
 #include "proc/tcb_life.h"
+#include "memory/pagefault.h"
 
 /* int munmap(void *addr, size_t length); */
 uint64 sys_munmap(void) {
@@ -165,6 +166,10 @@ void *sys_mmap(void) {
     void *retval = do_mmap(addr, length, prot, flags, fp, offset);
     release(&m->lock);
     // sema_signal(&m->mmap_sem);
+    if (retval != MAP_FAILED && (flags & MAP_POPULATE)) {
+        // reading the file may sleep, do it without the spinlock
+        populate_vma_range(m, (vaddr_t)retval, (vaddr_t)retval + length);
+    }
     return retval;
 }
 
@@ -9,6 +9,8 @@
 #include "debug.h"
 #include "memory/mm.h"
 #include "memory/pagefault.h"
+#include "memory/filemap.h"
+#include "memory/buddy.h"
 
 
 static uint32 perm_vma2pte(uint32 vma_perm) {
@@ -40,6 +42,266 @@ int is_a_cow_page(int flags) {
     return 1;
 }
 
+int fault_around_pages = FAULT_AROUND_PAGES;
+
+#define MAP_BATCH 32 // page cache pages got at a time
+
+// shared mapping: the page cache page itself, private mapping: read-only until the first write (see cow)
+static uint32 file_pte_perm(struct vma *vma) {
+    uint32 perm = perm_vma2pte(vma->perm) | PTE_R | PTE_U;
+    if (!(vma->perm & PERM_SHARED)) {
+        // a write is checked against vma->perm first, then copied by cow()
+        perm = (perm & ~PTE_W) | PTE_SHARE;
+    }
+    return perm;
+}
+
+static inline int pte_none(pagetable_t pagetable, vaddr_t va) {
+    pte_t *pte;
+    walk(pagetable, va, 0, 0, &pte);
+    return pte == NULL || *pte == 0;
+}
+
+// caller holds mm->lock, the threads of mm fault concurrently
+// map pa at va, unless another fault has mapped va meanwhile, pa is dropped then
+// return 0 if va is mapped
+static int install_pte(struct mm_struct *mm, vaddr_t va, paddr_t pa, uint32 perm) {
+    if (!pte_none(mm->pagetable, va)) {
+        kfree((void *)pa);
+        return 0;
+    }
+    if (mappages(mm->pagetable, va, PGSIZE, pa, perm, COMMONPAGE) != 0) {
+        kfree((void *)pa);
+        return -1;
+    }
+    return 0;
+}
+
+// caller holds mm->lock
+// map the cnt pages got from the page cache at va, return the number of them mapped
+static int install_file_pages(struct mm_struct *mm, struct vma *vma, vaddr_t va, int cnt, struct page **pages) {
+    uint32 perm = file_pte_perm(vma);
+    int mapped = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        if (pages[i] != NULL && install_pte(mm, va + i * PGSIZE, page_to_pa(pages[i]), perm) == 0) {
+            mapped++;
+        }
+    }
+    return mapped;
+}
+
+// map the page cache pages of [start, end) which are not mapped yet
+// only the cached ones, unless read is set
+static int map_file_range(struct mm_struct *mm, struct vma *vma, vaddr_t start, vaddr_t end, int read) {
+    pagetable_t pagetable = mm->pagetable;
+    struct inode *ip = vma->vm_file->f_tp.f_inode;
+    struct page *pages[MAP_BATCH];
+    int mapped = 0;
+
+    if (PGMASK(vma->offset) != 0) {
+        return 0;
+    }
+    vaddr_t va = start;
+    while (va < end) {
+        if (!pte_none(pagetable, va)) {
+            va += PGSIZE;
+            continue;
+        }
+        // a run of unmapped pages
+        int cnt = 1;
+        while (cnt < MAP_BATCH && va + cnt * PGSIZE < end && pte_none(pagetable, va + cnt * PGSIZE)) {
+            cnt++;
+        }
+
+        fat32_inode_lock(ip);
+        filemap_get_pages(ip, (vma->offset + va - vma->startva) >> PGSHIFT, cnt, read, pages);
+        fat32_inode_unlock(ip);
+
+        acquire(&mm->lock);
+        mapped += install_file_pages(mm, vma, va, cnt, pages);
+        release(&mm->lock);
+        va += cnt * PGSIZE;
+    }
+    return mapped;
+}
+
+// caller holds mm->lock
+// zero-fill the unmapped pages of [start, end)
+static int map_anon_range(struct mm_struct *mm, struct vma *vma, vaddr_t start, vaddr_t end) {
+    uint32 perm = perm_vma2pte(vma->perm) | PTE_R | PTE_U;
+    int mapped = 0;
+
+    for (vaddr_t va = start; va < end; va += PGSIZE) {
+        if (!pte_none(mm->pagetable, va)) {
+            continue;
+        }
+        void *mem;
+        if ((mem = kzalloc(PGSIZE)) == 0) {
+            break;
+        }
+        if (install_pte(mm, va, (paddr_t)mem, perm) < 0) {
+            break;
+        }
+        mapped++;
+    }
+    return mapped;
+}
+
+// map the page cache page of the file instead of copying it
+// it sleeps for the page, so it maps it under mm->lock only if no other fault has meanwhile
+static int filemap_fault(uint64 cause, struct mm_struct *mm, struct vma *vma, vaddr_t va) {
+    struct inode *ip = vma->vm_file->f_tp.f_inode;
+    uint64 off = vma->offset + va - vma->startva;
+    uint32 perm = file_pte_perm(vma);
+    struct page *page;
+    paddr_t pa;
+    int ret;
+
+    fat32_inode_lock(ip);
+    if (off >= ip->i_size || PGMASK(off) != 0) {
+        // beyond EOF, or not page aligned: an anonymous page as before
+        void *mem;
+        if ((mem = kzalloc(PGSIZE)) == 0) {
+            fat32_inode_unlock(ip);
+            return -1;
+        }
+        fat32_inode_read(ip, 0, (uint64)mem, off, PGSIZE);
+        fat32_inode_unlock(ip);
+        acquire(&mm->lock);
+        ret = install_pte(mm, va, (paddr_t)mem, perm_vma2pte(vma->perm) | PTE_R | PTE_U);
+        release(&mm->lock);
+        return ret;
+    }
+    filemap_get_pages(ip, off >> PGSHIFT, 1, 1, &page);
+    fat32_inode_unlock(ip);
+    if (page == NULL) {
+        return -1;
+    }
+    pa = page_to_pa(page);
+
+    if (!(vma->perm & PERM_SHARED) && cause == STORE_PAGEFAULT) {
+        // it will be written at once, copy it now
+        void *mem;
+        if ((mem = kmalloc(PGSIZE)) == 0) {
+            kfree((void *)pa);
+            return -1;
+        }
+        memmove(mem, (void *)pa, PGSIZE);
+        kfree((void *)pa);
+        pa = (paddr_t)mem;
+        perm |= PTE_W;
+        perm &= ~PTE_SHARE;
+    }
+
+    acquire(&mm->lock);
+    ret = install_pte(mm, va, pa, perm);
+    release(&mm->lock);
+    return ret;
+}
+
+// a fault right behind the pages mapped last time is a sequential one and doubles the window,
+// any other fault resets it
+static int fault_window(struct vma *vma, vaddr_t va) {
+    if (va == vma->fault_next) {
+        vma->fault_window = MIN(MAX(vma->fault_window * 2, 2), fault_around_pages);
+    } else {
+        vma->fault_window = 1;
+    }
+    return MAX(vma->fault_window, 1);
+}
+
+// map the neighbours of the faulting page va, to save the faults on them
+static void fault_around(struct mm_struct *mm, struct vma *vma, vaddr_t va) {
+    vaddr_t vma_end = vma->startva + vma->size;
+    int window = fault_window(vma, va);
+
+    if (vma->type == VMA_FILE && fault_around_pages > 1) {
+        // cached pages cost nothing but the PTEs, map the aligned block around va
+        vaddr_t start = va - ((va >> PGSHIFT) % fault_around_pages) * PGSIZE;
+        start = MAX(start, vma->startva);
+        map_file_range(mm, vma, start, MIN(vma_end, start + fault_around_pages * PGSIZE), 0);
+        if (window > 1) {
+            // sequential faults, read the window ahead
+            map_file_range(mm, vma, va + PGSIZE, MIN(vma_end, va + window * PGSIZE), 1);
+        }
+    } else if (vma->type == VMA_ANON && window > 1) {
+        acquire(&mm->lock);
+        map_anon_range(mm, vma, va + PGSIZE, MIN(vma_end, va + window * PGSIZE));
+        release(&mm->lock);
+    }
+
+    // the next sequential fault hits the end of the mapped run
+    vaddr_t next = va + PGSIZE;
+    vaddr_t limit = MIN(vma_end, va + 2 * fault_around_pages * PGSIZE);
+    while (next < limit && !pte_none(mm->pagetable, next)) {
+        next += PGSIZE;
+    }
+    vma->fault_next = next;
+}
+
+// prefault [start, end), for MAP_POPULATE and MADV_WILLNEED
+// it may do I/O, the caller must not hold mm->lock
+// the vmas are looked up under mm->lock, which is dropped to read the file, so the
+// pages read are only mapped if the range still maps the same part of the same file
+int populate_vma_range(struct mm_struct *mm, vaddr_t start, vaddr_t end) {
+    struct page *pages[MAP_BATCH];
+
+    start = PGROUNDDOWN(start);
+    end = PGROUNDUP(end);
+    while (start < end) {
+        acquire(&mm->lock);
+        struct vma *vma = find_vma_for_va(mm, start);
+        if (vma == NULL) {
+            release(&mm->lock);
+            return -1;
+        }
+        vaddr_t stop = MIN(end, vma->startva + vma->size);
+        if (!(vma->perm & (PERM_READ | PERM_WRITE | PERM_EXEC))) {
+            release(&mm->lock);
+            start = stop;
+            continue;
+        }
+        if (vma->type != VMA_FILE || PGMASK(vma->offset) != 0) {
+            if (vma->type == VMA_ANON) {
+                map_anon_range(mm, vma, start, stop);
+            }
+            release(&mm->lock);
+            start = stop;
+            continue;
+        }
+
+        // a batch of the file, the inode is pinned while mm->lock is dropped
+        struct inode *ip = fat32_inode_dup(vma->vm_file->f_tp.f_inode);
+        uint64 pgoff = (vma->offset + start - vma->startva) >> PGSHIFT;
+        int cnt = MIN((stop - start) >> PGSHIFT, MAP_BATCH);
+        stop = start + cnt * PGSIZE;
+        release(&mm->lock);
+
+        fat32_inode_lock(ip);
+        filemap_get_pages(ip, pgoff, cnt, 1, pages);
+        fat32_inode_unlock(ip);
+
+        acquire(&mm->lock);
+        vma = find_vma_for_va(mm, start);
+        if (vma != NULL && vma->type == VMA_FILE && vma->vm_file->f_tp.f_inode == ip
+            && vma->startva + vma->size >= stop && ((vma->offset + start - vma->startva) >> PGSHIFT) == pgoff) {
+            install_file_pages(mm, vma, start, cnt, pages);
+        } else {
+            // unmapped or mapped again meanwhile
+            for (int i = 0; i < cnt; i++) {
+                if (pages[i] != NULL) {
+                    kfree((void *)page_to_pa(pages[i]));
+                }
+            }
+        }
+        release(&mm->lock);
+        fat32_inode_put(ip);
+        start = stop;
+    }
+    return 0;
+}
+
 int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
     /* the va exceed the MAXVA is illegal */
     if (PGROUNDDOWN(stval) >= MAXVA) {
@@ -47,7 +309,8 @@ int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
         return -1;
     }
 
-    struct vma *vma = find_vma_for_va(proc_current()->mm, stval);
+    struct mm_struct *mm = proc_current()->mm;
+    struct vma *vma = find_vma_for_va(mm, stval);
     // if (stval > 0x3000b0000) {
     //     Log("hit");
     // }
@@ -64,14 +327,24 @@ int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
         int level;
         level = walk(pagetable, stval, 0, 0, &pte);
         if (pte == NULL || (*pte == 0)) {
-            uvmalloc(pagetable, PGROUNDDOWN(stval), PGROUNDUP(stval + 1), perm_vma2pte(vma->perm));
             if (vma->type == VMA_FILE) {
-                paddr_t pa = walkaddr(pagetable, stval);
-
-                fat32_inode_lock(vma->vm_file->f_tp.f_inode);
-                fat32_inode_read(vma->vm_file->f_tp.f_inode, 0, pa, vma->offset + PGROUNDDOWN(stval) - vma->startva, PGSIZE);
-                fat32_inode_unlock(vma->vm_file->f_tp.f_inode);
+                if (filemap_fault(cause, mm, vma, PGROUNDDOWN(stval)) < 0) {
+                    return -1;
+                }
+            } else {
+                void *mem;
+                if ((mem = kzalloc(PGSIZE)) == 0) {
+                    return -1;
+                }
+                // another thread may fault on it at the same time
+                acquire(&mm->lock);
+                int ret = install_pte(mm, PGROUNDDOWN(stval), (paddr_t)mem, perm_vma2pte(vma->perm) | PTE_R | PTE_U);
+                release(&mm->lock);
+                if (ret < 0) {
+                    return -1;
+                }
             }
+            fault_around(mm, vma, PGROUNDDOWN(stval));
         } else {
             pa = PTE2PA(*pte);
             flags = PTE_FLAGS(*pte);
@@ -95,6 +368,14 @@ int pagefault(uint64 cause, pagetable_t pagetable, vaddr_t stval) {
 
 int cow(pte_t *pte, int level, paddr_t pa, int flags) {
     void *mem;
+    if (level == COMMONPAGE) {
+        struct page *page = pa_to_page(pa);
+        // the other side has written or gone (e.g. the child of fork did exec), take the page over
+        if (page->mapping == NULL && atomic_read(&page->refcnt) == 1) {
+            *pte = *pte | PTE_W;
+            return 0;
+        }
+    }
     if (level == SUPERPAGE) {
         // 2MB superpage
         if ((mem = kmalloc(SUPERPGSIZE)) == 0) {
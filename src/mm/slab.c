@@ -0,0 +1,296 @@
+// Object cache (slab) allocator for sub-page objects.
+// Each slab is one buddy page cut into equal-sized objects,
+// free objects are chained through their first word.
+
+#include "common.h"
+#include "param.h"
+#include "lib/riscv.h"
+#include "lib/list.h"
+#include "atomic/spinlock.h"
+#include "memory/allocator.h"
+#include "memory/buddy.h"
+#include "memory/slab.h"
+#include "kernel/cpu.h"
+#include "debug.h"
+
+static struct kmem_cache kmalloc_caches[KMALLOC_NCLASS];
+static char *kmalloc_names[KMALLOC_NCLASS] = {
+    "kmalloc-16",
+    "kmalloc-32",
+    "kmalloc-64",
+    "kmalloc-128",
+    "kmalloc-256",
+    "kmalloc-512",
+    "kmalloc-1024",
+    "kmalloc-2048",
+};
+
+static inline struct page *obj_to_slab(void *obj) {
+    return pa_to_page(PGROUNDDOWN((uint64)obj));
+}
+
+static void kmem_cache_setup(struct kmem_cache *cache, const char *name, size_t size, size_t align) {
+    if (align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+    safestrcpy(cache->name, name, KMEM_CACHE_NAME_MAX);
+    cache->size = ROUND_UP(MAX(size, sizeof(void *)), align);
+    cache->num = PGSIZE / cache->size;
+    initlock(&cache->lock, "kmem_cache_lock");
+    INIT_LIST_HEAD(&cache->slabs_partial);
+    INIT_LIST_HEAD(&cache->slabs_full);
+    INIT_LIST_HEAD(&cache->slabs_free);
+    cache->nr_free_slabs = 0;
+    for (int i = 0; i < NCPU; i++) {
+        cache->mag[i].avail = 0;
+    }
+}
+
+void kmem_cache_init(void) {
+    size_t size = SLAB_MIN_SIZE;
+    for (int i = 0; i < KMALLOC_NCLASS; i++, size <<= 1) {
+        kmem_cache_setup(&kmalloc_caches[i], kmalloc_names[i], size, size);
+    }
+    ASSERT((size >> 1) == SLAB_MAX_SIZE);
+    Info("slab allocator init [ok]\n");
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align) {
+    struct kmem_cache *cache;
+    if (size == 0 || size > PGSIZE) {
+        Warn("kmem_cache_create: %s, object size %d not support", name, size);
+        return NULL;
+    }
+    if ((cache = (struct kmem_cache *)kzalloc(sizeof(struct kmem_cache))) == NULL) {
+        return NULL;
+    }
+    kmem_cache_setup(cache, name, size, align);
+    return cache;
+}
+
+// caller holds cache->lock
+// a brand-new slab page is linked into slabs_free
+static void slab_init_page(struct kmem_cache *cache, struct page *page) {
+    uint64 base = page_to_pa(page);
+    set_page_flags(page, PG_slab);
+    page->slab_cache = cache;
+    page->inuse = 0;
+    page->freelist = NULL;
+    for (int i = cache->num - 1; i >= 0; i--) {
+        void *obj = (void *)(base + i * cache->size);
+        *(void **)obj = page->freelist;
+        page->freelist = obj;
+    }
+    list_add(&page->list, &cache->slabs_free);
+    cache->nr_free_slabs++;
+}
+
+// caller holds cache->lock
+static void *slab_get_obj(struct kmem_cache *cache) {
+    struct page *page;
+    if (!list_empty(&cache->slabs_partial)) {
+        page = list_first_entry(&cache->slabs_partial, struct page, list);
+    } else if (!list_empty(&cache->slabs_free)) {
+        page = list_first_entry(&cache->slabs_free, struct page, list);
+        cache->nr_free_slabs--;
+    } else {
+        return NULL;
+    }
+
+    void *obj = page->freelist;
+    ASSERT(obj != NULL);
+    page->freelist = *(void **)obj;
+    page->inuse++;
+
+    if (page->inuse == cache->num) {
+        list_move(&page->list, &cache->slabs_full);
+    } else {
+        list_move(&page->list, &cache->slabs_partial);
+    }
+    return obj;
+}
+
+// caller holds cache->lock
+static void slab_put_obj(struct kmem_cache *cache, void *obj) {
+    struct page *page = obj_to_slab(obj);
+    ASSERT(page->slab_cache == cache && page->inuse > 0);
+
+    *(void **)obj = page->freelist;
+    page->freelist = obj;
+    page->inuse--;
+
+    if (page->inuse == 0) {
+        list_move(&page->list, &cache->slabs_free);
+        cache->nr_free_slabs++;
+    } else if (page->inuse == cache->num - 1) {
+        list_move(&page->list, &cache->slabs_partial);
+    }
+}
+
+// caller holds cache->lock, detach at most max free slabs into pages
+static void slab_collect_free(struct kmem_cache *cache, struct list_head *pages, uint max) {
+    struct page *page, *tmp;
+    list_for_each_entry_safe(page, tmp, &cache->slabs_free, list) {
+        if (max == 0) {
+            break;
+        }
+        list_move(&page->list, pages);
+        cache->nr_free_slabs--;
+        max--;
+    }
+}
+
+// give the pages back to the page allocator, without holding cache->lock
+static void slab_release_pages(struct list_head *pages) {
+    struct page *page, *tmp;
+    list_for_each_entry_safe(page, tmp, pages, list) {
+        list_del(&page->list);
+        clear_page_flags(page, PG_slab);
+        page->slab_cache = NULL;
+        page->freelist = NULL;
+        kfree((void *)page_to_pa(page));
+    }
+}
+
+// refill the magazine of current hart
+// interrupts are off, and the cache lock is not held
+static int cache_refill(struct kmem_cache *cache, struct kmem_magazine *mag) {
+    acquire(&cache->lock);
+    while (mag->avail < SLAB_MAG_BATCH) {
+        void *obj = slab_get_obj(cache);
+        if (obj != NULL) {
+            mag->objs[mag->avail++] = obj;
+            continue;
+        }
+        if (mag->avail > 0) {
+            break;
+        }
+        // no free object at all, grow the cache by one page
+        // drop the lock: the page allocator may reclaim memory and free into this cache
+        release(&cache->lock);
+        void *pa = kalloc();
+        acquire(&cache->lock);
+        if (pa == NULL) {
+            break;
+        }
+        slab_init_page(cache, pa_to_page((uint64)pa));
+    }
+    release(&cache->lock);
+    return mag->avail;
+}
+
+// flush the oldest SLAB_MAG_BATCH objects back to their slabs
+static void cache_flush(struct kmem_cache *cache, struct kmem_magazine *mag) {
+    struct list_head pages;
+    INIT_LIST_HEAD(&pages);
+
+    acquire(&cache->lock);
+    int n = MIN(SLAB_MAG_BATCH, mag->avail);
+    for (int i = 0; i < n; i++) {
+        slab_put_obj(cache, mag->objs[i]);
+    }
+    mag->avail -= n;
+    memmove(mag->objs, mag->objs + n, mag->avail * sizeof(void *));
+    if (cache->nr_free_slabs > SLAB_FREE_LIMIT) {
+        slab_collect_free(cache, &pages, cache->nr_free_slabs - SLAB_FREE_LIMIT);
+    }
+    release(&cache->lock);
+
+    slab_release_pages(&pages);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    void *obj = NULL;
+    push_off();
+    struct kmem_magazine *mag = &cache->mag[cpuid()];
+    if (mag->avail > 0 || cache_refill(cache, mag) > 0) {
+        obj = mag->objs[--mag->avail];
+    }
+    pop_off();
+    return obj;
+}
+
+void *kmem_cache_zalloc(struct kmem_cache *cache) {
+    void *obj = kmem_cache_alloc(cache);
+    if (obj != NULL) {
+        memset(obj, 0, cache->size);
+    }
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    push_off();
+    struct kmem_magazine *mag = &cache->mag[cpuid()];
+    if (mag->avail == SLAB_MAG_LIMIT) {
+        cache_flush(cache, mag);
+    }
+    mag->objs[mag->avail++] = obj;
+    pop_off();
+}
+
+// drain the magazine of current hart and give all empty slabs back
+void kmem_cache_shrink(struct kmem_cache *cache) {
+    struct list_head pages;
+    INIT_LIST_HEAD(&pages);
+
+    push_off();
+    struct kmem_magazine *mag = &cache->mag[cpuid()];
+    acquire(&cache->lock);
+    for (int i = 0; i < mag->avail; i++) {
+        slab_put_obj(cache, mag->objs[i]);
+    }
+    mag->avail = 0;
+    slab_collect_free(cache, &pages, cache->nr_free_slabs);
+    release(&cache->lock);
+    pop_off();
+
+    slab_release_pages(&pages);
+}
+
+// the caller must make sure that no one uses the cache any more
+void kmem_cache_destroy(struct kmem_cache *cache) {
+    struct list_head pages;
+    INIT_LIST_HEAD(&pages);
+
+    acquire(&cache->lock);
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        struct kmem_magazine *mag = &cache->mag[cpu];
+        for (int i = 0; i < mag->avail; i++) {
+            slab_put_obj(cache, mag->objs[i]);
+        }
+        mag->avail = 0;
+    }
+    if (!list_empty(&cache->slabs_partial) || !list_empty(&cache->slabs_full)) {
+        Warn("kmem_cache_destroy: %s still has objects in use", cache->name);
+    }
+    slab_collect_free(cache, &pages, cache->nr_free_slabs);
+    release(&cache->lock);
+
+    slab_release_pages(&pages);
+    kfree(cache);
+}
+
+static inline int kmalloc_index(size_t size) {
+    int idx = 0;
+    size_t class_size = SLAB_MIN_SIZE;
+    while (class_size < size) {
+        class_size <<= 1;
+        idx++;
+    }
+    return idx;
+}
+
+void *kmalloc_small(size_t size) {
+    ASSERT(size <= SLAB_MAX_SIZE);
+    return kmem_cache_alloc(&kmalloc_caches[kmalloc_index(size)]);
+}
+
+// return 1 if obj belongs to a slab, and it has been freed
+int kfree_small(void *obj) {
+    struct page *page = obj_to_slab(obj);
+    if (!test_page_flags(page, PG_slab)) {
+        return 0;
+    }
+    kmem_cache_free(page->slab_cache, obj);
+    return 1;
+}
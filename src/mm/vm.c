@@ -67,9 +67,6 @@ kvmmake(void) {
     // the highest virtual address in the kernel.
     kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X, COMMONPAGE);
 
-    // allocate and map a kernel stack for each process.
-    tcb_mapstacks(kpgtbl);
-
     // debug user program
     kvmmap(kpgtbl, 0, START_MEM, PGSIZE * 1000, PTE_R | PTE_W, 0);
 
@@ -420,99 +417,93 @@ void uvmfree(struct mm_struct *mm) {
     freewalk(mm->pagetable, 0);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// make a parent's pte copy-on-write, unless the vma is a shared file mapping
+static inline void cow_pte(struct vma *vma, pte_t *pte) {
+    if (vma->type != VMA_FILE || !(vma->perm & PERM_SHARED)) {
+        if ((*pte & PTE_W) == 0 && (*pte & PTE_SHARE) == 0) {
+            *pte = *pte | PTE_READONLY;
+        }
+        /* shared page */
+        if ((*pte & PTE_W) == 0 && (*pte & PTE_READONLY) != 0) {
+            *pte = *pte | PTE_READONLY;
+        }
+        *pte = *pte | PTE_SHARE;
+        *pte = *pte & ~PTE_W;
+    }
+}
+
+// Given a parent process's page table, share
+// its memory with a child's page table, copy-on-write
+// (the stacks too, the first write of either side copies the page).
+// The leaf page tables are walked once per 2MB, not once per page.
 // returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
 int uvmcopy(struct mm_struct *srcmm, struct mm_struct *dstmm) {
     struct vma *pos;
     list_for_each_entry(pos, &srcmm->head_vma, node) {
-        vaddr_t startva, endva;
+        vaddr_t startva, endva, va, stop;
+        pte_t *pte, *spt, *dpt;
         paddr_t pa;
-        pte_t *pte;
-        uint flags;
         int level;
 
-        /* for STACK VMA, copy both the pagetable and the physical memory */
-        if (pos->type == VMA_STACK) {
-            // ASSERT(pos->size == USTACK_PAGE * PGSIZE);
-            // Log("stack size is %d", pos->size / PGSIZE);
-            for (uint64 offset = 0; offset < pos->size; offset += PGSIZE) {
-                level = walk(srcmm->pagetable, pos->startva + offset, 0, 0, &pte);
-                // ASSERT(level <= 1 && level >= 0);
-                if (!(level <= 1 && level >= 0)) {
-                    panic("uvmcopy : level error\n");
-                }
-                pa = PTE2PA(*pte);
-
-                paddr_t new = (paddr_t)kzalloc(PGSIZE);
-                if (new == 0) {
-                    Warn("uvmcopy: no free mem");
-                    return -1;
-                }
-                memmove((void *)new, (void *)pa, PGSIZE);
-                if (mappages(dstmm->pagetable, pos->startva + offset, PGSIZE, new, PTE_W | PTE_R | PTE_U, COMMONPAGE) != 0) {
-                    panic("uvmcopy: map failed");
-                    return -1;
-                }
-                // Log("stack %p", pos->startva + offset);
-            }
-            continue;
-        }
-
-        /* for other vmas, copy pagetable only */
         startva = pos->startva;
         endva = startva + pos->size;
         ASSERT(startva % PGSIZE == 0 && endva % PGSIZE == 0);
-        for (vaddr_t i = startva; i < endva; i += PGSIZE) {
-            level = walk(srcmm->pagetable, i, 0, 0, &pte);
-            if (pte == NULL || *pte == 0) {
+        for (va = startva; va < endva; va = stop) {
+            stop = MIN(endva, SUPERPG_DOWN(va) + SUPERPGSIZE);
+            level = walk(srcmm->pagetable, va, 0, 0, &pte);
+            if (pte == NULL) {
+                // no leaf page table here
                 continue;
             }
-            if (!(level <= 1 && level >= 0)) {
-                panic("uvmcopy : level error\n");
-            }
-
-            if (pos->type != VMA_FILE || !(pos->perm & PERM_SHARED)) {
-                // if (pos->type != VMA_FILE) {
-                if ((*pte & PTE_W) == 0 && (*pte & PTE_SHARE) == 0) {
-                    *pte = *pte | PTE_READONLY;
+            if (level == SUPERPAGE) {
+                /* level == 1 ~ map superpage */
+                ASSERT(va == SUPERPG_DOWN(va));
+                if (*pte == 0) {
+                    continue;
                 }
-                /* shared page */
-                if ((*pte & PTE_W) == 0 && (*pte & PTE_READONLY) != 0) {
-                    *pte = *pte | PTE_READONLY;
+                cow_pte(pos, pte);
+                pa = PTE2PA(*pte);
+                if (mappages(dstmm->pagetable, va, SUPERPGSIZE, pa, PTE_FLAGS(*pte), SUPERPAGE) != 0) {
+                    goto err;
                 }
-                *pte = *pte | PTE_SHARE;
-                *pte = *pte & ~PTE_W;
+                /* call share_page after mappages success! */
+                share_page(pa);
+                continue;
+            }
+            if (level != COMMONPAGE) {
+                panic("uvmcopy : level error\n");
             }
 
-            pa = PTE2PA(*pte);
-            flags = PTE_FLAGS(*pte);
-
-            if (level == SUPERPAGE) {
-                /* level == 1 ~ map superpage */
-                ASSERT(i == SUPERPG_DOWN(i));
-                if (mappages(dstmm->pagetable, i, SUPERPGSIZE, pa, flags, SUPERPAGE) != 0) {
-                    goto err;
+            /* level == 0 ~ common pages, [va, stop) is in one leaf page table of each side */
+            spt = pte - PN(0, va);
+            dpt = NULL;
+            for (; va < stop; va += PGSIZE) {
+                pte = &spt[PN(0, va)];
+                if (*pte == 0) {
+                    continue;
                 }
-                i += (SUPERPGSIZE - PGSIZE);
-            } else if (level == COMMONPAGE) {
-                /* level == 0 ~ map common page */
-                if (mappages(dstmm->pagetable, i, PGSIZE, pa, flags, COMMONPAGE) != 0) {
-                    goto err;
+                if (dpt == NULL) {
+                    walk(dstmm->pagetable, va, 1, 0, &dpt);
+                    if (dpt == NULL) {
+                        goto err;
+                    }
+                    dpt -= PN(0, va);
                 }
+                if (dpt[PN(0, va)] & PTE_V) {
+                    panic("uvmcopy: remap");
+                }
+                cow_pte(pos, pte);
+                pa = PTE2PA(*pte);
+                dpt[PN(0, va)] = *pte;
+                share_page(pa);
             }
-            /* call share_page after mappages success! */
-            share_page(pa);
         }
     }
     return 0;
 
 err:
-    panic("TODO: error handler");
-    // uvmunmap(new, 0, i / PGSIZE, 0, 0);
+    // the caller frees dstmm, with the pages mapped so far
+    Warn("uvmcopy: no free mem");
     return -1;
 }
 
@@ -527,47 +518,82 @@ void uvmclear(pagetable_t pagetable, uint64 va) {
     *pte &= ~PTE_U;
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
-    uint64 n, va0, pa0;
+// The physical address of user va, and in *span how many bytes from there are
+// mapped by the same leaf PTE (to the end of the page or the superpage), so a
+// copy walks the page table once per page.
+// write : fault in a missing or COW page, as a store from the user would.
+// Return 0 if the user can't access va.
+static uint64 uaccess_pa(pagetable_t pagetable, uint64 va, int write, uint64 *span) {
+    pte_t *pte;
+    int level;
+    uint64 size;
 
-    while (len > 0) {
-        va0 = PGROUNDDOWN(dstva);
+    /* since walk will panic if va > maxva, so we have to handle this error before walk */
+    if (va >= MAXVA) {
+        return 0;
+    }
+    level = walk(pagetable, va, 0, 0, &pte);
+    if (write) {
         // kernel has the right to write all RAM without PAGE FAULT
         // so need to check if this write is legal(PTE_W == 1 in PTE)
         // if not, call pagefault
-        pte_t *pte;
-        int flags;
-        /* since walk will panic if va0 > maxva, so we have to handle this error before walk */
-        if (va0 >= MAXVA) {
-            return -1;
-        }
-        walk(pagetable, va0, 0, 0, &pte);
-        if (pte == NULL || (*pte == 0)) {
-            if (pagefault(STORE_PAGEFAULT, pagetable, dstva) < 0) {
-                return -1;
+        if (pte == NULL || *pte == 0) {
+            if (pagefault(STORE_PAGEFAULT, pagetable, va) < 0) {
+                return 0;
             }
-        }
-        flags = PTE_FLAGS(*pte);
-        if ((flags & PTE_W) == 0 && is_a_cow_page(flags)) {
-            if (pagefault(STORE_PAGEFAULT, pagetable, dstva) < 0) {
-                return -1;
+            level = walk(pagetable, va, 0, 0, &pte);
+        } else if ((PTE_FLAGS(*pte) & PTE_W) == 0) {
+            // never write a read-only page behind the user, it may be a page cache page
+            if (!is_a_cow_page(PTE_FLAGS(*pte)) || pagefault(STORE_PAGEFAULT, pagetable, va) < 0) {
+                return 0;
             }
+            level = walk(pagetable, va, 0, 0, &pte);
         }
+    }
+    if (pte == NULL || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0) {
+        return 0;
+    }
+    size = (level == SUPERPAGE) ? SUPERPGSIZE : PGSIZE;
+    *span = size - (va & (size - 1));
+    return PTE2PA(*pte) + (va & (size - 1));
+}
+
+// a byte of x is 0
+#define HAS_ZERO_BYTE(x) (((x)-0x0101010101010101UL) & ~(x) & 0x8080808080808080UL)
+
+// the length of the string at p, at most n, a word at a time once p is aligned
+static uint64 strnlen_chunk(const char *p, uint64 n) {
+    const char *s = p;
+
+    while (n > 0 && ((uint64)s & 7)) {
+        if (*s == '\0')
+            return s - p;
+        s++, n--;
+    }
+    while (n >= 8 && !HAS_ZERO_BYTE(*(const uint64 *)s)) {
+        s += 8, n -= 8;
+    }
+    while (n > 0 && *s != '\0') {
+        s++, n--;
+    }
+    return s - p;
+}
 
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// Return 0 on success, -1 on error.
+int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
+    uint64 n, pa, span;
+
+    while (len > 0) {
+        if ((pa = uaccess_pa(pagetable, dstva, 1, &span)) == 0)
             return -1;
-        n = PGSIZE - (dstva - va0);
-        if (n > len)
-            n = len;
-        memmove((void *)(pa0 + (dstva - va0)), src, n);
+        n = MIN(span, len);
+        memmove((void *)pa, src, n);
 
         len -= n;
         src += n;
-        dstva = va0 + PGSIZE;
+        dstva += n;
     }
     return 0;
 }
@@ -576,67 +602,62 @@ int copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
 // Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
 int copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
-    uint64 n, va0, pa0;
+    uint64 n, pa, span;
 
     while (len > 0) {
-        va0 = PGROUNDDOWN(srcva);
-        // if (va0 == 0x32407000) {
-        //     vmprint(pagetable, 1, 0, 0x32406000, 0);
-        // }
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
+        if ((pa = uaccess_pa(pagetable, srcva, 0, &span)) == 0)
             return -1;
-        n = PGSIZE - (srcva - va0);
-        if (n > len)
-            n = len;
-        memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+        n = MIN(span, len);
+        memmove(dst, (void *)pa, n);
 
         len -= n;
         dst += n;
-        srcva = va0 + PGSIZE;
+        srcva += n;
     }
     return 0;
 }
 
+// The length of the null-terminated string at user virtual address srcva,
+// without the '\0'. max if there is no '\0' in the first max bytes.
+// Return -1 on error.
+int64 strnlen_user(pagetable_t pagetable, uint64 srcva, uint64 max) {
+    uint64 n, pa, span, len = 0;
+
+    while (len < max) {
+        if ((pa = uaccess_pa(pagetable, srcva + len, 0, &span)) == 0)
+            return -1;
+        n = MIN(span, max - len);
+        uint64 m = strnlen_chunk((char *)pa, n);
+        len += m;
+        if (m < n)
+            break;
+    }
+    return len;
+}
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
 // Return 0 on success, -1 on error.
 int copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
-    uint64 n, va0, pa0;
-    int got_null = 0;
+    uint64 n, m, pa, span;
 
-    while (got_null == 0 && max > 0) {
-        va0 = PGROUNDDOWN(srcva);
-        pa0 = walkaddr(pagetable, va0);
-        if (pa0 == 0)
+    while (max > 0) {
+        if ((pa = uaccess_pa(pagetable, srcva, 0, &span)) == 0)
             return -1;
-        n = PGSIZE - (srcva - va0);
-        if (n > max)
-            n = max;
-
-        char *p = (char *)(pa0 + (srcva - va0));
-        while (n > 0) {
-            if (*p == '\0') {
-                *dst = '\0';
-                got_null = 1;
-                break;
-            } else {
-                *dst = *p;
-            }
-            --n;
-            --max;
-            p++;
-            dst++;
+        n = MIN(span, max);
+        m = strnlen_chunk((char *)pa, n);
+        memmove(dst, (void *)pa, m);
+        if (m < n) {
+            dst[m] = '\0';
+            return 0;
         }
 
-        srcva = va0 + PGSIZE;
-    }
-    if (got_null) {
-        return 0;
-    } else {
-        return -1;
+        max -= n;
+        dst += n;
+        srcva += n;
     }
+    return -1;
 }
 
 /* vpn ~ virtual page number */
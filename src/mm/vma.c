@@ -12,6 +12,7 @@
 #include "fs/fat/fat32_file.h"
 #include "fs/vfs/fs.h"
 #include "fs/vfs/ops.h"
+#include "memory/filemap.h"
 
 struct vma vmas[NVMA];
 struct spinlock vmas_lock;
@@ -150,6 +151,8 @@ static struct vma *vma_map_range(struct mm_struct *mm, uint64 va, size_t len, ui
     vma->size = PGROUNDUP(len);
     vma->perm = perm;
     vma->type = type;
+    vma->fault_next = 0;
+    vma->fault_window = 1;
 
     if (add_vma_to_vmspace(&mm->head_vma, vma) < 0) {
         goto free;
@@ -161,6 +164,8 @@ free:
     return 0;
 }
 
+// a shared file mapping maps the page cache pages themselves,
+// so only mark the pages written by the user (PTE_D) dirty
 static void writeback(pagetable_t pagetable, struct file *fp, vaddr_t start, size_t len) {
     ASSERT(start % PGSIZE == 0);
     ASSERT(fp != NULL);
@@ -173,8 +178,9 @@ static void writeback(pagetable_t pagetable, struct file *fp, vaddr_t start, siz
             continue;
         }
         /* only writeback dirty pages(pages with PTE_D) */
+        /* an anonymous page beyond EOF is not in the page cache, just drop it */
         if (PTE_FLAGS(*pte) & PTE_D) {
-            fat32_filewrite(fp, addr, (PGSIZE > (endva - addr) ? (endva - addr) : PGSIZE));
+            set_page_dirty(fp->f_tp.f_inode, pa_to_page(PTE2PA(*pte)));
         }
     }
 }
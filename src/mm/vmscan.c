@@ -0,0 +1,322 @@
+// Page cache reclaim: active/inactive LRU lists and the kswapd thread.
+
+#include "common.h"
+#include "lib/list.h"
+#include "lib/radix-tree.h"
+#include "atomic/spinlock.h"
+#include "atomic/semaphore.h"
+#include "atomic/cond.h"
+#include "memory/allocator.h"
+#include "memory/buddy.h"
+#include "memory/vmscan.h"
+#include "memory/writeback.h"
+#include "fs/vfs/fs.h"
+#include "fs/fat/fat32_mem.h"
+#include "proc/tcb_life.h"
+#include "debug.h"
+
+extern atomic_t pages_cnt;
+extern struct proc *initproc;
+
+struct lru_lists lru;
+struct kswapd_control kswapd_control;
+
+struct scan_control {
+    uint64 nr_to_reclaim;
+    uint64 nr_reclaimed;
+    uint64 nr_scanned;
+    uint64 nr_dirty; // dirty or under writeback, can't be evicted now
+};
+
+void lru_init(void) {
+    initlock(&lru.lock, "lru_lock");
+    INIT_LIST_HEAD(&lru.active);
+    INIT_LIST_HEAD(&lru.inactive);
+    lru.nr_active = 0;
+    lru.nr_inactive = 0;
+    Info("page cache LRU init [ok]\n");
+}
+
+// caller holds lru.lock
+static inline void add_page_to_lru(struct page *page) {
+    set_page_flags(page, PG_lru);
+    if (test_page_flags(page, PG_active)) {
+        list_add(&page->list, &lru.active);
+        lru.nr_active++;
+    } else {
+        list_add(&page->list, &lru.inactive);
+        lru.nr_inactive++;
+    }
+}
+
+// caller holds lru.lock
+static inline void del_page_from_lru(struct page *page) {
+    list_del(&page->list);
+    if (test_page_flags(page, PG_active)) {
+        lru.nr_active--;
+    } else {
+        lru.nr_inactive--;
+    }
+    clear_page_flags(page, PG_lru);
+}
+
+// a new page of the page cache
+void lru_cache_add(struct page *page) {
+    acquire(&lru.lock);
+    ASSERT(!test_page_flags(page, PG_lru));
+    clear_page_flags(page, PG_active);
+    clear_page_flags(page, PG_referenced);
+    add_page_to_lru(page);
+    release(&lru.lock);
+}
+
+// the page is leaving the page cache, caller holds the tree lock of its inode
+void lru_cache_del(struct page *page) {
+    acquire(&lru.lock);
+    // an isolated page is not on the list, reclaim will notice the truncation by itself
+    if (test_page_flags(page, PG_lru)) {
+        del_page_from_lru(page);
+    }
+    clear_page_flags(page, PG_active);
+    clear_page_flags(page, PG_referenced);
+    // under lru.lock, reclaim that couldn't take the tree lock checks it before putting the page back
+    page->mapping = NULL;
+    release(&lru.lock);
+}
+
+// inactive, unreferenced -> inactive, referenced -> active, unreferenced
+void mark_page_accessed(struct page *page) {
+    if (test_page_flags(page, PG_active) || !test_page_flags(page, PG_referenced)) {
+        set_page_flags(page, PG_referenced);
+        return;
+    }
+
+    acquire(&lru.lock);
+    if (test_page_flags(page, PG_lru) && !test_page_flags(page, PG_active)) {
+        del_page_from_lru(page);
+        set_page_flags(page, PG_active);
+        add_page_to_lru(page);
+        clear_page_flags(page, PG_referenced);
+    }
+    release(&lru.lock);
+}
+
+// caller holds lru.lock
+// deactivate the pages at the tail of the active list, unless they are referenced since the last scan
+static void refill_inactive(struct scan_control *sc, int nr_to_scan) {
+    for (; nr_to_scan > 0 && !list_empty(&lru.active); nr_to_scan--) {
+        struct page *page = list_last_entry(&lru.active, struct page, list);
+        sc->nr_scanned++;
+        if (test_page_flags(page, PG_referenced)) {
+            clear_page_flags(page, PG_referenced);
+            list_move(&page->list, &lru.active);
+            continue;
+        }
+        del_page_from_lru(page);
+        clear_page_flags(page, PG_active);
+        add_page_to_lru(page);
+    }
+}
+
+// take at most SWAP_CLUSTER_MAX pages off the tail of the inactive list
+// each of them is pinned by an extra reference, so it survives a concurrent truncation,
+// and so is its inode, which the caller puts
+static int isolate_inactive(struct scan_control *sc, struct page **pages, struct inode **hosts) {
+    int n = 0;
+
+    acquire(&lru.lock);
+    if (lru.nr_inactive < lru.nr_active) {
+        refill_inactive(sc, SWAP_CLUSTER_MAX);
+    }
+    for (int scan = 0; scan < SWAP_CLUSTER_MAX && !list_empty(&lru.inactive); scan++) {
+        struct page *page = list_last_entry(&lru.inactive, struct page, list);
+        sc->nr_scanned++;
+        if (test_page_flags(page, PG_referenced)) {
+            // second chance
+            clear_page_flags(page, PG_referenced);
+            list_move(&page->list, &lru.inactive);
+            continue;
+        }
+        // the inode can't be freed while the page is on the LRU (see lru_cache_del),
+        // but it may be already unused and unhashed on its way to inode_destroy
+        if ((hosts[n] = fat32_inode_grab(page->mapping->host)) == NULL) {
+            list_move(&page->list, &lru.inactive);
+            continue;
+        }
+        del_page_from_lru(page);
+        page_cache_get(page);
+        pages[n] = page;
+        n++;
+    }
+    release(&lru.lock);
+    return n;
+}
+
+// evict an isolated page if it is clean and nobody else uses it, otherwise put it back
+// return 1 if the page is freed
+static int shrink_page(struct scan_control *sc, struct page *page, struct inode *ip) {
+    // readers and writers of the page cache hold i_read_lock
+    int locked = sema_trywait(&ip->i_read_lock);
+    // direct reclaim may come from someone who holds the tree lock of this inode
+    int held = holding(&ip->tree_lock);
+    int freed = 0;
+
+    // never wait for a tree lock here, the allocation we reclaim for may hold another one
+    if (!held && !tryacquire(&ip->tree_lock)) {
+        acquire(&lru.lock);
+        if (page->mapping != NULL) {
+            // not truncated (see lru_cache_del), try it again later
+            add_page_to_lru(page);
+        }
+        release(&lru.lock);
+        goto unlock;
+    }
+    struct address_space *mapping = ip->i_mapping;
+    if (mapping == NULL || page->mapping != mapping || radix_tree_lookup_node(&mapping->page_tree, page->index) != page) {
+        // truncated while isolated, only our reference is left
+        goto out;
+    }
+
+    if (radix_tree_tag_get(&mapping->page_tree, page->index, PAGECACHE_TAG_DIRTY)
+        || radix_tree_tag_get(&mapping->page_tree, page->index, PAGECACHE_TAG_WRITEBACK)) {
+        sc->nr_dirty++;
+        goto keep;
+    }
+    // one reference of the page cache, one of ours
+    if (!locked || held || atomic_read(&page->refcnt) > 2) {
+        goto keep;
+    }
+
+    radix_tree_delete(&mapping->page_tree, page->index);
+    mapping->nrpages--;
+    page->mapping = NULL;
+    freed = 1;
+    goto out;
+
+keep:
+    acquire(&lru.lock);
+    add_page_to_lru(page);
+    release(&lru.lock);
+out:
+    if (!held) {
+        release(&ip->tree_lock);
+    }
+unlock:
+    if (locked) {
+        sema_signal(&ip->i_read_lock);
+    }
+
+    if (freed) {
+        // the reference of the page cache
+        kfree_cold((void *)page_to_pa(page));
+    }
+    kfree_cold((void *)page_to_pa(page));
+    return freed;
+}
+
+static void shrink_inactive_list(struct scan_control *sc) {
+    struct page *pages[SWAP_CLUSTER_MAX];
+    struct inode *hosts[SWAP_CLUSTER_MAX];
+    // look at every page at most twice
+    uint64 max_scan = 2 * (READ_ONCE(lru.nr_active) + READ_ONCE(lru.nr_inactive));
+
+    while (sc->nr_reclaimed < sc->nr_to_reclaim && sc->nr_scanned < max_scan) {
+        uint64 scanned = sc->nr_scanned;
+        int n = isolate_inactive(sc, pages, hosts);
+        for (int i = 0; i < n; i++) {
+            sc->nr_reclaimed += shrink_page(sc, pages[i], hosts[i]);
+            fat32_inode_put(hosts[i]);
+        }
+        if (sc->nr_scanned == scanned) {
+            break; // the LRU is empty
+        }
+    }
+}
+
+// reclaim at least nr_to_reclaim clean pages of the page cache, if there are
+// return the number of freed pages
+uint64 shrink_page_cache(uint64 nr_to_reclaim) {
+    struct scan_control sc = {
+        .nr_to_reclaim = nr_to_reclaim,
+        .nr_reclaimed = 0,
+        .nr_scanned = 0,
+        .nr_dirty = 0,
+    };
+    shrink_inactive_list(&sc);
+    return sc.nr_reclaimed;
+}
+
+// reclaim until KSWAPD_HIGH_PAGES pages are free
+// return 0 if it gives up
+static int kswapd_balance(void) {
+    int written = 0;
+
+    while (atomic_read(&pages_cnt) < KSWAPD_HIGH_PAGES) {
+        struct scan_control sc = {
+            .nr_to_reclaim = SWAP_CLUSTER_MAX,
+            .nr_reclaimed = 0,
+            .nr_scanned = 0,
+            .nr_dirty = 0,
+        };
+        shrink_inactive_list(&sc);
+        if (sc.nr_reclaimed > 0) {
+            continue;
+        }
+        if (sc.nr_dirty == 0 || written) {
+            // the page cache of the unused inodes goes with them
+            if (fat32_inode_shrink(SWAP_CLUSTER_MAX) > 0) {
+                continue;
+            }
+            return 0;
+        }
+        // clean pages are used up, write the dirty ones back and scan them again
+        writeback_inodes(sc.nr_dirty);
+        written = 1;
+    }
+    return 1;
+}
+
+static void kswapd(void) {
+    // similar to thread_forkret
+    release(&thread_current()->lock);
+
+    int balanced = 1;
+    acquire(&kswapd_control.lock);
+    kswapd_control.who = thread_current();
+    while (1) {
+        // somebody woke us up while we were busy, don't go to sleep
+        if (!balanced || atomic_read(&pages_cnt) >= KSWAPD_LOW_PAGES) {
+            kswapd_control.sleeping = 1;
+            cond_wait(&kswapd_control.wait, &kswapd_control.lock);
+        }
+        kswapd_control.sleeping = 0;
+        release(&kswapd_control.lock);
+
+        balanced = kswapd_balance();
+
+        acquire(&kswapd_control.lock);
+    }
+}
+
+void wakeup_kswapd(void) {
+    // unlocked test is OK here, kswapd checks the free pages before it sleeps
+    if (!READ_ONCE(kswapd_control.sleeping)) {
+        return;
+    }
+    acquire(&kswapd_control.lock);
+    if (kswapd_control.sleeping) {
+        kswapd_control.sleeping = 0;
+        cond_signal(&kswapd_control.wait);
+    }
+    release(&kswapd_control.lock);
+}
+
+void kswapd_init(void) {
+    initlock(&kswapd_control.lock, "kswapd_lock");
+    cond_init(&kswapd_control.wait, "kswapd_cond");
+    kswapd_control.who = NULL;
+    kswapd_control.sleeping = 0;
+
+    struct tcb *t = NULL;
+    create_thread(initproc, t, "kswapd", kswapd);
+}
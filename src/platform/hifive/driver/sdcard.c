@@ -888,27 +888,38 @@ void sdcard_disk_write(void *addr, uint sec, uint nr_sec) {
 void sdcard_disk_rw(struct bio_vec *bio_vec, int write) {
     uint sec;
     uint nr_sec;
+    uint64 addr;
 
     sec = bio_vec->blockno_start * (BSIZE / 512);
-    nr_sec = bio_vec->block_len;
 
+    push_off();
+    // the sd card is driven by polling, a scatter-gather vec is one transfer per segment
+    for (int i = 0; i < bio_vec_nr_segs(bio_vec); i++) {
+        nr_sec = bio_vec_seg(bio_vec, i, &addr) / BSIZE;
 #ifdef SIFIVE_U
-    sec *= BSIZE;
+        uint dev_sec = sec * BSIZE;
+#else
+        uint dev_sec = sec;
 #endif
-
-    push_off();
-    if (write) {
-        sdcard_disk_write(bio_vec->data, sec, nr_sec);
-    } else {
-        sdcard_disk_read(bio_vec->data, sec, nr_sec);
+        if (write) {
+            sdcard_disk_write((void *)addr, dev_sec, nr_sec);
+        } else {
+            sdcard_disk_read((void *)addr, dev_sec, nr_sec);
+        }
+        sec += nr_sec;
     }
     pop_off();
 
     return;
 }
 
-inline void disk_rw(void *bio_vec, int write, int type) {
-    sdcard_disk_rw((struct bio_vec *)bio_vec, write);
+// synchronous, rq is done before we return
+int disk_submit(struct request *rq) {
+    for (struct bio_vec *vec = rq->vec_head; vec != NULL; vec = vec->bi_next) {
+        sdcard_disk_rw(vec, rq->rw);
+    }
+    blk_end_request(rq);
+    return 0;
 }
 
 void disk_init() {
@@ -62,8 +62,7 @@ static struct disk {
     // for use when completion interrupt arrives.
     // indexed by first descriptor index of chain.
     struct {
-        struct buffer_head *b_old;
-        struct bio_vec *b_new;
+        struct request *rq;
         char status;
     } info[NUM];
 
@@ -73,7 +72,7 @@ static struct disk {
 
     struct spinlock vdisk_lock;
 
-    struct semaphore sem_disk;
+    int nr_free; // free descriptors
 
 } __attribute__((aligned(PGSIZE))) disk;
 
@@ -82,7 +81,6 @@ void virtio_disk_init(void) {
 
     initlock(&disk.vdisk_lock, "virtio_disk");
 
-    sema_init(&disk.sem_disk, 0, "sem_disk");
 
     if (*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 || *R(VIRTIO_MMIO_VERSION) != 1 || *R(VIRTIO_MMIO_DEVICE_ID) != 2 || *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551) {
         panic("could not find virtio disk");
@@ -137,6 +135,7 @@ void virtio_disk_init(void) {
     // all NUM descriptors start out unused.
     for (int i = 0; i < NUM; i++)
         disk.free[i] = 1;
+    disk.nr_free = NUM;
 
     // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
@@ -147,6 +146,7 @@ alloc_desc() {
     for (int i = 0; i < NUM; i++) {
         if (disk.free[i]) {
             disk.free[i] = 0;
+            disk.nr_free--;
             return i;
         }
     }
@@ -165,8 +165,7 @@ free_desc(int i) {
     disk.desc[i].flags = 0;
     disk.desc[i].next = 0;
     disk.free[i] = 1;
-    // wakeup(&disk.free[0]);
-    sema_signal(&disk.sem_disk);
+    disk.nr_free++;
 }
 
 // free a chain of descriptors.
@@ -183,59 +182,47 @@ free_chain(int i) {
     }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// a disk transfer uses one for the header, one for the status,
+// and one for each data segment in between.
 static int
-alloc3_desc(int *idx) {
-    for (int i = 0; i < 3; i++) {
+alloc_descs(int *idx, int n) {
+    if (disk.nr_free < n)
+        return -1;
+    for (int i = 0; i < n; i++) {
         idx[i] = alloc_desc();
-        if (idx[i] < 0) {
-            for (int j = 0; j < i; j++)
-                free_desc(idx[j]);
-            return -1;
-        }
+        ASSERT(idx[i] >= 0);
     }
     return 0;
 }
 
-// b is a pointer to struct bio_vec
-void virtio_disk_rw(void *b, int write, int type) {
-    uint64 sector;
-    struct buffer_head *b_old = NULL;
-    struct bio_vec *b_new = NULL;
-    if (type == BLOCK_OLD) {
-        // we don't use this
-        b_old = (struct buffer_head *)b;
-        sector = b_old->blockno * (BSIZE / 512);
-    } else if (type == BLOCK_NEW) {
-        b_new = (struct bio_vec *)b;
-        sector = b_new->blockno_start * (BSIZE / 512);
-    } else {
-        panic("error\n");
-    }
+// queue rq, and return without waiting for it
+// virtio_disk_intr() completes it
+int virtio_disk_submit(struct request *rq) {
+    uint64 sector = rq->blockno_start * (BSIZE / 512);
+    int n = rq->nr_segs + 2;
+    int idx[BLK_MAX_SEGS + 2];
+    ASSERT(rq->nr_segs <= BLK_MAX_SEGS);
 
     acquire(&disk.vdisk_lock);
     // the spec's Section 5.2 says that legacy block operations use
     // three descriptors: one for type/reserved/sector, one for the
     // data, one for a 1-byte status result.
+    // the data may be a chain of descriptors as well (scatter-gather),
+    // a segment for each piece of the bio_vecs merged into rq.
 
-    // allocate the three descriptors.
-    int idx[3];
-    while (1) {
-        if (alloc3_desc(idx) == 0) {
-            break;
-        }
+    // the ring is full, the block layer keeps rq until a request completes.
+    if (alloc_descs(idx, n) != 0) {
         release(&disk.vdisk_lock);
-        sema_wait(&disk.sem_disk);
-        acquire(&disk.vdisk_lock);
+        return -1;
     }
 
-    // format the three descriptors.
+    // format the descriptors.
     // qemu's virtio-blk.c reads them.
 
     struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
 
-    if (write)
+    if (rq->rw == DISK_WRITE)
         buf0->type = VIRTIO_BLK_T_OUT; // write the disk
     else
         buf0->type = VIRTIO_BLK_T_IN; // read the disk
@@ -247,42 +234,30 @@ void virtio_disk_rw(void *b, int write, int type) {
     disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
     disk.desc[idx[0]].next = idx[1];
 
-    if (type == BLOCK_OLD) {
-        // we don't use this
-        disk.desc[idx[1]].addr = (uint64)b_old->data;
-        disk.desc[idx[1]].len = BSIZE;
-    } else if (type == BLOCK_NEW) {
-        disk.desc[idx[1]].addr = (uint64)b_new->data;
-        disk.desc[idx[1]].len = BSIZE * (b_new->block_len);
-    } else {
-        panic("error\n");
+    int d = 1;
+    for (struct bio_vec *vec = rq->vec_head; vec != NULL; vec = vec->bi_next) {
+        for (int i = 0; i < bio_vec_nr_segs(vec); i++, d++) {
+            uint64 addr;
+            disk.desc[idx[d]].len = bio_vec_seg(vec, i, &addr);
+            disk.desc[idx[d]].addr = addr;
+            if (rq->rw == DISK_WRITE)
+                disk.desc[idx[d]].flags = 0; // device reads the data
+            else
+                disk.desc[idx[d]].flags = VRING_DESC_F_WRITE; // device writes the data
+            disk.desc[idx[d]].flags |= VRING_DESC_F_NEXT;
+            disk.desc[idx[d]].next = idx[d + 1];
+        }
     }
-
-    if (write)
-        disk.desc[idx[1]].flags = 0; // device reads b->data
-    else
-        disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-    disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-    disk.desc[idx[1]].next = idx[2];
+    ASSERT(d == n - 1);
 
     disk.info[idx[0]].status = 0xff; // device writes 0 on success
-    disk.desc[idx[2]].addr = (uint64)&disk.info[idx[0]].status;
-    disk.desc[idx[2]].len = 1;
-    disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-    disk.desc[idx[2]].next = 0;
-
-    // record struct buffer_head for virtio_disk_intr().
-
-    if (type == BLOCK_OLD) {
-        // we don't use this
-        b_old->disk = 1;
-        disk.info[idx[0]].b_old = b_old;
-    } else if (type == BLOCK_NEW) {
-        b_new->disk = 1;
-        disk.info[idx[0]].b_new = b_new;
-    } else {
-        panic("error\n");
-    }
+    disk.desc[idx[n - 1]].addr = (uint64)&disk.info[idx[0]].status;
+    disk.desc[idx[n - 1]].len = 1;
+    disk.desc[idx[n - 1]].flags = VRING_DESC_F_WRITE; // device writes the status
+    disk.desc[idx[n - 1]].next = 0;
+
+    // record the request for virtio_disk_intr().
+    disk.info[idx[0]].rq = rq;
 
     // tell the device the first index in our chain of descriptors.
     disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -296,33 +271,14 @@ void virtio_disk_rw(void *b, int write, int type) {
 
     *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-    // Wait for virtio_disk_intr() to say request has finished.
-
-    if (type == BLOCK_OLD) {
-        while (b_old->disk == 1) {
-            // we don't use this
-            release(&disk.vdisk_lock);
-            sema_wait(&b_old->sem_disk_done);
-            acquire(&disk.vdisk_lock);
-        }
-        disk.info[idx[0]].b_old = 0;
-    } else if (type == BLOCK_NEW) {
-        while (b_new->disk == 1) {
-            release(&disk.vdisk_lock);
-            sema_wait(&b_new->sem_disk_done);
-            acquire(&disk.vdisk_lock);
-        }
-        disk.info[idx[0]].b_new = 0;
-    } else {
-        panic("error\n");
-    }
-
-    free_chain(idx[0]);
-
     release(&disk.vdisk_lock);
+    return 0;
 }
 
 void virtio_disk_intr() {
+    struct request *done[NUM];
+    int n = 0;
+
     acquire(&disk.vdisk_lock);
 
     // the device won't raise another interrupt until we tell it
@@ -345,27 +301,22 @@ void virtio_disk_intr() {
         if (disk.info[id].status != 0)
             panic("virtio_disk_intr status");
 
-        if (BLOCK_SEL == BLOCK_OLD) {
-            // we don't use this
-            struct buffer_head *b_old = disk.info[id].b_old;
-            b_old->disk = 0; // disk is done with buf
-            sema_signal(&b_old->sem_disk_done);
-        } else if (BLOCK_SEL == BLOCK_NEW) {
-            struct bio_vec *b_new = disk.info[id].b_new;
-            b_new->disk = 0; // disk is done with buf
-            sema_signal(&b_new->sem_disk_done);
-        } else {
-            panic("error\n");
-        }
+        done[n++] = disk.info[id].rq;
+        disk.info[id].rq = 0;
+        free_chain(id);
 
         disk.used_idx += 1;
     }
-
     release(&disk.vdisk_lock);
+
+    // the block layer dispatches the next requests
+    for (int i = 0; i < n; i++) {
+        blk_end_request(done[i]);
+    }
 }
 
-inline void disk_rw(void *b, int write, int type) {
-    virtio_disk_rw(b, write, type);
+inline int disk_submit(struct request *rq) {
+    return virtio_disk_submit(rq);
 }
 
 inline void disk_intr() {
@@ -694,6 +694,14 @@ int do_execve(char *path, struct binprm *bprm) {
         goto bad;
     }
 
+    /* The trapframe takes slot 0 of the new mm, and leaves the old one
+       (still used by the parent after vfork) */
+    acquire(&oldmm->lock);
+    uvmunmap(oldmm->pagetable, THREAD_TRAPFRAME(t->tidx), 1, 0, 1);
+    mm_free_tframe(oldmm, t->tidx);
+    release(&oldmm->lock);
+    t->tidx = mm_alloc_tframe(mm); // 0, nobody else sees mm yet
+
     /* Save program name for debugging */
     char *s, *last;
     for (last = s = path; *s; s++)
@@ -727,10 +735,11 @@ int do_execve(char *path, struct binprm *bprm) {
     // uvm_thread_trapframe(mm->pagetable, 0);
 
     /* free the old pagetable */
-    free_mm(oldmm, atomic_read(&p->tg->thread_cnt));
+    free_mm(oldmm);
 
     /* commit new mm */
     p->mm = mm;
+    vfork_release(p);
 
     kfree(bprm->elf_ex);
 
@@ -750,7 +759,7 @@ int do_execve(char *path, struct binprm *bprm) {
 bad:
     // TODO
     // Note: cnt is 1!
-    free_mm(mm, 0);
+    free_mm(mm);
     // todo
     // kfree(ex);
     return -1;
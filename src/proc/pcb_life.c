@@ -6,6 +6,7 @@
 #include "memory/allocator.h"
 #include "memory/vm.h"
 #include "memory/vma.h"
+#include "memory/mm.h"
 #include "memory/binfmt.h"
 #include "kernel/trap.h"
 #include "kernel/cpu.h"
@@ -30,9 +31,8 @@
 #include "test.h"
 
 extern Queue_t unused_p_q, used_p_q, zombie_p_q;
-extern Queue_t unused_t_q, runnable_t_q, sleeping_t_q;
+extern Queue_t unused_t_q, sleeping_t_q;
 extern Queue_t *STATES[PCB_STATEMAX];
-extern struct tcb thread[NTCB];
 extern struct hash_table pid_map;
 
 struct proc proc[NPROC];
@@ -53,7 +53,6 @@ void proc_init(void) {
         p = proc + i;
         sprintf(proc_lock_name[i], "proc_%d", i);
         initlock(&p->lock, proc_lock_name[i]);
-        sema_init(&p->tlock, 1, "sem_ofile");
         p->state = PCB_UNUSED;
         Queue_push_back_atomic(&unused_p_q, p);
     }
@@ -89,7 +88,8 @@ void appendChild(struct proc *parent, struct proc *child) {
 }
 
 // allocate a new proc (return with lock)
-struct proc *alloc_proc(void) {
+// mm : share it (clone with CLONE_VM), or NULL for a new one
+struct proc *alloc_proc(struct mm_struct *mm) {
     struct proc *p;
 
     // fetch a unused proc from unused queue
@@ -110,7 +110,7 @@ struct proc *alloc_proc(void) {
 
     // allocate memory
     // slob TODO
-    p->mm = alloc_mm();
+    p->mm = mm != NULL ? mmget(mm) : alloc_mm();
     if (p->mm == NULL) {
         Warn("fix error handler!");
         free_proc(p);
@@ -146,12 +146,15 @@ struct proc *alloc_proc(void) {
     p->utime = 0;
     p->stime = 0;
 
-    // bug!!!
-    INIT_LIST_HEAD(&p->real_timer.list);
+    init_timer(&p->real_timer);
 
     // bug!!!
     INIT_LIST_HEAD(&p->sysvshm.shm_clist);
 
+    p->vfork_done = NULL;
+    // do_clone() or the first proc sets it
+    p->files = NULL;
+
     // state
     PCB_Q_changeState(p, PCB_USED);
 
@@ -165,11 +168,11 @@ struct proc *alloc_proc(void) {
 }
 
 // create a proc with a group leader thread
-struct proc *create_proc() {
+struct proc *create_proc(struct mm_struct *mm) {
     struct tcb *t = NULL;
     struct proc *p = NULL;
 
-    if ((p = alloc_proc()) == 0) {
+    if ((p = alloc_proc(mm)) == 0) {
         return 0;
     }
 
@@ -178,7 +181,13 @@ struct proc *create_proc() {
         return 0;
     }
 
-    proc_join_thread(p, t, NULL);
+    if (proc_join_thread(p, t, NULL) < 0) {
+        free_thread(t);
+        release(&t->lock);
+        thread_reclaim(t);
+        free_proc(p);
+        return 0;
+    }
 
     release(&t->lock);
 
@@ -189,7 +198,12 @@ struct proc *create_proc() {
 void free_proc(struct proc *p) {
     // free_mm will write back, must release the lock of p?
     release(&p->lock); // bug for iozone
-    free_mm(p->mm, p->tg->thread_idx);
+    free_mm(p->mm);
+    if (p->files) {
+        // never ran
+        fdt_put(p->files);
+        p->files = NULL;
+    }
     acquire(&p->lock); // bug for iozone
 
     if (p->tg)
@@ -231,7 +245,10 @@ struct file console;
 void userinit(void) {
     struct proc *p = NULL;
 
-    p = create_proc();
+    p = create_proc(NULL);
+    if ((p->files = fdt_alloc()) == NULL) {
+        panic("userinit: no fdtable");
+    }
 
     safestrcpy(p->name, "/init", 10);
     safestrcpy(p->tg->group_leader->name, "/init-0", 10);
@@ -305,13 +322,16 @@ int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid)
         // print_tf_flag = 1;
         if (proc_join_thread(p, t, NULL) < 0) {
             free_thread(t);
+            release(&t->lock);
+            thread_reclaim(t);
+            return -1;
         }
 #ifdef __DEBUG_THREAD__
         printfRed("clone a thread, pid : %d, tid : %d\n", p->pid, t->tid);
 #endif
     } else {
-        // Allocate process.
-        if ((np = create_proc()) == 0) {
+        // Allocate process, on the mm of p for CLONE_VM
+        if ((np = create_proc((flags & CLONE_VM) ? p->mm : NULL)) == 0) {
             // proc_thread_print();
             return -1;
         }
@@ -370,41 +390,37 @@ int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid)
     }
 
     // ==============create proc with group leader=======================
-    acquire(&p->lock);
-    /* Copy vma */
-    // print_vma(&p->mm->head_vma);
-    if (vmacopy(p->mm, np->mm) < 0) {
-        free_proc(np);
-        release(&p->lock);
-        release(&np->lock);
-        return -1;
-    }
+    // CLONE_VM : np already shares the mm of p, nothing to copy
+    if (!(flags & CLONE_VM)) {
+        acquire(&p->lock);
+        /* Copy vma */
+        // print_vma(&p->mm->head_vma);
+        if (vmacopy(p->mm, np->mm) < 0) {
+            free_proc(np);
+            release(&p->lock);
+            release(&np->lock);
+            return -1;
+        }
 
-    // Copy user memory from parent to child.
-    if (flags & CLONE_VM) {
-        np->mm->pagetable = p->mm->pagetable;
-    } else {
+        // Share user memory with the child, copy-on-write.
         if (uvmcopy(p->mm, np->mm) < 0) {
             free_proc(np);
             release(&p->lock);
             release(&np->lock);
             return -1;
         }
-    }
 
-    np->mm->start_brk = p->mm->start_brk;
-    np->mm->brk = p->mm->brk;
-    release(&p->lock);
-    // increment reference counts on open file descriptors.
+        np->mm->start_brk = p->mm->start_brk;
+        np->mm->brk = p->mm->brk;
+        release(&p->lock);
+    }
+    // share the descriptor table, or copy it with references to the same files
     if (flags & CLONE_FILES) {
-    } else {
-        for (int i = 0; i < NOFILE; i++)
-            if (p->ofile[i])
-                // np->ofile[i] = fat32_filedup(p->ofile[i]);
-                np->ofile[i] = p->ofile[i]->f_op->dup(p->ofile[i]);
-        // else
-        //     break;// to speed up?
-        // TODO : clone a completely same fdtable   >> not necessary
+        np->files = fdt_get(p->files);
+    } else if ((np->files = fdt_dup(p->files)) == NULL) {
+        free_proc(np);
+        release(&np->lock);
+        return -1;
     }
 
     // if (flags & CLONE_NEWIPC) {
@@ -429,32 +445,49 @@ int do_clone(uint64 flags, vaddr_t stack, uint64 ptid, uint64 tls, uint64 ctid)
     printfRed("clone : %d -> %d\n", p->pid, np->pid); // debug
 #endif
 
+    struct semaphore vfork_done;
+    if (flags & CLONE_VFORK) {
+        sema_init(&vfork_done, 0, "vfork_done");
+        np->vfork_done = &vfork_done;
+    }
+
     // printfGreen("clone end, mm: %d pages\n", get_free_mem()/4096);
     acquire(&t->lock);
     TCB_Q_changeState(t, TCB_RUNNABLE);
     release(&t->lock);
 
+    if (flags & CLONE_VFORK) {
+        // the child runs on our mm (and stack), wait until it execs or exits
+        sema_wait(&vfork_done);
+    }
+
     return pid;
 }
 
+// the child of vfork is done with the mm of its parent (exec or exit), wake the parent
+void vfork_release(struct proc *p) {
+    struct semaphore *done = p->vfork_done;
+    if (done != NULL) {
+        p->vfork_done = NULL;
+        sema_signal(done);
+    }
+}
+
 int exit_process(int status) {
     struct proc *p = proc_current();
     if (p == initproc)
         panic("init exiting");
 
-    // private to proc, no need to acquire
-    for (int fd = 0; fd < NOFILE; fd++) {
-        if (p->ofile[fd]) {
-            struct file *f = p->ofile[fd];
-            generic_fileclose(f);
-            p->ofile[fd] = 0;
-        }
-    }
+    // the files are closed with the last user of the table
+    fdt_put(p->files);
+    p->files = NULL;
     fat32_inode_put(p->cwd);
     p->cwd = 0;
 
-    // !!! bug
-    delete_timer_atomic(&p->real_timer);
+    vfork_release(p);
+
+    // the SIGALRM callback must not run on a dead process
+    delete_timer_sync(&p->real_timer);
 
     // Give any children to init.
     reparent(p);
@@ -478,7 +511,7 @@ void exit_wakeup(struct proc *p, struct tcb *t) {
         int val = 0;
         if (copyout(p->mm->pagetable, t->clear_child_tid, (char *)&val, sizeof(val)))
             panic("exit error\n");
-        futex_wakeup(t->clear_child_tid, 1);
+        futex_wake(t->clear_child_tid, 0, 1);
     }
 }
 
@@ -730,7 +763,6 @@ void proc_prlimit_init(struct proc *p) {
     rlim_tmp = rlim + RLIMIT_NOFILE;
     rlim_tmp->rlim_max = NOFILE;
     rlim_tmp->rlim_cur = NOFILE;
-    p->max_ofile = NOFILE;
 
     // PLIMIT_STACK
     rlim_tmp = rlim + RLIMIT_STACK;
@@ -754,8 +786,14 @@ void do_exit_group(struct proc *p) {
         atomic_dec_return(&tg->thread_cnt);
 
         exit_wakeup(p, t_cur); // !!! bug
+        // a sleeper is off its kernel stack, so is a runnable one still queued;
+        // one running, or picked by a scheduler waiting for its lock, is reclaimed by that scheduler
+        int reclaim = t_cur->state == TCB_SLEEPING || (t_cur->state == TCB_RUNNABLE && sched_dequeue(t_cur));
         free_thread(t_cur);
         release(&t_cur->lock);
+        if (reclaim) {
+            thread_reclaim(t_cur);
+        }
     }
     release(&p->tg->lock);
 }
@@ -864,8 +902,11 @@ void uvminit(struct mm_struct *mm, uchar *src, uint sz) {
 void oscomp_init(void) {
     struct proc *p;
     struct tcb *t;
-    p = create_proc();
+    p = create_proc(NULL);
     ASSERT(p != NULL);
+    if ((p->files = fdt_alloc()) == NULL) {
+        panic("oscomp_init: no fdtable");
+    }
     t = p->tg->group_leader;
     ASSERT(t != NULL);
     initproc = p;
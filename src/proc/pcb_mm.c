@@ -11,29 +11,9 @@
 #include "proc/pcb_mm.h"
 #include "memory/vma.h"
 
-extern struct tcb thread[NTCB];
 extern char trampoline[];          // trampoline.S
 extern char __user_rt_sigreturn[]; // sigret.S
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-
-void tcb_mapstacks(pagetable_t kpgtbl) {
-    struct tcb *t;
-
-    for (t = thread; t < &thread[NTCB]; t++) {
-        char *pa = kmalloc(KSTACK_PAGE * PGSIZE);
-        if (pa == 0)
-            panic("kalloc");
-        uint64 va = KSTACK((int)(t - thread));
-        kvmmap(kpgtbl, va, (uint64)pa, KSTACK_PAGE * PGSIZE, PTE_R | PTE_W, COMMONPAGE);
-    }
-    Info("========= Information of thread kernel stack ==========\n");
-    Info("number of thread : %d , pages per thread : %d, total : %d\n", NTCB, KSTACK_PAGE, NTCB * KSTACK_PAGE);
-    Info("thread kernel stack init [ok]\n");
-}
-
 /* Create a user page table, with no user memory,
    but with trampoline and sigreturn pages.
 */
@@ -66,8 +46,7 @@ pagetable_t proc_pagetable() {
 
 // Free a process's page table, and free the
 // physical memory it refers to.
-void proc_freepagetable(struct mm_struct *mm, int thread_cnt) {
-    // maxoffset starts from 0
+void proc_freepagetable(struct mm_struct *mm) {
     // vmprint(mm->pagetable, 1, 0, 0, 0);
     // printfYELLOW("================");
     uvmunmap(mm->pagetable, TRAMPOLINE, 1, 0, 0);
@@ -75,9 +54,14 @@ void proc_freepagetable(struct mm_struct *mm, int thread_cnt) {
     uvmunmap(mm->pagetable, USTACK_GURAD_PAGE, 1, 0, 1);
     // vmprint(mm->pagetable, 1, 0, 0, 0);
     acquire(&mm->lock);
-    for (int offset = 0; offset < thread_cnt; offset++) {
-        /* on-demand unmap */
-        uvmunmap(mm->pagetable, TRAPFRAME - offset * PGSIZE, 1, 0, 1);
+    for (int w = 0; w < NTFRAME_WORDS; w++) {
+        uint64 bits = mm->tframe_map[w];
+        while (bits != 0) {
+            int tidx = w * 64 + __builtin_ctzl(bits);
+            bits &= bits - 1;
+            /* on-demand unmap */
+            uvmunmap(mm->pagetable, THREAD_TRAPFRAME(tidx), 1, 0, 1);
+        }
     }
     release(&mm->lock);
     // printfYELLOW("================");
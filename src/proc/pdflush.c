@@ -17,7 +17,6 @@ void pdflush_init() {
 
     for (int i = 0; i < MIN_PDFLUSH_THREADS; i++)
         start_one_pdflush_thread();
-    // page_writeback_timer_init();
 }
 
 static int __pdflush(struct pdflush_work *my_work) {
@@ -40,7 +39,9 @@ static int __pdflush(struct pdflush_work *my_work) {
         if (wait_ret == 0) {
             printfRed("pdflush : error\n");
         } else {
+#ifdef __DEBUG_PROC__
             printfRed("pdflush : wakeup\n");
+#endif
         }
 
         // ensure my_work is removed form list
@@ -108,6 +109,10 @@ int pdflush_operation(void (*fn)(uint64), uint64 arg0) {
     int ret = 0;
     ASSERT(fn != NULL);
 
+    if (pdflush_control.entry.next == NULL) {
+        // before pdflush_init()
+        return -1;
+    }
     acquire(&pdflush_control.lock);
     if (list_empty(&pdflush_control.entry)) {
         release(&pdflush_control.lock);
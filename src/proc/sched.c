@@ -9,6 +9,8 @@
 #include "debug.h"
 #include "common.h"
 #include "lib/timer.h"
+#include "lib/rbtree.h"
+#include "lib/sbi.h"
 
 Queue_t unused_p_q, used_p_q, zombie_p_q;
 Queue_t *STATES[PCB_STATEMAX] = {
@@ -16,15 +18,16 @@ Queue_t *STATES[PCB_STATEMAX] = {
     [PCB_USED] & used_p_q,
     [PCB_ZOMBIE] & zombie_p_q};
 
-Queue_t unused_t_q, used_t_q, runnable_t_q, sleeping_t_q, zombie_t_q;
+Queue_t unused_t_q, used_t_q, sleeping_t_q, zombie_t_q;
+// TCB_RUNNABLE : run_queues
 Queue_t *T_STATES[TCB_STATEMAX] = {
     [TCB_UNUSED] & unused_t_q,
     [TCB_USED] & used_t_q,
-    [TCB_RUNNABLE] & runnable_t_q,
     [TCB_SLEEPING] & sleeping_t_q};
 
+struct run_queue run_queues[NCPU];
+
 extern struct proc proc[NPROC];
-extern struct tcb thread[NTCB];
 
 void PCB_Q_ALL_INIT() {
     Queue_init(&unused_p_q, "PCB_UNUSED", PCB_STATE_QUEUE);
@@ -35,8 +38,215 @@ void PCB_Q_ALL_INIT() {
 void TCB_Q_ALL_INIT() {
     Queue_init(&unused_t_q, "TCB_UNUSED", TCB_STATE_QUEUE);
     Queue_init(&used_t_q, "TCB_USED", TCB_STATE_QUEUE);
-    Queue_init(&runnable_t_q, "TCB_RUNNABLE", TCB_STATE_QUEUE);
     Queue_init(&sleeping_t_q, "TCB_SLEEPING", TCB_STATE_QUEUE);
+    for (int i = 0; i < NCPU; i++) {
+        struct run_queue *rq = &run_queues[i];
+        initlock(&rq->lock, "TCB_RUNNABLE");
+        INIT_LIST_HEAD(&rq->rt_list);
+        rq->cfs_tasks = RB_ROOT;
+        rq->min_vruntime = 0;
+        rq->nr_running = 0;
+        rq->rt_nr_running = 0;
+        rq->idle = 0;
+    }
+}
+
+#define rq_nr_running(cpu) (READ_ONCE(run_queues[cpu].nr_running))
+
+// nice -20 ~ 19, every step is about 10% of the hart (similar to Linux)
+static const int sched_prio_to_weight[MAX_NICE - MIN_NICE + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15};
+
+static int thread_weight(struct tcb *t) {
+    if (t->policy == SCHED_IDLE) {
+        return 3;
+    }
+    return sched_prio_to_weight[t->nice - MIN_NICE];
+}
+
+// holding t->lock, t is running
+// charge the time since exec_start to it
+static void update_curr(struct tcb *t) {
+    uint64 now = rdtime();
+    uint64 delta = now - t->exec_start;
+    t->exec_start = now;
+    t->sum_exec_runtime += delta;
+    if (!rt_policy(t->policy)) {
+        t->vruntime += delta * NICE_0_LOAD / thread_weight(t);
+    }
+}
+
+static struct tcb *cfs_first(struct run_queue *rq) {
+    struct rb_node *left = rb_first(&rq->cfs_tasks);
+    return left ? rb_entry(left, struct tcb, run_node) : NULL;
+}
+
+static struct tcb *rt_first(struct run_queue *rq) {
+    return list_empty(&rq->rt_list) ? NULL : list_first_entry(&rq->rt_list, struct tcb, state_list);
+}
+
+// holding rq->lock
+static void __rq_enqueue(struct run_queue *rq, struct tcb *t) {
+    if (rt_policy(t->policy)) {
+        // behind the ones of the same priority
+        struct tcb *pos;
+        list_for_each_entry(pos, &rq->rt_list, state_list) {
+            if (pos->rt_priority < t->rt_priority) {
+                break;
+            }
+        }
+        list_add_tail(&t->state_list, &pos->state_list);
+        rq->rt_nr_running++;
+    } else {
+        // a sleeper doesn't bring back all the time it slept
+        uint64 bonus = SCHED_WAKEUP_BONUS_MS * (FREQUENCY / 1000);
+        uint64 floor = rq->min_vruntime > bonus ? rq->min_vruntime - bonus : 0;
+        t->vruntime = MAX(t->vruntime, floor);
+
+        struct rb_node **link = &rq->cfs_tasks.rb_node;
+        struct rb_node *parent = NULL;
+        while (*link != NULL) {
+            parent = *link;
+            if (t->vruntime < rb_entry(parent, struct tcb, run_node)->vruntime) {
+                link = &parent->rb_left;
+            } else {
+                link = &parent->rb_right;
+            }
+        }
+        rb_link_node(&t->run_node, parent, link);
+        rb_insert_color(&t->run_node, &rq->cfs_tasks);
+    }
+    rq->nr_running++;
+    t->on_rq = 1;
+}
+
+// holding rq->lock
+static void __rq_dequeue(struct run_queue *rq, struct tcb *t) {
+    if (rt_policy(t->policy)) {
+        list_del_reinit(&t->state_list);
+        rq->rt_nr_running--;
+    } else {
+        rb_erase(&t->run_node, &rq->cfs_tasks);
+    }
+    rq->nr_running--;
+    t->on_rq = 0;
+}
+
+// a thread has been put on the run queue of cpu, wake up an idle hart to run it
+static void wake_idle_hart(int cpu) {
+    int this = cpuid();
+
+    // pairs with the one in cpu_idle()
+    __sync_synchronize();
+    if (cpu != this && READ_ONCE(run_queues[cpu].idle)) {
+        sbi_send_ipi(1UL << cpu, 0);
+        return;
+    }
+    // cpu is busy, the thread is for whoever steals it first
+    // (this hart is going to pick the only one of its own queue)
+    if (rq_nr_running(cpu) <= (cpu == this ? 1 : 0)) {
+        return;
+    }
+    for (int i = 0; i < NCPU; i++) {
+        if (i != cpu && i != this && READ_ONCE(run_queues[i].idle)) {
+            sbi_send_ipi(1UL << i, 0);
+            return;
+        }
+    }
+}
+
+// holding t->lock, t is on no run queue
+// the vruntime of a fair thread is relative to the min_vruntime of its run queue,
+// keep how far it is ahead of (or behind) the others when it moves to the queue of cpu
+static void migrate_vruntime(struct tcb *t, int cpu) {
+    if (t->rq_cpu == cpu) {
+        return;
+    }
+    if (!rt_policy(t->policy) && t->last_cpu >= 0) {
+        int64 lag = t->vruntime - READ_ONCE(run_queues[t->rq_cpu].min_vruntime);
+        uint64 min = READ_ONCE(run_queues[cpu].min_vruntime);
+        t->vruntime = (lag >= 0 || min > -lag) ? min + lag : 0;
+    }
+    t->rq_cpu = cpu;
+}
+
+// holding t->lock
+static void rq_enqueue(struct tcb *t, int cpu) {
+    struct run_queue *rq = &run_queues[cpu];
+    migrate_vruntime(t, cpu);
+    acquire(&rq->lock);
+    __rq_enqueue(rq, t);
+    release(&rq->lock);
+    wake_idle_hart(cpu);
+}
+
+// holding t->lock
+// the scheduler of some hart may have taken it off already, return 0 in that case
+static int rq_dequeue(struct tcb *t) {
+    struct run_queue *rq = &run_queues[t->rq_cpu];
+    int on_rq;
+    acquire(&rq->lock);
+    if ((on_rq = t->on_rq) != 0) {
+        __rq_dequeue(rq, t);
+    }
+    release(&rq->lock);
+    return on_rq;
+}
+
+// take the thread to run next off the run queue of cpu
+static struct tcb *rq_pick(int cpu) {
+    struct run_queue *rq = &run_queues[cpu];
+    acquire(&rq->lock);
+    struct tcb *t = rt_first(rq);
+    if (t == NULL && (t = cfs_first(rq)) != NULL) {
+        rq->min_vruntime = MAX(rq->min_vruntime, t->vruntime);
+    }
+    if (t != NULL) {
+        __rq_dequeue(rq, t);
+    }
+    release(&rq->lock);
+    return t;
+}
+
+static int rq_busiest(int self) {
+    int busiest = -1;
+    int max = 0;
+    for (int i = 0; i < NCPU; i++) {
+        if (i != self && rq_nr_running(i) > max) {
+            max = rq_nr_running(i);
+            busiest = i;
+        }
+    }
+    return busiest;
+}
+
+// the hart whose run queue t is put on
+static int select_task_rq(struct tcb *t) {
+    int this = cpuid();
+    int prev = t->last_cpu;
+
+    if (prev < 0) {
+        // never ran, the least loaded one
+        int idlest = this;
+        for (int i = 0; i < NCPU; i++) {
+            if (rq_nr_running(i) < rq_nr_running(idlest)) {
+                idlest = i;
+            }
+        }
+        return idlest;
+    }
+    if (prev == this) {
+        return this;
+    }
+    // wake affine : the waker's hart if the cache hot one is busier
+    return rq_nr_running(this) < rq_nr_running(prev) ? this : prev;
 }
 
 void PCB_Q_changeState(struct proc *p, enum procstate state_new) {
@@ -54,12 +264,22 @@ void TCB_Q_changeState(struct tcb *t, enum thread_state state_new) {
     Queue_t *tcb_q_new = T_STATES[state_new];
     Queue_t *tcb_q_old = T_STATES[t->state];
 
-    if (t->state != TCB_RUNNING) {
+    if (t->state == TCB_RUNNING) {
+        // it leaves the hart
+        update_curr(t);
+    }
+    if (t->state == TCB_RUNNABLE) {
+        rq_dequeue(t);
+    } else if (t->state != TCB_RUNNING) {
         Queue_remove_atomic(tcb_q_old, (void *)t);
     } else {
         Queue_remove((void *)t, TCB_STATE_QUEUE);
     }
-    Queue_push_back_atomic(tcb_q_new, (void *)t);
+    if (state_new == TCB_RUNNABLE) {
+        rq_enqueue(t, select_task_rq(t));
+    } else {
+        Queue_push_back_atomic(tcb_q_new, (void *)t);
+    }
 
     // if (t->tid == 4 && state_new == TCB_SLEEPING) {
     //     printfGreen("4 ready\n");
@@ -72,6 +292,80 @@ void TCB_Q_changeState(struct tcb *t, enum thread_state state_new) {
     return;
 }
 
+// a new thread takes after its creator
+void sched_fork(struct tcb *t) {
+    struct tcb *parent = thread_current();
+
+    t->rq_cpu = 0;
+    t->last_cpu = -1;
+    t->on_rq = 0;
+    t->policy = parent ? parent->policy : SCHED_NORMAL;
+    t->rt_priority = parent ? parent->rt_priority : 0;
+    t->nice = parent ? parent->nice : 0;
+    // it will be placed at min_vruntime of its run queue
+    t->vruntime = 0;
+    t->sum_exec_runtime = 0;
+    t->time_slice = SCHED_RR_TIMESLICE;
+}
+
+// holding t->lock, t is runnable
+// take it off its run queue, return 0 if the scheduler of some hart has picked it already
+int sched_dequeue(struct tcb *t) {
+    return rq_dequeue(t);
+}
+
+// holding t->lock
+// policy, rt_priority and nice are checked by the caller
+int sched_setattr(struct tcb *t, int policy, int rt_priority, int nice) {
+    int queued = (t->state == TCB_RUNNABLE && rq_dequeue(t));
+
+    if (rt_policy(t->policy) && !rt_policy(policy)) {
+        // join the fair ones where they are now
+        t->vruntime = READ_ONCE(run_queues[t->rq_cpu].min_vruntime);
+    }
+    t->policy = policy;
+    t->rt_priority = rt_priority;
+    t->nice = nice;
+    t->time_slice = SCHED_RR_TIMESLICE;
+    if (queued) {
+        rq_enqueue(t, t->rq_cpu);
+    }
+    return 0;
+}
+
+// timer tick of this hart, return 1 if the current thread should give up the hart
+int sched_tick(void) {
+    struct tcb *t = thread_current();
+    struct tcb *next;
+    int resched = 0;
+
+    if (t == NULL || t->state != TCB_RUNNING) {
+        return 0;
+    }
+    acquire(&t->lock);
+    update_curr(t);
+    struct run_queue *rq = &run_queues[cpuid()];
+    acquire(&rq->lock);
+    next = rt_first(rq);
+    if (rt_policy(t->policy)) {
+        if (t->policy == SCHED_RR && --t->time_slice <= 0) {
+            // round robin among the same priority
+            t->time_slice = SCHED_RR_TIMESLICE;
+            resched = (next != NULL && next->rt_priority >= t->rt_priority);
+        } else {
+            resched = (next != NULL && next->rt_priority > t->rt_priority);
+        }
+    } else if (next != NULL) {
+        resched = 1;
+    } else {
+        next = cfs_first(rq);
+        resched = (next != NULL && next->vruntime < t->vruntime);
+    }
+    release(&rq->lock);
+    release(&t->lock);
+    return resched;
+}
+
 void thread_yield(void) {
     struct tcb *t = thread_current();
     acquire(&t->lock);
@@ -99,7 +393,11 @@ void thread_wakeup_atomic(void *t) {
 #endif
 
     acquire(&thread->lock);
-    ASSERT(thread->wait_chan_entry != NULL);
+    if (thread->wait_chan_entry == NULL) {
+        // woken up already (e.g. by pollwake), the timer lost the race
+        release(&thread->lock);
+        return;
+    }
     Queue_remove_atomic(thread->wait_chan_entry, (void *)thread);
     ASSERT(thread->state == TCB_SLEEPING);
     thread->wait_chan_entry = NULL;
@@ -123,14 +421,13 @@ int thread_sched(void) {
 
     intena = t_mycpu()->intena;
 
-    // set timer for thread
+    // set timer for thread, in the tcb so that free_thread() can take it down
     int set_timer = thread->time_out; // !!!
-    struct timer_list timer;
-    timer.expires = 0;
-    timer.count = 1;                 // only once
+    struct timer_list *timer = &thread->sleep_timer;
+    timer->count = 1;                 // only once
+    timer->expires = 0;
     if (set_timer != 0) {
-        INIT_LIST_HEAD(&timer.list); // bug!!!
-        add_timer_atomic(&timer, thread->time_out, thread_wakeup_atomic, (void *)thread);
+        add_timer_atomic(timer, thread->time_out, thread_wakeup_atomic, (void *)thread);
     }
 
     swtch(&thread->context, &t_mycpu()->context);
@@ -138,29 +435,100 @@ int thread_sched(void) {
 
     if (set_timer != 0) {
         thread->time_out = 0; // bug !!!
-        delete_timer_atomic(&timer);
+        delete_timer_atomic(timer);
     }
 
-    return timer.expires == 0; // if it is 0, is is reasonable
+    return timer->expires == 0; // if it is 0, is is reasonable
+}
+
+// the next thread to run on this hart
+// pull from the busiest hart now and then, steal from it once we have nothing
+static struct tcb *pick_next_thread(int self, uint64 *nr_picked) {
+    struct tcb *t = NULL;
+    int busiest;
+
+    if (++*nr_picked % SCHED_BALANCE_INTERVAL == 0) {
+        busiest = rq_busiest(self);
+        if (busiest >= 0 && rq_nr_running(busiest) >= rq_nr_running(self) + SCHED_IMBALANCE) {
+            t = rq_pick(busiest);
+        }
+    }
+    if (t == NULL) {
+        t = rq_pick(self);
+    }
+    if (t == NULL && (busiest = rq_busiest(self)) >= 0) {
+        t = rq_pick(busiest);
+    }
+    return t;
+}
+
+// nothing to run or steal : wait for an interrupt, without the tick (NO_HZ idle)
+// TIMEKEEPER_HART keeps ticking for clockintr(), the timers of this hart still wake it up
+static void cpu_idle(int self) {
+    struct run_queue *rq = &run_queues[self];
+
+    intr_off();
+    WRITE_ONCE(rq->idle, 1);
+    // pairs with the one in wake_idle_hart()
+    __sync_synchronize();
+    for (int i = 0; i < NCPU; i++) {
+        if (rq_nr_running(i) > 0) {
+            // enqueued before the waker could see us idle
+            WRITE_ONCE(rq->idle, 0);
+            intr_on();
+            return;
+        }
+    }
+    if (self != TIMEKEEPER_HART) {
+        timer_stop_tick();
+    }
+    // an interrupt pending wakes it up, even with interrupts off
+    asm volatile("wfi");
+    WRITE_ONCE(rq->idle, 0);
+    if (self != TIMEKEEPER_HART) {
+        timer_start_tick();
+    }
+    // take the interrupt now
+    intr_on();
 }
 
 void thread_scheduler(void) {
     struct tcb *t;
     struct thread_cpu *c = t_mycpu();
+    int self = cpuid();
+    uint64 nr_picked = 0;
 
     c->thread = 0;
     for (;;) {
         // Avoid deadlock by ensuring that devices can interrupt.
         intr_on();
-        t = (struct tcb *)Queue_provide_atomic(&runnable_t_q, 1); // remove it
-        if (t == NULL)
+        t = pick_next_thread(self, &nr_picked); // remove it
+        if (t == NULL) {
+            cpu_idle(self);
             continue;
+        }
 
         acquire(&t->lock);
+        if (t->state == TCB_UNUSED) {
+            // do_exit_group freed it after we picked it, nobody else knows it now
+            release(&t->lock);
+            thread_reclaim(t);
+            continue;
+        }
+        // stolen or pulled from another hart, it competes with the ones here now
+        migrate_vruntime(t, self);
         t->state = TCB_RUNNING;
+        t->last_cpu = self;
+        t->exec_start = rdtime();
         c->thread = t;
         swtch(&c->context, &t->context);
         c->thread = 0;
+        // t may be reclaimed by do_exit_group as soon as its lock is released
+        int state = t->state;
         release(&t->lock);
+        if (state == TCB_UNUSED) {
+            // it exited, and it is off its kernel stack now
+            thread_reclaim(t);
+        }
     }
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "proc/sched.h"
 #include "proc/tcb_life.h"
 #include "kernel/trap.h"
+#include "kernel/syscall.h"
 #include "lib/list.h"
 #include "debug.h"
 #include "lib/hash.h"
@@ -9,33 +10,28 @@
 #include "lib/timer.h"
 #include "proc/options.h"
 #include "memory/vm.h"
+#include "memory/slab.h"
 
-extern Queue_t unused_t_q, runnable_t_q, sleeping_t_q, zombie_t_q;
+extern Queue_t unused_t_q, sleeping_t_q, zombie_t_q;
 extern Queue_t *STATES[TCB_STATEMAX];
 extern struct hash_table tid_map;
 extern struct proc *initproc;
 extern struct cond cond_ticks;
 
-struct tcb thread[NTCB];
-char tcb_lock_name[NTCB][10];
+// the tcbs come and go with the threads, no fixed table
+static struct kmem_cache *tcb_cachep;
 
 atomic_t next_tid;
 atomic_t count_tid;
 
 // tcb init
 void tcb_init(void) {
-    struct tcb *t;
     atomic_set(&next_tid, 1);
     atomic_set(&count_tid, 0);
 
     TCB_Q_ALL_INIT();
-    for (int i = 0; i < NTCB; i++) {
-        t = thread + i;
-        initlock(&t->lock, tcb_lock_name[i]); // init its spinlock
-
-        t->state = TCB_UNUSED;
-        t->kstack = KSTACK((int)(t - thread));
-        Queue_push_back(&unused_t_q, t);
+    if ((tcb_cachep = kmem_cache_create("tcb", sizeof(struct tcb), sizeof(void *))) == NULL) {
+        panic("tcb_init: no tcb cache");
     }
     Info("thread table init [ok]\n");
     return;
@@ -54,9 +50,19 @@ struct tcb *thread_current(void) {
 struct tcb *alloc_thread(thread_callback callback) {
     struct tcb *t;
 
-    t = (struct tcb *)Queue_provide_atomic(&unused_t_q, 1); // remove it from the queue
-    if (t == NULL)
+    if ((t = (struct tcb *)kmem_cache_zalloc(tcb_cachep)) == NULL) {
         return 0;
+    }
+    if ((t->kstack = (uint64)kmalloc(KSTACK_PAGE * PGSIZE)) == 0) {
+        kmem_cache_free(tcb_cachep, t);
+        return 0;
+    }
+    initlock(&t->lock, "tcb");
+    atomic_set(&t->ref, 1);
+    INIT_LIST_HEAD(&t->state_list);
+    t->state = TCB_UNUSED;
+    t->tidx = -1; // no trapframe slot until proc_join_thread()
+    init_timer(&t->sleep_timer);
     acquire(&t->lock);
 
     // spinlock and threads list head
@@ -87,24 +93,31 @@ struct tcb *alloc_thread(thread_callback callback) {
     // for clone
     t->set_child_tid = 0;
     t->clear_child_tid = 0;
+
+    // scheduler
+    sched_fork(t);
     return t;
 }
 
-// free a thread
+// free a thread, holding t->lock
+// the tcb and its kernel stack stay until thread_reclaim()
 void free_thread(struct tcb *t) {
-    // free & unmap tramframe
-    acquire(&t->p->mm->lock);
-    if (t->trapframe)
-        uvmunmap(t->p->mm->pagetable, THREAD_TRAPFRAME(t->tidx), 1, 1, 1);
-    else
-        uvmunmap(t->p->mm->pagetable, THREAD_TRAPFRAME(t->tidx), 1, 0, 1);
-    release(&t->p->mm->lock);
+    // free & unmap tramframe, the slot goes back to the mm
+    if (t->tidx >= 0) {
+        acquire(&t->p->mm->lock);
+        if (t->trapframe)
+            uvmunmap(t->p->mm->pagetable, THREAD_TRAPFRAME(t->tidx), 1, 1, 1);
+        else
+            uvmunmap(t->p->mm->pagetable, THREAD_TRAPFRAME(t->tidx), 1, 0, 1);
+        mm_free_tframe(t->p->mm, t->tidx);
+        release(&t->p->mm->lock);
+    }
 
-    // bug!
+    // the wait queue must not lead to it any more
     if (t->wait_chan_entry != NULL) {
-        // Queue_remove_atomic(thread->wait_chan_entry, (void *)thread);
-        ASSERT(thread->state == TCB_SLEEPING);
-        thread->wait_chan_entry = NULL;
+        ASSERT(t->state == TCB_SLEEPING);
+        Queue_remove_atomic(t->wait_chan_entry, (void *)t);
+        t->wait_chan_entry = NULL;
     }
     // bug!
     if (t->sig) {
@@ -122,7 +135,7 @@ void free_thread(struct tcb *t) {
     cnt_tid_dec;
 
     t->tid = 0;
-    t->tidx = 0;
+    t->tidx = -1;
     t->trapframe = 0;
     t->name[0] = 0;
     // t->exit_status = 0;
@@ -134,10 +147,35 @@ void free_thread(struct tcb *t) {
     signal_queue_flush(&t->pending); // !!!
     t->killed = 0;                   // !!! bug qwq
 
+    // on unused_t_q until it is reclaimed
     TCB_Q_changeState(t, TCB_UNUSED);
 }
 
-// if map trapframe failed, return -1
+// the last reference gives the tcb and its kernel stack back
+static void thread_put(struct tcb *t) {
+    // atomic_dec_return returns the old value
+    if (atomic_dec_return(&t->ref) == 1) {
+        kfree((void *)t->kstack);
+        kmem_cache_free(tcb_cachep, t);
+    }
+}
+
+// give the tcb and its kernel stack back, t is freed and nobody runs on the stack
+// the hart it ran on does it after switching away (see thread_scheduler), for
+// a thread that wasn't running, the one who freed it does it after releasing t->lock
+// a find_get_tid() in flight may keep the memory a little longer
+void thread_reclaim(struct tcb *t) {
+    ASSERT(t->state == TCB_UNUSED);
+    // a sleep timer firing right now will find it woken up already (wait_chan_entry == NULL)
+    delete_timer_sync(&t->sleep_timer);
+    Queue_remove_atomic(&unused_t_q, (void *)t);
+    // killed by do_exit_group inside a syscall, it never got back to syscall()
+    argfd_put_atomic(t);
+    thread_put(t);
+}
+
+// if no trapframe slot is left or map trapframe failed, return -1
+// the thread is out of the group again then
 int proc_join_thread(struct proc *p, struct tcb *t, char *name) {
     struct thread_group *tg = p->tg;
 
@@ -148,15 +186,21 @@ int proc_join_thread(struct proc *p, struct tcb *t, char *name) {
     }
     list_add_tail(&t->threads, &p->tg->threads);
     tg->tgid = p->pid;
-    t->tidx = tg->thread_idx++;
     t->p = p;
     release(&p->tg->lock);
 
     acquire(&t->p->mm->lock);
+    // the slot comes from the mm, a proc sharing it (CLONE_VM) must not take ours
+    if ((t->tidx = mm_alloc_tframe(p->mm)) < 0) {
+        release(&t->p->mm->lock);
+        goto bad;
+    }
     // Log("thread idx is %d, within group %d", t->tidx, p->pid);
-    if ((t->trapframe = uvm_thread_trapframe(p->mm->pagetable, t->tidx)) == 0) {   
+    if ((t->trapframe = uvm_thread_trapframe(p->mm->pagetable, t->tidx)) == 0) {
+        mm_free_tframe(p->mm, t->tidx);
+        t->tidx = -1;
         release(&t->p->mm->lock);
-        return -1;
+        goto bad;
     }
     release(&t->p->mm->lock);
 
@@ -169,8 +213,17 @@ int proc_join_thread(struct proc *p, struct tcb *t, char *name) {
         strncpy(t->name, name, 20);
     }
 
-
     return 0;
+
+bad:
+    acquire(&tg->lock);
+    list_del_reinit(&t->threads);
+    if (tg->group_leader == t) {
+        tg->group_leader = NULL;
+    }
+    release(&tg->lock);
+    atomic_dec_return(&tg->thread_cnt);
+    return -1;
 }
 
 // send signal to all threads of proc p
@@ -213,7 +266,6 @@ void tginit(struct thread_group *tg) {
     initlock(&tg->lock, "thread group lock");
     tg->group_leader = NULL;
     atomic_set(&tg->thread_cnt, 0);
-    tg->thread_idx = 0;
     INIT_LIST_HEAD(&tg->threads);
 }
 
@@ -256,9 +308,30 @@ void thread_send_signal(struct tcb *t_cur, siginfo_t *info) {
 }
 
 // find the tcb* given tid using hash map
+// return it with t->lock held, NULL if there is none or it has exited meanwhile
 struct tcb *find_get_tid(tid_t tid) {
-    struct hash_node *node = hash_lookup(&tid_map, (void *)&tid, NULL, 1, 0); // release it, not holding it
-    return node != NULL ? (struct tcb *)(node->value) : NULL;
+    struct tcb *t = NULL;
+    struct hash_node *node = hash_lookup(&tid_map, (void *)&tid, NULL, 0, 0); // not release it, not holding it
+    if (node != NULL) {
+        t = (struct tcb *)(node->value);
+        // free_thread() takes it out of tid_map before thread_reclaim(), the reference keeps
+        // it in memory until we have t->lock (free_thread() holds t->lock, then tid_map's)
+        atomic_inc_return(&t->ref);
+    }
+    release(&tid_map.lock);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    acquire(&t->lock);
+    if (t->state == TCB_UNUSED) {
+        release(&t->lock);
+        thread_put(t);
+        return NULL;
+    }
+    // not the last reference, it isn't reclaimed before it is unused
+    thread_put(t);
+    return t;
 }
 
 // find tcb given pid and tidx
@@ -286,12 +359,11 @@ struct tcb *find_get_tidx(int pid, int tidx) {
     return NULL;
 }
 
+// holding t->lock
 void do_tkill(struct tcb *t, sig_t signo) {
     siginfo_t info;
     signal_info_init(signo, &info, 0);
-    acquire(&t->lock);
     thread_send_signal(t, &info);
-    release(&t->lock);
 #ifdef __DEBUG_SIGNAL__
     printfCYAN("tkill , tid : %d, signo : %d\n", t->tid, signo);
 #endif
@@ -318,7 +390,9 @@ void create_thread(struct proc *p, struct tcb *t, char *name, thread_callback ca
         panic("no free thread\n");
     }
 
-    proc_join_thread(p, t, name);
+    if (proc_join_thread(p, t, name) < 0) {
+        panic("no trapframe slot\n");
+    }
 
     TCB_Q_changeState(t, TCB_RUNNABLE);
     release(&t->lock);